@@ -23,10 +23,140 @@
 
 #define DVM_IDENT_FSTYPE (1U<<0)
 
+#define DVM_IMAGE_READONLY (1U<<0)
+#define DVM_IMAGE_DIRECT   (1U<<1)
+
+#define DVM_CACHE_READ_AHEAD      (1U<<0)
+#define DVM_CACHE_MIDPOINT_INSERT (1U<<1)
+#define DVM_CACHE_WRITE_THROUGH   (1U<<2)
+
+#define DVM_EMU_SLEEP (1U<<0)
+
+#define DVM_FSDRV_CASE_INSENSITIVE (1U<<0)
+
+#define DVM_MOUNT_READONLY      (1U<<0) // Refuse changes with EROFS, even if the disc is writable
+#define DVM_MOUNT_NOATIME       (1U<<1) // Do not update access times when reading
+#define DVM_MOUNT_SYNC          (1U<<2) // Write each file back to the disc after every write call
+#define DVM_MOUNT_WRITE_THROUGH (1U<<3) // Make the disc cache below the volume write through
+
+#define DVM_JOURNAL_DEFAULT 0 // Driver default
+#define DVM_JOURNAL_OFF     1
+#define DVM_JOURNAL_ON      2 // Journal data and metadata (if unsupported: as DVM_JOURNAL_ORDERED)
+#define DVM_JOURNAL_ORDERED 3 // Journal metadata, written after the data it refers to
+
+#define DVM_IO_CLASS_OTHER 0
+#define DVM_IO_CLASS_META  1
+#define DVM_IO_CLASS_DATA  2
+
+#define DVM_HIST_OPS     3  // Indexed by DVM_TRACE_OP_READ/WRITE/FLUSH
+#define DVM_HIST_SIZES   4  // 1 sector, 2..8, 9..64, 65+ (flushes count as 1 sector)
+#define DVM_HIST_BUCKETS 24 // Bucket 0: under 1 us, bucket N: [2^(N-1), 2^N) us, last bucket open ended
+
+#define DVM_TRACE_MAGIC   0x544d5644 // "DVMT" on little endian machines
+#define DVM_TRACE_VERSION 1
+
+#define DVM_TRACE_OP_READ  0
+#define DVM_TRACE_OP_WRITE 1
+#define DVM_TRACE_OP_FLUSH 2
+#define DVM_TRACE_OP_TRIM  3
+
+#define DVM_TRACE_PARTIAL (1U<<0)
+#define DVM_TRACE_FAILED  (1U<<1)
+
+#define DVM_TP_MAGIC   0x504d5644 // "DVMP" on little endian machines
+#define DVM_TP_VERSION 1
+
+// Tracepoint categories (bit N of the enable mask enables category N)
+#define DVM_TP_CAT_CACHE  0
+#define DVM_TP_CAT_PROBE  1
+#define DVM_TP_CAT_VOLUME 2
+#define DVM_TP_CAT_DRIVER 3
+#define DVM_TP_MASK_ALL   0xfU
+
+// Tracepoint IDs: the category is in the high byte. Arguments are listed in
+// order, names are packed into up to 8 bytes in memory order.
+#define DVM_TP_CACHE_READ         0x0000 // sector, count
+#define DVM_TP_CACHE_WRITE        0x0001 // sector, count
+#define DVM_TP_CACHE_TRIM         0x0002 // sector, count
+#define DVM_TP_CACHE_FLUSH        0x0003
+#define DVM_TP_CACHE_SEARCH       0x0004 // sector, found page sector
+#define DVM_TP_CACHE_MISS         0x0005 // sector
+#define DVM_TP_CACHE_MAPPED       0x0006 // sector, count
+#define DVM_TP_CACHE_LOAD         0x0007 // sector, count
+#define DVM_TP_CACHE_LOAD_ERROR   0x0008 // sector, count
+#define DVM_TP_CACHE_WRITEBACK    0x0009 // sector, count
+#define DVM_TP_CACHE_WB_ERROR     0x000a // sector, count
+#define DVM_TP_CACHE_DIRECT_READ  0x000b // sector, count
+#define DVM_TP_CACHE_DIRECT_WRITE 0x000c // sector, count
+#define DVM_TP_CACHE_DIRECT_ERROR 0x000d // sector, count
+#define DVM_TP_PROBE_READ_ERROR   0x0100 // sector
+#define DVM_TP_PROBE_VBR          0x0101
+#define DVM_TP_PROBE_MBR          0x0102
+#define DVM_TP_PROBE_NO_TABLE     0x0103
+#define DVM_TP_PROBE_MALFORMED    0x0104
+#define DVM_TP_PROBE_SIZE         0x0105 // disc sectors, sectors used by partitions
+#define DVM_TP_PROBE_OUT_OF_BOUND 0x0106
+#define DVM_TP_PROBE_PART         0x0107 // index<<8 | type, start sector, sector count
+#define DVM_TP_PROBE_FSTYPE       0x0108 // index, fstype
+#define DVM_TP_PROBE_LOADED       0x0109 // partition count
+#define DVM_TP_PROBE_TIMEOUT      0x010a // name
+#define DVM_TP_PROBE_GPT          0x010b // header sector, entry count
+#define DVM_TP_PROBE_GPT_INVALID  0x010c // sector of the header or entry array failing validation
+#define DVM_TP_PROBE_EBR          0x010d // sector
+#define DVM_TP_VOLUME_MOUNT       0x0200 // name, device id, set as default
+#define DVM_TP_VOLUME_UNMOUNT     0x0201 // name
+#define DVM_TP_VOLUME_LAZY_MOUNT  0x0202 // name, success
+#define DVM_TP_DRIVER_FAT_ERROR   0x0300 // FatFs result
+
+// Filesystem operations counted by dvmGetVolumeStats
+#define DVM_VOLOP_OPEN      0
+#define DVM_VOLOP_CLOSE     1
+#define DVM_VOLOP_READ      2
+#define DVM_VOLOP_WRITE     3
+#define DVM_VOLOP_SEEK      4
+#define DVM_VOLOP_FSTAT     5
+#define DVM_VOLOP_STAT      6
+#define DVM_VOLOP_UNLINK    7
+#define DVM_VOLOP_CHDIR     8
+#define DVM_VOLOP_RENAME    9
+#define DVM_VOLOP_MKDIR     10
+#define DVM_VOLOP_RMDIR     11
+#define DVM_VOLOP_DIROPEN   12
+#define DVM_VOLOP_DIRNEXT   13
+#define DVM_VOLOP_DIRCLOSE  14
+#define DVM_VOLOP_STATVFS   15
+#define DVM_VOLOP_FTRUNCATE 16
+#define DVM_VOLOP_FSYNC     17
+#define DVM_VOLOP_COUNT     18
+
+typedef struct DvmCacheStats DvmCacheStats;
 typedef struct DvmDisc DvmDisc;
+typedef struct DvmDiscCaps DvmDiscCaps;
 typedef struct DvmDiscIface DvmDiscIface;
+typedef struct DvmEmuTiming DvmEmuTiming;
+typedef struct DvmFileExtent DvmFileExtent;
 typedef struct DvmFsDriver DvmFsDriver;
+typedef struct DvmHistOpStats DvmHistOpStats;
+typedef struct DvmHistStats DvmHistStats;
+typedef struct DvmMountOptions DvmMountOptions;
 typedef struct DvmPartInfo DvmPartInfo;
+typedef struct DvmSchedStats DvmSchedStats;
+typedef struct DvmTpHeader DvmTpHeader;
+typedef struct DvmTpRecord DvmTpRecord;
+typedef struct DvmTraceHeader DvmTraceHeader;
+typedef struct DvmTraceRecord DvmTraceRecord;
+typedef struct DvmVolumeOpStats DvmVolumeOpStats;
+typedef struct DvmVolumeStats DvmVolumeStats;
+
+// Returns monotonic time in nanoseconds (used for traces and latency statistics)
+typedef uint64_t (*DvmTimeSourceFn)(void);
+
+struct DvmDiscCaps {
+	uint32_t max_sectors; // Maximum sectors per request (0 = no limit)
+	uint32_t opt_sectors; // Optimal request size in sectors (0 = unknown)
+	uint16_t align;       // Buffer alignment in bytes required for direct transfers (0 or 1 = any)
+	uint16_t queue_depth; // Requests the device can have in flight (0 = unknown)
+};
 
 struct DvmDisc {
 	const DvmDiscIface* vt;
@@ -36,6 +166,7 @@ struct DvmDisc {
 	sec_t num_sectors;
 	uint16_t sector_sz;
 	uint16_t block_sz;
+	DvmDiscCaps caps;
 };
 
 struct DvmDiscIface {
@@ -43,6 +174,19 @@ struct DvmDiscIface {
 	bool (*read_sectors)(DvmDisc* self, void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial);
 	bool (*write_sectors)(DvmDisc* self, const void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial);
 	bool (*flush)(DvmDisc* self);
+
+	// Optional: returns a pointer to the sectors if they are directly addressable
+	const void* (*map_sectors)(DvmDisc* self, sec_t first_sector, sec_t num_sectors);
+
+	// Optional: discards the contents of the sectors
+	bool (*trim)(DvmDisc* self, sec_t first_sector, sec_t num_sectors);
+
+	// Optional: like flush, but only writes back cached data of the given runs of sectors
+	bool (*flush_ranges)(DvmDisc* self, const DvmFileExtent* runs, unsigned num_runs);
+
+	// Optional: transfers the sectors without keeping them cached, while staying
+	// coherent with whatever is (used for files opened with O_DIRECT)
+	bool (*direct_io)(DvmDisc* self, void* buffer, sec_t first_sector, sec_t num_sectors, bool is_write);
 };
 
 struct DvmFsDriver {
@@ -52,6 +196,27 @@ struct DvmFsDriver {
 
 	bool (*mount)(devoptab_t* dotab, DvmDisc* disc, DvmPartInfo* part);
 	void (*umount)(void* device_data);
+
+	// Optional: stat and read-only open of a path looked up earlier, by its st_ino.
+	// Used when the volume's path lookup cache knows it. Returns 0, or -1 (and sets
+	// r->_errno) if the inode cannot be used, in which case the path is looked up.
+	int (*stat_ino)(struct _reent* r, void* device_data, uint64_t ino, struct stat* st);
+	int (*open_ino)(struct _reent* r, void* device_data, void* fd, uint64_t ino, int flags);
+
+	// Optional: writes back changes the driver keeps outside of open files (such as
+	// cached metadata). Used by dvmSyncAll. Returns 0, or -1 (and sets r->_errno).
+	int (*sync)(struct _reent* r, void* device_data);
+
+	// Optional: maps the data of an open file to runs of sectors on the volume's disc.
+	// Returns the total number of runs (only max_extents are stored), or 0 if unknown.
+	unsigned (*get_extents)(void* device_data, void* fd, DvmFileExtent* out, unsigned max_extents, DvmDisc** out_disc);
+
+	unsigned flags; // DVM_FSDRV_*
+};
+
+struct DvmFileExtent {
+	sec_t sector;      // First disc sector of the run
+	sec_t num_sectors; // Length of the run in sectors
 };
 
 struct DvmPartInfo {
@@ -62,6 +227,111 @@ struct DvmPartInfo {
 	sec_t num_sectors;
 };
 
+struct DvmMountOptions {
+	unsigned flags;     // DVM_MOUNT_*
+	unsigned journal;   // DVM_JOURNAL_* (journaling filesystems)
+	unsigned commit_ms; // Write files back once their changes are this old (0 = on fsync/close/unmount only)
+};
+
+struct DvmCacheStats {
+	uint64_t hits;            // Page accesses served from the cache
+	uint64_t misses;          // Pages allocated on access (loaded unless written whole)
+	uint64_t direct_sectors;  // Sectors transferred straight to/from the caller's buffer
+	uint32_t writebacks;      // Dirty pages written back to the inner disc
+	uint32_t readahead_pages; // Pages loaded ahead of sequential reads
+};
+
+struct DvmEmuTiming {
+	const char* name;
+	uint32_t read_cmd_ns;      // Fixed cost of a read command
+	uint32_t write_cmd_ns;     // Fixed cost of a write command (also charged for trims)
+	uint32_t flush_ns;
+	uint32_t read_kib_s;       // Transfer rates (0 = free)
+	uint32_t write_kib_s;
+	uint32_t seek_ns;          // Penalty for commands not starting where the previous one ended
+	uint32_t block_sectors;    // Erase block size in 512-byte units (0 = none)
+	uint32_t block_penalty_ns; // Penalty for each erase block that a write covers only partially
+};
+
+struct DvmHistOpStats {
+	uint64_t count;
+	uint64_t sectors;
+	uint64_t total_us;
+	uint32_t max_us;
+	uint32_t errors;
+	uint32_t buckets[DVM_HIST_SIZES][DVM_HIST_BUCKETS];
+};
+
+struct DvmHistStats {
+	DvmHistOpStats ops[DVM_HIST_OPS];
+	uint32_t in_flight;     // Requests currently inside the inner disc
+	uint32_t max_in_flight;
+};
+
+struct DvmSchedStats {
+	uint64_t sectors_submitted; // Sectors written by the layer above
+	uint64_t sectors_written;   // Sectors written to the inner disc
+	uint32_t write_cmds;        // Write commands issued to the inner disc
+	uint32_t blocks_full;       // Erase blocks written whole in one aligned command
+	uint32_t blocks_partial;    // Erase blocks touched by partial writes
+};
+
+// Trace files are a DvmTraceHeader followed by DvmTraceRecords, both in the
+// byte order of the capturing machine (detect it through the magic)
+struct DvmTraceHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_sz;   // sizeof(DvmTraceRecord)
+	uint16_t sector_sz;
+	uint16_t reserved;
+	uint32_t num_dropped; // Records overwritten before they were read
+	uint64_t num_sectors;
+};
+
+struct DvmTraceRecord {
+	uint64_t timestamp_ns; // Start of the call, relative to the creation of the trace
+	uint64_t sector;
+	uint32_t num_sectors;
+	uint32_t duration_ns;  // Saturates at UINT32_MAX
+	uint8_t op;            // DVM_TRACE_OP_*
+	uint8_t flags;         // DVM_TRACE_PARTIAL, DVM_TRACE_FAILED
+	uint8_t io_class;      // DVM_IO_CLASS_* hint current at the time of the call
+	uint8_t reserved[5];
+};
+
+// Tracepoint dumps are a DvmTpHeader followed by DvmTpRecords, both in the
+// byte order of the capturing machine (detect it through the magic)
+struct DvmTpHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_sz;   // sizeof(DvmTpRecord)
+	uint32_t num_dropped; // Records overwritten or torn before they were read
+	uint32_t reserved;
+};
+
+struct DvmTpRecord {
+	uint64_t timestamp_ns;
+	uint64_t arg[3];
+	uint32_t seq;          // Position in the stream of records, starting at 1
+	uint16_t id;           // DVM_TP_*
+	uint16_t reserved;
+};
+
+struct DvmVolumeOpStats {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint32_t errors;   // Calls that failed (reaching the end of a directory is not an error)
+};
+
+struct DvmVolumeStats {
+	DvmVolumeOpStats ops[DVM_VOLOP_COUNT];
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t dentry_hits;   // Path operations answered by the lookup cache
+	uint64_t dentry_misses; // Path operations that had the driver look up the path
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -70,10 +340,40 @@ extern "C" {
 bool dvmInitDefault(void);
 bool dvmInit(bool set_app_cwdir, unsigned cache_pages, unsigned sectors_per_page);
 void dvmDeinit(void);
+void dvmSetTimeSource(DvmTimeSourceFn fn);
+
+// Tracepoints
+bool dvmTpStart(size_t max_records, unsigned mask);
+unsigned dvmTpSetMask(unsigned mask);
+bool dvmTpGetHeader(DvmTpHeader* out);
+size_t dvmTpRead(DvmTpRecord* out, size_t max_records);
 
 // Disc and cache management
 DvmDisc* dvmDiscCreate(DISC_INTERFACE* iface);
 DvmDisc* dvmDiscCacheCreate(DvmDisc* inner_disc, unsigned cache_pages, unsigned sectors_per_page);
+DvmDisc* dvmDiscCacheCreateEx(DvmDisc* inner_disc, unsigned cache_pages, unsigned sectors_per_page, unsigned flags);
+bool dvmDiscCacheGetStats(DvmDisc* disc, DvmCacheStats* out, bool reset);
+DvmDisc* dvmDiscRamCreate(sec_t num_sectors, unsigned sector_sz, size_t max_bytes);
+size_t dvmDiscRamGetUsage(DvmDisc* disc);
+DvmDisc* dvmDiscOverlayCreate(DvmDisc* lower_disc, DvmDisc* delta_disc);
+bool dvmDiscOverlayCommit(DvmDisc* disc);
+bool dvmDiscOverlayDiscard(DvmDisc* disc);
+DvmDisc* dvmDiscCompCreate(DvmDisc* inner_disc, unsigned cache_blocks);
+DvmDisc* dvmDiscArrayCreate(DvmDisc* const members[], unsigned num_members, unsigned stripe_sectors);
+DvmDisc* dvmDiscLoopCreate(const char* path, unsigned flags, unsigned sector_sz);
+DvmDisc* dvmDiscSchedCreate(DvmDisc* inner_disc, unsigned queue_sectors, unsigned merge_sectors, unsigned deadline, unsigned erase_sectors);
+bool dvmDiscSchedGetStats(DvmDisc* disc, DvmSchedStats* out, bool reset);
+DvmDisc* dvmDiscEmuCreate(DvmDisc* inner_disc, const DvmEmuTiming* timing, unsigned flags);
+uint64_t dvmDiscEmuGetBusyNs(DvmDisc* disc, bool reset);
+const DvmEmuTiming* dvmEmuGetPreset(unsigned index);
+uint64_t dvmEmuClockNs(void);
+DvmDisc* dvmDiscHistCreate(DvmDisc* inner_disc);
+bool dvmDiscHistGetStats(DvmDisc* disc, DvmHistStats* out, bool reset);
+DvmDisc* dvmDiscTraceCreate(DvmDisc* inner_disc, size_t max_records);
+bool dvmDiscTraceGetHeader(DvmDisc* disc, DvmTraceHeader* out);
+size_t dvmDiscTraceRead(DvmDisc* disc, DvmTraceRecord* out, size_t max_records);
+size_t dvmDiscTraceReplay(DvmDisc* disc, const DvmTraceRecord* records, size_t num_records);
+unsigned dvmSetIoClass(unsigned io_class);
 void dvmDiscAddUser(DvmDisc* disc);
 void dvmDiscRemoveUser(DvmDisc* disc);
 
@@ -92,16 +392,72 @@ static inline bool dvmDiscFlush(DvmDisc* disc)
 	return disc->vt->flush(disc);
 }
 
+static inline bool dvmDiscFlushRanges(DvmDisc* disc, const DvmFileExtent* runs, unsigned num_runs)
+{
+	// Discs that cannot tell the runs apart are flushed as a whole
+	return disc->vt->flush_ranges ? disc->vt->flush_ranges(disc, runs, num_runs) : disc->vt->flush(disc);
+}
+
+static inline bool dvmDiscDirectIo(DvmDisc* disc, void* buffer, sec_t first_sector, sec_t num_sectors, bool is_write)
+{
+	// Discs that do not cache anything are always direct
+	if (disc->vt->direct_io) {
+		return disc->vt->direct_io(disc, buffer, first_sector, num_sectors, is_write);
+	}
+
+	return is_write ? dvmDiscWriteSectors(disc, buffer, first_sector, num_sectors) : dvmDiscReadSectors(disc, buffer, first_sector, num_sectors);
+}
+
+static inline const void* dvmDiscMapSectors(DvmDisc* disc, sec_t first_sector, sec_t num_sectors)
+{
+	return disc->vt->map_sectors ? disc->vt->map_sectors(disc, first_sector, num_sectors) : NULL;
+}
+
+static inline bool dvmDiscTrim(DvmDisc* disc, sec_t first_sector, sec_t num_sectors)
+{
+	// Discarding is only a hint: discs without support keep their contents
+	return disc->vt->trim ? disc->vt->trim(disc, first_sector, num_sectors) : true;
+}
+
+static inline void dvmDiscCapsMerge(DvmDiscCaps* caps, const DvmDiscCaps* other)
+{
+	// Combine the capabilities of two discs that requests may be sent to
+	if (other->max_sectors && (!caps->max_sectors || other->max_sectors < caps->max_sectors)) {
+		caps->max_sectors = other->max_sectors;
+	}
+	if (other->opt_sectors > caps->opt_sectors) {
+		caps->opt_sectors = other->opt_sectors;
+	}
+	if (other->align > caps->align) {
+		caps->align = other->align;
+	}
+	if (!caps->queue_depth || (other->queue_depth && other->queue_depth < caps->queue_depth)) {
+		caps->queue_depth = other->queue_depth;
+	}
+}
+
 // Volume management
 bool dvmRegisterFsDriver(const DvmFsDriver* fsdrv);
 bool dvmMountPartition(const char* name, DvmDisc* disc, DvmPartInfo* part);
 bool dvmMountVolume(const char* name, DvmDisc* disc, sec_t start_sector, const char* fstype);
+bool dvmMountVolumeEx(const char* name, DvmDisc* disc, sec_t start_sector, const char* fstype, const DvmMountOptions* options);
+bool dvmGetMountOptions(const char* name, DvmMountOptions* out);
 bool dvmUnmountVolume(const char* name);
+bool dvmSyncAll(void);
+bool dvmGetVolumeStats(const char* name, DvmVolumeStats* out, bool reset);
 
 // Partition table and filesystem probing
 unsigned dvmReadPartitionTable(DvmDisc* disc, DvmPartInfo* out, unsigned max_partitions, unsigned flags);
 unsigned dvmProbeMountDisc(const char* basename, DvmDisc* disc);
 unsigned dvmProbeMountDiscIface(const char* basename, DISC_INTERFACE* iface, unsigned cache_pages, unsigned sectors_per_page);
+unsigned dvmProbeMountLoop(const char* basename, const char* path, unsigned flags);
+
+#ifdef LIBDVM_HOSTED
+// Disc image files (hosted builds only)
+DvmDisc* dvmDiscImageCreate(const char* path, unsigned flags, unsigned sector_sz);
+DvmDisc* dvmDiscImageMapCreate(const char* path, unsigned sector_sz);
+unsigned dvmProbeMountImage(const char* basename, const char* path, unsigned flags, unsigned cache_pages, unsigned sectors_per_page);
+#endif
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,29 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#define FEATURE_MEDIUM_CANREAD   0x00000001
+#define FEATURE_MEDIUM_CANWRITE  0x00000002
+#define FEATURE_MEDIUM_CANFORMAT 0x00000004
+
+typedef uint64_t sec_t;
+
+typedef bool (* FN_MEDIUM_STARTUP)(void);
+typedef bool (* FN_MEDIUM_ISINSERTED)(void);
+typedef bool (* FN_MEDIUM_READSECTORS)(sec_t sector, sec_t numSectors, void* buffer);
+typedef bool (* FN_MEDIUM_WRITESECTORS)(sec_t sector, sec_t numSectors, const void* buffer);
+typedef bool (* FN_MEDIUM_CLEARSTATUS)(void);
+typedef bool (* FN_MEDIUM_SHUTDOWN)(void);
+
+typedef struct DISC_INTERFACE_STRUCT {
+	unsigned long          ioType;
+	unsigned long          features;
+	FN_MEDIUM_STARTUP      startup;
+	FN_MEDIUM_ISINSERTED   isInserted;
+	FN_MEDIUM_READSECTORS  readSectors;
+	FN_MEDIUM_WRITESECTORS writeSectors;
+	FN_MEDIUM_CLEARSTATUS  clearStatus;
+	FN_MEDIUM_SHUTDOWN     shutdown;
+} DISC_INTERFACE;
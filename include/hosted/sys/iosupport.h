@@ -0,0 +1,106 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#pragma once
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+
+// Stand-in for the devkitPro newlib device layer on hosted builds.
+// Only the parts used by libdvm and its filesystem drivers are provided.
+
+#ifndef _PC_TIMESTAMP_RESOLUTION
+#define _PC_TIMESTAMP_RESOLUTION 0x100
+#endif
+
+enum {
+	STD_IN,
+	STD_OUT,
+	STD_ERR,
+	STD_MAX = 16,
+};
+
+struct _reent {
+	int _errno;
+	void* deviceData;
+};
+
+typedef struct {
+	void* device;
+	void* dirStruct;
+} DIR_ITER;
+
+typedef struct {
+	const char* name;
+	size_t structSize;
+	int (*open_r)(struct _reent* r, void* fileStruct, const char* path, int flags, int mode);
+	int (*close_r)(struct _reent* r, void* fd);
+	ssize_t (*write_r)(struct _reent* r, void* fd, const char* ptr, size_t len);
+	ssize_t (*read_r)(struct _reent* r, void* fd, char* ptr, size_t len);
+	off_t (*seek_r)(struct _reent* r, void* fd, off_t pos, int dir);
+	int (*fstat_r)(struct _reent* r, void* fd, struct stat* st);
+	int (*stat_r)(struct _reent* r, const char* file, struct stat* st);
+	int (*link_r)(struct _reent* r, const char* existing, const char* newLink);
+	int (*unlink_r)(struct _reent* r, const char* name);
+	int (*chdir_r)(struct _reent* r, const char* name);
+	int (*rename_r)(struct _reent* r, const char* oldName, const char* newName);
+	int (*mkdir_r)(struct _reent* r, const char* path, int mode);
+	size_t dirStateSize;
+	DIR_ITER* (*diropen_r)(struct _reent* r, DIR_ITER* dirState, const char* path);
+	int (*dirreset_r)(struct _reent* r, DIR_ITER* dirState);
+	int (*dirnext_r)(struct _reent* r, DIR_ITER* dirState, char* filename, struct stat* filestat);
+	int (*dirclose_r)(struct _reent* r, DIR_ITER* dirState);
+	int (*statvfs_r)(struct _reent* r, const char* path, struct statvfs* buf);
+	int (*ftruncate_r)(struct _reent* r, void* fd, off_t len);
+	int (*fsync_r)(struct _reent* r, void* fd);
+	void* deviceData;
+	int (*chmod_r)(struct _reent* r, const char* path, mode_t mode);
+	int (*fchmod_r)(struct _reent* r, void* fd, mode_t mode);
+	int (*rmdir_r)(struct _reent* r, const char* name);
+	int (*lstat_r)(struct _reent* r, const char* file, struct stat* st);
+	int (*utimes_r)(struct _reent* r, const char* filename, const struct timeval times[2]);
+	long (*fpathconf_r)(struct _reent* r, void* fd, int name);
+	long (*pathconf_r)(struct _reent* r, const char* path, int name);
+	int (*symlink_r)(struct _reent* r, const char* target, const char* linkpath);
+	ssize_t (*readlink_r)(struct _reent* r, const char* path, char* buf, size_t bufsiz);
+} devoptab_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern const devoptab_t* devoptab_list[STD_MAX];
+
+int AddDevice(const devoptab_t* device);
+int FindDevice(const char* name);
+int RemoveDevice(const char* name);
+void setDefaultDevice(int device);
+const devoptab_t* GetDeviceOpTab(const char* name);
+
+// Hosted dispatch through the device table (stand-in for libsysbase)
+int dvmHostOpen(const char* path, int flags, int mode);
+int dvmHostClose(int fd);
+ssize_t dvmHostRead(int fd, void* buf, size_t len);
+ssize_t dvmHostWrite(int fd, const void* buf, size_t len);
+off_t dvmHostLseek(int fd, off_t offset, int whence);
+int dvmHostFstat(int fd, struct stat* st);
+int dvmHostFtruncate(int fd, off_t len);
+int dvmHostFsync(int fd);
+long dvmHostFpathconf(int fd, int name);
+int dvmHostStat(const char* path, struct stat* st);
+int dvmHostUnlink(const char* path);
+int dvmHostRmdir(const char* path);
+int dvmHostMkdir(const char* path, int mode);
+int dvmHostRename(const char* old_path, const char* new_path);
+int dvmHostChdir(const char* path);
+int dvmHostStatvfs(const char* path, struct statvfs* buf);
+DIR_ITER* dvmHostDirOpen(const char* path);
+int dvmHostDirReset(DIR_ITER* it);
+int dvmHostDirNext(DIR_ITER* it, char* filename, struct stat* st);
+int dvmHostDirClose(DIR_ITER* it);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#pragma once
+#include <pthread.h>
+
+// newlib-compatible lock primitives for hosted builds
+typedef pthread_mutex_t _LOCK_T;
+
+#define __LOCK_INIT(class, lock) class _LOCK_T lock = PTHREAD_MUTEX_INITIALIZER
+
+#define __lock_init(lock)    pthread_mutex_init(&(lock), NULL)
+#define __lock_acquire(lock) pthread_mutex_lock(&(lock))
+#define __lock_release(lock) pthread_mutex_unlock(&(lock))
+#define __lock_close(lock)   pthread_mutex_destroy(&(lock))
+
+typedef pthread_mutex_t _LOCK_RECURSIVE_T;
+
+static inline void __dvm_lock_init_recursive(pthread_mutex_t* lock)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+#define __lock_init_recursive(lock)    __dvm_lock_init_recursive(&(lock))
+#define __lock_acquire_recursive(lock) pthread_mutex_lock(&(lock))
+#define __lock_release_recursive(lock) pthread_mutex_unlock(&(lock))
+#define __lock_close_recursive(lock)   pthread_mutex_destroy(&(lock))
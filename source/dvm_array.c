@@ -0,0 +1,331 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/lock.h>
+#include <dvm.h>
+#include "dvm_debug.h"
+
+#define BOUNCE_SZ (64U*1024)
+
+typedef struct DvmDiscArrayMember {
+	DvmDisc* disc;
+	sec_t start_sector; // Concatenation only: first sector of this member in the array
+	sec_t num_sectors;  // Sectors used from this member
+} DvmDiscArrayMember;
+
+typedef struct DvmDiscArray {
+	DvmDisc base;
+
+	_LOCK_T lock;
+	uint8_t* bounce;
+	unsigned stripe_sectors;
+	unsigned bounce_rows;
+	unsigned num_members;
+
+	DvmDiscArrayMember members[];
+} DvmDiscArray;
+
+static bool _dvmDiscArrayMemberIo(DvmDisc* disc, uint8_t* buffer, sec_t sector, sec_t num_sectors, bool is_partial, bool is_write)
+{
+	if (is_write) {
+		return disc->vt->write_sectors(disc, buffer, sector, num_sectors, is_partial);
+	} else {
+		return disc->vt->read_sectors(disc, buffer, sector, num_sectors, is_partial);
+	}
+}
+
+static bool _dvmDiscArrayConcatIo(DvmDiscArray* self, uint8_t* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial, bool is_write)
+{
+	unsigned i = 0;
+	bool ret = true;
+	while (ret && num_sectors) {
+		// Find the member holding this sector
+		while (first_sector >= self->members[i].start_sector + self->members[i].num_sectors) {
+			i ++;
+		}
+
+		const DvmDiscArrayMember* m = &self->members[i];
+		sec_t member_sector = first_sector - m->start_sector;
+		sec_t max_cur_sectors = m->num_sectors - member_sector;
+		sec_t cur_sectors = num_sectors < max_cur_sectors ? num_sectors : max_cur_sectors;
+
+		ret = _dvmDiscArrayMemberIo(m->disc, buffer, member_sector, cur_sectors, is_partial, is_write);
+
+		buffer += cur_sectors*self->base.sector_sz;
+		first_sector += cur_sectors;
+		num_sectors -= cur_sectors;
+	}
+
+	return ret;
+}
+
+static bool _dvmDiscArrayStripeRows(DvmDiscArray* self, uint8_t* buffer, sec_t row, unsigned num_rows, bool is_write)
+{
+	// Whole rows: issue one contiguous command per member, gathering or
+	// scattering its stripes through the bounce buffer
+	const unsigned n = self->num_members;
+	const size_t stripe_sz = self->stripe_sectors*self->base.sector_sz;
+	const sec_t member_sector = row*self->stripe_sectors;
+	const sec_t member_count = (sec_t)num_rows*self->stripe_sectors;
+
+	bool ret = true;
+	for (unsigned i = 0; ret && i < n; i ++) {
+		DvmDisc* disc = self->members[i].disc;
+
+		if (is_write) {
+			for (unsigned r = 0; r < num_rows; r ++) {
+				memcpy(self->bounce + r*stripe_sz, buffer + (r*n + i)*stripe_sz, stripe_sz);
+			}
+			ret = dvmDiscWriteSectors(disc, self->bounce, member_sector, member_count);
+		} else {
+			ret = dvmDiscReadSectors(disc, self->bounce, member_sector, member_count);
+			for (unsigned r = 0; ret && r < num_rows; r ++) {
+				memcpy(buffer + (r*n + i)*stripe_sz, self->bounce + r*stripe_sz, stripe_sz);
+			}
+		}
+	}
+
+	return ret;
+}
+
+static bool _dvmDiscArrayStripeIo(DvmDiscArray* self, uint8_t* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial, bool is_write)
+{
+	const unsigned n = self->num_members;
+	const unsigned stripe = self->stripe_sectors;
+	const sec_t row_sectors = (sec_t)n*stripe;
+
+	bool ret = true;
+	while (ret && num_sectors) {
+		sec_t stripe_idx = first_sector / stripe;
+		unsigned stripe_offset = first_sector % stripe;
+		sec_t cur_sectors;
+
+		if ((first_sector % row_sectors) == 0 && num_sectors >= row_sectors) {
+			sec_t num_rows = num_sectors / row_sectors;
+			if (num_rows > self->bounce_rows) {
+				num_rows = self->bounce_rows;
+			}
+
+			cur_sectors = num_rows*row_sectors;
+			ret = _dvmDiscArrayStripeRows(self, buffer, first_sector / row_sectors, num_rows, is_write);
+		} else {
+			// Leading or trailing stripe pieces go straight to their member
+			sec_t max_cur_sectors = stripe - stripe_offset;
+			cur_sectors = num_sectors < max_cur_sectors ? num_sectors : max_cur_sectors;
+
+			DvmDisc* disc = self->members[stripe_idx % n].disc;
+			sec_t member_sector = (stripe_idx / n)*stripe + stripe_offset;
+			ret = _dvmDiscArrayMemberIo(disc, buffer, member_sector, cur_sectors, is_partial, is_write);
+		}
+
+		buffer += cur_sectors*self->base.sector_sz;
+		first_sector += cur_sectors;
+		num_sectors -= cur_sectors;
+	}
+
+	return ret;
+}
+
+static bool _dvmDiscArrayReadWrite(DvmDiscArray* self, uint8_t* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial, bool is_write)
+{
+	// Early fail on out of bounds access
+	if (first_sector >= self->base.num_sectors || num_sectors > self->base.num_sectors - first_sector) {
+		return false;
+	}
+
+	__lock_acquire(self->lock);
+	dvmDebug("array%s(%p,0x%lx,%lu)\n", is_write ? "Write" : "Read", buffer, first_sector, num_sectors);
+
+	bool ret;
+	if (self->stripe_sectors) {
+		ret = _dvmDiscArrayStripeIo(self, buffer, first_sector, num_sectors, is_partial, is_write);
+	} else {
+		ret = _dvmDiscArrayConcatIo(self, buffer, first_sector, num_sectors, is_partial, is_write);
+	}
+
+	__lock_release(self->lock);
+	return ret;
+}
+
+static bool _dvmDiscArrayReadSectors(DvmDisc* self_, void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	DvmDiscArray* self = (DvmDiscArray*)self_;
+	return _dvmDiscArrayReadWrite(self, (uint8_t*)buffer, first_sector, num_sectors, is_partial, false);
+}
+
+static bool _dvmDiscArrayWriteSectors(DvmDisc* self_, const void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	DvmDiscArray* self = (DvmDiscArray*)self_;
+	return _dvmDiscArrayReadWrite(self, (uint8_t*)buffer, first_sector, num_sectors, is_partial, true);
+}
+
+static bool _dvmDiscArrayFlush(DvmDisc* self_)
+{
+	DvmDiscArray* self = (DvmDiscArray*)self_;
+
+	bool ret = true;
+	for (unsigned i = 0; i < self->num_members; i ++) {
+		ret &= dvmDiscFlush(self->members[i].disc);
+	}
+
+	return ret;
+}
+
+static bool _dvmDiscArrayTrim(DvmDisc* self_, sec_t first_sector, sec_t num_sectors)
+{
+	DvmDiscArray* self = (DvmDiscArray*)self_;
+
+	// Early fail on out of bounds access
+	if (first_sector >= self->base.num_sectors || num_sectors > self->base.num_sectors - first_sector) {
+		return false;
+	}
+
+	bool ret = true;
+	unsigned i = 0;
+	while (num_sectors) {
+		DvmDisc* disc;
+		sec_t member_sector, cur_sectors;
+
+		if (self->stripe_sectors) {
+			const unsigned stripe = self->stripe_sectors;
+			sec_t stripe_idx = first_sector / stripe;
+			unsigned stripe_offset = first_sector % stripe;
+			sec_t max_cur_sectors = stripe - stripe_offset;
+			cur_sectors = num_sectors < max_cur_sectors ? num_sectors : max_cur_sectors;
+			disc = self->members[stripe_idx % self->num_members].disc;
+			member_sector = (stripe_idx / self->num_members)*stripe + stripe_offset;
+		} else {
+			while (first_sector >= self->members[i].start_sector + self->members[i].num_sectors) {
+				i ++;
+			}
+
+			const DvmDiscArrayMember* m = &self->members[i];
+			member_sector = first_sector - m->start_sector;
+			sec_t max_cur_sectors = m->num_sectors - member_sector;
+			cur_sectors = num_sectors < max_cur_sectors ? num_sectors : max_cur_sectors;
+			disc = m->disc;
+		}
+
+		ret &= dvmDiscTrim(disc, member_sector, cur_sectors);
+		first_sector += cur_sectors;
+		num_sectors -= cur_sectors;
+	}
+
+	return ret;
+}
+
+static void _dvmDiscArrayDestroy(DvmDisc* self_)
+{
+	DvmDiscArray* self = (DvmDiscArray*)self_;
+
+	_dvmDiscArrayFlush(self_);
+	for (unsigned i = 0; i < self->num_members; i ++) {
+		dvmDiscRemoveUser(self->members[i].disc);
+	}
+
+	__lock_close(self->lock);
+	free(self->bounce);
+	free(self);
+}
+
+static const DvmDiscIface s_dvmDiscArrayIface = {
+	.destroy       = _dvmDiscArrayDestroy,
+	.read_sectors  = _dvmDiscArrayReadSectors,
+	.write_sectors = _dvmDiscArrayWriteSectors,
+	.flush         = _dvmDiscArrayFlush,
+	.trim          = _dvmDiscArrayTrim,
+};
+
+DvmDisc* dvmDiscArrayCreate(DvmDisc* const members[], unsigned num_members, unsigned stripe_sectors)
+{
+	// Parameter validation
+	if (!members || !num_members || !members[0]) {
+		return NULL;
+	}
+
+	// Stripes are given in 512-byte units, and must be whole member sectors
+	const unsigned sector_sz = members[0]->sector_sz;
+	if ((stripe_sectors*512U) % sector_sz) {
+		return NULL;
+	}
+	stripe_sectors = stripe_sectors*512U / sector_sz;
+
+	uint16_t features = FEATURE_MEDIUM_CANREAD | FEATURE_MEDIUM_CANWRITE;
+	uint16_t block_sz = 0;
+	DvmDiscCaps caps = {0};
+	sec_t min_sectors = ~(sec_t)0;
+	for (unsigned i = 0; i < num_members; i ++) {
+		const DvmDisc* m = members[i];
+
+		// Members must share the sector size and have a known size
+		if (!m || m->sector_sz != sector_sz || ~m->num_sectors == 0) {
+			return NULL;
+		}
+
+		features &= m->features;
+		dvmDiscCapsMerge(&caps, &m->caps);
+		if (m->block_sz > block_sz) {
+			block_sz = m->block_sz;
+		}
+		if (m->num_sectors < min_sectors) {
+			min_sectors = m->num_sectors;
+		}
+	}
+
+	// Striping uses the same amount of whole stripes from each member
+	if (stripe_sectors && min_sectors < stripe_sectors) {
+		return NULL;
+	}
+
+	DvmDiscArray* disc = (DvmDiscArray*)calloc(1, sizeof(DvmDiscArray) + num_members*sizeof(DvmDiscArrayMember));
+	if (!disc) {
+		return NULL;
+	}
+
+	if (stripe_sectors) {
+		size_t stripe_sz = stripe_sectors*sector_sz;
+		disc->bounce_rows = stripe_sz < BOUNCE_SZ ? BOUNCE_SZ / stripe_sz : 1;
+
+		// Keep each per-member command within the member transfer limit, after
+		// which the array itself only needs limiting if a stripe exceeds it
+		if (caps.max_sectors && stripe_sectors <= caps.max_sectors) {
+			if (disc->bounce_rows*stripe_sectors > caps.max_sectors) {
+				disc->bounce_rows = caps.max_sectors / stripe_sectors;
+			}
+			caps.max_sectors = 0;
+		}
+		caps.opt_sectors = num_members*stripe_sectors;
+
+		size_t align = caps.align > LIBDVM_BUFFER_ALIGN ? caps.align : LIBDVM_BUFFER_ALIGN;
+		disc->bounce = (uint8_t*)aligned_alloc(align, (disc->bounce_rows*stripe_sz + align - 1) &~ (align - 1));
+		if (!disc->bounce) {
+			free(disc);
+			return NULL;
+		}
+	}
+
+	sec_t total_sectors = 0;
+	for (unsigned i = 0; i < num_members; i ++) {
+		DvmDiscArrayMember* m = &disc->members[i];
+		m->disc = members[i];
+		m->start_sector = total_sectors;
+		m->num_sectors = stripe_sectors ? min_sectors - min_sectors % stripe_sectors : members[i]->num_sectors;
+		total_sectors += m->num_sectors;
+		dvmDiscAddUser(m->disc);
+	}
+
+	disc->base.vt = &s_dvmDiscArrayIface;
+	disc->base.io_type = members[0]->io_type;
+	disc->base.features = features;
+	disc->base.num_sectors = total_sectors;
+	disc->base.sector_sz = sector_sz;
+	disc->base.block_sz = block_sz;
+	disc->base.caps = caps;
+	__lock_init(disc->lock);
+	disc->stripe_sectors = stripe_sectors;
+	disc->num_members = num_members;
+
+	return &disc->base;
+}
@@ -9,6 +9,11 @@
 
 #define LIBDVM_EMPTY_PAGE (~(sec_t)0)
 
+// Pages loaded in one command once sequential page loads are detected
+#define LIBDVM_READ_AHEAD_PAGES 4U
+
+extern unsigned g_dvmDefaultCacheFlags;
+
 #ifdef LIBDVM_WITH_CACHE_COPY
 void _dvmCacheCopy(void* dst, const void* src, size_t size);
 #else
@@ -51,6 +56,11 @@ struct DvmDiscCache {
 	DvmDisc* inner;
 	uint8_t* data;
 	uint8_t page_shift;
+	unsigned flags;
+	unsigned write_through; // Volumes mounted with DVM_MOUNT_WRITE_THROUGH
+	unsigned num_pages;
+	sec_t next_load;
+	DvmCacheStats stats;
 	DvmDiscCacheNode list;
 
 	DvmDiscCacheEntry entries[];
@@ -89,6 +99,90 @@ static uint8_t* _dvmDiscCacheEntryGetData(DvmDiscCache* self, DvmDiscCacheEntry*
 	return self->data + ((p-self->entries) << self->page_shift)*self->base.sector_sz;
 }
 
+static void _dvmDiscCacheMoveAfter(DvmDiscCache* self, DvmDiscCacheEntry* p, DvmDiscCacheEntry* after)
+{
+	if (p == after) {
+		return;
+	}
+
+	// Unlink...
+	(p->link.prev ? &p->link.prev->link : &self->list)->next = p->link.next;
+	(p->link.next ? &p->link.next->link : &self->list)->prev = p->link.prev;
+
+	// ...and relink after the given entry (NULL: as the MRU)
+	p->link.prev = after;
+	p->link.next = after ? after->link.next : self->list.next;
+	(p->link.prev ? &p->link.prev->link : &self->list)->next = p;
+	(p->link.next ? &p->link.next->link : &self->list)->prev = p;
+}
+
+static void _dvmDiscCacheInsertNew(DvmDiscCache* self, DvmDiscCacheEntry* p)
+{
+	if (!(self->flags & DVM_CACHE_MIDPOINT_INSERT)) {
+		_dvmDiscCacheMoveAfter(self, p, NULL);
+		return;
+	}
+
+	// Newly loaded pages start 3/8 of the way up from the LRU end, and only
+	// become MRU when accessed again (keeps one-off scans from flushing the cache)
+	DvmDiscCacheEntry* after = self->list.prev;
+	for (unsigned i = 0; after && i < self->num_pages*3/8; i ++) {
+		after = after->link.prev;
+	}
+
+	// Unallocated entries must stay together at the LRU end
+	while (after && after->base_sector == LIBDVM_EMPTY_PAGE) {
+		after = after->link.prev;
+	}
+
+	_dvmDiscCacheMoveAfter(self, p, after);
+}
+
+static void _dvmDiscCacheDrop(DvmDiscCache* self, DvmDiscCacheEntry* p)
+{
+	p->base_sector = LIBDVM_EMPTY_PAGE;
+	p->dirty_start = 1U << self->page_shift;
+	p->dirty_end = 0;
+
+	// Move it to the LRU end along with the other unallocated entries
+	(p->link.prev ? &p->link.prev->link : &self->list)->next = p->link.next;
+	(p->link.next ? &p->link.next->link : &self->list)->prev = p->link.prev;
+	p->link.next = NULL;
+	p->link.prev = self->list.prev;
+	(p->link.prev ? &p->link.prev->link : &self->list)->next = p;
+	self->list.prev = p;
+}
+
+static bool _dvmDiscCacheInnerIo(DvmDiscCache* self, uint8_t* buffer, sec_t first_sector, sec_t num_sectors, bool is_write)
+{
+	// Split requests that exceed the transfer limit of the inner disc,
+	// keeping each piece aligned to a multiple of the limit
+	const sec_t max_sectors = self->inner->caps.max_sectors;
+
+	bool ret = true;
+	while (ret && num_sectors) {
+		sec_t cur_sectors = num_sectors;
+		if (max_sectors) {
+			sec_t max_cur_sectors = max_sectors - first_sector % max_sectors;
+			if (cur_sectors > max_cur_sectors) {
+				cur_sectors = max_cur_sectors;
+			}
+		}
+
+		if (is_write) {
+			ret = dvmDiscWriteSectors(self->inner, buffer, first_sector, cur_sectors);
+		} else {
+			ret = dvmDiscReadSectors(self->inner, buffer, first_sector, cur_sectors);
+		}
+
+		buffer += cur_sectors*self->base.sector_sz;
+		first_sector += cur_sectors;
+		num_sectors -= cur_sectors;
+	}
+
+	return ret;
+}
+
 static bool _dvmDiscCacheEntryFlush(DvmDiscCache* self, DvmDiscCacheEntry* p)
 {
 	// Do nothing if this entry is already clean
@@ -99,15 +193,16 @@ static bool _dvmDiscCacheEntryFlush(DvmDiscCache* self, DvmDiscCacheEntry* p)
 	uint8_t* data = _dvmDiscCacheEntryGetData(self, p) + p->dirty_start*self->base.sector_sz;
 	sec_t sector = p->base_sector + p->dirty_start;
 	unsigned sz = p->dirty_end - p->dirty_start;
-	dvmDebug(" flush %lx (%u) <- %p\n", sector, sz, data);
+	dvmTp(DVM_TP_CACHE_WRITEBACK, sector, sz);
 
-	bool ret = dvmDiscWriteSectors(self->inner, data, sector, sz);
+	bool ret = _dvmDiscCacheInnerIo(self, data, sector, sz, true);
 	if (ret) {
 		// Mark this entry as clean
 		p->dirty_start = 1U << self->page_shift;
 		p->dirty_end = 0;
+		self->stats.writebacks ++;
 	} else {
-		dvmDebug(" flush error!\n");
+		dvmTp(DVM_TP_CACHE_WB_ERROR, sector, sz);
 	}
 
 	return ret;
@@ -117,7 +212,7 @@ static bool _dvmDiscCacheFlush(DvmDisc* self_)
 {
 	DvmDiscCache* self = (DvmDiscCache*)self_;
 	__lock_acquire(self->lock);
-	dvmDebug("cacheFlush()\n");
+	dvmTp(DVM_TP_CACHE_FLUSH);
 
 	bool ret = true;
 	for (DvmDiscCacheEntry* p = self->list.next; p; p = p->link.next) {
@@ -134,6 +229,36 @@ static bool _dvmDiscCacheFlush(DvmDisc* self_)
 	return ret;
 }
 
+static bool _dvmDiscCacheFlushRanges(DvmDisc* self_, const DvmFileExtent* runs, unsigned num_runs)
+{
+	DvmDiscCache* self = (DvmDiscCache*)self_;
+	__lock_acquire(self->lock);
+	dvmTp(DVM_TP_CACHE_FLUSH);
+
+	// Dirty pages are written back whole if their dirty span touches a run
+	bool ret = true;
+	for (DvmDiscCacheEntry* p = self->list.next; p; p = p->link.next) {
+		if (p->base_sector == LIBDVM_EMPTY_PAGE) {
+			break;
+		} else if (p->dirty_start >= p->dirty_end) {
+			continue;
+		}
+
+		sec_t dirty_start = p->base_sector + p->dirty_start;
+		sec_t dirty_end = p->base_sector + p->dirty_end;
+		for (unsigned i = 0; i < num_runs; i ++) {
+			if (runs[i].sector < dirty_end && dirty_start < runs[i].sector + runs[i].num_sectors) {
+				ret &= _dvmDiscCacheEntryFlush(self, p);
+				break;
+			}
+		}
+	}
+
+	ret &= dvmDiscFlush(self->inner);
+	__lock_release(self->lock);
+	return ret;
+}
+
 static void _dvmDiscCacheDestroy(DvmDisc* self_)
 {
 	DvmDiscCache* self = (DvmDiscCache*)self_;
@@ -145,6 +270,36 @@ static void _dvmDiscCacheDestroy(DvmDisc* self_)
 	free(self);
 }
 
+static unsigned _dvmDiscCacheReadAhead(DvmDiscCache* self, DvmDiscCacheEntry* p)
+{
+	// Only entries following the victim in memory can receive the extra pages,
+	// so that the whole window is loaded with a single command. Dirty entries
+	// are never evicted for read-ahead, and pages already cached end the window.
+	const unsigned page_sz = 1U << self->page_shift;
+	unsigned idx = p - self->entries;
+	unsigned num_pages = 1;
+
+	while (num_pages < LIBDVM_READ_AHEAD_PAGES && (idx + num_pages) < self->num_pages) {
+		DvmDiscCacheEntry* q = &self->entries[idx + num_pages];
+		sec_t page_sector = p->base_sector + num_pages*page_sz;
+		if (page_sector >= self->base.num_sectors || q->dirty_start < q->dirty_end) {
+			break;
+		}
+
+		DvmDiscCacheEntry* other = _dvmDiscCacheSearch(self, page_sector);
+		if (other && other->base_sector == page_sector) {
+			break;
+		}
+
+		q->base_sector = page_sector;
+		_dvmDiscCacheInsertNew(self, q);
+		num_pages ++;
+	}
+
+	self->stats.readahead_pages += num_pages - 1;
+	return num_pages;
+}
+
 static bool _dvmDiscCacheReadWrite(
 	DvmDiscCache* self, uint8_t* buffer, sec_t first_sector, sec_t num_sectors,
 	bool is_partial, bool is_write)
@@ -160,7 +315,8 @@ static bool _dvmDiscCacheReadWrite(
 		return false;
 	}
 
-	const bool is_aligned = _dvmIsAlignedAccess(buffer, is_write);
+	const uintptr_t inner_align = self->inner->caps.align ? self->inner->caps.align : 1;
+	const bool is_aligned = _dvmIsAlignedAccess(buffer, is_write) && ((uintptr_t)buffer & (inner_align-1)) == 0;
 	const unsigned page_sz = 1U << self->page_shift;
 	const unsigned page_mask = page_sz - 1;
 
@@ -168,6 +324,7 @@ static bool _dvmDiscCacheReadWrite(
 
 	DvmDiscCacheEntry* p = NULL;
 	sec_t search_base = 0;
+	const void* map;
 
 	while (num_sectors) {
 		// Calculate associated page & offset within page
@@ -180,21 +337,23 @@ static bool _dvmDiscCacheReadWrite(
 
 		// Check if the entire page is accessed (i.e. not a partial read/write)
 		bool is_whole = cur_page_offset == 0 && cur_sectors == page_sz;
+		bool is_new = false;
 
 		// Search the cache for this page if needed
 		if (cur_page_sector >= search_base) {
 			p = _dvmDiscCacheSearch(self, cur_page_sector);
 			if (p) {
-				dvmDebug(" search %lx -> %p %lx\n", cur_page_sector, p, p->base_sector);
+				dvmTp(DVM_TP_CACHE_SEARCH, cur_page_sector, p->base_sector);
 				search_base = p->base_sector+1;
 			} else {
-				dvmDebug(" miss %lx\n", cur_page_sector);
+				dvmTp(DVM_TP_CACHE_MISS, cur_page_sector);
 				search_base = LIBDVM_EMPTY_PAGE;
 			}
 		}
 
 		// Cache hit:
 		if (p && p->base_sector == cur_page_sector) {
+			self->stats.hits ++;
 _cacheHit:
 			uint8_t* data = _dvmDiscCacheEntryGetData(self, p) + cur_page_offset*self->base.sector_sz;
 			if (is_write) {
@@ -208,11 +367,18 @@ _cacheHit:
 				if (dirty_end > p->dirty_end) {
 					p->dirty_end = dirty_end;
 				}
+
+				// Written through pages stay cached, but clean
+				if (((self->flags & DVM_CACHE_WRITE_THROUGH) || self->write_through) && !_dvmDiscCacheEntryFlush(self, p)) {
+					return false;
+				}
 			} else {
 				_dvmCacheCopy(buffer, data, cur_sectors*self->base.sector_sz);
 			}
 
-			if (!is_whole && p != self->list.next) {
+			if (is_new && (self->flags & DVM_CACHE_MIDPOINT_INSERT)) {
+				_dvmDiscCacheInsertNew(self, p);
+			} else if (!is_whole && p != self->list.next) {
 				// Make this the MRU
 				p->link.prev->link.next = p->link.next;
 				(p->link.next ? &p->link.next->link : &self->list)->prev = p->link.prev;
@@ -223,6 +389,12 @@ _cacheHit:
 			}
 		}
 
+		// Uncached read from a directly addressable inner disc (copy straight from it):
+		else if (!is_write && (map = dvmDiscMapSectors(self->inner, first_sector, cur_sectors))) {
+			dvmTp(DVM_TP_CACHE_MAPPED, first_sector, cur_sectors);
+			_dvmCacheCopy(buffer, map, cur_sectors*self->base.sector_sz);
+		}
+
 		// Partial access or misaligned access:
 		else if (is_partial || !is_aligned) {
 			p = self->list.prev;
@@ -234,20 +406,35 @@ _cacheHit:
 				return false;
 			}
 
+			// The reused entry replaces the previous search result
 			p->base_sector = cur_page_sector;
+			search_base = 0;
+			is_new = true;
+			self->stats.misses ++;
 
 			if (!is_write || !is_whole) {
-				// Read in...
-				void* data = _dvmDiscCacheEntryGetData(self, p);
-				sec_t max_sz = self->base.num_sectors - cur_page_sector;
-				unsigned sz = page_sz < max_sz ? page_sz : max_sz;
-				dvmDebug(" load %lx (%u) -> %p\n", cur_page_sector, sz, data);
+				// Read in, along with the following pages if reading sequentially
+				unsigned num_pages = 1;
+				if (!is_write && (self->flags & DVM_CACHE_READ_AHEAD) && cur_page_sector == self->next_load) {
+					num_pages = _dvmDiscCacheReadAhead(self, p);
+				}
 
-				if (!dvmDiscReadSectors(self->inner, data, cur_page_sector, sz)) {
-					p->base_sector = LIBDVM_EMPTY_PAGE;
-					dvmDebug(" load error!\n");
+				uint8_t* data = _dvmDiscCacheEntryGetData(self, p);
+				sec_t max_sz = self->base.num_sectors - cur_page_sector;
+				sec_t sz = (sec_t)num_pages*page_sz < max_sz ? (sec_t)num_pages*page_sz : max_sz;
+				dvmTp(DVM_TP_CACHE_LOAD, cur_page_sector, sz);
+
+				if (!_dvmDiscCacheInnerIo(self, data, cur_page_sector, sz, false)) {
+					// The contents of every claimed entry are lost: return them all to
+					// the LRU end, as unallocated entries must not be followed by others
+					for (unsigned i = 0; i < num_pages; i ++) {
+						_dvmDiscCacheDrop(self, &p[i]);
+					}
+					dvmTp(DVM_TP_CACHE_LOAD_ERROR, cur_page_sector, sz);
 					return false;
 				}
+
+				self->next_load = cur_page_sector + (sec_t)num_pages*page_sz;
 			}
 
 			goto _cacheHit;
@@ -259,17 +446,11 @@ _cacheHit:
 			// (up until the next cached page or disc end if no more pages)
 			max_cur_sectors = (p ? p->base_sector : self->base.num_sectors) - first_sector;
 			cur_sectors = num_sectors < max_cur_sectors ? num_sectors : max_cur_sectors;
-			dvmDebug(" direct %lx (%lu) %s %p\n", first_sector, cur_sectors, is_write ? "<-" : "->", buffer);
-
-			bool ret;
-			if (is_write) {
-				ret = dvmDiscWriteSectors(self->inner, buffer, first_sector, cur_sectors);
-			} else {
-				ret = dvmDiscReadSectors(self->inner, buffer, first_sector, cur_sectors);
-			}
+			dvmTp(is_write ? DVM_TP_CACHE_DIRECT_WRITE : DVM_TP_CACHE_DIRECT_READ, first_sector, cur_sectors);
+			self->stats.direct_sectors += cur_sectors;
 
-			if (!ret) {
-				dvmDebug(" direct fail\n");
+			if (!_dvmDiscCacheInnerIo(self, buffer, first_sector, cur_sectors, is_write)) {
+				dvmTp(DVM_TP_CACHE_DIRECT_ERROR, first_sector, cur_sectors);
 				return false;
 			}
 		}
@@ -287,7 +468,7 @@ static bool _dvmDiscCacheReadSectors(DvmDisc* self_, void* buffer, sec_t first_s
 {
 	DvmDiscCache* self = (DvmDiscCache*)self_;
 	__lock_acquire(self->lock);
-	dvmDebug("cacheRead(%p,0x%lx,%lu)\n", buffer, first_sector, num_sectors);
+	dvmTp(DVM_TP_CACHE_READ, first_sector, num_sectors);
 	bool ret = _dvmDiscCacheReadWrite(self, (uint8_t*)buffer, first_sector, num_sectors, is_partial, false);
 	__lock_release(self->lock);
 	return ret;
@@ -297,20 +478,158 @@ static bool _dvmDiscCacheWriteSectors(DvmDisc* self_, const void* buffer, sec_t
 {
 	DvmDiscCache* self = (DvmDiscCache*)self_;
 	__lock_acquire(self->lock);
-	dvmDebug("cacheWrite(%p,0x%lx,%lu)\n", buffer, first_sector, num_sectors);
+	dvmTp(DVM_TP_CACHE_WRITE, first_sector, num_sectors);
 	bool ret = _dvmDiscCacheReadWrite(self, (uint8_t*)buffer, first_sector, num_sectors, is_partial, true);
 	__lock_release(self->lock);
 	return ret;
 }
 
+static bool _dvmDiscCacheTrim(DvmDisc* self_, sec_t first_sector, sec_t num_sectors)
+{
+	DvmDiscCache* self = (DvmDiscCache*)self_;
+	__lock_acquire(self->lock);
+	dvmTp(DVM_TP_CACHE_TRIM, first_sector, num_sectors);
+
+	const unsigned page_sz = 1U << self->page_shift;
+	const sec_t end_sector = first_sector + num_sectors;
+
+	DvmDiscCacheEntry* next;
+	for (DvmDiscCacheEntry* p = self->list.next; p; p = next) {
+		next = p->link.next;
+
+		// Early exit if we find an unallocated cache entry
+		if (p->base_sector == LIBDVM_EMPTY_PAGE) {
+			break;
+		}
+
+		// Skip pages outside the range
+		if (p->base_sector >= end_sector || (p->base_sector + page_sz) <= first_sector) {
+			continue;
+		}
+
+		if (p->base_sector >= first_sector && (p->base_sector + page_sz) <= end_sector) {
+			// Whole page discarded: drop it, including unwritten data
+			_dvmDiscCacheDrop(self, p);
+		} else {
+			// Partially discarded page: zero the discarded sectors, and write them
+			// back so that the disc agrees even if it does not support discarding
+			unsigned start = p->base_sector < first_sector ? first_sector - p->base_sector : 0;
+			unsigned end = (p->base_sector + page_sz) > end_sector ? end_sector - p->base_sector : page_sz;
+			memset(_dvmDiscCacheEntryGetData(self, p) + start*self->base.sector_sz, 0, (end - start)*self->base.sector_sz);
+
+			if (start < p->dirty_start) {
+				p->dirty_start = start;
+			}
+			if (end > p->dirty_end) {
+				p->dirty_end = end;
+			}
+		}
+	}
+
+	bool ret = dvmDiscTrim(self->inner, first_sector, num_sectors);
+	__lock_release(self->lock);
+	return ret;
+}
+
+static bool _dvmDiscCacheDirectIo(DvmDisc* self_, void* buffer_, sec_t first_sector, sec_t num_sectors, bool is_write)
+{
+	DvmDiscCache* self = (DvmDiscCache*)self_;
+	uint8_t* buffer = (uint8_t*)buffer_;
+
+	if (first_sector >= self->base.num_sectors || num_sectors > self->base.num_sectors - first_sector) {
+		return false;
+	}
+
+	__lock_acquire(self->lock);
+	dvmTp(is_write ? DVM_TP_CACHE_DIRECT_WRITE : DVM_TP_CACHE_DIRECT_READ, first_sector, num_sectors);
+
+	const unsigned page_sz = 1U << self->page_shift;
+	const sec_t end_sector = first_sector + num_sectors;
+
+	// Cached pages in the range may be newer than the disc: write them back first.
+	// Pages that are about to be overwritten are dropped instead of going stale.
+	bool ret = true;
+	DvmDiscCacheEntry* next;
+	for (DvmDiscCacheEntry* p = self->list.next; ret && p; p = next) {
+		next = p->link.next;
+
+		// Early exit if we find an unallocated cache entry
+		if (p->base_sector == LIBDVM_EMPTY_PAGE) {
+			break;
+		}
+
+		// Skip pages outside the range
+		if (p->base_sector >= end_sector || (p->base_sector + page_sz) <= first_sector) {
+			continue;
+		}
+
+		bool is_covered = p->base_sector >= first_sector && (p->base_sector + page_sz) <= end_sector;
+		if (!(is_write && is_covered)) {
+			ret = _dvmDiscCacheEntryFlush(self, p);
+		}
+
+		if (ret && is_write) {
+			_dvmDiscCacheDrop(self, p);
+		}
+	}
+
+	const uintptr_t inner_align = self->inner->caps.align ? self->inner->caps.align : 1;
+	if (!ret) {
+		// Write back failed: leave the disc alone
+	} else if (_dvmIsAlignedAccess(buffer, is_write) && ((uintptr_t)buffer & (inner_align-1)) == 0) {
+		ret = _dvmDiscCacheInnerIo(self, buffer, first_sector, num_sectors, is_write);
+	} else {
+		// Misaligned buffer: bounce through the least recently used page, which stays unallocated
+		DvmDiscCacheEntry* p = self->list.prev;
+		ret = _dvmDiscCacheEntryFlush(self, p);
+		if (ret) {
+			_dvmDiscCacheDrop(self, p);
+		}
+
+		uint8_t* data = _dvmDiscCacheEntryGetData(self, p);
+		for (sec_t pos = 0; ret && pos < num_sectors; pos += page_sz) {
+			sec_t cur_sectors = (num_sectors - pos) < page_sz ? num_sectors - pos : page_sz;
+			size_t cur_sz = cur_sectors*self->base.sector_sz;
+			uint8_t* cur_buffer = buffer + pos*self->base.sector_sz;
+
+			if (is_write) {
+				_dvmCacheCopy(data, cur_buffer, cur_sz);
+			}
+
+			ret = _dvmDiscCacheInnerIo(self, data, first_sector + pos, cur_sectors, is_write);
+
+			if (ret && !is_write) {
+				_dvmCacheCopy(cur_buffer, data, cur_sz);
+			}
+		}
+	}
+
+	if (ret) {
+		self->stats.direct_sectors += num_sectors;
+	} else {
+		dvmTp(DVM_TP_CACHE_DIRECT_ERROR, first_sector, num_sectors);
+	}
+
+	__lock_release(self->lock);
+	return ret;
+}
+
 static const DvmDiscIface s_dvmDiscCacheIface = {
 	.destroy       = _dvmDiscCacheDestroy,
 	.read_sectors  = _dvmDiscCacheReadSectors,
 	.write_sectors = _dvmDiscCacheWriteSectors,
 	.flush         = _dvmDiscCacheFlush,
+	.trim          = _dvmDiscCacheTrim,
+	.flush_ranges  = _dvmDiscCacheFlushRanges,
+	.direct_io     = _dvmDiscCacheDirectIo,
 };
 
 DvmDisc* dvmDiscCacheCreate(DvmDisc* inner_disc, unsigned cache_pages, unsigned sectors_per_page)
+{
+	return dvmDiscCacheCreateEx(inner_disc, cache_pages, sectors_per_page, g_dvmDefaultCacheFlags);
+}
+
+DvmDisc* dvmDiscCacheCreateEx(DvmDisc* inner_disc, unsigned cache_pages, unsigned sectors_per_page, unsigned flags)
 {
 	sectors_per_page = sectors_per_page*512U / inner_disc->sector_sz;
 	if (sectors_per_page < inner_disc->block_sz) {
@@ -327,7 +646,10 @@ DvmDisc* dvmDiscCacheCreate(DvmDisc* inner_disc, unsigned cache_pages, unsigned
 		return inner_disc;
 	}
 
-	void* data = aligned_alloc(LIBDVM_BUFFER_ALIGN, cache_pages*sectors_per_page*inner_disc->sector_sz);
+	// Page buffers are handed to the inner disc, so they must satisfy its alignment too
+	size_t align = inner_disc->caps.align > LIBDVM_BUFFER_ALIGN ? inner_disc->caps.align : LIBDVM_BUFFER_ALIGN;
+	size_t data_sz = cache_pages*sectors_per_page*inner_disc->sector_sz;
+	void* data = aligned_alloc(align, (data_sz + align - 1) &~ (align - 1));
 	if (!data) {
 		free(disc);
 		return inner_disc;
@@ -340,11 +662,18 @@ DvmDisc* dvmDiscCacheCreate(DvmDisc* inner_disc, unsigned cache_pages, unsigned
 	disc->base.num_sectors = inner_disc->num_sectors;
 	disc->base.sector_sz = inner_disc->sector_sz;
 	disc->base.block_sz = sectors_per_page;
+	disc->base.caps = inner_disc->caps;
+	if (!disc->base.caps.opt_sectors) {
+		disc->base.caps.opt_sectors = sectors_per_page;
+	}
 	__lock_init(disc->lock);
 	dvmDiscAddUser(inner_disc);
 	disc->inner = inner_disc;
 	disc->data = (uint8_t*)data;
 	disc->page_shift = 0;
+	disc->flags = flags;
+	disc->num_pages = cache_pages;
+	disc->next_load = LIBDVM_EMPTY_PAGE;
 
 	// Calculate page shift (log2)
 	while ((1U << disc->page_shift) != sectors_per_page) {
@@ -367,3 +696,43 @@ DvmDisc* dvmDiscCacheCreate(DvmDisc* inner_disc, unsigned cache_pages, unsigned
 
 	return &disc->base;
 }
+
+bool dvmDiscCacheGetStats(DvmDisc* disc, DvmCacheStats* out, bool reset)
+{
+	if (!disc || disc->vt != &s_dvmDiscCacheIface) {
+		return false;
+	}
+
+	DvmDiscCache* self = (DvmDiscCache*)disc;
+	__lock_acquire(self->lock);
+
+	if (out) {
+		*out = self->stats;
+	}
+
+	if (reset) {
+		memset(&self->stats, 0, sizeof(self->stats));
+	}
+
+	__lock_release(self->lock);
+	return true;
+}
+
+bool _dvmDiscCacheWriteThrough(DvmDisc* disc, bool enable)
+{
+	if (!disc || disc->vt != &s_dvmDiscCacheIface) {
+		return false;
+	}
+
+	DvmDiscCache* self = (DvmDiscCache*)disc;
+	__lock_acquire(self->lock);
+
+	if (enable) {
+		self->write_through ++;
+	} else {
+		self->write_through --;
+	}
+
+	__lock_release(self->lock);
+	return true;
+}
@@ -1,10 +1,22 @@
 // SPDX-License-Identifier: ZPL-2.1
 // SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#include <stdalign.h>
+#include <stdlib.h>
 #include <calico.h>
 #include <dvm.h>
+#include "dvm_probe.h"
+#include "dvm_thread.h"
+
+#define THREAD_STACK_SZ 4096
 
 MK_WEAK unsigned g_dvmDefaultCachePages = 16;
 MK_WEAK unsigned g_dvmDefaultSectorsPerPage = 8;
+MK_WEAK unsigned g_dvmDefaultCacheFlags = 0;
+MK_WEAK unsigned g_dvmLazyMount = 0;
+MK_WEAK unsigned g_dvmParallelProbe = 0;
+MK_WEAK unsigned g_dvmProbeTimeoutMs = 5000;
+MK_WEAK unsigned g_dvmDentryCacheSize = 0;
+MK_WEAK unsigned g_dvmVolumeStats = 0;
 MK_WEAK unsigned g_dvmCalicoNandMount = 0;
 
 void _dvmSetAppWorkingDir(const char* argv0);
@@ -59,6 +71,7 @@ static DvmDisc s_dvmDiscDldi = {
 	.vt        = &s_dvmDiscCalicoIface,
 	.io_type   = BlkDevice_Dldi,
 	.sector_sz = 512U,
+	.caps      = { .align = ARM_CACHE_LINE_SZ, .queue_depth = 1 },
 };
 
 static DvmDisc s_dvmDiscSd = {
@@ -66,6 +79,7 @@ static DvmDisc s_dvmDiscSd = {
 	.io_type   = BlkDevice_TwlSdCard,
 	.features  = FEATURE_MEDIUM_CANREAD | FEATURE_MEDIUM_CANWRITE,
 	.sector_sz = 512U,
+	.caps      = { .align = ARM_CACHE_LINE_SZ, .queue_depth = 1 },
 };
 
 static DvmDisc s_dvmDiscNand = {
@@ -73,6 +87,7 @@ static DvmDisc s_dvmDiscNand = {
 	.io_type   = BlkDevice_TwlNandAes,
 	.features  = FEATURE_MEDIUM_CANREAD,
 	.sector_sz = 512U,
+	.caps      = { .align = ARM_CACHE_LINE_SZ, .queue_depth = 1 },
 };
 
 static DvmDisc* _dvmGetCalicoDisc(DvmDisc* disc, unsigned cache_pages, unsigned sectors_per_page)
@@ -98,45 +113,84 @@ static DvmDisc* _dvmGetCalicoDisc(DvmDisc* disc, unsigned cache_pages, unsigned
 	return disc;
 }
 
-static inline unsigned _dvmGetAndMountCalicoDisc(const char* name, DvmDisc* disc, unsigned cache_pages, unsigned sectors_per_page)
+static DvmDisc* _dvmOpenCalicoDisc(const DvmProbeJob* job)
 {
-	unsigned num_mounted = 0;
-	disc = _dvmGetCalicoDisc(disc, cache_pages, sectors_per_page);
-	if (disc) {
-		num_mounted = dvmProbeMountDisc(name, disc);
-		if (!num_mounted) {
-			disc->vt->destroy(disc);
-		}
+	return _dvmGetCalicoDisc((DvmDisc*)job->arg, job->cache_pages, job->sectors_per_page);
+}
+
+typedef struct DvmThread {
+	Thread thread;
+	void (*entry)(void* arg);
+	void* arg;
+	alignas(8) u8 stack[THREAD_STACK_SZ];
+} DvmThread;
+
+static int _dvmThreadEntry(void* arg)
+{
+	DvmThread* t = (DvmThread*)arg;
+	t->entry(t->arg);
+	return 0;
+}
+
+void* _dvmThreadStart(void (*entry)(void* arg), void* arg)
+{
+	DvmThread* t = (DvmThread*)malloc(sizeof(DvmThread));
+	if (t) {
+		t->entry = entry;
+		t->arg = arg;
+		threadPrepare(&t->thread, _dvmThreadEntry, t, &t->stack[THREAD_STACK_SZ], MAIN_THREAD_PRIO);
+		threadStart(&t->thread);
 	}
 
-	return num_mounted;
+	return t;
+}
+
+void _dvmThreadFinish(void* thread, bool join)
+{
+	DvmThread* t = (DvmThread*)thread;
+
+	// Abandoned threads still run on their stack, which is thus never freed
+	if (join) {
+		threadJoin(&t->thread);
+		free(t);
+	}
+}
+
+void _dvmThreadSleep(void)
+{
+	threadSleep(1000);
 }
 
 bool dvmInit(bool set_app_cwdir, unsigned cache_pages, unsigned sectors_per_page)
 {
 	unsigned num_mounted = 0;
+	unsigned num_jobs = 0;
+	DvmProbeJob jobs[3];
 
 	// Initialize block device subsystem
 	blkInit();
 
-	// Try mounting DLDI
-	num_mounted += _dvmGetAndMountCalicoDisc("fat", &s_dvmDiscDldi, cache_pages, sectors_per_page);
+	// DLDI
+	jobs[num_jobs++] = (DvmProbeJob){ .name = "fat", .open = _dvmOpenCalicoDisc, .arg = &s_dvmDiscDldi, .cache_pages = cache_pages, .sectors_per_page = sectors_per_page };
 
 	if (systemIsTwlMode()) {
-		// Try mounting DSi SD card
-		num_mounted += _dvmGetAndMountCalicoDisc("sd", &s_dvmDiscSd, cache_pages, sectors_per_page);
+		// DSi SD card
+		jobs[num_jobs++] = (DvmProbeJob){ .name = "sd", .open = _dvmOpenCalicoDisc, .arg = &s_dvmDiscSd, .cache_pages = cache_pages, .sectors_per_page = sectors_per_page };
 
-		// Try mounting DSi NAND if requested
+		// DSi NAND if requested
 		if (g_dvmCalicoNandMount) {
 			// Enable write access if requested
 			if (g_dvmCalicoNandMount >= 2) {
 				s_dvmDiscNand.features |= FEATURE_MEDIUM_CANWRITE;
 			}
 
-			num_mounted += _dvmGetAndMountCalicoDisc("nand", &s_dvmDiscNand, cache_pages, sectors_per_page);
+			jobs[num_jobs++] = (DvmProbeJob){ .name = "nand", .open = _dvmOpenCalicoDisc, .arg = &s_dvmDiscNand, .cache_pages = cache_pages, .sectors_per_page = sectors_per_page };
 		}
 	}
 
+	// Try mounting all devices, optionally initializing them in parallel
+	num_mounted += _dvmProbeMountJobs(jobs, num_jobs, g_dvmParallelProbe != 0, g_dvmProbeTimeoutMs);
+
 	// Set current working directory if needed
 	if (set_app_cwdir && num_mounted != 0) {
 		const char* argv0 = g_envNdsArgvHeader->argv[0];
@@ -0,0 +1,379 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/lock.h>
+#include <dvm.h>
+#include "dvm_debug.h"
+#include "dvm_comp.h"
+
+#define LIBDVM_EMPTY_BLOCK UINT32_MAX
+
+typedef struct DvmDiscCompEntry {
+	uint32_t block;
+	uint32_t age;
+} DvmDiscCompEntry;
+
+typedef struct DvmDiscComp {
+	DvmDisc base;
+
+	_LOCK_T lock;
+	DvmDisc* inner;
+	uint64_t* index;
+	uint8_t* stage;
+	uint8_t* data;
+	uint32_t num_blocks;
+	uint32_t block_bytes;
+	uint8_t block_shift;
+	uint32_t clock;
+	unsigned cache_blocks;
+
+	DvmDiscCompEntry entries[];
+} DvmDiscComp;
+
+static inline uint64_t _dvmReadLe(const uint8_t* buf, unsigned size)
+{
+	uint64_t ret = 0;
+	for (unsigned i = size; i; i --) {
+		ret = (ret << 8) | buf[i-1];
+	}
+	return ret;
+}
+
+static size_t _dvmLz4Length(const uint8_t** src, const uint8_t* src_end, size_t len)
+{
+	// Lengths of 15 continue with bytes until one is not 255
+	if (len == 15) {
+		unsigned b;
+		do {
+			if (*src >= src_end) {
+				return SIZE_MAX;
+			}
+			b = *(*src)++;
+			len += b;
+		} while (b == 255);
+	}
+
+	return len;
+}
+
+static bool _dvmLz4Decompress(const uint8_t* src, size_t src_sz, uint8_t* dst, size_t dst_sz)
+{
+	const uint8_t* src_end = src + src_sz;
+	uint8_t* out = dst;
+	uint8_t* out_end = dst + dst_sz;
+
+	while (src < src_end) {
+		unsigned token = *src++;
+
+		// Literals
+		size_t len = _dvmLz4Length(&src, src_end, token >> 4);
+		if (len > (size_t)(src_end - src) || len > (size_t)(out_end - out)) {
+			return false;
+		}
+
+		memcpy(out, src, len);
+		out += len;
+		src += len;
+
+		// The last sequence only has literals
+		if (src == src_end) {
+			break;
+		}
+
+		// Match
+		if ((src_end - src) < 2) {
+			return false;
+		}
+
+		size_t offset = src[0] | (src[1] << 8);
+		src += 2;
+		if (!offset || offset > (size_t)(out - dst)) {
+			return false;
+		}
+
+		len = _dvmLz4Length(&src, src_end, token & 15);
+		if (len == SIZE_MAX || (len += 4) > (size_t)(out_end - out)) {
+			return false;
+		}
+
+		const uint8_t* match = out - offset;
+		if (offset >= len) {
+			memcpy(out, match, len);
+			out += len;
+		} else {
+			// Overlapping match (repeating pattern)
+			while (len--) {
+				*out++ = *match++;
+			}
+		}
+	}
+
+	return out == out_end;
+}
+
+static bool _dvmDiscCompReadBytes(DvmDiscComp* self, uint64_t offset, size_t size, const uint8_t** out)
+{
+	const unsigned inner_sz = self->inner->sector_sz;
+	sec_t first_sector = offset / inner_sz;
+	sec_t num_sectors = (offset + size + inner_sz - 1) / inner_sz - first_sector;
+
+	// Decompress straight from directly addressable discs
+	const uint8_t* map = (const uint8_t*)dvmDiscMapSectors(self->inner, first_sector, num_sectors);
+	if (map) {
+		*out = map + offset % inner_sz;
+		return true;
+	}
+
+	if (!self->inner->vt->read_sectors(self->inner, self->stage, first_sector, num_sectors, false)) {
+		dvmDebug(" comp read error\n");
+		return false;
+	}
+
+	*out = self->stage + offset % inner_sz;
+	return true;
+}
+
+static bool _dvmDiscCompDecode(DvmDiscComp* self, uint32_t block, uint8_t* out)
+{
+	uint64_t start = self->index[block];
+	uint64_t end = self->index[block+1] & DVMZ_INDEX_OFFSET;
+	size_t size = end - (start & DVMZ_INDEX_OFFSET);
+
+	// The last block may be short
+	sec_t first_sector = (sec_t)block << self->block_shift;
+	sec_t max_sectors = self->base.num_sectors - first_sector;
+	sec_t num_sectors = (sec_t)1 << self->block_shift;
+	size_t out_sz = (num_sectors < max_sectors ? num_sectors : max_sectors)*self->base.sector_sz;
+
+	const uint8_t* data;
+	if (!_dvmDiscCompReadBytes(self, start & DVMZ_INDEX_OFFSET, size, &data)) {
+		return false;
+	}
+
+	dvmDebug(" decode %x (%zu -> %zu)\n", block, size, out_sz);
+	if (start & DVMZ_INDEX_RAW) {
+		if (size != out_sz) {
+			return false;
+		}
+		memcpy(out, data, size);
+		return true;
+	}
+
+	return _dvmLz4Decompress(data, size, out, out_sz);
+}
+
+static uint8_t* _dvmDiscCompGetBlock(DvmDiscComp* self, uint32_t block)
+{
+	DvmDiscCompEntry* lru = &self->entries[0];
+	for (unsigned i = 0; i < self->cache_blocks; i ++) {
+		DvmDiscCompEntry* p = &self->entries[i];
+		if (p->block == block) {
+			p->age = ++self->clock;
+			return self->data + i*self->block_bytes;
+		}
+
+		if (p->age < lru->age) {
+			lru = p;
+		}
+	}
+
+	// Cache miss: decode into the least recently used entry
+	uint8_t* data = self->data + (lru - self->entries)*self->block_bytes;
+	if (!_dvmDiscCompDecode(self, block, data)) {
+		lru->block = LIBDVM_EMPTY_BLOCK;
+		lru->age = 0;
+		return NULL;
+	}
+
+	lru->block = block;
+	lru->age = ++self->clock;
+	return data;
+}
+
+static void _dvmDiscCompDestroy(DvmDisc* self_)
+{
+	DvmDiscComp* self = (DvmDiscComp*)self_;
+
+	dvmDiscRemoveUser(self->inner);
+	__lock_close(self->lock);
+	free(self->data);
+	free(self->stage);
+	free(self->index);
+	free(self);
+}
+
+static bool _dvmDiscCompReadSectors(DvmDisc* self_, void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	DvmDiscComp* self = (DvmDiscComp*)self_;
+
+	// Early fail on out of bounds access
+	if (first_sector >= self->base.num_sectors || num_sectors > self->base.num_sectors - first_sector) {
+		return false;
+	}
+
+	__lock_acquire(self->lock);
+	dvmDebug("compRead(%p,0x%lx,%lu)\n", buffer, first_sector, num_sectors);
+
+	const unsigned block_sectors = 1U << self->block_shift;
+
+	bool ret = true;
+	uint8_t* buf = (uint8_t*)buffer;
+	while (ret && num_sectors) {
+		uint32_t block = first_sector >> self->block_shift;
+		unsigned block_offset = first_sector & (block_sectors-1);
+
+		sec_t max_cur_sectors = block_sectors - block_offset;
+		sec_t cur_sectors = num_sectors < max_cur_sectors ? num_sectors : max_cur_sectors;
+		bool is_whole = block_offset == 0 && (cur_sectors == block_sectors || first_sector + cur_sectors == self->base.num_sectors);
+
+		if (is_whole) {
+			// Whole blocks are decoded straight into the caller's buffer
+			// (they are unlikely to be read again soon)
+			ret = _dvmDiscCompDecode(self, block, buf);
+		} else {
+			const uint8_t* data = _dvmDiscCompGetBlock(self, block);
+			if (data) {
+				memcpy(buf, data + block_offset*self->base.sector_sz, cur_sectors*self->base.sector_sz);
+			} else {
+				ret = false;
+			}
+		}
+
+		buf += cur_sectors*self->base.sector_sz;
+		first_sector += cur_sectors;
+		num_sectors -= cur_sectors;
+	}
+
+	__lock_release(self->lock);
+	return ret;
+}
+
+static bool _dvmDiscCompWriteSectors(DvmDisc* self_, const void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	return false;
+}
+
+static bool _dvmDiscCompFlush(DvmDisc* self_)
+{
+	return true;
+}
+
+static const DvmDiscIface s_dvmDiscCompIface = {
+	.destroy       = _dvmDiscCompDestroy,
+	.read_sectors  = _dvmDiscCompReadSectors,
+	.write_sectors = _dvmDiscCompWriteSectors,
+	.flush         = _dvmDiscCompFlush,
+};
+
+static bool _dvmDiscCompLoadIndex(DvmDiscComp* self, uint64_t inner_bytes)
+{
+	const unsigned inner_sz = self->inner->sector_sz;
+	size_t index_bytes = (self->num_blocks + 1)*sizeof(uint64_t);
+	size_t total_bytes = sizeof(DvmCompHeader) + index_bytes;
+	sec_t num_sectors = (total_bytes + inner_sz - 1) / inner_sz;
+
+	uint8_t* buf = (uint8_t*)aligned_alloc(LIBDVM_BUFFER_ALIGN, num_sectors*inner_sz);
+	if (!buf) {
+		return false;
+	}
+
+	bool ret = dvmDiscReadSectors(self->inner, buf, 0, num_sectors);
+	for (uint32_t i = 0; ret && i <= self->num_blocks; i ++) {
+		uint64_t entry = _dvmReadLe(buf + sizeof(DvmCompHeader) + i*sizeof(uint64_t), sizeof(uint64_t));
+		self->index[i] = entry;
+
+		// Validate block placement and size
+		uint64_t offset = entry & DVMZ_INDEX_OFFSET;
+		if (offset < total_bytes || offset > inner_bytes) {
+			ret = false;
+		} else if (i && (offset < (self->index[i-1] & DVMZ_INDEX_OFFSET) || offset - (self->index[i-1] & DVMZ_INDEX_OFFSET) > self->block_bytes)) {
+			ret = false;
+		}
+	}
+
+	free(buf);
+	return ret;
+}
+
+DvmDisc* dvmDiscCompCreate(DvmDisc* inner_disc, unsigned cache_blocks)
+{
+	if (!inner_disc || !cache_blocks || ~inner_disc->num_sectors == 0) {
+		return NULL;
+	}
+
+	// Read and validate the header
+	uint8_t* hdr_buf = (uint8_t*)aligned_alloc(LIBDVM_BUFFER_ALIGN, inner_disc->sector_sz);
+	if (!hdr_buf) {
+		return NULL;
+	}
+
+	DvmCompHeader hdr;
+	bool ok = dvmDiscReadSectors(inner_disc, hdr_buf, 0, 1);
+	memcpy(&hdr, hdr_buf, sizeof(hdr));
+	free(hdr_buf);
+
+	uint64_t num_sectors = _dvmReadLe(hdr.num_sectors_le, 8);
+	uint64_t num_blocks = _dvmReadLe(hdr.num_blocks_le, 4);
+	if (!ok || _dvmReadLe(hdr.magic_le, 4) != DVMZ_MAGIC || _dvmReadLe(hdr.version_le, 2) != DVMZ_VERSION) {
+		dvmDebug("Not a compressed image\n");
+		return NULL;
+	}
+
+	if (hdr.sector_shift < 9 || hdr.sector_shift > 15 || hdr.block_shift < hdr.sector_shift ||
+		(1U << hdr.block_shift) < DVMZ_MIN_BLOCK_SZ || (1U << hdr.block_shift) > DVMZ_MAX_BLOCK_SZ ||
+		!num_sectors || num_blocks != ((num_sectors - 1) >> (hdr.block_shift - hdr.sector_shift)) + 1) {
+		dvmDebug("Bad compressed image geometry\n");
+		return NULL;
+	}
+
+	// The index must lie within the image, and fit in memory (rounded up to whole sectors)
+	uint64_t inner_bytes = (uint64_t)inner_disc->num_sectors*inner_disc->sector_sz;
+	uint64_t index_bytes = (num_blocks + 1)*sizeof(uint64_t);
+	if (sizeof(DvmCompHeader) + index_bytes > inner_bytes || sizeof(DvmCompHeader) + index_bytes + inner_disc->sector_sz > SIZE_MAX) {
+		dvmDebug("Bad compressed image index size\n");
+		return NULL;
+	}
+
+	DvmDiscComp* disc = (DvmDiscComp*)calloc(1, sizeof(DvmDiscComp) + cache_blocks*sizeof(DvmDiscCompEntry));
+	if (!disc) {
+		return NULL;
+	}
+
+	disc->inner = inner_disc;
+	disc->num_blocks = num_blocks;
+	disc->block_bytes = 1U << hdr.block_shift;
+	disc->block_shift = hdr.block_shift - hdr.sector_shift;
+	disc->cache_blocks = cache_blocks;
+	disc->index = (uint64_t*)malloc((size_t)index_bytes);
+	disc->stage = (uint8_t*)aligned_alloc(LIBDVM_BUFFER_ALIGN, disc->block_bytes + 2*inner_disc->sector_sz);
+	disc->data = (uint8_t*)aligned_alloc(LIBDVM_BUFFER_ALIGN, cache_blocks*disc->block_bytes);
+
+	if (!disc->index || !disc->stage || !disc->data || !_dvmDiscCompLoadIndex(disc, inner_bytes)) {
+		dvmDebug("Bad compressed image index\n");
+		free(disc->data);
+		free(disc->stage);
+		free(disc->index);
+		free(disc);
+		return NULL;
+	}
+
+	for (unsigned i = 0; i < cache_blocks; i ++) {
+		disc->entries[i].block = LIBDVM_EMPTY_BLOCK;
+	}
+
+	disc->base.vt = &s_dvmDiscCompIface;
+	disc->base.io_type = inner_disc->io_type;
+	disc->base.features = FEATURE_MEDIUM_CANREAD;
+	disc->base.num_sectors = num_sectors;
+	disc->base.sector_sz = 1U << hdr.sector_shift;
+	disc->base.block_sz = 0;
+	disc->base.caps.opt_sectors = 1U << disc->block_shift;
+	disc->base.caps.align = 1;
+	disc->base.caps.queue_depth = 1;
+	__lock_init(disc->lock);
+	dvmDiscAddUser(inner_disc);
+
+	return &disc->base;
+}
@@ -0,0 +1,32 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#pragma once
+#include <stdint.h>
+
+// Block-compressed disc image layout (shared with tools/dvmzpack.c)
+//
+// The image starts with a header, followed by an index of num_blocks+1 little
+// endian 64-bit byte offsets. Block i is stored in [index[i], index[i+1]) (with
+// the flag bits masked out), either compressed in LZ4 block format or raw if
+// DVMZ_INDEX_RAW is set. All blocks decompress to the block size, except for
+// the last one which is cut short at the end of the image.
+
+#define DVMZ_MAGIC         0x5a4d5644 // "DVMZ"
+#define DVMZ_VERSION       1
+#define DVMZ_MIN_BLOCK_SZ  4096U
+#define DVMZ_MAX_BLOCK_SZ  (1024U*1024)
+
+#define DVMZ_INDEX_RAW     (UINT64_C(1) << 63)
+#define DVMZ_INDEX_OFFSET  (DVMZ_INDEX_RAW - 1)
+
+typedef struct DvmCompHeader {
+	uint8_t magic_le[4];
+	uint8_t version_le[2];
+	uint8_t block_shift;  // log2 of the uncompressed block size in bytes
+	uint8_t sector_shift; // log2 of the logical sector size in bytes
+	uint8_t num_sectors_le[8];
+	uint8_t num_blocks_le[4];
+	uint8_t _pad_0x14[12];
+} DvmCompHeader;
+
+_Static_assert(sizeof(DvmCompHeader) == 32, "DvmCompHeader size");
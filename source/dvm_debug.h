@@ -1,8 +1,10 @@
 // SPDX-License-Identifier: ZPL-2.1
 // SPDX-FileCopyrightText: Copyright fincs, devkitPro
 #pragma once
+#include <stdint.h>
 
 //#define LIBDVM_DEBUG
+//#define LIBDVM_NO_TRACEPOINTS
 
 #if defined(LIBDVM_DEBUG) && defined(__NDS__)
 #include <calico/system/dietprint.h>
@@ -10,3 +12,17 @@
 #else
 #define dvmDebug(...) ((void)0)
 #endif
+
+// Binary tracepoints: dvmTp(DVM_TP_xxx, up to 3 integer arguments). Disabled
+// categories cost a load and a branch.
+#ifndef LIBDVM_NO_TRACEPOINTS
+extern unsigned _dvmTpMask;
+void _dvmTpEmit(unsigned id, uint64_t a, uint64_t b, uint64_t c);
+uint64_t _dvmTpPackName(const char* name);
+#define _dvmTp(_id, _a, _b, _c, ...) do { \
+	if (_dvmTpMask & (1U << ((_id) >> 8))) _dvmTpEmit((_id), (_a), (_b), (_c)); \
+} while (0)
+#define dvmTp(...) _dvmTp(__VA_ARGS__, 0, 0, 0)
+#else
+#define dvmTp(...) ((void)0)
+#endif
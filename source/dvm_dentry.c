@@ -0,0 +1,456 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#include <stdlib.h>
+#include <string.h>
+#include <sys/lock.h>
+#include "dvm_dentry.h"
+
+#define DENTRY_NAME_MAX 32
+#define DENTRY_MAX      0xffff
+
+#define ROOT_ID  1
+#define FIRST_ID 2
+
+// Entry flags
+#define DENTRY_REF (1U << 7) // Used since the clock hand last passed
+#define DENTRY_KIND_MASK 3
+
+typedef struct DvmDentry {
+	uint64_t ino;
+	uint32_t id;         // 0 = free slot (never reused for another entry)
+	uint32_t gen;        // Generation of the children (directories)
+	uint32_t parent;
+	uint32_t parent_gen;
+	uint32_t hash;
+	uint16_t next;       // Next entry in the bucket + 1
+	uint8_t flags;
+	uint8_t name_len;
+	char name[DENTRY_NAME_MAX];
+} DvmDentry;
+
+struct DvmDentryCache {
+	_LOCK_T lock;
+	unsigned flags;
+	uint32_t ticket;
+	uint32_t next_id;
+	uint32_t root_gen;
+	uint16_t num_entries;
+	uint16_t hand;
+	uint32_t bucket_mask;
+	uint16_t* buckets;   // First entry + 1
+	DvmDentry entries[];
+};
+
+typedef struct DvmDentryName {
+	const char* str;
+	size_t len;
+	uint32_t hash;
+	char buf[DENTRY_NAME_MAX]; // Case folded
+} DvmDentryName;
+
+static const char* _dvmDentryStrip(const char* path, size_t* path_len)
+{
+	const char* colon = memchr(path, ':', *path_len);
+	if (colon) {
+		*path_len -= colon + 1 - path;
+		path = colon + 1;
+	}
+
+	return *path_len && path[0] == '/' ? path : NULL;
+}
+
+// Returns the next component of [*pos, end), or false at the end of the path
+static bool _dvmDentryNext(const char** pos, const char* end, const char** out, size_t* out_len)
+{
+	const char* p = *pos;
+	while (p != end && *p == '/') {
+		p ++;
+	}
+
+	if (p == end) {
+		return false;
+	}
+
+	const char* name = p;
+	while (p != end && *p != '/') {
+		p ++;
+	}
+
+	*pos = p;
+	*out = name;
+	*out_len = p - name;
+	return true;
+}
+
+static bool _dvmDentryIsLast(const char* pos, const char* end)
+{
+	while (pos != end && *pos == '/') {
+		pos ++;
+	}
+
+	return pos == end;
+}
+
+static bool _dvmDentryPrepName(DvmDentryCache* dc, DvmDentryName* out, const char* str, size_t len, uint32_t parent)
+{
+	if (len > DENTRY_NAME_MAX || (str[0] == '.' && (len == 1 || (len == 2 && str[1] == '.')))) {
+		return false;
+	}
+
+	if (dc->flags & DENTRY_FOLD_CASE) {
+		// FAT resolves short name aliases (with a numeric tail) and ignores
+		// trailing dots and spaces: such names are not cached
+		if (str[0] == ' ' || str[len-1] == ' ' || str[len-1] == '.') {
+			return false;
+		}
+
+		for (size_t i = 0; i < len; i ++) {
+			char c = str[i];
+			if ((uint8_t)c >= 0x80 || c == '~') {
+				return false;
+			}
+			out->buf[i] = c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+		}
+
+		str = out->buf;
+	}
+
+	// FNV-1a, seeded with the parent
+	uint32_t hash = 2166136261U ^ parent;
+	for (size_t i = 0; i < len; i ++) {
+		hash = (hash ^ (uint8_t)str[i]) * 16777619U;
+	}
+
+	out->str = str;
+	out->len = len;
+	out->hash = hash;
+	return true;
+}
+
+static DvmDentry* _dvmDentryFind(DvmDentryCache* dc, uint32_t parent, uint32_t parent_gen, const DvmDentryName* name)
+{
+	for (unsigned idx = dc->buckets[name->hash & dc->bucket_mask]; idx; ) {
+		DvmDentry* e = &dc->entries[idx-1];
+		if (e->hash == name->hash && e->parent == parent && e->parent_gen == parent_gen &&
+			e->name_len == name->len && memcmp(e->name, name->str, name->len) == 0) {
+			return e;
+		}
+		idx = e->next;
+	}
+
+	return NULL;
+}
+
+static void _dvmDentryUnlink(DvmDentryCache* dc, DvmDentry* e)
+{
+	uint16_t* link = &dc->buckets[e->hash & dc->bucket_mask];
+	uint16_t idx = e - dc->entries + 1;
+	while (*link != idx) {
+		link = &dc->entries[*link-1].next;
+	}
+
+	*link = e->next;
+	e->id = 0;
+}
+
+static void _dvmDentryFlush(DvmDentryCache* dc)
+{
+	memset(dc->buckets, 0, (dc->bucket_mask+1)*sizeof(uint16_t));
+	memset(dc->entries, 0, dc->num_entries*sizeof(DvmDentry));
+	dc->hand = 0;
+	dc->root_gen ++;
+}
+
+static uint32_t _dvmDentryNewId(DvmDentryCache* dc)
+{
+	if (dc->next_id == 0) {
+		// Ids wrapped around: entries referring to old ones have to go
+		_dvmDentryFlush(dc);
+		dc->next_id = FIRST_ID;
+		return 0;
+	}
+
+	return dc->next_id++;
+}
+
+static DvmDentry* _dvmDentryAlloc(DvmDentryCache* dc)
+{
+	// Clock replacement: entries used since the last pass get another chance
+	for (;;) {
+		DvmDentry* e = &dc->entries[dc->hand];
+		if (++dc->hand == dc->num_entries) {
+			dc->hand = 0;
+		}
+
+		if (!e->id) {
+			return e;
+		} else if (e->flags & DENTRY_REF) {
+			e->flags &= ~DENTRY_REF;
+		} else {
+			_dvmDentryUnlink(dc, e);
+			return e;
+		}
+	}
+}
+
+static DvmDentry* _dvmDentrySet(DvmDentryCache* dc, DvmDentry* e, uint32_t parent, uint32_t parent_gen, const DvmDentryName* name, unsigned kind, uint64_t ino)
+{
+	if (e && (e->flags & DENTRY_KIND_MASK) == kind) {
+		// Same object: directories keep their children
+		if (ino) {
+			e->ino = ino;
+		}
+		e->flags |= DENTRY_REF;
+		return e;
+	}
+
+	if (e) {
+		_dvmDentryUnlink(dc, e);
+	}
+
+	uint32_t id = _dvmDentryNewId(dc);
+	if (!id) {
+		// Flushed: the parent is gone
+		return NULL;
+	}
+
+	e = _dvmDentryAlloc(dc);
+	e->ino = ino;
+	e->id = id;
+	e->gen = 0;
+	e->parent = parent;
+	e->parent_gen = parent_gen;
+	e->hash = name->hash;
+	e->flags = kind;
+	e->name_len = name->len;
+	memcpy(e->name, name->str, name->len);
+
+	uint16_t* bucket = &dc->buckets[name->hash & dc->bucket_mask];
+	e->next = *bucket;
+	*bucket = e - dc->entries + 1;
+	return e;
+}
+
+DvmDentryCache* _dvmDentryCreate(unsigned num_entries, unsigned flags)
+{
+	if (!num_entries) {
+		return NULL;
+	} else if (num_entries > DENTRY_MAX) {
+		num_entries = DENTRY_MAX;
+	}
+
+	unsigned num_buckets = 1;
+	while (num_buckets < num_entries) {
+		num_buckets <<= 1;
+	}
+
+	size_t entries_sz = num_entries*sizeof(DvmDentry);
+	DvmDentryCache* dc = (DvmDentryCache*)malloc(sizeof(DvmDentryCache) + entries_sz + num_buckets*sizeof(uint16_t));
+	if (!dc) {
+		return NULL;
+	}
+
+	memset(dc, 0, sizeof(DvmDentryCache));
+	__lock_init(dc->lock);
+	dc->flags = flags;
+	dc->next_id = FIRST_ID;
+	dc->num_entries = num_entries;
+	dc->bucket_mask = num_buckets - 1;
+	dc->buckets = (uint16_t*)((uint8_t*)dc->entries + entries_sz);
+	_dvmDentryFlush(dc);
+
+	return dc;
+}
+
+void _dvmDentryDestroy(DvmDentryCache* dc)
+{
+	if (dc) {
+		__lock_close(dc->lock);
+		free(dc);
+	}
+}
+
+unsigned _dvmDentryLookup(DvmDentryCache* dc, const char* path, uint64_t* out_ino)
+{
+	size_t path_len = strlen(path);
+	path = _dvmDentryStrip(path, &path_len);
+	if (!path) {
+		return DENTRY_MISS;
+	}
+
+	const char* end = path + path_len;
+	const char* pos = path;
+	const char* str;
+	size_t len;
+
+	__lock_acquire(dc->lock);
+
+	uint32_t parent = ROOT_ID, parent_gen = dc->root_gen;
+	unsigned kind = DENTRY_DIR;
+	uint64_t ino = 0;
+
+	while (_dvmDentryNext(&pos, end, &str, &len)) {
+		DvmDentryName name;
+		DvmDentry* e;
+		if (kind != DENTRY_DIR || !_dvmDentryPrepName(dc, &name, str, len, parent) ||
+			!(e = _dvmDentryFind(dc, parent, parent_gen, &name))) {
+			kind = DENTRY_MISS;
+			break;
+		}
+
+		e->flags |= DENTRY_REF;
+		kind = e->flags & DENTRY_KIND_MASK;
+		if (kind == DENTRY_NEGATIVE) {
+			// Nothing below it exists either
+			break;
+		}
+
+		ino = e->ino;
+		parent = e->id;
+		parent_gen = e->gen;
+	}
+
+	__lock_release(dc->lock);
+
+	// Files named with a trailing slash are left for the driver to reject
+	if (kind == DENTRY_FILE && end[-1] == '/') {
+		kind = DENTRY_MISS;
+	}
+
+	*out_ino = ino;
+	return kind;
+}
+
+uint32_t _dvmDentryTicket(DvmDentryCache* dc)
+{
+	return __atomic_load_n(&dc->ticket, __ATOMIC_RELAXED);
+}
+
+size_t _dvmDentryInsert(DvmDentryCache* dc, uint32_t ticket, const char* path, size_t path_len, unsigned kind, uint64_t ino)
+{
+	const char* full_path = path;
+	path = _dvmDentryStrip(path, &path_len);
+	if (!path) {
+		return 0;
+	}
+
+	const char* end = path + path_len;
+	const char* pos = path;
+	const char* str;
+	size_t len;
+	size_t ret = 0;
+
+	__lock_acquire(dc->lock);
+
+	if (ticket != dc->ticket) {
+		__lock_release(dc->lock);
+		return 0;
+	}
+
+	uint32_t parent = ROOT_ID, parent_gen = dc->root_gen;
+	while (_dvmDentryNext(&pos, end, &str, &len)) {
+		DvmDentryName name;
+		if (!_dvmDentryPrepName(dc, &name, str, len, parent)) {
+			break;
+		}
+
+		DvmDentry* e = _dvmDentryFind(dc, parent, parent_gen, &name);
+		if (_dvmDentryIsLast(pos, end)) {
+			_dvmDentrySet(dc, e, parent, parent_gen, &name, kind, ino);
+			break;
+		}
+
+		if (kind == DENTRY_NEGATIVE && (!e || (e->flags & DENTRY_KIND_MASK) != DENTRY_DIR)) {
+			// Unless already known to be missing, the parent has to be looked up
+			if (!e) {
+				const char* last = end;
+				while (last[-1] == '/') {
+					last --;
+				}
+				while (last[-1] != '/') {
+					last --;
+				}
+				while (last[-1] == '/') {
+					last --;
+				}
+				ret = last - full_path;
+			}
+			break;
+		}
+
+		// Found by the driver: the intermediate components are directories
+		if (!(e = _dvmDentrySet(dc, e, parent, parent_gen, &name, DENTRY_DIR, 0))) {
+			break;
+		}
+
+		parent = e->id;
+		parent_gen = e->gen;
+	}
+
+	__lock_release(dc->lock);
+	return ret;
+}
+
+void _dvmDentryInvalidate(DvmDentryCache* dc, const char* path)
+{
+	size_t path_len = strlen(path);
+	path = _dvmDentryStrip(path, &path_len);
+
+	__lock_acquire(dc->lock);
+	dc->ticket ++;
+
+	// Relative paths, and volumes where directories have other names, are
+	// not tracked precisely: everything is dropped
+	if (!path || (dc->flags & DENTRY_ALIASED)) {
+		_dvmDentryFlush(dc);
+		__lock_release(dc->lock);
+		return;
+	}
+
+	const char* end = path + path_len;
+	const char* pos = path;
+	const char* str;
+	size_t len;
+
+	DvmDentry* dir = NULL;
+	uint32_t parent = ROOT_ID, parent_gen = dc->root_gen;
+	bool flush = true;
+	while (_dvmDentryNext(&pos, end, &str, &len)) {
+		if (_dvmDentryIsLast(pos, end)) {
+			// The names inside the parent directory changed (unless the
+			// path named the directory itself or one above it)
+			if (str[0] != '.' || (len != 1 && (len != 2 || str[1] != '.'))) {
+				if (dir) {
+					dir->gen ++;
+				} else {
+					dc->root_gen ++;
+				}
+				flush = false;
+			}
+			break;
+		}
+
+		DvmDentryName name;
+		DvmDentry* e;
+		if (!_dvmDentryPrepName(dc, &name, str, len, parent)) {
+			break;
+		} else if (!(e = _dvmDentryFind(dc, parent, parent_gen, &name))) {
+			// Nothing is cached inside of the parent directory
+			flush = false;
+			break;
+		} else if ((e->flags & DENTRY_KIND_MASK) != DENTRY_DIR) {
+			// Out of date (the volume was changed behind our back)
+			break;
+		}
+
+		dir = e;
+		parent = e->id;
+		parent_gen = e->gen;
+	}
+
+	if (flush) {
+		_dvmDentryFlush(dc);
+	}
+
+	__lock_release(dc->lock);
+}
@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#pragma once
+#include <dvm.h>
+
+// Path lookup (dentry) cache of a volume
+//
+// Entries map a name inside a cached directory to what the driver found
+// there: nothing (negative entries), a file or a directory, along with its
+// st_ino if known. Only absolute paths are cached. Components that have more
+// than one spelling ("." and "..", and on case insensitive volumes anything
+// that is not plain ASCII or could be a short name alias) are passed through.
+//
+// Each directory entry carries a generation, and its children are only valid
+// for the generation they were inserted under. Changing the names inside a
+// directory bumps its generation, which drops all of them at once.
+
+#define DENTRY_MISS     0
+#define DENTRY_NEGATIVE 1
+#define DENTRY_FILE     2
+#define DENTRY_DIR      3
+
+// Creation flags
+#define DENTRY_FOLD_CASE (1U << 0) // Names are case insensitive (ASCII)
+#define DENTRY_ALIASED   (1U << 1) // Directories can be reached through symlinks
+
+typedef struct DvmDentryCache DvmDentryCache;
+
+DvmDentryCache* _dvmDentryCreate(unsigned num_entries, unsigned flags);
+void _dvmDentryDestroy(DvmDentryCache* dc);
+
+// Returns the DENTRY_* kind of the path (for DENTRY_FILE and DENTRY_DIR,
+// out_ino is set to its st_ino or 0 if unknown)
+unsigned _dvmDentryLookup(DvmDentryCache* dc, const char* path, uint64_t* out_ino);
+
+// Lookups that reach the driver take a ticket beforehand: their results are
+// dropped if the volume changed in the meantime. Intermediate directories of
+// positive entries are inserted too. Negative entries are only inserted into
+// cached directories: otherwise, the length of the parent directory path is
+// returned so that the caller can look it up first.
+uint32_t _dvmDentryTicket(DvmDentryCache* dc);
+size_t _dvmDentryInsert(DvmDentryCache* dc, uint32_t ticket, const char* path, size_t path_len, unsigned kind, uint64_t ino);
+
+// Called after a path was created or removed (or renamed away)
+void _dvmDentryInvalidate(DvmDentryCache* dc, const char* path);
@@ -0,0 +1,72 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#pragma once
+#include <string.h>
+#include <dvm.h>
+
+// Runs of sectors written since the last flush, so that fsync can write back
+// the sectors of one file (and the metadata it depends on) instead of the
+// whole disc cache. Sets that saw too many separate runs stop tracking them,
+// and are then flushed along with everything else.
+
+#define DVM_DIRTY_MAX_RUNS 8
+
+typedef struct DvmDirtyRuns {
+	unsigned num_runs; // Above DVM_DIRTY_MAX_RUNS: too many to track
+	DvmFileExtent runs[DVM_DIRTY_MAX_RUNS];
+} DvmDirtyRuns;
+
+static inline void _dvmDirtyClear(DvmDirtyRuns* d)
+{
+	d->num_runs = 0;
+}
+
+static inline void _dvmDirtyAdd(DvmDirtyRuns* d, sec_t sector, sec_t num_sectors)
+{
+	if (d->num_runs > DVM_DIRTY_MAX_RUNS) {
+		return;
+	}
+
+	// Grow a run that overlaps or touches the new one (sequential writes end up in one run)
+	for (unsigned i = 0; i < d->num_runs; i ++) {
+		DvmFileExtent* run = &d->runs[i];
+		sec_t run_end = run->sector + run->num_sectors;
+		if (sector <= run_end && run->sector <= sector + num_sectors) {
+			sec_t end = sector + num_sectors > run_end ? sector + num_sectors : run_end;
+			if (sector < run->sector) {
+				run->sector = sector;
+			}
+			run->num_sectors = end - run->sector;
+			return;
+		}
+	}
+
+	if (d->num_runs < DVM_DIRTY_MAX_RUNS) {
+		d->runs[d->num_runs].sector = sector;
+		d->runs[d->num_runs].num_sectors = num_sectors;
+	}
+
+	d->num_runs ++;
+}
+
+// Writes back the runs of both sets (then clears them), or the whole disc
+// if either set stopped tracking
+static inline bool _dvmDirtyFlush(DvmDisc* disc, DvmDirtyRuns* a, DvmDirtyRuns* b)
+{
+	bool ret;
+	if (a->num_runs > DVM_DIRTY_MAX_RUNS || b->num_runs > DVM_DIRTY_MAX_RUNS) {
+		ret = dvmDiscFlush(disc);
+	} else {
+		DvmFileExtent runs[2*DVM_DIRTY_MAX_RUNS];
+		memcpy(&runs[0], a->runs, a->num_runs*sizeof(DvmFileExtent));
+		memcpy(&runs[a->num_runs], b->runs, b->num_runs*sizeof(DvmFileExtent));
+		ret = dvmDiscFlushRanges(disc, runs, a->num_runs + b->num_runs);
+	}
+
+	if (ret) {
+		_dvmDirtyClear(a);
+		_dvmDirtyClear(b);
+	}
+
+	return ret;
+}
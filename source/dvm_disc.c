@@ -95,6 +95,11 @@ DvmDisc* dvmDiscCreate(DISC_INTERFACE* iface)
 		disc->base.sector_sz = 512U;
 		disc->base.block_sz = 0;
 #endif
+		// DISC_INTERFACE does not report transfer limits
+		disc->base.caps.max_sectors = 0;
+		disc->base.caps.opt_sectors = 0;
+		disc->base.caps.align = LIBDVM_BUFFER_ALIGN;
+		disc->base.caps.queue_depth = 1;
 		disc->iface = iface;
 	}
 
@@ -0,0 +1,243 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/lock.h>
+#include <dvm.h>
+#include "dvm_debug.h"
+
+typedef struct DvmDiscEmu {
+	DvmDisc base;
+
+	_LOCK_T lock;
+	DvmDisc* inner;
+	DvmEmuTiming timing;
+	unsigned flags;
+	sec_t head;
+	uint64_t busy_ns;
+} DvmDiscEmu;
+
+// Rough figures measured on typical hardware: they only need to get the
+// relative costs of commands, transfers and seeks right
+static const DvmEmuTiming s_dvmEmuPresets[] = {
+	{
+		.name = "ds-slot1",   // SD through a DS slot-1 flashcart (SPI)
+		.read_cmd_ns = 250000, .write_cmd_ns = 1000000, .flush_ns = 0,
+		.read_kib_s = 1500, .write_kib_s = 700, .seek_ns = 100000,
+		.block_sectors = 64, .block_penalty_ns = 3000000,
+	},
+	{
+		.name = "dsi-sd",     // DSi/3DS internal SD slot
+		.read_cmd_ns = 100000, .write_cmd_ns = 400000, .flush_ns = 0,
+		.read_kib_s = 9000, .write_kib_s = 5000, .seek_ns = 50000,
+		.block_sectors = 256, .block_penalty_ns = 2000000,
+	},
+	{
+		.name = "gba-slot2",  // SD/CF adapters in the GBA slot
+		.read_cmd_ns = 300000, .write_cmd_ns = 1500000, .flush_ns = 0,
+		.read_kib_s = 600, .write_kib_s = 300, .seek_ns = 100000,
+		.block_sectors = 64, .block_penalty_ns = 3000000,
+	},
+	{
+		.name = "gc-sdgecko", // SD Gecko in a GameCube memory card slot (SPI)
+		.read_cmd_ns = 300000, .write_cmd_ns = 1000000, .flush_ns = 0,
+		.read_kib_s = 1200, .write_kib_s = 600, .seek_ns = 100000,
+		.block_sectors = 64, .block_penalty_ns = 3000000,
+	},
+	{
+		.name = "wii-sd",     // Wii front SD slot
+		.read_cmd_ns = 150000, .write_cmd_ns = 500000, .flush_ns = 0,
+		.read_kib_s = 10000, .write_kib_s = 6000, .seek_ns = 50000,
+		.block_sectors = 256, .block_penalty_ns = 2000000,
+	},
+	{
+		.name = "wii-usbhdd", // USB 2.0 hard disk on a Wii
+		.read_cmd_ns = 200000, .write_cmd_ns = 300000, .flush_ns = 5000000,
+		.read_kib_s = 25000, .write_kib_s = 20000, .seek_ns = 9000000,
+		.block_sectors = 0, .block_penalty_ns = 0,
+	},
+};
+
+#define NUM_PRESETS (sizeof(s_dvmEmuPresets)/sizeof(s_dvmEmuPresets[0]))
+
+// Virtual time shared by all emulated discs, so that timing code above them
+// can run on it through dvmSetTimeSource. Not synchronized between threads.
+static uint64_t s_dvmEmuClock;
+
+static uint64_t _dvmDiscEmuTransferNs(uint64_t bytes, uint32_t kib_s)
+{
+	return kib_s ? bytes*1000000000U / ((uint64_t)kib_s*1024U) : 0;
+}
+
+static void _dvmDiscEmuElapse(DvmDiscEmu* self, uint64_t ns)
+{
+	self->busy_ns += ns;
+
+	if (!(self->flags & DVM_EMU_SLEEP)) {
+		s_dvmEmuClock += ns;
+		return;
+	}
+
+	struct timespec ts = { .tv_sec = ns / 1000000000U, .tv_nsec = ns % 1000000000U };
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+}
+
+static uint64_t _dvmDiscEmuCost(DvmDiscEmu* self, sec_t first_sector, sec_t num_sectors, bool is_write)
+{
+	const DvmEmuTiming* t = &self->timing;
+	uint64_t bytes = (uint64_t)num_sectors*self->base.sector_sz;
+	uint64_t ns;
+
+	if (is_write) {
+		ns = t->write_cmd_ns + _dvmDiscEmuTransferNs(bytes, t->write_kib_s);
+
+		// Writes that do not cover whole erase blocks make the device read-modify-write them
+		if (t->block_sectors) {
+			sec_t end_sector = first_sector + num_sectors;
+			unsigned num_partial = (first_sector % t->block_sectors) != 0;
+			if ((end_sector % t->block_sectors) && (!num_partial || (end_sector-1) / t->block_sectors != first_sector / t->block_sectors)) {
+				num_partial ++;
+			}
+			ns += (uint64_t)num_partial*t->block_penalty_ns;
+		}
+	} else {
+		ns = t->read_cmd_ns + _dvmDiscEmuTransferNs(bytes, t->read_kib_s);
+	}
+
+	if (first_sector != self->head) {
+		ns += t->seek_ns;
+	}
+
+	self->head = first_sector + num_sectors;
+	return ns;
+}
+
+static void _dvmDiscEmuDestroy(DvmDisc* self_)
+{
+	DvmDiscEmu* self = (DvmDiscEmu*)self_;
+
+	dvmDiscRemoveUser(self->inner);
+	__lock_close(self->lock);
+	free(self);
+}
+
+static bool _dvmDiscEmuReadSectors(DvmDisc* self_, void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	DvmDiscEmu* self = (DvmDiscEmu*)self_;
+
+	// The emulated device executes one command at a time
+	__lock_acquire(self->lock);
+	bool ret = self->inner->vt->read_sectors(self->inner, buffer, first_sector, num_sectors, is_partial);
+	_dvmDiscEmuElapse(self, _dvmDiscEmuCost(self, first_sector, num_sectors, false));
+	__lock_release(self->lock);
+
+	return ret;
+}
+
+static bool _dvmDiscEmuWriteSectors(DvmDisc* self_, const void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	DvmDiscEmu* self = (DvmDiscEmu*)self_;
+
+	__lock_acquire(self->lock);
+	bool ret = self->inner->vt->write_sectors(self->inner, buffer, first_sector, num_sectors, is_partial);
+	_dvmDiscEmuElapse(self, _dvmDiscEmuCost(self, first_sector, num_sectors, true));
+	__lock_release(self->lock);
+
+	return ret;
+}
+
+static bool _dvmDiscEmuFlush(DvmDisc* self_)
+{
+	DvmDiscEmu* self = (DvmDiscEmu*)self_;
+
+	__lock_acquire(self->lock);
+	bool ret = dvmDiscFlush(self->inner);
+	_dvmDiscEmuElapse(self, self->timing.flush_ns);
+	__lock_release(self->lock);
+
+	return ret;
+}
+
+static bool _dvmDiscEmuTrim(DvmDisc* self_, sec_t first_sector, sec_t num_sectors)
+{
+	DvmDiscEmu* self = (DvmDiscEmu*)self_;
+
+	__lock_acquire(self->lock);
+	bool ret = dvmDiscTrim(self->inner, first_sector, num_sectors);
+	_dvmDiscEmuElapse(self, self->timing.write_cmd_ns);
+	__lock_release(self->lock);
+
+	return ret;
+}
+
+static const DvmDiscIface s_dvmDiscEmuIface = {
+	.destroy       = _dvmDiscEmuDestroy,
+	.read_sectors  = _dvmDiscEmuReadSectors,
+	.write_sectors = _dvmDiscEmuWriteSectors,
+	.flush         = _dvmDiscEmuFlush,
+	.trim          = _dvmDiscEmuTrim,
+};
+
+const DvmEmuTiming* dvmEmuGetPreset(unsigned index)
+{
+	return index < NUM_PRESETS ? &s_dvmEmuPresets[index] : NULL;
+}
+
+uint64_t dvmEmuClockNs(void)
+{
+	return s_dvmEmuClock;
+}
+
+DvmDisc* dvmDiscEmuCreate(DvmDisc* inner_disc, const DvmEmuTiming* timing, unsigned flags)
+{
+	// Parameter validation
+	if (!inner_disc || !timing) {
+		return NULL;
+	}
+
+	DvmDiscEmu* disc = (DvmDiscEmu*)malloc(sizeof(DvmDiscEmu));
+	if (!disc) {
+		return NULL;
+	}
+
+	memset(disc, 0, sizeof(DvmDiscEmu));
+	disc->base.vt = &s_dvmDiscEmuIface;
+	disc->base.io_type = inner_disc->io_type;
+	disc->base.features = inner_disc->features;
+	disc->base.num_sectors = inner_disc->num_sectors;
+	disc->base.sector_sz = inner_disc->sector_sz;
+	disc->base.block_sz = inner_disc->block_sz;
+	disc->base.caps = inner_disc->caps;
+	disc->base.caps.queue_depth = 1;
+	__lock_init(disc->lock);
+	dvmDiscAddUser(inner_disc);
+	disc->inner = inner_disc;
+	disc->timing = *timing;
+	disc->flags = flags;
+
+	// Erase block sizes are given in 512-byte units like the other layers
+	disc->timing.block_sectors = disc->timing.block_sectors*512U / inner_disc->sector_sz;
+
+	dvmDebug("Emu: %s\n", timing->name ? timing->name : "custom");
+	return &disc->base;
+}
+
+uint64_t dvmDiscEmuGetBusyNs(DvmDisc* disc, bool reset)
+{
+	if (!disc || disc->vt != &s_dvmDiscEmuIface) {
+		return 0;
+	}
+
+	DvmDiscEmu* self = (DvmDiscEmu*)disc;
+	__lock_acquire(self->lock);
+
+	uint64_t ret = self->busy_ns;
+	if (reset) {
+		self->busy_ns = 0;
+	}
+
+	__lock_release(self->lock);
+	return ret;
+}
@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#include <stdlib.h>
+#include <string.h>
+#include <sys/lock.h>
+#include <dvm.h>
+
+uint64_t _dvmGetTimeNs(void);
+
+typedef struct DvmDiscHist {
+	DvmDisc base;
+
+	_LOCK_T lock;
+	DvmDisc* inner;
+	DvmHistStats stats;
+} DvmDiscHist;
+
+static unsigned _dvmDiscHistSizeClass(sec_t num_sectors)
+{
+	if (num_sectors <= 1) {
+		return 0;
+	} else if (num_sectors <= 8) {
+		return 1;
+	} else if (num_sectors <= 64) {
+		return 2;
+	} else {
+		return 3;
+	}
+}
+
+static unsigned _dvmDiscHistBucket(uint32_t us)
+{
+	if (!us) {
+		return 0;
+	}
+
+	unsigned bucket = 32 - __builtin_clz(us);
+	return bucket < DVM_HIST_BUCKETS ? bucket : DVM_HIST_BUCKETS-1;
+}
+
+static uint64_t _dvmDiscHistBegin(DvmDiscHist* self)
+{
+	__lock_acquire(self->lock);
+	if (++self->stats.in_flight > self->stats.max_in_flight) {
+		self->stats.max_in_flight = self->stats.in_flight;
+	}
+	__lock_release(self->lock);
+
+	return _dvmGetTimeNs();
+}
+
+static void _dvmDiscHistEnd(DvmDiscHist* self, unsigned op, sec_t num_sectors, uint64_t start, bool ret)
+{
+	uint64_t us64 = (_dvmGetTimeNs() - start) / 1000U;
+	uint32_t us = us64 < UINT32_MAX ? us64 : UINT32_MAX;
+
+	__lock_acquire(self->lock);
+
+	DvmHistOpStats* st = &self->stats.ops[op];
+	st->count ++;
+	st->sectors += num_sectors;
+	st->total_us += us;
+	if (us > st->max_us) {
+		st->max_us = us;
+	}
+	if (!ret) {
+		st->errors ++;
+	}
+	st->buckets[_dvmDiscHistSizeClass(num_sectors)][_dvmDiscHistBucket(us)] ++;
+	self->stats.in_flight --;
+
+	__lock_release(self->lock);
+}
+
+static void _dvmDiscHistDestroy(DvmDisc* self_)
+{
+	DvmDiscHist* self = (DvmDiscHist*)self_;
+
+	dvmDiscRemoveUser(self->inner);
+	__lock_close(self->lock);
+	free(self);
+}
+
+static bool _dvmDiscHistReadSectors(DvmDisc* self_, void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	DvmDiscHist* self = (DvmDiscHist*)self_;
+
+	uint64_t start = _dvmDiscHistBegin(self);
+	bool ret = self->inner->vt->read_sectors(self->inner, buffer, first_sector, num_sectors, is_partial);
+	_dvmDiscHistEnd(self, DVM_TRACE_OP_READ, num_sectors, start, ret);
+
+	return ret;
+}
+
+static bool _dvmDiscHistWriteSectors(DvmDisc* self_, const void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	DvmDiscHist* self = (DvmDiscHist*)self_;
+
+	uint64_t start = _dvmDiscHistBegin(self);
+	bool ret = self->inner->vt->write_sectors(self->inner, buffer, first_sector, num_sectors, is_partial);
+	_dvmDiscHistEnd(self, DVM_TRACE_OP_WRITE, num_sectors, start, ret);
+
+	return ret;
+}
+
+static bool _dvmDiscHistFlush(DvmDisc* self_)
+{
+	DvmDiscHist* self = (DvmDiscHist*)self_;
+
+	uint64_t start = _dvmDiscHistBegin(self);
+	bool ret = dvmDiscFlush(self->inner);
+	_dvmDiscHistEnd(self, DVM_TRACE_OP_FLUSH, 0, start, ret);
+
+	return ret;
+}
+
+static bool _dvmDiscHistTrim(DvmDisc* self_, sec_t first_sector, sec_t num_sectors)
+{
+	DvmDiscHist* self = (DvmDiscHist*)self_;
+	return dvmDiscTrim(self->inner, first_sector, num_sectors);
+}
+
+static const void* _dvmDiscHistMapSectors(DvmDisc* self_, sec_t first_sector, sec_t num_sectors)
+{
+	DvmDiscHist* self = (DvmDiscHist*)self_;
+	return dvmDiscMapSectors(self->inner, first_sector, num_sectors);
+}
+
+static const DvmDiscIface s_dvmDiscHistIface = {
+	.destroy       = _dvmDiscHistDestroy,
+	.read_sectors  = _dvmDiscHistReadSectors,
+	.write_sectors = _dvmDiscHistWriteSectors,
+	.flush         = _dvmDiscHistFlush,
+	.map_sectors   = _dvmDiscHistMapSectors,
+	.trim          = _dvmDiscHistTrim,
+};
+
+DvmDisc* dvmDiscHistCreate(DvmDisc* inner_disc)
+{
+	if (!inner_disc) {
+		return NULL;
+	}
+
+	DvmDiscHist* disc = (DvmDiscHist*)malloc(sizeof(DvmDiscHist));
+	if (!disc) {
+		return NULL;
+	}
+
+	memset(disc, 0, sizeof(DvmDiscHist));
+	disc->base.vt = &s_dvmDiscHistIface;
+	disc->base.io_type = inner_disc->io_type;
+	disc->base.features = inner_disc->features;
+	disc->base.num_sectors = inner_disc->num_sectors;
+	disc->base.sector_sz = inner_disc->sector_sz;
+	disc->base.block_sz = inner_disc->block_sz;
+	disc->base.caps = inner_disc->caps;
+	__lock_init(disc->lock);
+	dvmDiscAddUser(inner_disc);
+	disc->inner = inner_disc;
+
+	return &disc->base;
+}
+
+bool dvmDiscHistGetStats(DvmDisc* disc, DvmHistStats* out, bool reset)
+{
+	if (!disc || disc->vt != &s_dvmDiscHistIface) {
+		return false;
+	}
+
+	DvmDiscHist* self = (DvmDiscHist*)disc;
+	__lock_acquire(self->lock);
+
+	if (out) {
+		*out = self->stats;
+	}
+
+	// Requests still in flight survive the reset
+	if (reset) {
+		uint32_t in_flight = self->stats.in_flight;
+		memset(&self->stats, 0, sizeof(self->stats));
+		self->stats.in_flight = in_flight;
+		self->stats.max_in_flight = in_flight;
+	}
+
+	__lock_release(self->lock);
+	return true;
+}
@@ -0,0 +1,535 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dvm.h>
+#include "dvm_debug.h"
+#include "dvm_probe.h"
+#include "dvm_thread.h"
+
+#define DIRECT_IO_ALIGN 4096U
+#define BOUNCE_SECTORS  64U
+#define WILLNEED_MIN_SZ (64U*1024)
+
+#define COMP_CACHE_BLOCKS 4U
+
+extern const DvmFsDriver g_vfatFsDriver __attribute__((weak));
+extern const DvmFsDriver g_exfatFsDriver __attribute__((weak));
+extern const DvmFsDriver g_ext2FsDriver __attribute__((weak));
+
+__attribute__((weak)) unsigned g_dvmDefaultCachePages = 32;
+__attribute__((weak)) unsigned g_dvmDefaultSectorsPerPage = 8;
+__attribute__((weak)) unsigned g_dvmDefaultCacheFlags = 0;
+__attribute__((weak)) unsigned g_dvmLazyMount = 0;
+__attribute__((weak)) unsigned g_dvmParallelProbe = 0;
+__attribute__((weak)) unsigned g_dvmProbeTimeoutMs = 5000;
+__attribute__((weak)) unsigned g_dvmDentryCacheSize = 0;
+__attribute__((weak)) unsigned g_dvmVolumeStats = 0;
+
+typedef struct DvmDiscImage {
+	DvmDisc base;
+	int fd;
+	uint8_t* bounce;
+} DvmDiscImage;
+
+static void _dvmDiscImageDestroy(DvmDisc* self_)
+{
+	DvmDiscImage* self = (DvmDiscImage*)self_;
+	close(self->fd);
+	free(self->bounce);
+	free(self);
+}
+
+static bool _dvmDiscImageTransfer(DvmDiscImage* self, uint8_t* buffer, sec_t first_sector, sec_t num_sectors, bool is_write)
+{
+	size_t size = num_sectors*self->base.sector_sz;
+	off_t offset = (off_t)first_sector*self->base.sector_sz;
+
+	while (size) {
+		ssize_t ret;
+		if (is_write) {
+			ret = pwrite(self->fd, buffer, size, offset);
+		} else {
+			ret = pread(self->fd, buffer, size, offset);
+		}
+
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		} else if (ret <= 0) {
+			dvmDebug("Image %s error at 0x%lx\n", is_write ? "write" : "read", (unsigned long)offset);
+			return false;
+		}
+
+		buffer += ret;
+		offset += ret;
+		size -= ret;
+	}
+
+	return true;
+}
+
+static bool _dvmDiscImageReadWrite(DvmDiscImage* self, uint8_t* buffer, sec_t first_sector, sec_t num_sectors, bool is_write)
+{
+	// Early fail on out of bounds access
+	if (first_sector >= self->base.num_sectors || num_sectors > self->base.num_sectors - first_sector) {
+		return false;
+	}
+
+	// Direct access
+	if (!self->bounce || ((uintptr_t)buffer & (DIRECT_IO_ALIGN-1)) == 0) {
+		return _dvmDiscImageTransfer(self, buffer, first_sector, num_sectors, is_write);
+	}
+
+	// O_DIRECT with a misaligned buffer: go through the bounce buffer
+	const sec_t bounce_sectors = BOUNCE_SECTORS*512U / self->base.sector_sz;
+	while (num_sectors) {
+		sec_t cur_sectors = num_sectors < bounce_sectors ? num_sectors : bounce_sectors;
+		size_t cur_size = cur_sectors*self->base.sector_sz;
+
+		if (is_write) {
+			memcpy(self->bounce, buffer, cur_size);
+		}
+
+		if (!_dvmDiscImageTransfer(self, self->bounce, first_sector, cur_sectors, is_write)) {
+			return false;
+		}
+
+		if (!is_write) {
+			memcpy(buffer, self->bounce, cur_size);
+		}
+
+		buffer += cur_size;
+		first_sector += cur_sectors;
+		num_sectors -= cur_sectors;
+	}
+
+	return true;
+}
+
+static bool _dvmDiscImageReadSectors(DvmDisc* self_, void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	DvmDiscImage* self = (DvmDiscImage*)self_;
+	return _dvmDiscImageReadWrite(self, (uint8_t*)buffer, first_sector, num_sectors, false);
+}
+
+static bool _dvmDiscImageWriteSectors(DvmDisc* self_, const void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	DvmDiscImage* self = (DvmDiscImage*)self_;
+	if (!(self->base.features & FEATURE_MEDIUM_CANWRITE)) {
+		return false;
+	}
+
+	return _dvmDiscImageReadWrite(self, (uint8_t*)buffer, first_sector, num_sectors, true);
+}
+
+static bool _dvmDiscImageFlush(DvmDisc* self_)
+{
+	DvmDiscImage* self = (DvmDiscImage*)self_;
+	if (!(self->base.features & FEATURE_MEDIUM_CANWRITE)) {
+		return true;
+	}
+
+	return fdatasync(self->fd) == 0;
+}
+
+static bool _dvmDiscImageTrim(DvmDisc* self_, sec_t first_sector, sec_t num_sectors)
+{
+	DvmDiscImage* self = (DvmDiscImage*)self_;
+	if (!(self->base.features & FEATURE_MEDIUM_CANWRITE)) {
+		return false;
+	}
+
+	// Early fail on out of bounds access
+	if (first_sector >= self->base.num_sectors || num_sectors > self->base.num_sectors - first_sector) {
+		return false;
+	}
+
+	// Punch a hole in the image file (block devices and older filesystems can't)
+	off_t offset = (off_t)first_sector*self->base.sector_sz;
+	off_t size = (off_t)num_sectors*self->base.sector_sz;
+	return fallocate(self->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == 0 || errno == EOPNOTSUPP;
+}
+
+static const DvmDiscIface s_dvmDiscImageIface = {
+	.destroy       = _dvmDiscImageDestroy,
+	.read_sectors  = _dvmDiscImageReadSectors,
+	.write_sectors = _dvmDiscImageWriteSectors,
+	.flush         = _dvmDiscImageFlush,
+	.trim          = _dvmDiscImageTrim,
+};
+
+DvmDisc* dvmDiscImageCreate(const char* path, unsigned flags, unsigned sector_sz)
+{
+	if (!sector_sz) {
+		sector_sz = 512U;
+	}
+
+	// Parameter validation
+	if (!path || sector_sz < 512U || (sector_sz & (sector_sz-1)) || sector_sz > UINT16_MAX) {
+		return NULL;
+	}
+
+	int oflags = (flags & DVM_IMAGE_READONLY) ? O_RDONLY : O_RDWR;
+	if (flags & DVM_IMAGE_DIRECT) {
+		oflags |= O_DIRECT;
+	}
+
+	int fd = open(path, oflags | O_CLOEXEC);
+	if (fd < 0) {
+		dvmDebug("Cannot open image %s\n", path);
+		return NULL;
+	}
+
+	// Works for both regular files and block devices
+	off_t size = lseek(fd, 0, SEEK_END);
+	if (size < (off_t)sector_sz) {
+		close(fd);
+		return NULL;
+	}
+
+	DvmDiscImage* disc = (DvmDiscImage*)calloc(1, sizeof(DvmDiscImage));
+	if (disc && (flags & DVM_IMAGE_DIRECT)) {
+		disc->bounce = (uint8_t*)aligned_alloc(DIRECT_IO_ALIGN, BOUNCE_SECTORS*512U);
+		if (!disc->bounce) {
+			free(disc);
+			disc = NULL;
+		}
+	}
+
+	if (!disc) {
+		close(fd);
+		return NULL;
+	}
+
+	disc->base.vt = &s_dvmDiscImageIface;
+	disc->base.io_type = ('I'<<24) | ('M'<<16) | ('G'<<8) | 'F';
+	disc->base.features = FEATURE_MEDIUM_CANREAD;
+	if (!(flags & DVM_IMAGE_READONLY)) {
+		disc->base.features |= FEATURE_MEDIUM_CANWRITE;
+	}
+	disc->base.num_sectors = size / sector_sz;
+	disc->base.sector_sz = sector_sz;
+	disc->base.block_sz = 0;
+	disc->base.caps.align = (flags & DVM_IMAGE_DIRECT) ? DIRECT_IO_ALIGN : 1;
+	disc->base.caps.queue_depth = 1;
+	disc->fd = fd;
+
+	// Use the preferred I/O size of the underlying file as the optimal request size
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_blksize > (blksize_t)sector_sz) {
+		disc->base.caps.opt_sectors = st.st_blksize / sector_sz;
+	}
+
+	return &disc->base;
+}
+
+typedef struct DvmDiscImageMap {
+	DvmDisc base;
+	const uint8_t* data;
+	size_t size;
+	uintptr_t page_mask;
+} DvmDiscImageMap;
+
+static void _dvmDiscImageMapDestroy(DvmDisc* self_)
+{
+	DvmDiscImageMap* self = (DvmDiscImageMap*)self_;
+	munmap((void*)self->data, self->size);
+	free(self);
+}
+
+static const void* _dvmDiscImageMapSectors(DvmDisc* self_, sec_t first_sector, sec_t num_sectors)
+{
+	DvmDiscImageMap* self = (DvmDiscImageMap*)self_;
+
+	// Fail on out of bounds access
+	if (first_sector >= self->base.num_sectors || num_sectors > self->base.num_sectors - first_sector) {
+		return NULL;
+	}
+
+	return self->data + (size_t)first_sector*self->base.sector_sz;
+}
+
+static bool _dvmDiscImageMapReadSectors(DvmDisc* self_, void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	DvmDiscImageMap* self = (DvmDiscImageMap*)self_;
+	const uint8_t* data = (const uint8_t*)_dvmDiscImageMapSectors(self_, first_sector, num_sectors);
+	if (!data) {
+		return false;
+	}
+
+	// The mapping is advised as random access (filesystem metadata). Large
+	// non-partial reads are file data: ask the kernel to prefetch them.
+	size_t size = num_sectors*self->base.sector_sz;
+	if (!is_partial && size >= WILLNEED_MIN_SZ) {
+		uintptr_t start = (uintptr_t)data & ~self->page_mask;
+		madvise((void*)start, (uintptr_t)data + size - start, MADV_WILLNEED);
+	}
+
+	memcpy(buffer, data, size);
+	return true;
+}
+
+static bool _dvmDiscImageMapWriteSectors(DvmDisc* self_, const void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	return false;
+}
+
+static bool _dvmDiscImageMapFlush(DvmDisc* self_)
+{
+	return true;
+}
+
+static const DvmDiscIface s_dvmDiscImageMapIface = {
+	.destroy       = _dvmDiscImageMapDestroy,
+	.read_sectors  = _dvmDiscImageMapReadSectors,
+	.write_sectors = _dvmDiscImageMapWriteSectors,
+	.flush         = _dvmDiscImageMapFlush,
+	.map_sectors   = _dvmDiscImageMapSectors,
+};
+
+DvmDisc* dvmDiscImageMapCreate(const char* path, unsigned sector_sz)
+{
+	if (!sector_sz) {
+		sector_sz = 512U;
+	}
+
+	// Parameter validation
+	if (!path || sector_sz < 512U || (sector_sz & (sector_sz-1)) || sector_sz > UINT16_MAX) {
+		return NULL;
+	}
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		dvmDebug("Cannot open image %s\n", path);
+		return NULL;
+	}
+
+	// The image must fit in the address space
+	off_t size = lseek(fd, 0, SEEK_END);
+	if (size < (off_t)sector_sz || (uint64_t)size > SIZE_MAX) {
+		close(fd);
+		return NULL;
+	}
+
+	// The mapping keeps its own reference to the file
+	void* data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		dvmDebug("Cannot map image %s\n", path);
+		return NULL;
+	}
+
+	DvmDiscImageMap* disc = (DvmDiscImageMap*)calloc(1, sizeof(DvmDiscImageMap));
+	if (!disc) {
+		munmap(data, size);
+		return NULL;
+	}
+
+	madvise(data, size, MADV_RANDOM);
+
+	disc->base.vt = &s_dvmDiscImageMapIface;
+	disc->base.io_type = ('I'<<24) | ('M'<<16) | ('G'<<8) | 'M';
+	disc->base.features = FEATURE_MEDIUM_CANREAD;
+	disc->base.num_sectors = size / sector_sz;
+	disc->base.sector_sz = sector_sz;
+	disc->base.block_sz = 0;
+	disc->base.caps.align = 1;
+	disc->base.caps.queue_depth = 1;
+	disc->data = (const uint8_t*)data;
+	disc->size = size;
+	disc->page_mask = sysconf(_SC_PAGESIZE) - 1;
+
+	return &disc->base;
+}
+
+static DvmDisc* _dvmOpenImage(const char* path, unsigned flags, unsigned cache_pages, unsigned sectors_per_page)
+{
+	DvmDisc* disc = NULL;
+
+	// Read-only images are mapped: the page cache already holds their
+	// contents, so no DvmDiscCache is needed on top.
+	if ((flags & (DVM_IMAGE_READONLY|DVM_IMAGE_DIRECT)) == DVM_IMAGE_READONLY) {
+		disc = dvmDiscImageMapCreate(path, 0);
+		if (disc) {
+			cache_pages = 0;
+		}
+	}
+
+	if (!disc) {
+		disc = dvmDiscImageCreate(path, flags, 0);
+	}
+
+	// Block-compressed images are decompressed on the fly (through their own block cache)
+	if (disc && (flags & DVM_IMAGE_READONLY)) {
+		DvmDisc* comp = dvmDiscCompCreate(disc, COMP_CACHE_BLOCKS);
+		if (comp) {
+			disc = comp;
+			cache_pages = 0;
+		}
+	}
+
+	if (disc && cache_pages != 0) {
+		disc = dvmDiscCacheCreate(disc, cache_pages, sectors_per_page);
+	}
+
+	return disc;
+}
+
+static DvmDisc* _dvmProbeOpenImage(const DvmProbeJob* job)
+{
+	return _dvmOpenImage((const char*)job->arg, 0, job->cache_pages, job->sectors_per_page);
+}
+
+unsigned dvmProbeMountImage(const char* basename, const char* path, unsigned flags, unsigned cache_pages, unsigned sectors_per_page)
+{
+	unsigned num_mounted = 0;
+	DvmDisc* disc = _dvmOpenImage(path, flags, cache_pages, sectors_per_page);
+
+	if (disc) {
+		num_mounted = dvmProbeMountDisc(basename, disc);
+	}
+
+	if (!num_mounted && disc) {
+		disc->vt->destroy(disc);
+	}
+
+	return num_mounted;
+}
+
+typedef struct DvmThread {
+	pthread_t handle;
+	void (*entry)(void* arg);
+	void* arg;
+	unsigned refs; // Freed by whoever of the thread and its finisher is last
+} DvmThread;
+
+static void* _dvmThreadEntry(void* arg)
+{
+	DvmThread* t = (DvmThread*)arg;
+	t->entry(t->arg);
+
+	if (!__atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL)) {
+		free(t);
+	}
+
+	return NULL;
+}
+
+void* _dvmThreadStart(void (*entry)(void* arg), void* arg)
+{
+	DvmThread* t = (DvmThread*)malloc(sizeof(DvmThread));
+	if (t) {
+		t->entry = entry;
+		t->arg = arg;
+		t->refs = 2;
+		if (pthread_create(&t->handle, NULL, _dvmThreadEntry, t) != 0) {
+			free(t);
+			t = NULL;
+		}
+	}
+
+	return t;
+}
+
+void _dvmThreadFinish(void* thread, bool join)
+{
+	DvmThread* t = (DvmThread*)thread;
+
+	// Abandoned threads are left to run to completion
+	if (join) {
+		pthread_join(t->handle, NULL);
+	} else {
+		pthread_detach(t->handle);
+	}
+
+	if (!__atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL)) {
+		free(t);
+	}
+}
+
+void _dvmThreadSleep(void)
+{
+	usleep(1000);
+}
+
+bool dvmInit(bool set_app_cwdir, unsigned cache_pages, unsigned sectors_per_page)
+{
+	unsigned num_mounted = 0;
+
+	// Register FAT12/FAT16/FAT32 driver
+	dvmRegisterFsDriver(&g_vfatFsDriver);
+
+	// Register exFAT driver
+	dvmRegisterFsDriver(&g_exfatFsDriver);
+
+	// Register ext2/ext3/ext4 driver
+	dvmRegisterFsDriver(&g_ext2FsDriver);
+
+	// Images to mount are listed as name=path pairs separated by semicolons,
+	// for example LIBDVM_IMAGES="sd=/tmp/sd.img;usb=/tmp/usb.img"
+	const char* images = getenv("LIBDVM_IMAGES");
+	char* list = images ? strdup(images) : NULL;
+
+	DvmProbeJob* jobs = NULL;
+	unsigned num_jobs = 0;
+	for (char* cur = list; cur && *cur; ) {
+		char* end = strchr(cur, ';');
+		if (end) {
+			*end = 0;
+		}
+
+		char* eq = strchr(cur, '=');
+		if (eq && eq != cur && eq[1] && (eq - cur) < 16) {
+			DvmProbeJob* new_jobs = (DvmProbeJob*)realloc(jobs, (num_jobs+1)*sizeof(DvmProbeJob));
+			if (!new_jobs) {
+				break;
+			}
+
+			*eq = 0;
+			jobs = new_jobs;
+			jobs[num_jobs++] = (DvmProbeJob){ .name = cur, .open = _dvmProbeOpenImage, .arg = eq + 1, .cache_pages = cache_pages, .sectors_per_page = sectors_per_page };
+		}
+
+		cur = end ? end + 1 : NULL;
+	}
+
+	// Try mounting all images, optionally opening them in parallel
+	num_mounted += _dvmProbeMountJobs(jobs, num_jobs, g_dvmParallelProbe != 0, g_dvmProbeTimeoutMs);
+
+	// Jobs that timed out keep using their path, so the list is kept for them
+	bool abandoned = false;
+	for (unsigned i = 0; i < num_jobs; i ++) {
+		abandoned = abandoned || jobs[i].state == PROBE_ABANDONED;
+	}
+
+	if (!abandoned) {
+		free(list);
+	}
+
+	free(jobs);
+
+	// The host working directory is not on a libdvm volume: set_app_cwdir only
+	// keeps the first mounted volume as the default device.
+	(void)set_app_cwdir;
+
+	return num_mounted != 0;
+}
+
+void dvmDeinit(void)
+{
+	// Only files and volumes with unwritten changes are written back
+	dvmSyncAll();
+
+	for (unsigned i = 3; i < STD_MAX; i ++) {
+		const devoptab_t* dotab = devoptab_list[i];
+		if (dotab && strcmp(dotab->name, "stdnull") != 0) {
+			dvmUnmountVolume(dotab->name);
+		}
+	}
+}
@@ -0,0 +1,535 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/iosupport.h>
+
+#define MAX_HANDLES 256
+
+typedef struct DvmHostHandle {
+	int device;
+	alignas(2*sizeof(void*)) uint8_t file_struct[];
+} DvmHostHandle;
+
+static const devoptab_t s_dvmHostStdnull = {
+	.name = "stdnull",
+};
+
+const devoptab_t* devoptab_list[STD_MAX] = {
+	[0 ... STD_MAX-1] = &s_dvmHostStdnull,
+};
+
+static pthread_mutex_t s_dvmHostLock = PTHREAD_MUTEX_INITIALIZER;
+static int s_dvmHostDefaultDevice;
+static char s_dvmHostCwd[PATH_MAX];
+static DvmHostHandle* s_dvmHostHandles[MAX_HANDLES];
+
+int FindDevice(const char* name)
+{
+	const char* colonpos = strchr(name, ':');
+	if (!colonpos) {
+		return -1;
+	}
+
+	size_t namelen = colonpos - name;
+	for (int i = 0; i < STD_MAX; i ++) {
+		const devoptab_t* dotab = devoptab_list[i];
+		if (dotab != &s_dvmHostStdnull && strlen(dotab->name) == namelen && memcmp(dotab->name, name, namelen) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+int AddDevice(const devoptab_t* device)
+{
+	int ret = -1;
+	size_t namelen = strlen(device->name);
+	pthread_mutex_lock(&s_dvmHostLock);
+
+	for (int i = 3; i < STD_MAX; i ++) {
+		const devoptab_t* dotab = devoptab_list[i];
+		if (dotab == &s_dvmHostStdnull) {
+			if (ret < 0) {
+				ret = i;
+			}
+		} else if (strlen(dotab->name) == namelen && memcmp(dotab->name, device->name, namelen) == 0) {
+			ret = i;
+			break;
+		}
+	}
+
+	if (ret >= 0) {
+		devoptab_list[ret] = device;
+	}
+
+	pthread_mutex_unlock(&s_dvmHostLock);
+	return ret;
+}
+
+int RemoveDevice(const char* name)
+{
+	pthread_mutex_lock(&s_dvmHostLock);
+
+	int dev = FindDevice(name);
+	if (dev >= 3) {
+		devoptab_list[dev] = &s_dvmHostStdnull;
+		if (dev == s_dvmHostDefaultDevice) {
+			s_dvmHostDefaultDevice = 0;
+			s_dvmHostCwd[0] = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&s_dvmHostLock);
+	return dev >= 3 ? 0 : -1;
+}
+
+void setDefaultDevice(int device)
+{
+	if (device >= 0 && device < STD_MAX) {
+		s_dvmHostDefaultDevice = device;
+	}
+}
+
+const devoptab_t* GetDeviceOpTab(const char* name)
+{
+	int dev = strchr(name, ':') ? FindDevice(name) : s_dvmHostDefaultDevice;
+	return dev >= 0 ? devoptab_list[dev] : NULL;
+}
+
+static const char* _dvmHostResolvePath(const char* path, char* buf, int* out_dev)
+{
+	*out_dev = -1;
+
+	// Paths with a device name are used verbatim
+	const char* colonpos = strchr(path, ':');
+	const char* slashpos = strchr(path, '/');
+	if (colonpos && (!slashpos || colonpos < slashpos)) {
+		*out_dev = FindDevice(path);
+		return path;
+	}
+
+	// Otherwise resolve against the default device and working directory
+	int dev = s_dvmHostDefaultDevice;
+	if (dev < 3) {
+		return NULL;
+	}
+
+	const char* prefix = devoptab_list[dev]->name;
+	const char* sep = ":";
+	if (*path != '/' && s_dvmHostCwd[0]) {
+		prefix = s_dvmHostCwd;
+		sep = "";
+	}
+
+	size_t prefixlen = strlen(prefix), seplen = strlen(sep), pathlen = strlen(path);
+	if ((prefixlen + seplen + pathlen + 1) > PATH_MAX) {
+		return NULL;
+	}
+
+	memcpy(buf, prefix, prefixlen);
+	memcpy(buf + prefixlen, sep, seplen);
+	memcpy(buf + prefixlen + seplen, path, pathlen + 1);
+
+	*out_dev = dev;
+	return buf;
+}
+
+static const char* _dvmHostPathBegin(const char* path, char* buf, struct _reent* r, const devoptab_t** out_dotab)
+{
+	int dev;
+	path = _dvmHostResolvePath(path, buf, &dev);
+	if (!path || dev < 0) {
+		errno = ENODEV;
+		return NULL;
+	}
+
+	*out_dotab = devoptab_list[dev];
+	r->_errno = 0;
+	r->deviceData = (*out_dotab)->deviceData;
+	return path;
+}
+
+static DvmHostHandle* _dvmHostFdBegin(int fd, struct _reent* r, const devoptab_t** out_dotab)
+{
+	DvmHostHandle* handle = NULL;
+	if (fd >= 0 && fd < MAX_HANDLES) {
+		handle = s_dvmHostHandles[fd];
+	}
+
+	if (!handle) {
+		errno = EBADF;
+		return NULL;
+	}
+
+	*out_dotab = devoptab_list[handle->device];
+	r->_errno = 0;
+	r->deviceData = (*out_dotab)->deviceData;
+	return handle;
+}
+
+static inline long _dvmHostResult(struct _reent* r, long ret)
+{
+	if (ret < 0) {
+		errno = r->_errno;
+	}
+
+	return ret;
+}
+
+static inline int _dvmHostNoSys(void)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int dvmHostOpen(const char* path, int flags, int mode)
+{
+	char buf[PATH_MAX];
+	struct _reent r;
+	const devoptab_t* dotab;
+	path = _dvmHostPathBegin(path, buf, &r, &dotab);
+	if (!path) {
+		return -1;
+	} else if (!dotab->open_r) {
+		return _dvmHostNoSys();
+	}
+
+	DvmHostHandle* handle = (DvmHostHandle*)calloc(1, sizeof(DvmHostHandle) + dotab->structSize);
+	if (!handle) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	handle->device = FindDevice(path);
+
+	// Allocate a descriptor (0-2 are reserved like on the real platforms)
+	pthread_mutex_lock(&s_dvmHostLock);
+	int fd = 3;
+	while (fd < MAX_HANDLES && s_dvmHostHandles[fd]) {
+		fd ++;
+	}
+	if (fd < MAX_HANDLES) {
+		s_dvmHostHandles[fd] = handle;
+	}
+	pthread_mutex_unlock(&s_dvmHostLock);
+
+	if (fd >= MAX_HANDLES) {
+		free(handle);
+		errno = EMFILE;
+		return -1;
+	}
+
+	if (dotab->open_r(&r, handle->file_struct, path, flags, mode) < 0) {
+		s_dvmHostHandles[fd] = NULL;
+		free(handle);
+		errno = r._errno;
+		return -1;
+	}
+
+	return fd;
+}
+
+int dvmHostClose(int fd)
+{
+	struct _reent r;
+	const devoptab_t* dotab;
+	DvmHostHandle* handle = _dvmHostFdBegin(fd, &r, &dotab);
+	if (!handle) {
+		return -1;
+	}
+
+	if (dotab->close_r && dotab->close_r(&r, handle->file_struct) < 0) {
+		return _dvmHostResult(&r, -1);
+	}
+
+	s_dvmHostHandles[fd] = NULL;
+	free(handle);
+	return 0;
+}
+
+ssize_t dvmHostRead(int fd, void* buf, size_t len)
+{
+	struct _reent r;
+	const devoptab_t* dotab;
+	DvmHostHandle* handle = _dvmHostFdBegin(fd, &r, &dotab);
+	if (!handle) {
+		return -1;
+	} else if (!dotab->read_r) {
+		return _dvmHostNoSys();
+	}
+
+	return _dvmHostResult(&r, dotab->read_r(&r, handle->file_struct, (char*)buf, len));
+}
+
+ssize_t dvmHostWrite(int fd, const void* buf, size_t len)
+{
+	struct _reent r;
+	const devoptab_t* dotab;
+	DvmHostHandle* handle = _dvmHostFdBegin(fd, &r, &dotab);
+	if (!handle) {
+		return -1;
+	} else if (!dotab->write_r) {
+		return _dvmHostNoSys();
+	}
+
+	return _dvmHostResult(&r, dotab->write_r(&r, handle->file_struct, (const char*)buf, len));
+}
+
+off_t dvmHostLseek(int fd, off_t offset, int whence)
+{
+	struct _reent r;
+	const devoptab_t* dotab;
+	DvmHostHandle* handle = _dvmHostFdBegin(fd, &r, &dotab);
+	if (!handle) {
+		return -1;
+	} else if (!dotab->seek_r) {
+		return _dvmHostNoSys();
+	}
+
+	return _dvmHostResult(&r, dotab->seek_r(&r, handle->file_struct, offset, whence));
+}
+
+int dvmHostFstat(int fd, struct stat* st)
+{
+	struct _reent r;
+	const devoptab_t* dotab;
+	DvmHostHandle* handle = _dvmHostFdBegin(fd, &r, &dotab);
+	if (!handle) {
+		return -1;
+	} else if (!dotab->fstat_r) {
+		return _dvmHostNoSys();
+	}
+
+	return _dvmHostResult(&r, dotab->fstat_r(&r, handle->file_struct, st));
+}
+
+int dvmHostFtruncate(int fd, off_t len)
+{
+	struct _reent r;
+	const devoptab_t* dotab;
+	DvmHostHandle* handle = _dvmHostFdBegin(fd, &r, &dotab);
+	if (!handle) {
+		return -1;
+	} else if (!dotab->ftruncate_r) {
+		return _dvmHostNoSys();
+	}
+
+	return _dvmHostResult(&r, dotab->ftruncate_r(&r, handle->file_struct, len));
+}
+
+int dvmHostFsync(int fd)
+{
+	struct _reent r;
+	const devoptab_t* dotab;
+	DvmHostHandle* handle = _dvmHostFdBegin(fd, &r, &dotab);
+	if (!handle) {
+		return -1;
+	} else if (!dotab->fsync_r) {
+		return _dvmHostNoSys();
+	}
+
+	return _dvmHostResult(&r, dotab->fsync_r(&r, handle->file_struct));
+}
+
+long dvmHostFpathconf(int fd, int name)
+{
+	struct _reent r;
+	const devoptab_t* dotab;
+	DvmHostHandle* handle = _dvmHostFdBegin(fd, &r, &dotab);
+	if (!handle) {
+		return -1;
+	} else if (!dotab->fpathconf_r) {
+		return _dvmHostNoSys();
+	}
+
+	return _dvmHostResult(&r, dotab->fpathconf_r(&r, handle->file_struct, name));
+}
+
+int dvmHostStat(const char* path, struct stat* st)
+{
+	char buf[PATH_MAX];
+	struct _reent r;
+	const devoptab_t* dotab;
+	path = _dvmHostPathBegin(path, buf, &r, &dotab);
+	if (!path) {
+		return -1;
+	} else if (!dotab->stat_r) {
+		return _dvmHostNoSys();
+	}
+
+	return _dvmHostResult(&r, dotab->stat_r(&r, path, st));
+}
+
+int dvmHostUnlink(const char* path)
+{
+	char buf[PATH_MAX];
+	struct _reent r;
+	const devoptab_t* dotab;
+	path = _dvmHostPathBegin(path, buf, &r, &dotab);
+	if (!path) {
+		return -1;
+	} else if (!dotab->unlink_r) {
+		return _dvmHostNoSys();
+	}
+
+	return _dvmHostResult(&r, dotab->unlink_r(&r, path));
+}
+
+int dvmHostRmdir(const char* path)
+{
+	char buf[PATH_MAX];
+	struct _reent r;
+	const devoptab_t* dotab;
+	path = _dvmHostPathBegin(path, buf, &r, &dotab);
+	if (!path) {
+		return -1;
+	} else if (!dotab->rmdir_r) {
+		return _dvmHostNoSys();
+	}
+
+	return _dvmHostResult(&r, dotab->rmdir_r(&r, path));
+}
+
+int dvmHostMkdir(const char* path, int mode)
+{
+	char buf[PATH_MAX];
+	struct _reent r;
+	const devoptab_t* dotab;
+	path = _dvmHostPathBegin(path, buf, &r, &dotab);
+	if (!path) {
+		return -1;
+	} else if (!dotab->mkdir_r) {
+		return _dvmHostNoSys();
+	}
+
+	return _dvmHostResult(&r, dotab->mkdir_r(&r, path, mode));
+}
+
+int dvmHostRename(const char* old_path, const char* new_path)
+{
+	char old_buf[PATH_MAX], new_buf[PATH_MAX];
+	struct _reent r;
+	const devoptab_t* dotab;
+	const devoptab_t* new_dotab;
+	old_path = _dvmHostPathBegin(old_path, old_buf, &r, &dotab);
+	new_path = old_path ? _dvmHostPathBegin(new_path, new_buf, &r, &new_dotab) : NULL;
+	if (!new_path) {
+		return -1;
+	} else if (dotab != new_dotab) {
+		errno = EXDEV;
+		return -1;
+	} else if (!dotab->rename_r) {
+		return _dvmHostNoSys();
+	}
+
+	return _dvmHostResult(&r, dotab->rename_r(&r, old_path, new_path));
+}
+
+int dvmHostChdir(const char* path)
+{
+	char buf[PATH_MAX];
+	struct _reent r;
+	const devoptab_t* dotab;
+	path = _dvmHostPathBegin(path, buf, &r, &dotab);
+	if (!path) {
+		return -1;
+	} else if (!dotab->chdir_r) {
+		return _dvmHostNoSys();
+	} else if (dotab->chdir_r(&r, path) < 0) {
+		return _dvmHostResult(&r, -1);
+	}
+
+	// Remember the new working directory (always ending in a slash)
+	pthread_mutex_lock(&s_dvmHostLock);
+	size_t len = strnlen(path, PATH_MAX-2);
+	memmove(s_dvmHostCwd, path, len);
+	if (!len || s_dvmHostCwd[len-1] != '/') {
+		s_dvmHostCwd[len++] = '/';
+	}
+	s_dvmHostCwd[len] = 0;
+	setDefaultDevice(FindDevice(s_dvmHostCwd));
+	pthread_mutex_unlock(&s_dvmHostLock);
+
+	return 0;
+}
+
+int dvmHostStatvfs(const char* path, struct statvfs* buf)
+{
+	char pathbuf[PATH_MAX];
+	struct _reent r;
+	const devoptab_t* dotab;
+	path = _dvmHostPathBegin(path, pathbuf, &r, &dotab);
+	if (!path) {
+		return -1;
+	} else if (!dotab->statvfs_r) {
+		return _dvmHostNoSys();
+	}
+
+	return _dvmHostResult(&r, dotab->statvfs_r(&r, path, buf));
+}
+
+DIR_ITER* dvmHostDirOpen(const char* path)
+{
+	char buf[PATH_MAX];
+	struct _reent r;
+	const devoptab_t* dotab;
+	path = _dvmHostPathBegin(path, buf, &r, &dotab);
+	if (!path) {
+		return NULL;
+	} else if (!dotab->diropen_r) {
+		_dvmHostNoSys();
+		return NULL;
+	}
+
+	DIR_ITER* it = (DIR_ITER*)calloc(1, sizeof(DIR_ITER) + dotab->dirStateSize + 2*sizeof(void*));
+	if (!it) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	it->device = (void*)dotab;
+	it->dirStruct = (void*)(((uintptr_t)&it[1] + 2*sizeof(void*)-1) & ~(uintptr_t)(2*sizeof(void*)-1));
+
+	if (!dotab->diropen_r(&r, it, path)) {
+		free(it);
+		errno = r._errno;
+		return NULL;
+	}
+
+	return it;
+}
+
+static const devoptab_t* _dvmHostDirDevice(DIR_ITER* it)
+{
+	return (const devoptab_t*)it->device;
+}
+
+int dvmHostDirReset(DIR_ITER* it)
+{
+	const devoptab_t* dotab = _dvmHostDirDevice(it);
+	struct _reent r = { 0, dotab->deviceData };
+	return _dvmHostResult(&r, dotab->dirreset_r(&r, it));
+}
+
+int dvmHostDirNext(DIR_ITER* it, char* filename, struct stat* st)
+{
+	const devoptab_t* dotab = _dvmHostDirDevice(it);
+	struct _reent r = { 0, dotab->deviceData };
+	return _dvmHostResult(&r, dotab->dirnext_r(&r, it, filename, st));
+}
+
+int dvmHostDirClose(DIR_ITER* it)
+{
+	const devoptab_t* dotab = _dvmHostDirDevice(it);
+	struct _reent r = { 0, dotab->deviceData };
+	int ret = _dvmHostResult(&r, dotab->dirclose_r(&r, it));
+	free(it);
+	return ret;
+}
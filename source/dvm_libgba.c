@@ -3,6 +3,10 @@
 
 __attribute__((weak)) unsigned g_dvmDefaultCachePages = 2;
 __attribute__((weak)) unsigned g_dvmDefaultSectorsPerPage = 8;
+__attribute__((weak)) unsigned g_dvmDefaultCacheFlags = 0;
+__attribute__((weak)) unsigned g_dvmLazyMount = 0;
+__attribute__((weak)) unsigned g_dvmDentryCacheSize = 0;
+__attribute__((weak)) unsigned g_dvmVolumeStats = 0;
 
 bool dvmInit(bool set_app_cwdir, unsigned cache_pages, unsigned sectors_per_page)
 {
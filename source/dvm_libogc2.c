@@ -5,11 +5,17 @@
 #include <unistd.h>
 #include <ogc/aram.h>
 #include <ogc/dvd.h>
+#include <ogc/lwp.h>
 #include <ogc/system.h>
 #include <ogc/usbstorage.h>
 #include <sdcard/gcsd.h>
 #include <sdcard/wiisd_io.h>
 #include <dvm.h>
+#include "dvm_probe.h"
+#include "dvm_thread.h"
+
+#define THREAD_STACK_SZ (16*1024)
+#define THREAD_PRIO     64
 
 extern const DvmFsDriver g_vfatFsDriver __attribute__((weak));
 extern const DvmFsDriver g_exfatFsDriver __attribute__((weak));
@@ -17,6 +23,12 @@ extern const DvmFsDriver g_ext2FsDriver __attribute__((weak));
 
 __attribute__((weak)) unsigned g_dvmDefaultCachePages = 32;
 __attribute__((weak)) unsigned g_dvmDefaultSectorsPerPage = 8;
+__attribute__((weak)) unsigned g_dvmDefaultCacheFlags = 0;
+__attribute__((weak)) unsigned g_dvmLazyMount = 0;
+__attribute__((weak)) unsigned g_dvmParallelProbe = 0;
+__attribute__((weak)) unsigned g_dvmProbeTimeoutMs = 10000;
+__attribute__((weak)) unsigned g_dvmDentryCacheSize = 0;
+__attribute__((weak)) unsigned g_dvmVolumeStats = 0;
 
 void _dvmSetAppWorkingDir(const char* argv0);
 
@@ -25,6 +37,60 @@ bool _dvmIsAlignedAccess(const void* ptr, bool is_write)
 	return SYS_IsDMAAddress(ptr, LIBDVM_BUFFER_ALIGN);
 }
 
+typedef struct DvmThread {
+	lwp_t handle;
+	void (*entry)(void* arg);
+	void* arg;
+	unsigned refs; // Freed by whoever of the thread and its finisher is last
+} DvmThread;
+
+static void* _dvmThreadEntry(void* arg)
+{
+	DvmThread* t = (DvmThread*)arg;
+	t->entry(t->arg);
+
+	if (!__atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL)) {
+		free(t);
+	}
+
+	return NULL;
+}
+
+void* _dvmThreadStart(void (*entry)(void* arg), void* arg)
+{
+	DvmThread* t = (DvmThread*)malloc(sizeof(DvmThread));
+	if (t) {
+		t->entry = entry;
+		t->arg = arg;
+		t->refs = 2;
+		if (LWP_CreateThread(&t->handle, _dvmThreadEntry, t, NULL, THREAD_STACK_SZ, THREAD_PRIO) < 0) {
+			free(t);
+			t = NULL;
+		}
+	}
+
+	return t;
+}
+
+void _dvmThreadFinish(void* thread, bool join)
+{
+	DvmThread* t = (DvmThread*)thread;
+
+	// Abandoned threads are left to run to completion
+	if (join) {
+		LWP_JoinThread(t->handle, NULL);
+	}
+
+	if (!__atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL)) {
+		free(t);
+	}
+}
+
+void _dvmThreadSleep(void)
+{
+	usleep(1000);
+}
+
 static s32 _dvmOnReset(s32 final)
 {
 	if (!final) {
@@ -65,30 +131,35 @@ bool dvmInit(bool set_app_cwdir, unsigned cache_pages, unsigned sectors_per_page
 	// Register ext2/ext3/ext4 driver
 	dvmRegisterFsDriver(&g_ext2FsDriver);
 
+	DvmProbeJob jobs[] = {
 #if defined(__wii__)
-	// Try mounting SD card
-	num_mounted += dvmProbeMountDiscIface("sd", sd, cache_pages, sectors_per_page);
+		// SD card
+		{ .name = "sd",    .open = _dvmProbeOpenIface, .arg = sd,    .cache_pages = cache_pages, .sectors_per_page = sectors_per_page },
 
-	// Try mounting the first found USB drive
-	num_mounted += dvmProbeMountDiscIface("usb", usb, cache_pages, sectors_per_page);
+		// First found USB drive
+		{ .name = "usb",   .open = _dvmProbeOpenIface, .arg = usb,   .cache_pages = cache_pages, .sectors_per_page = sectors_per_page },
 #endif
 
-	// Try mounting Memory Slot A / Serial Port 1
-	num_mounted += dvmProbeMountDiscIface("carda", carda, cache_pages, sectors_per_page);
+		// Memory Slot A / Serial Port 1
+		{ .name = "carda", .open = _dvmProbeOpenIface, .arg = carda, .cache_pages = cache_pages, .sectors_per_page = sectors_per_page },
 
-	// Try mounting Memory Slot B
-	num_mounted += dvmProbeMountDiscIface("cardb", cardb, cache_pages, sectors_per_page);
+		// Memory Slot B
+		{ .name = "cardb", .open = _dvmProbeOpenIface, .arg = cardb, .cache_pages = cache_pages, .sectors_per_page = sectors_per_page },
 
 #if defined(__gamecube__)
-	// Try mounting Serial Port 2
-	num_mounted += dvmProbeMountDiscIface("sd", sd, cache_pages, sectors_per_page);
+		// Serial Port 2
+		{ .name = "sd",    .open = _dvmProbeOpenIface, .arg = sd,    .cache_pages = cache_pages, .sectors_per_page = sectors_per_page },
 
-	// Try mounting GC Loader
-	num_mounted += dvmProbeMountDiscIface("dvd", dvd, cache_pages, sectors_per_page);
+		// GC Loader
+		{ .name = "dvd",   .open = _dvmProbeOpenIface, .arg = dvd,   .cache_pages = cache_pages, .sectors_per_page = sectors_per_page },
 
-	// Try mounting Memory Expansion Pak
-	num_mounted += dvmProbeMountDiscIface("ram", ram, cache_pages, sectors_per_page);
+		// Memory Expansion Pak
+		{ .name = "ram",   .open = _dvmProbeOpenIface, .arg = ram,   .cache_pages = cache_pages, .sectors_per_page = sectors_per_page },
 #endif
+	};
+
+	// Try mounting all devices, optionally starting them up in parallel
+	num_mounted += _dvmProbeMountJobs(jobs, sizeof(jobs)/sizeof(jobs[0]), g_dvmParallelProbe != 0, g_dvmProbeTimeoutMs);
 
 	// Set current working directory if needed
 	if (set_app_cwdir && num_mounted != 0) {
@@ -112,9 +183,8 @@ bool dvmInit(bool set_app_cwdir, unsigned cache_pages, unsigned sectors_per_page
 
 void dvmDeinit(void)
 {
-	for (int fd = 3; fd < 1024; fd ++) {
-		fsync(fd);
-	}
+	// Only files and volumes with unwritten changes are written back
+	dvmSyncAll();
 
 	for (unsigned i = 3; i < STD_MAX; i ++) {
 		const devoptab_t* dotab = devoptab_list[i];
@@ -0,0 +1,336 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/lock.h>
+#ifndef LIBDVM_HOSTED
+#include <sys/reent.h>
+#endif
+#include <dvm.h>
+#include "dvm_debug.h"
+
+// Files with more runs than this are considered too fragmented for passthrough
+#define MAX_EXTENTS 4096U
+
+unsigned _dvmGetFileExtents(const devoptab_t* dotab, void* fd, DvmFileExtent* out, unsigned max_extents, DvmDisc** out_disc);
+
+typedef struct DvmDiscLoopExtent {
+	sec_t file_sector;
+	sec_t disc_sector;
+} DvmDiscLoopExtent;
+
+typedef struct DvmDiscLoop {
+	DvmDisc base;
+
+	_LOCK_T lock;
+	const devoptab_t* dotab;
+#ifdef LIBDVM_HOSTED
+	struct _reent reent;
+#endif
+
+	// Passthrough: runs of file sectors on the disc holding the file (the last
+	// entry only marks the end of the file). NULL target means file I/O.
+	DvmDisc* target;
+	unsigned num_extents;
+	DvmDiscLoopExtent* extents;
+
+	alignas(2*sizeof(void*)) uint8_t file[];
+} DvmDiscLoop;
+
+static struct _reent* _dvmDiscLoopReent(DvmDiscLoop* self)
+{
+#ifdef LIBDVM_HOSTED
+	struct _reent* r = &self->reent;
+#else
+	struct _reent* r = _REENT;
+#endif
+	r->deviceData = self->dotab->deviceData;
+	return r;
+}
+
+static unsigned _dvmDiscLoopFindExtent(DvmDiscLoop* self, sec_t sector)
+{
+	unsigned lo = 0, hi = self->num_extents;
+	while ((hi - lo) > 1) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (self->extents[mid].file_sector <= sector) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+static bool _dvmDiscLoopExtentIo(DvmDiscLoop* self, uint8_t* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial, bool is_write)
+{
+	DvmDisc* target = self->target;
+	unsigned i = _dvmDiscLoopFindExtent(self, first_sector);
+
+	bool ret = true;
+	while (ret && num_sectors) {
+		const DvmDiscLoopExtent* e = &self->extents[i++];
+		sec_t max_cur_sectors = e[1].file_sector - first_sector;
+		sec_t cur_sectors = num_sectors < max_cur_sectors ? num_sectors : max_cur_sectors;
+		sec_t sector = e->disc_sector + (first_sector - e->file_sector);
+
+		if (is_write) {
+			ret = target->vt->write_sectors(target, buffer, sector, cur_sectors, is_partial);
+		} else {
+			ret = target->vt->read_sectors(target, buffer, sector, cur_sectors, is_partial);
+		}
+
+		buffer += cur_sectors*self->base.sector_sz;
+		first_sector += cur_sectors;
+		num_sectors -= cur_sectors;
+	}
+
+	return ret;
+}
+
+static bool _dvmDiscLoopFileIo(DvmDiscLoop* self, uint8_t* buffer, sec_t first_sector, sec_t num_sectors, bool is_write)
+{
+	struct _reent* r = _dvmDiscLoopReent(self);
+	off_t pos = (off_t)first_sector*self->base.sector_sz;
+	size_t len = num_sectors*self->base.sector_sz;
+
+	if (self->dotab->seek_r(r, self->file, pos, SEEK_SET) != pos) {
+		return false;
+	}
+
+	while (len) {
+		ssize_t cur;
+		if (is_write) {
+			cur = self->dotab->write_r(r, self->file, (const char*)buffer, len);
+		} else {
+			cur = self->dotab->read_r(r, self->file, (char*)buffer, len);
+		}
+
+		if (cur <= 0) {
+			return false;
+		}
+
+		buffer += cur;
+		len -= cur;
+	}
+
+	return true;
+}
+
+static bool _dvmDiscLoopReadWrite(DvmDiscLoop* self, uint8_t* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial, bool is_write)
+{
+	// Early fail on out of bounds access
+	if (first_sector >= self->base.num_sectors || num_sectors > self->base.num_sectors - first_sector) {
+		return false;
+	}
+
+	__lock_acquire(self->lock);
+	dvmDebug("loop%s(%p,0x%lx,%lu)\n", is_write ? "Write" : "Read", buffer, first_sector, num_sectors);
+
+	bool ret;
+	if (self->target) {
+		ret = _dvmDiscLoopExtentIo(self, buffer, first_sector, num_sectors, is_partial, is_write);
+	} else {
+		ret = _dvmDiscLoopFileIo(self, buffer, first_sector, num_sectors, is_write);
+	}
+
+	__lock_release(self->lock);
+	return ret;
+}
+
+static bool _dvmDiscLoopReadSectors(DvmDisc* self_, void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	DvmDiscLoop* self = (DvmDiscLoop*)self_;
+	return _dvmDiscLoopReadWrite(self, (uint8_t*)buffer, first_sector, num_sectors, is_partial, false);
+}
+
+static bool _dvmDiscLoopWriteSectors(DvmDisc* self_, const void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	DvmDiscLoop* self = (DvmDiscLoop*)self_;
+	return _dvmDiscLoopReadWrite(self, (uint8_t*)buffer, first_sector, num_sectors, is_partial, true);
+}
+
+static bool _dvmDiscLoopFlush(DvmDisc* self_)
+{
+	DvmDiscLoop* self = (DvmDiscLoop*)self_;
+	__lock_acquire(self->lock);
+
+	bool ret;
+	if (self->target) {
+		ret = dvmDiscFlush(self->target);
+	} else {
+		ret = !self->dotab->fsync_r || self->dotab->fsync_r(_dvmDiscLoopReent(self), self->file) == 0;
+	}
+
+	__lock_release(self->lock);
+	return ret;
+}
+
+static bool _dvmDiscLoopTrim(DvmDisc* self_, sec_t first_sector, sec_t num_sectors)
+{
+	DvmDiscLoop* self = (DvmDiscLoop*)self_;
+
+	// Early fail on out of bounds access
+	if (first_sector >= self->base.num_sectors || num_sectors > self->base.num_sectors - first_sector) {
+		return false;
+	}
+
+	// The file keeps its allocation: only passthrough can discard the sectors
+	if (!self->target) {
+		return true;
+	}
+
+	bool ret = true;
+	unsigned i = _dvmDiscLoopFindExtent(self, first_sector);
+	while (num_sectors) {
+		const DvmDiscLoopExtent* e = &self->extents[i++];
+		sec_t max_cur_sectors = e[1].file_sector - first_sector;
+		sec_t cur_sectors = num_sectors < max_cur_sectors ? num_sectors : max_cur_sectors;
+
+		ret &= dvmDiscTrim(self->target, e->disc_sector + (first_sector - e->file_sector), cur_sectors);
+		first_sector += cur_sectors;
+		num_sectors -= cur_sectors;
+	}
+
+	return ret;
+}
+
+static void _dvmDiscLoopDestroy(DvmDisc* self_)
+{
+	DvmDiscLoop* self = (DvmDiscLoop*)self_;
+
+	_dvmDiscLoopFlush(self_);
+	self->dotab->close_r(_dvmDiscLoopReent(self), self->file);
+	if (self->target) {
+		dvmDiscRemoveUser(self->target);
+	}
+
+	__lock_close(self->lock);
+	free(self->extents);
+	free(self);
+}
+
+static const DvmDiscIface s_dvmDiscLoopIface = {
+	.destroy       = _dvmDiscLoopDestroy,
+	.read_sectors  = _dvmDiscLoopReadSectors,
+	.write_sectors = _dvmDiscLoopWriteSectors,
+	.flush         = _dvmDiscLoopFlush,
+	.trim          = _dvmDiscLoopTrim,
+};
+
+static void _dvmDiscLoopResolve(DvmDiscLoop* self, unsigned sector_sz)
+{
+	DvmFileExtent* runs = (DvmFileExtent*)malloc(MAX_EXTENTS*sizeof(DvmFileExtent));
+	if (!runs) {
+		return;
+	}
+
+	DvmDisc* target = NULL;
+	unsigned num_runs = _dvmGetFileExtents(self->dotab, self->file, runs, MAX_EXTENTS, &target);
+	if (!num_runs || num_runs > MAX_EXTENTS || !target || (sector_sz && sector_sz != target->sector_sz)) {
+		dvmDebug("Loop: %u runs, using file I/O\n", num_runs);
+		free(runs);
+		return;
+	}
+
+	self->extents = (DvmDiscLoopExtent*)malloc((num_runs+1)*sizeof(DvmDiscLoopExtent));
+	if (!self->extents) {
+		free(runs);
+		return;
+	}
+
+	sec_t file_sector = 0;
+	for (unsigned i = 0; i < num_runs; i ++) {
+		self->extents[i].file_sector = file_sector;
+		self->extents[i].disc_sector = runs[i].sector;
+		file_sector += runs[i].num_sectors;
+	}
+
+	self->extents[num_runs].file_sector = file_sector;
+	self->extents[num_runs].disc_sector = 0;
+	self->num_extents = num_runs;
+	self->target = target;
+	dvmDiscAddUser(target);
+
+	dvmDebug("Loop: %u runs on disc %p\n", num_runs, target);
+	free(runs);
+}
+
+DvmDisc* dvmDiscLoopCreate(const char* path, unsigned flags, unsigned sector_sz)
+{
+	// Parameter validation
+	if (!path || (sector_sz && (sector_sz < 512U || (sector_sz & (sector_sz-1)) || sector_sz > UINT16_MAX))) {
+		return NULL;
+	}
+
+	const devoptab_t* dotab = GetDeviceOpTab(path);
+	if (!dotab || !dotab->open_r || !dotab->close_r || !dotab->read_r || !dotab->seek_r) {
+		return NULL;
+	}
+
+	DvmDiscLoop* disc = (DvmDiscLoop*)calloc(1, sizeof(DvmDiscLoop) + dotab->structSize);
+	if (!disc) {
+		return NULL;
+	}
+
+	__lock_init(disc->lock);
+	disc->dotab = dotab;
+	struct _reent* r = _dvmDiscLoopReent(disc);
+	int oflags = (flags & DVM_IMAGE_READONLY) ? O_RDONLY : O_RDWR;
+	if (dotab->open_r(r, disc->file, path, oflags, 0) != 0) {
+		dvmDebug("Cannot open loop file %s\n", path);
+		__lock_close(disc->lock);
+		free(disc);
+		return NULL;
+	}
+
+	// Resolve the physical layout once, falling back to file I/O if unknown
+	_dvmDiscLoopResolve(disc, sector_sz);
+	if (!sector_sz) {
+		sector_sz = disc->target ? disc->target->sector_sz : 512U;
+	}
+
+	off_t size = dotab->seek_r(r, disc->file, 0, SEEK_END);
+	if (size < (off_t)sector_sz || (disc->target && disc->extents[disc->num_extents].file_sector < (sec_t)(size / sector_sz))) {
+		_dvmDiscLoopDestroy(&disc->base);
+		return NULL;
+	}
+
+	disc->base.vt = &s_dvmDiscLoopIface;
+	disc->base.io_type = ('L'<<24) | ('O'<<16) | ('O'<<8) | 'P';
+	disc->base.features = FEATURE_MEDIUM_CANREAD;
+	if (!(flags & DVM_IMAGE_READONLY)) {
+		disc->base.features |= FEATURE_MEDIUM_CANWRITE;
+	}
+	disc->base.num_sectors = size / sector_sz;
+	disc->base.sector_sz = sector_sz;
+	disc->base.block_sz = 0;
+	if (disc->target) {
+		disc->base.caps = disc->target->caps;
+	} else {
+		disc->base.caps.align = 1;
+		disc->base.caps.queue_depth = 1;
+	}
+
+	return &disc->base;
+}
+
+unsigned dvmProbeMountLoop(const char* basename, const char* path, unsigned flags)
+{
+	unsigned num_mounted = 0;
+	DvmDisc* disc = dvmDiscLoopCreate(path, flags, 0);
+
+	if (disc) {
+		num_mounted = dvmProbeMountDisc(basename, disc);
+	}
+
+	if (!num_mounted && disc) {
+		disc->vt->destroy(disc);
+	}
+
+	return num_mounted;
+}
@@ -0,0 +1,321 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/lock.h>
+#include <dvm.h>
+#include "dvm_debug.h"
+
+// Each bitmap leaf tracks 32768 sectors in 4 KiB
+#define LEAF_SHIFT   15
+#define LEAF_SECTORS ((sec_t)1 << LEAF_SHIFT)
+#define LEAF_WORDS   (LEAF_SECTORS / 32)
+
+#define COPY_SECTORS 64U
+
+typedef struct DvmDiscOverlay {
+	DvmDisc base;
+
+	_LOCK_T lock;
+	DvmDisc* lower;
+	DvmDisc* delta;
+	size_t num_leaves;
+
+	uint32_t* leaves[];
+} DvmDiscOverlay;
+
+static bool _dvmDiscOverlayTest(DvmDiscOverlay* self, sec_t sector)
+{
+	const uint32_t* leaf = self->leaves[sector >> LEAF_SHIFT];
+	unsigned bit = sector & (LEAF_SECTORS-1);
+	return leaf && ((leaf[bit / 32] >> (bit % 32)) & 1);
+}
+
+static bool _dvmDiscOverlaySetRange(DvmDiscOverlay* self, sec_t first_sector, sec_t num_sectors)
+{
+	for (sec_t sector = first_sector; sector < first_sector + num_sectors; sector ++) {
+		uint32_t** leaf = &self->leaves[sector >> LEAF_SHIFT];
+		if (!*leaf) {
+			*leaf = (uint32_t*)calloc(LEAF_WORDS, sizeof(uint32_t));
+			if (!*leaf) {
+				return false;
+			}
+		}
+
+		unsigned bit = sector & (LEAF_SECTORS-1);
+		(*leaf)[bit / 32] |= 1U << (bit % 32);
+	}
+
+	return true;
+}
+
+static void _dvmDiscOverlayClearRange(DvmDiscOverlay* self, sec_t first_sector, sec_t num_sectors)
+{
+	for (sec_t sector = first_sector; sector < first_sector + num_sectors; sector ++) {
+		uint32_t* leaf = self->leaves[sector >> LEAF_SHIFT];
+		if (leaf) {
+			unsigned bit = sector & (LEAF_SECTORS-1);
+			leaf[bit / 32] &= ~(1U << (bit % 32));
+		}
+	}
+}
+
+static sec_t _dvmDiscOverlayRun(DvmDiscOverlay* self, sec_t first_sector, sec_t num_sectors, bool* out_in_delta)
+{
+	// Count the sectors that share the location (lower or delta) of the first one
+	const bool in_delta = _dvmDiscOverlayTest(self, first_sector);
+	const uint32_t same_word = in_delta ? ~0U : 0;
+
+	sec_t n = 0;
+	while (n < num_sectors) {
+		sec_t sector = first_sector + n;
+		const uint32_t* leaf = self->leaves[sector >> LEAF_SHIFT];
+		unsigned bit = sector & (LEAF_SECTORS-1);
+
+		if (!leaf) {
+			// Missing leaves have no sectors in the delta
+			if (in_delta) {
+				break;
+			}
+			n += LEAF_SECTORS - bit;
+		} else if ((bit % 32) == 0 && leaf[bit / 32] == same_word) {
+			// Skip over whole words
+			n += 32;
+		} else if (((leaf[bit / 32] >> (bit % 32)) & 1) == in_delta) {
+			n ++;
+		} else {
+			break;
+		}
+	}
+
+	*out_in_delta = in_delta;
+	return n < num_sectors ? n : num_sectors;
+}
+
+static bool _dvmDiscOverlayFlush(DvmDisc* self_)
+{
+	DvmDiscOverlay* self = (DvmDiscOverlay*)self_;
+	__lock_acquire(self->lock);
+	bool ret = dvmDiscFlush(self->delta);
+	__lock_release(self->lock);
+	return ret;
+}
+
+static void _dvmDiscOverlayDestroy(DvmDisc* self_)
+{
+	DvmDiscOverlay* self = (DvmDiscOverlay*)self_;
+
+	_dvmDiscOverlayFlush(self_);
+	dvmDiscRemoveUser(self->delta);
+	dvmDiscRemoveUser(self->lower);
+	__lock_close(self->lock);
+
+	for (size_t i = 0; i < self->num_leaves; i ++) {
+		free(self->leaves[i]);
+	}
+
+	free(self);
+}
+
+static bool _dvmDiscOverlayReadSectors(DvmDisc* self_, void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	DvmDiscOverlay* self = (DvmDiscOverlay*)self_;
+
+	// Early fail on out of bounds access
+	if (first_sector >= self->base.num_sectors || num_sectors > self->base.num_sectors - first_sector) {
+		return false;
+	}
+
+	__lock_acquire(self->lock);
+	dvmDebug("overlayRead(%p,0x%lx,%lu)\n", buffer, first_sector, num_sectors);
+
+	bool ret = true;
+	uint8_t* buf = (uint8_t*)buffer;
+	while (ret && num_sectors) {
+		bool in_delta;
+		sec_t cur_sectors = _dvmDiscOverlayRun(self, first_sector, num_sectors, &in_delta);
+
+		// Split reads keep the caller's partial hint
+		DvmDisc* disc = in_delta ? self->delta : self->lower;
+		ret = disc->vt->read_sectors(disc, buf, first_sector, cur_sectors, is_partial);
+
+		buf += cur_sectors*self->base.sector_sz;
+		first_sector += cur_sectors;
+		num_sectors -= cur_sectors;
+	}
+
+	__lock_release(self->lock);
+	return ret;
+}
+
+static bool _dvmDiscOverlayWriteSectors(DvmDisc* self_, const void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	DvmDiscOverlay* self = (DvmDiscOverlay*)self_;
+
+	// Early fail on out of bounds access
+	if (first_sector >= self->base.num_sectors || num_sectors > self->base.num_sectors - first_sector) {
+		return false;
+	}
+
+	__lock_acquire(self->lock);
+	dvmDebug("overlayWrite(%p,0x%lx,%lu)\n", buffer, first_sector, num_sectors);
+
+	// Sectors only become visible in the delta once they have been written there
+	bool ret = self->delta->vt->write_sectors(self->delta, buffer, first_sector, num_sectors, is_partial);
+	if (ret) {
+		ret = _dvmDiscOverlaySetRange(self, first_sector, num_sectors);
+	}
+
+	__lock_release(self->lock);
+	return ret;
+}
+
+static bool _dvmDiscOverlayTrim(DvmDisc* self_, sec_t first_sector, sec_t num_sectors)
+{
+	DvmDiscOverlay* self = (DvmDiscOverlay*)self_;
+
+	// Early fail on out of bounds access
+	if (first_sector >= self->base.num_sectors || num_sectors > self->base.num_sectors - first_sector) {
+		return false;
+	}
+
+	// Discarded sectors fall back to the lower disc and free their delta storage
+	__lock_acquire(self->lock);
+	_dvmDiscOverlayClearRange(self, first_sector, num_sectors);
+	bool ret = dvmDiscTrim(self->delta, first_sector, num_sectors);
+	__lock_release(self->lock);
+	return ret;
+}
+
+static const DvmDiscIface s_dvmDiscOverlayIface = {
+	.destroy       = _dvmDiscOverlayDestroy,
+	.read_sectors  = _dvmDiscOverlayReadSectors,
+	.write_sectors = _dvmDiscOverlayWriteSectors,
+	.flush         = _dvmDiscOverlayFlush,
+	.trim          = _dvmDiscOverlayTrim,
+};
+
+DvmDisc* dvmDiscOverlayCreate(DvmDisc* lower_disc, DvmDisc* delta_disc)
+{
+	// Parameter validation (the lower disc must have a known size)
+	if (!lower_disc || ~lower_disc->num_sectors == 0 || !(lower_disc->features & FEATURE_MEDIUM_CANREAD)) {
+		return NULL;
+	}
+
+	// Use a sparse RAM disc as the delta store by default
+	DvmDisc* own_delta = NULL;
+	if (!delta_disc) {
+		delta_disc = own_delta = dvmDiscRamCreate(lower_disc->num_sectors, lower_disc->sector_sz, 0);
+		if (!delta_disc) {
+			return NULL;
+		}
+	}
+
+	// The delta store mirrors the geometry of the lower disc
+	if (delta_disc->sector_sz != lower_disc->sector_sz || delta_disc->num_sectors < lower_disc->num_sectors ||
+		(delta_disc->features & (FEATURE_MEDIUM_CANREAD|FEATURE_MEDIUM_CANWRITE)) != (FEATURE_MEDIUM_CANREAD|FEATURE_MEDIUM_CANWRITE)) {
+		return NULL;
+	}
+
+	size_t num_leaves = ((lower_disc->num_sectors - 1) >> LEAF_SHIFT) + 1;
+	DvmDiscOverlay* disc = (DvmDiscOverlay*)calloc(1, sizeof(DvmDiscOverlay) + num_leaves*sizeof(uint32_t*));
+	if (!disc) {
+		if (own_delta) {
+			own_delta->vt->destroy(own_delta);
+		}
+		return NULL;
+	}
+
+	disc->base.vt = &s_dvmDiscOverlayIface;
+	disc->base.io_type = lower_disc->io_type;
+	disc->base.features = FEATURE_MEDIUM_CANREAD | FEATURE_MEDIUM_CANWRITE;
+	disc->base.num_sectors = lower_disc->num_sectors;
+	disc->base.sector_sz = lower_disc->sector_sz;
+	disc->base.block_sz = lower_disc->block_sz;
+	disc->base.caps = lower_disc->caps;
+	dvmDiscCapsMerge(&disc->base.caps, &delta_disc->caps);
+	__lock_init(disc->lock);
+	dvmDiscAddUser(lower_disc);
+	dvmDiscAddUser(delta_disc);
+	disc->lower = lower_disc;
+	disc->delta = delta_disc;
+	disc->num_leaves = num_leaves;
+
+	return &disc->base;
+}
+
+static bool _dvmDiscOverlayClear(DvmDiscOverlay* self)
+{
+	for (size_t i = 0; i < self->num_leaves; i ++) {
+		if (self->leaves[i]) {
+			free(self->leaves[i]);
+			self->leaves[i] = NULL;
+		}
+	}
+
+	return dvmDiscTrim(self->delta, 0, self->base.num_sectors);
+}
+
+bool dvmDiscOverlayCommit(DvmDisc* disc)
+{
+	if (!disc || disc->vt != &s_dvmDiscOverlayIface) {
+		return false;
+	}
+
+	DvmDiscOverlay* self = (DvmDiscOverlay*)disc;
+	if (!(self->lower->features & FEATURE_MEDIUM_CANWRITE)) {
+		return false;
+	}
+
+	void* buf = aligned_alloc(LIBDVM_BUFFER_ALIGN, COPY_SECTORS*self->base.sector_sz);
+	if (!buf) {
+		return false;
+	}
+
+	__lock_acquire(self->lock);
+	dvmDebug("overlayCommit()\n");
+
+	// Copy every written sector down to the lower disc
+	bool ret = true;
+	sec_t sector = 0;
+	while (ret && sector < self->base.num_sectors) {
+		bool in_delta;
+		sec_t cur_sectors = _dvmDiscOverlayRun(self, sector, self->base.num_sectors - sector, &in_delta);
+
+		for (sec_t pos = sector; ret && in_delta && pos < sector + cur_sectors;) {
+			sec_t remaining = sector + cur_sectors - pos;
+			sec_t copy_sectors = remaining < COPY_SECTORS ? remaining : COPY_SECTORS;
+			ret = dvmDiscReadSectors(self->delta, buf, pos, copy_sectors) && dvmDiscWriteSectors(self->lower, buf, pos, copy_sectors);
+			pos += copy_sectors;
+		}
+
+		sector += cur_sectors;
+	}
+
+	// Only drop the delta once the lower disc holds its contents
+	if (ret) {
+		ret = dvmDiscFlush(self->lower);
+	}
+	if (ret) {
+		ret = _dvmDiscOverlayClear(self);
+	}
+
+	__lock_release(self->lock);
+	free(buf);
+	return ret;
+}
+
+bool dvmDiscOverlayDiscard(DvmDisc* disc)
+{
+	if (!disc || disc->vt != &s_dvmDiscOverlayIface) {
+		return false;
+	}
+
+	DvmDiscOverlay* self = (DvmDiscOverlay*)disc;
+	__lock_acquire(self->lock);
+	dvmDebug("overlayDiscard()\n");
+	bool ret = _dvmDiscOverlayClear(self);
+	__lock_release(self->lock);
+	return ret;
+}
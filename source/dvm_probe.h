@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#pragma once
+#include <dvm.h>
+
+// Devices probed at startup (shared by the platform backends)
+//
+// Each job opens its device and returns the disc to probe (or NULL if it is
+// absent). In parallel mode, opening runs on one worker thread per job, since
+// starting up devices can block for a long time. Discs are always probed and
+// mounted on the calling thread, in job order, so that volumes register in the
+// same order as in sequential mode.
+//
+// Jobs that do not finish before the timeout are abandoned: their worker
+// destroys the disc it opened on its own, so the job argument must stay
+// valid until the program exits. Their state is set to PROBE_ABANDONED.
+
+#define PROBE_RUNNING   0
+#define PROBE_DONE      1
+#define PROBE_ABANDONED 2
+
+typedef struct DvmProbeJob DvmProbeJob;
+
+struct DvmProbeJob {
+	const char* name;
+	DvmDisc* (*open)(const DvmProbeJob* job);
+	void* arg;
+	unsigned cache_pages;
+	unsigned sectors_per_page;
+
+	// Used by _dvmProbeMountJobs
+	DvmDisc* disc;
+	void* thread;
+	unsigned state;
+};
+
+unsigned _dvmProbeMountJobs(DvmProbeJob* jobs, unsigned num_jobs, bool parallel, unsigned timeout_ms);
+
+// Opens the DISC_INTERFACE in arg
+DvmDisc* _dvmProbeOpenIface(const DvmProbeJob* job);
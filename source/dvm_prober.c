@@ -3,17 +3,40 @@
 #include <stdalign.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/lock.h>
 #include <dvm.h>
 #include "dvm_debug.h"
+#include "dvm_probe.h"
 
 #define MIN_BUF_SZ 2048U
 
+// Room for a GPT header and a standard 16 KiB entry array in one read
+#define TABLE_BUF_SZ (16U*1024 + 4096U)
+
+#define MAX_PARTITIONS   128
+#define GPT_HDR_SZ       92
+#define GPT_ENTRY_SZ     128
+#define GPT_MAX_ENTRY_SZ 512
+#define GPT_MAX_ARRAY_SZ (1024U*1024)
+
+uint64_t _dvmGetTimeNs(void);
+bool _dvmMountVolumeNow(const char* name, DvmDisc* disc, sec_t start_sector, const char* fstype);
+
+// Backends without threads do not provide these
+void* _dvmThreadStart(void (*entry)(void* arg), void* arg) __attribute__((weak));
+void _dvmThreadFinish(void* thread, bool join) __attribute__((weak));
+void _dvmThreadSleep(void) __attribute__((weak));
+
+__LOCK_INIT(static, s_dvmProbeLock);
+
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
 #define le16(x) (x)
 #define le32(x) (x)
+#define le64(x) (x)
 #else
 #define le16(x) __builtin_bswap16(x)
 #define le32(x) __builtin_bswap32(x)
+#define le64(x) __builtin_bswap64(x)
 #endif
 
 typedef struct DvmMbrPartEntry {
@@ -49,6 +72,13 @@ static inline unsigned _dvmRead32(const void* buf, unsigned offset)
 	return le32(ret);
 }
 
+static inline uint64_t _dvmRead64(const void* buf, unsigned offset)
+{
+	uint64_t ret;
+	memcpy(&ret, (const uint8_t*)buf + offset, sizeof(ret));
+	return le64(ret);
+}
+
 static const char* _dvmIdentMbrVbr(const void* buf)
 {
 	unsigned jmp = _dvmRead8(buf, 0);
@@ -102,17 +132,290 @@ static const char* _dvmIdentMbrVbr(const void* buf)
 	return NULL;
 }
 
+static inline bool _dvmIsExtended(unsigned type)
+{
+	return type == 0x05 || type == 0x0f || type == 0x85;
+}
+
+static uint32_t _dvmCrc32(uint32_t crc, const void* buf, size_t size)
+{
+	// CRC-32 (IEEE 802.3), processed a nibble at a time to keep the table small
+	static const uint32_t s_table[16] = {
+		0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+		0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+	};
+
+	const uint8_t* p = (const uint8_t*)buf;
+	crc = ~crc;
+	while (size--) {
+		crc ^= *p++;
+		crc = (crc >> 4) ^ s_table[crc & 0xf];
+		crc = (crc >> 4) ^ s_table[crc & 0xf];
+	}
+
+	return ~crc;
+}
+
+static unsigned _dvmGptPartType(const void* guid)
+{
+	// Partition type GUIDs (in on-disk byte order), mapped to their MBR equivalents
+	static const struct {
+		uint8_t guid[16];
+		uint8_t type;
+	} s_types[] = {
+		{ { 0xa2,0xa0,0xd0,0xeb,0xe5,0xb9,0x33,0x44,0x87,0xc0,0x68,0xb6,0xb7,0x26,0x99,0xc7 }, 0x07 }, // Basic data
+		{ { 0xaf,0x3d,0xc6,0x0f,0x83,0x84,0x72,0x47,0x8e,0x79,0x3d,0x69,0xd8,0x47,0x7d,0xe4 }, 0x83 }, // Linux filesystem
+		{ { 0x28,0x73,0x2a,0xc1,0x1f,0xf8,0xd2,0x11,0xba,0x4b,0x00,0xa0,0xc9,0x3e,0xc9,0x3b }, 0xef }, // EFI system
+	};
+
+	for (unsigned i = 0; i < sizeof(s_types)/sizeof(s_types[0]); i ++) {
+		if (memcmp(guid, s_types[i].guid, 16) == 0) {
+			return s_types[i].type;
+		}
+	}
+
+	return 0xee;
+}
+
+static bool _dvmReadGptHeader(DvmDisc* disc, sec_t lba, const void* hdr)
+{
+	static const uint32_t s_zero = 0;
+
+	if (memcmp(hdr, "EFI PART", 8) != 0) {
+		return false;
+	}
+
+	// The header CRC is calculated with its own field zeroed
+	unsigned hdr_sz = _dvmRead32(hdr, 0x0c);
+	if (hdr_sz < GPT_HDR_SZ || hdr_sz > disc->sector_sz) {
+		return false;
+	}
+
+	uint32_t crc = _dvmCrc32(0, hdr, 0x10);
+	crc = _dvmCrc32(crc, &s_zero, 4);
+	crc = _dvmCrc32(crc, (const uint8_t*)hdr + 0x14, hdr_sz - 0x14);
+	if (crc != _dvmRead32(hdr, 0x10) || _dvmRead64(hdr, 0x18) != lba) {
+		return false;
+	}
+
+	unsigned num_entries = _dvmRead32(hdr, 0x50);
+	unsigned entry_sz = _dvmRead32(hdr, 0x54);
+	uint64_t array_lba = _dvmRead64(hdr, 0x48);
+	uint64_t array_sz = (uint64_t)num_entries*entry_sz;
+	// Entries larger than any in use would not fit the read buffer
+	return entry_sz >= GPT_ENTRY_SZ && entry_sz <= GPT_MAX_ENTRY_SZ && _dvmIsPo2(entry_sz) && array_sz <= GPT_MAX_ARRAY_SZ &&
+		array_lba >= 2 && array_lba < disc->num_sectors;
+}
+
+static bool _dvmReadGptAt(DvmDisc* disc, sec_t hdr_lba, DvmPartInfo* out, unsigned max_partitions, unsigned* out_num_parts, sec_t* total_used_sectors, void* buf, size_t buf_sz)
+{
+	unsigned sector_sz = disc->sector_sz;
+
+	// The primary header is read together with the entry array that normally follows it
+	sec_t buf_lba = hdr_lba;
+	sec_t buf_count = hdr_lba == 1 ? buf_sz / sector_sz : 1;
+	if (buf_count > disc->num_sectors - hdr_lba) {
+		buf_count = disc->num_sectors - hdr_lba;
+	}
+
+	if (!disc->vt->read_sectors(disc, buf, buf_lba, buf_count, true)) {
+		dvmTp(DVM_TP_PROBE_READ_ERROR, buf_lba);
+		return false;
+	}
+
+	if (!_dvmReadGptHeader(disc, hdr_lba, buf)) {
+		dvmTp(DVM_TP_PROBE_GPT_INVALID, hdr_lba);
+		return false;
+	}
+
+	uint8_t hdr[GPT_HDR_SZ];
+	memcpy(hdr, buf, sizeof(hdr));
+
+	uint64_t first_usable = _dvmRead64(hdr, 0x28);
+	uint64_t last_usable = _dvmRead64(hdr, 0x30);
+	sec_t array_lba = _dvmRead64(hdr, 0x48);
+	unsigned num_entries = _dvmRead32(hdr, 0x50);
+	unsigned entry_sz = _dvmRead32(hdr, 0x54);
+	uint32_t array_crc = _dvmRead32(hdr, 0x58);
+	dvmTp(DVM_TP_PROBE_GPT, hdr_lba, num_entries);
+
+	// Go through the entry array in as few reads as the buffer allows,
+	// reusing what was read along with the header. Entries never straddle
+	// two chunks, as both sizes are powers of two.
+	size_t array_sz = (size_t)num_entries*entry_sz;
+	size_t chunk_sz = buf_sz - buf_sz % (entry_sz > sector_sz ? entry_sz : sector_sz);
+	uint32_t crc = 0;
+	unsigned num_parts = 0;
+	for (size_t pos = 0; pos < array_sz; pos += chunk_sz) {
+		sec_t lba = array_lba + pos / sector_sz;
+		size_t size = array_sz - pos < chunk_sz ? array_sz - pos : chunk_sz;
+		sec_t count = (size + sector_sz - 1) / sector_sz;
+
+		if (lba < buf_lba || lba + count > buf_lba + buf_count) {
+			if (!disc->vt->read_sectors(disc, buf, lba, count, true)) {
+				dvmTp(DVM_TP_PROBE_READ_ERROR, lba);
+				return false;
+			}
+
+			buf_lba = lba;
+			buf_count = count;
+		}
+
+		const uint8_t* chunk = (const uint8_t*)buf + (lba - buf_lba)*sector_sz;
+		crc = _dvmCrc32(crc, chunk, size);
+
+		for (size_t i = 0; i < size; i += entry_sz) {
+			const uint8_t* entry = chunk + i;
+			uint64_t first_lba = _dvmRead64(entry, 0x20);
+			uint64_t last_lba = _dvmRead64(entry, 0x28);
+
+			// Skip unused entries
+			static const uint8_t s_unused[16] = { 0 };
+			if (memcmp(entry, s_unused, 16) == 0 || num_parts >= max_partitions) {
+				continue;
+			}
+
+			if (first_lba < first_usable || last_lba < first_lba || last_lba > last_usable || last_lba >= (sec_t)~(sec_t)0) {
+				dvmTp(DVM_TP_PROBE_MALFORMED);
+				return false;
+			}
+
+			DvmPartInfo* part = &out[num_parts++];
+			part->index = (pos + i) / entry_sz + 1;
+			part->type = _dvmGptPartType(entry);
+			part->fstype = NULL;
+			part->start_sector = first_lba;
+			part->num_sectors = last_lba - first_lba + 1;
+		}
+	}
+
+	if (crc != array_crc) {
+		dvmTp(DVM_TP_PROBE_GPT_INVALID, array_lba);
+		return false;
+	}
+
+	*out_num_parts = num_parts;
+	*total_used_sectors = last_usable < (sec_t)~(sec_t)0 ? last_usable + 1 : ~(sec_t)0;
+	return true;
+}
+
+static bool _dvmReadGpt(DvmDisc* disc, DvmPartInfo* out, unsigned max_partitions, unsigned* out_num_parts, sec_t* total_used_sectors, void* buf, size_t buf_sz)
+{
+	// Fall back to the backup header at the end of the disc (if its size is known)
+	return _dvmReadGptAt(disc, 1, out, max_partitions, out_num_parts, total_used_sectors, buf, buf_sz) ||
+		(~disc->num_sectors != 0 && _dvmReadGptAt(disc, disc->num_sectors - 1, out, max_partitions, out_num_parts, total_used_sectors, buf, buf_sz));
+}
+
+static unsigned _dvmReadEbrChain(DvmDisc* disc, DvmPartInfo* out, unsigned num_parts, unsigned max_partitions, sec_t ext_start, sec_t* total_used_sectors, void* buf)
+{
+	// Logical partitions are numbered from 5, after the primary ones. Links
+	// are only followed forward, so that malformed chains cannot loop.
+	unsigned index = 5;
+	sec_t ebr_lba = ext_start;
+	while (num_parts < max_partitions) {
+		dvmTp(DVM_TP_PROBE_EBR, ebr_lba);
+		if (!disc->vt->read_sectors(disc, buf, ebr_lba, 1, true)) {
+			dvmTp(DVM_TP_PROBE_READ_ERROR, ebr_lba);
+			break;
+		}
+
+		if (_dvmRead16(buf, 0x1fe) != 0xaa55) {
+			dvmTp(DVM_TP_PROBE_MALFORMED);
+			break;
+		}
+
+		const DvmMbrPartEntry* ebr_part = (const DvmMbrPartEntry*)((const char*)buf + 0x1be);
+		sec_t num_sectors = _dvmRead32(ebr_part[0].num_sectors_le, 0);
+		if (ebr_part[0].type != 0x00 && num_sectors != 0) {
+			DvmPartInfo* part = &out[num_parts++];
+			part->index = index++;
+			part->type = ebr_part[0].type;
+			part->fstype = NULL;
+			part->start_sector = ebr_lba + _dvmRead32(ebr_part[0].start_lba_le, 0);
+			part->num_sectors = num_sectors;
+
+			sec_t part_end = part->start_sector + part->num_sectors;
+			if (part_end > *total_used_sectors) {
+				*total_used_sectors = part_end;
+			}
+		}
+
+		// The next EBR is addressed relative to the extended partition
+		sec_t next_lba = ext_start + _dvmRead32(ebr_part[1].start_lba_le, 0);
+		if (!_dvmIsExtended(ebr_part[1].type) || next_lba <= ebr_lba) {
+			break;
+		}
+
+		ebr_lba = next_lba;
+	}
+
+	return num_parts;
+}
+
+static bool _dvmIdentPartitions(DvmDisc* disc, DvmPartInfo* parts, unsigned num_parts, void* buf, size_t buf_sz)
+{
+	unsigned sector_sz = disc->sector_sz;
+	sec_t buf_sectors = buf_sz / sector_sz;
+	sec_t probe_sectors = (MIN_BUF_SZ + sector_sz - 1) / sector_sz;
+
+	// Boot sectors are read in order of position, merging those close enough
+	// to share a read
+	unsigned* order = (unsigned*)malloc(num_parts*sizeof(unsigned));
+	if (!order) {
+		return false;
+	}
+
+	for (unsigned i = 0; i < num_parts; i ++) {
+		unsigned j = i;
+		for (; j > 0 && parts[order[j-1]].start_sector > parts[i].start_sector; j --) {
+			order[j] = order[j-1];
+		}
+		order[j] = i;
+	}
+
+	bool ret = true;
+	for (unsigned i = 0; ret && i < num_parts; ) {
+		sec_t first_sector = parts[order[i]].start_sector;
+		unsigned end = i + 1;
+		while (end < num_parts && parts[order[end]].start_sector + probe_sectors - first_sector <= buf_sectors) {
+			end ++;
+		}
+
+		sec_t num_sectors = parts[order[end-1]].start_sector + probe_sectors - first_sector;
+		if (!disc->vt->read_sectors(disc, buf, first_sector, num_sectors, true)) {
+			dvmTp(DVM_TP_PROBE_READ_ERROR, first_sector);
+			ret = false;
+			break;
+		}
+
+		for (; i < end; i ++) {
+			DvmPartInfo* part = &parts[order[i]];
+			dvmTp(DVM_TP_PROBE_PART, part->index<<8 | part->type, part->start_sector, part->num_sectors);
+
+			const char* ident = _dvmIdentMbrVbr((const uint8_t*)buf + (part->start_sector - first_sector)*sector_sz);
+			if (ident && *ident) {
+				dvmTp(DVM_TP_PROBE_FSTYPE, part->index, _dvmTpPackName(ident));
+				part->fstype = ident;
+			}
+		}
+	}
+
+	free(order);
+	return ret;
+}
+
 static unsigned _dvmReadPartitionTable(DvmDisc* disc, DvmPartInfo* out, unsigned max_partitions, unsigned flags, void* buf, size_t buf_sz)
 {
-	if (!disc->vt->read_sectors(disc, buf, 0, buf_sz / disc->sector_sz, true)) {
-		dvmDebug("Disc read error\n");
+	sec_t probe_sectors = (MIN_BUF_SZ + disc->sector_sz - 1) / disc->sector_sz;
+	if (!disc->vt->read_sectors(disc, buf, 0, probe_sectors, true)) {
+		dvmTp(DVM_TP_PROBE_READ_ERROR, 0);
 		return 0;
 	}
 
 	const char* ident = _dvmIdentMbrVbr(buf);
 	if (ident) {
 		if (*ident) {
-			dvmDebug("Found VBR\n");
+			dvmTp(DVM_TP_PROBE_VBR);
 			out->index = 0;
 			out->type = 0;
 			out->fstype = ident;
@@ -120,28 +423,53 @@ static unsigned _dvmReadPartitionTable(DvmDisc* disc, DvmPartInfo* out, unsigned
 			out->num_sectors = disc->num_sectors;
 			return 1;
 		} else {
-			dvmDebug("Found MBR\n");
+			dvmTp(DVM_TP_PROBE_MBR);
 		}
 	} else {
-		dvmDebug("Cannot find MBR or VBR\n");
+		dvmTp(DVM_TP_PROBE_NO_TABLE);
 		return 0;
 	}
 
-	DvmMbrPartEntry* mbr_part = (DvmMbrPartEntry*)((char*)buf + 0x1be);
-	sec_t total_used_sectors = 0;
-	unsigned num_parts = 0;
-	for (unsigned i = 0; i < 4 && num_parts < max_partitions; i ++) {
-		unsigned status = mbr_part[i].status;
-		unsigned type   = mbr_part[i].type;
+	// Keep the MBR entries, as the buffer is reused for the reads below
+	DvmMbrPartEntry mbr_part[4];
+	memcpy(mbr_part, (char*)buf + 0x1be, sizeof(mbr_part));
 
+	bool is_gpt = false;
+	for (unsigned i = 0; i < 4; i ++) {
 		// Validate partition status
-		if (status != 0x80 && status != 0x00) {
-			dvmDebug("Malformed MBR\n");
+		if (mbr_part[i].status != 0x80 && mbr_part[i].status != 0x00) {
+			dvmTp(DVM_TP_PROBE_MALFORMED);
 			return 0;
 		}
 
-		// Skip unpopulated/extended partitions
-		if (type == 0x00 || type == 0x05 || type == 0x0f) {
+		is_gpt = is_gpt || mbr_part[i].type == 0xee;
+	}
+
+	// A protective MBR announces a GPT. If the GPT is damaged, the MBR (with
+	// any hybrid entries) is used instead.
+	sec_t total_used_sectors = 0;
+	unsigned num_parts = 0;
+	if (is_gpt) {
+		is_gpt = _dvmReadGpt(disc, out, max_partitions, &num_parts, &total_used_sectors, buf, buf_sz);
+	}
+
+	for (unsigned i = 0; !is_gpt && i < 4 && num_parts < max_partitions; i ++) {
+		unsigned type = mbr_part[i].type;
+		sec_t start_sector = _dvmRead32(mbr_part[i].start_lba_le, 0);
+		sec_t num_sectors = _dvmRead32(mbr_part[i].num_sectors_le, 0);
+
+		// Skip unpopulated/protective partitions
+		if (type == 0x00 || type == 0xee) {
+			continue;
+		}
+
+		sec_t part_end = start_sector + num_sectors;
+		if (part_end > total_used_sectors) {
+			total_used_sectors = part_end;
+		}
+
+		// Extended partitions hold the logical ones, which come after all primary ones
+		if (_dvmIsExtended(type)) {
 			continue;
 		}
 
@@ -149,40 +477,29 @@ static unsigned _dvmReadPartitionTable(DvmDisc* disc, DvmPartInfo* out, unsigned
 		part->index = i+1;
 		part->type = type;
 		part->fstype = NULL;
-		part->start_sector = _dvmRead32(mbr_part[i].start_lba_le, 0);
-		part->num_sectors = _dvmRead32(mbr_part[i].num_sectors_le, 0);
+		part->start_sector = start_sector;
+		part->num_sectors = num_sectors;
+	}
 
-		sec_t part_end = part->start_sector + part->num_sectors;
-		if (part_end > total_used_sectors) {
-			total_used_sectors = part_end;
+	for (unsigned i = 0; !is_gpt && i < 4; i ++) {
+		if (_dvmIsExtended(mbr_part[i].type)) {
+			num_parts = _dvmReadEbrChain(disc, out, num_parts, max_partitions, _dvmRead32(mbr_part[i].start_lba_le, 0), &total_used_sectors, buf);
+			break;
 		}
 	}
 
 	// Validate disc size
-	dvmDebug("Disc size 0x%lx\n", disc->num_sectors);
-	dvmDebug("Det  size 0x%lx\n", total_used_sectors);
+	dvmTp(DVM_TP_PROBE_SIZE, disc->num_sectors, total_used_sectors);
 	if (~disc->num_sectors == 0) {
 		disc->num_sectors = total_used_sectors;
 	} else if (total_used_sectors > disc->num_sectors) {
-		dvmDebug("Out of bound partitions\n");
+		dvmTp(DVM_TP_PROBE_OUT_OF_BOUND);
 		return 0;
 	}
 
 	// Identify fstype for each partition if needed
-	if (flags & DVM_IDENT_FSTYPE) {
-		for (unsigned i = 0; i < num_parts; i ++) {
-			dvmDebug("[%u:%.2X] 0x%lx 0x%lx\n", out[i].index, out[i].type, out[i].start_sector, out[i].num_sectors);
-			if (!disc->vt->read_sectors(disc, buf, out[i].start_sector, buf_sz / disc->sector_sz, true)) {
-				dvmDebug("Disc read error\n");
-				return 0;
-			}
-
-			ident = _dvmIdentMbrVbr(buf);
-			if (ident && *ident) {
-				dvmDebug("  fstype %s\n", ident);
-				out[i].fstype = ident;
-			}
-		}
+	if ((flags & DVM_IDENT_FSTYPE) && num_parts && !_dvmIdentPartitions(disc, out, num_parts, buf, buf_sz)) {
+		return 0;
 	}
 
 	return num_parts;
@@ -194,8 +511,9 @@ unsigned dvmReadPartitionTable(DvmDisc* disc, DvmPartInfo* out, unsigned max_par
 		return 0;
 	}
 
+	// The buffer is also used for batched reads, so it is kept a multiple of the sector size
 	unsigned num_parts = 0;
-	size_t buf_sz = disc->sector_sz < MIN_BUF_SZ ? MIN_BUF_SZ : disc->sector_sz;
+	size_t buf_sz = TABLE_BUF_SZ < disc->sector_sz ? disc->sector_sz : TABLE_BUF_SZ - TABLE_BUF_SZ % disc->sector_sz;
 	void* buf = aligned_alloc(LIBDVM_BUFFER_ALIGN, buf_sz);
 	if (buf) {
 		num_parts = _dvmReadPartitionTable(disc, out, max_partitions, flags, buf, buf_sz);
@@ -207,51 +525,74 @@ unsigned dvmReadPartitionTable(DvmDisc* disc, DvmPartInfo* out, unsigned max_par
 
 unsigned dvmProbeMountDisc(const char* basename, DvmDisc* disc)
 {
-	DvmPartInfo partinfo[4];
-	unsigned num_parts = dvmReadPartitionTable(disc, partinfo, 4, DVM_IDENT_FSTYPE);
+	DvmPartInfo* partinfo = (DvmPartInfo*)malloc(MAX_PARTITIONS*sizeof(DvmPartInfo));
+	if (!partinfo) {
+		return 0;
+	}
+
+	unsigned num_parts = dvmReadPartitionTable(disc, partinfo, MAX_PARTITIONS, DVM_IDENT_FSTYPE);
 	if (!num_parts) {
-		return dvmMountVolume(basename, disc, 0, "exfat") ? 1 : 0;
+		free(partinfo);
+		return _dvmMountVolumeNow(basename, disc, 0, "exfat") ? 1 : 0;
 	}
 
-	dvmDebug("Loaded %u partitions\n", num_parts);
+	dvmTp(DVM_TP_PROBE_LOADED, num_parts);
 	char volname[16];
-	size_t basenamelen = strnlen(basename, sizeof(volname)-2);
+	size_t basenamelen = strnlen(basename, sizeof(volname)-4);
 	memcpy(volname, basename, basenamelen);
 
 	// Try to mount partitions
 	unsigned num_mounted = 0;
 	for (unsigned i = 0; i < num_parts; i ++) {
 		DvmPartInfo* part = &partinfo[i];
-		if (!part->fstype) {
+		// Volume names only have room for three digits (GPT allows more entries)
+		if (!part->fstype || part->index >= 1000) {
 			continue;
 		}
 
-		volname[basenamelen+0] = part->index > 1 ? ('0' + part->index) : 0;
-		volname[basenamelen+1] = 0;
+		// Partitions after the first are numbered, e.g. sd, sd2, ... sd12
+		char* p = &volname[basenamelen];
+		if (part->index >= 100) {
+			*p++ = '0' + part->index / 100;
+		}
+		if (part->index >= 10) {
+			*p++ = '0' + part->index / 10 % 10;
+		}
+		if (part->index > 1) {
+			*p++ = '0' + part->index % 10;
+		}
+		*p = 0;
 
 		if (dvmMountPartition(volname, disc, part)) {
 			num_mounted ++;
 		}
 	}
 
+	free(partinfo);
 	return num_mounted;
 }
 
-unsigned dvmProbeMountDiscIface(const char* basename, DISC_INTERFACE* iface, unsigned cache_pages, unsigned sectors_per_page)
+DvmDisc* _dvmProbeOpenIface(const DvmProbeJob* job)
 {
-	unsigned num_mounted = 0;
 	DvmDisc* disc = NULL;
 
-	if (iface) {
-		disc = dvmDiscCreate(iface);
+	if (job->arg) {
+		disc = dvmDiscCreate((DISC_INTERFACE*)job->arg);
 	}
 
-	if (disc && cache_pages != 0) {
-		disc = dvmDiscCacheCreate(disc, cache_pages, sectors_per_page);
+	if (disc && job->cache_pages != 0) {
+		disc = dvmDiscCacheCreate(disc, job->cache_pages, job->sectors_per_page);
 	}
 
+	return disc;
+}
+
+static unsigned _dvmProbeMountJobDisc(const char* name, DvmDisc* disc)
+{
+	unsigned num_mounted = 0;
+
 	if (disc) {
-		num_mounted = dvmProbeMountDisc(basename, disc);
+		num_mounted = dvmProbeMountDisc(name, disc);
 	}
 
 	if (!num_mounted && disc) {
@@ -260,3 +601,134 @@ unsigned dvmProbeMountDiscIface(const char* basename, DISC_INTERFACE* iface, uns
 
 	return num_mounted;
 }
+
+static void _dvmProbeWorker(void* arg)
+{
+	DvmProbeJob* job = (DvmProbeJob*)arg;
+	DvmDisc* disc = job->open(job);
+
+	__lock_acquire(s_dvmProbeLock);
+	bool abandoned = job->state == PROBE_ABANDONED;
+	job->disc = disc;
+	job->state = PROBE_DONE;
+	__lock_release(s_dvmProbeLock);
+
+	// Nobody is waiting for abandoned jobs anymore
+	if (abandoned) {
+		if (disc) {
+			disc->vt->destroy(disc);
+		}
+		free(job);
+	}
+}
+
+static void _dvmProbeWaitJobs(DvmProbeJob** work, unsigned num_jobs, unsigned timeout_ms)
+{
+	uint64_t deadline = _dvmGetTimeNs() + (uint64_t)timeout_ms*1000000U;
+
+	for (;;) {
+		unsigned num_done = 0;
+		__lock_acquire(s_dvmProbeLock);
+		for (unsigned i = 0; i < num_jobs; i ++) {
+			num_done += !work[i] || work[i]->state == PROBE_DONE;
+		}
+		__lock_release(s_dvmProbeLock);
+
+		if (num_done == num_jobs || (timeout_ms && _dvmGetTimeNs() >= deadline)) {
+			break;
+		}
+
+		_dvmThreadSleep();
+	}
+}
+
+unsigned _dvmProbeMountJobs(DvmProbeJob* jobs, unsigned num_jobs, bool parallel, unsigned timeout_ms)
+{
+	unsigned num_mounted = 0;
+
+	// Parallel probing needs threads from the backend
+	DvmProbeJob** work = NULL;
+	if (parallel && num_jobs > 1 && _dvmThreadStart && _dvmThreadFinish && _dvmThreadSleep) {
+		work = (DvmProbeJob**)calloc(num_jobs, sizeof(DvmProbeJob*));
+	}
+
+	if (!work) {
+		for (unsigned i = 0; i < num_jobs; i ++) {
+			num_mounted += _dvmProbeMountJobDisc(jobs[i].name, jobs[i].open(&jobs[i]));
+			jobs[i].state = PROBE_DONE;
+		}
+
+		return num_mounted;
+	}
+
+	// Jobs are copied, as abandoned ones outlive this call
+	for (unsigned i = 0; i < num_jobs; i ++) {
+		DvmProbeJob* job = (DvmProbeJob*)malloc(sizeof(DvmProbeJob));
+		if (job) {
+			*job = jobs[i];
+			job->disc = NULL;
+			job->state = PROBE_RUNNING;
+			job->thread = _dvmThreadStart(_dvmProbeWorker, job);
+		}
+
+		// Open the device right away if there is no worker for it
+		if (job && !job->thread) {
+			_dvmProbeWorker(job);
+		}
+
+		work[i] = job;
+	}
+
+	_dvmProbeWaitJobs(work, num_jobs, timeout_ms);
+
+	// Mount in job order, regardless of the order in which workers finished
+	for (unsigned i = 0; i < num_jobs; i ++) {
+		DvmProbeJob* job = work[i];
+
+		// Jobs that could not be allocated are opened here instead
+		jobs[i].state = PROBE_DONE;
+		if (!job) {
+			num_mounted += _dvmProbeMountJobDisc(jobs[i].name, jobs[i].open(&jobs[i]));
+			continue;
+		}
+
+		// The worker frees abandoned jobs, so they must not be touched afterwards
+		void* thread = job->thread;
+		__lock_acquire(s_dvmProbeLock);
+		bool abandoned = job->state == PROBE_RUNNING;
+		if (abandoned) {
+			job->state = PROBE_ABANDONED;
+		}
+		__lock_release(s_dvmProbeLock);
+
+		if (abandoned) {
+			jobs[i].state = PROBE_ABANDONED;
+			dvmTp(DVM_TP_PROBE_TIMEOUT, _dvmTpPackName(jobs[i].name));
+			_dvmThreadFinish(thread, false);
+			continue;
+		}
+
+		if (thread) {
+			_dvmThreadFinish(thread, true);
+		}
+
+		num_mounted += _dvmProbeMountJobDisc(job->name, job->disc);
+		free(job);
+	}
+
+	free(work);
+	return num_mounted;
+}
+
+unsigned dvmProbeMountDiscIface(const char* basename, DISC_INTERFACE* iface, unsigned cache_pages, unsigned sectors_per_page)
+{
+	DvmProbeJob job = {
+		.name             = basename,
+		.open             = _dvmProbeOpenIface,
+		.arg              = iface,
+		.cache_pages      = cache_pages,
+		.sectors_per_page = sectors_per_page,
+	};
+
+	return _dvmProbeMountJobs(&job, 1, false, 0);
+}
@@ -0,0 +1,284 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/lock.h>
+#include <dvm.h>
+#include "dvm_debug.h"
+
+#define CHUNK_SZ   4096U
+#define LEAF_SHIFT 10
+#define LEAF_SZ    (1U << LEAF_SHIFT)
+
+typedef struct DvmDiscRam {
+	DvmDisc base;
+
+	_LOCK_T lock;
+	size_t max_bytes;
+	size_t used_bytes;
+	size_t chunk_bytes;
+	uint8_t chunk_shift;
+	size_t num_leaves;
+
+	uint8_t** leaves[];
+} DvmDiscRam;
+
+static bool _dvmIsZero(const uint8_t* data, size_t size)
+{
+	for (size_t i = 0; i < size; i ++) {
+		if (data[i]) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static uint8_t** _dvmDiscRamGetSlot(DvmDiscRam* self, sec_t chunk, bool alloc)
+{
+	uint8_t*** leaf = &self->leaves[chunk >> LEAF_SHIFT];
+	if (!*leaf) {
+		if (!alloc) {
+			return NULL;
+		}
+
+		*leaf = (uint8_t**)calloc(LEAF_SZ, sizeof(uint8_t*));
+		if (!*leaf) {
+			return NULL;
+		}
+	}
+
+	return &(*leaf)[chunk & (LEAF_SZ-1)];
+}
+
+static uint8_t* _dvmDiscRamGetChunk(DvmDiscRam* self, sec_t chunk)
+{
+	uint8_t** slot = _dvmDiscRamGetSlot(self, chunk, false);
+	return slot ? *slot : NULL;
+}
+
+static uint8_t* _dvmDiscRamAllocChunk(DvmDiscRam* self, sec_t chunk)
+{
+	// Enforce the size cap
+	if (self->max_bytes && (self->used_bytes + self->chunk_bytes) > self->max_bytes) {
+		dvmDebug(" ram full\n");
+		return NULL;
+	}
+
+	uint8_t** slot = _dvmDiscRamGetSlot(self, chunk, true);
+	if (!slot) {
+		return NULL;
+	}
+
+	uint8_t* data = (uint8_t*)aligned_alloc(LIBDVM_BUFFER_ALIGN, self->chunk_bytes);
+	if (data) {
+		memset(data, 0, self->chunk_bytes);
+		self->used_bytes += self->chunk_bytes;
+		*slot = data;
+	}
+
+	return data;
+}
+
+static void _dvmDiscRamDestroy(DvmDisc* self_)
+{
+	DvmDiscRam* self = (DvmDiscRam*)self_;
+
+	for (size_t i = 0; i < self->num_leaves; i ++) {
+		uint8_t** leaf = self->leaves[i];
+		if (!leaf) {
+			continue;
+		}
+
+		for (unsigned j = 0; j < LEAF_SZ; j ++) {
+			free(leaf[j]);
+		}
+
+		free(leaf);
+	}
+
+	__lock_close(self->lock);
+	free(self);
+}
+
+static bool _dvmDiscRamReadWrite(DvmDiscRam* self, uint8_t* buffer, sec_t first_sector, sec_t num_sectors, bool is_write)
+{
+	// Early fail on out of bounds access
+	if (first_sector >= self->base.num_sectors || num_sectors > self->base.num_sectors - first_sector) {
+		return false;
+	}
+
+	const unsigned chunk_sectors = 1U << self->chunk_shift;
+
+	while (num_sectors) {
+		sec_t chunk = first_sector >> self->chunk_shift;
+		unsigned chunk_offset = first_sector & (chunk_sectors-1);
+
+		sec_t max_cur_sectors = chunk_sectors - chunk_offset;
+		sec_t cur_sectors = num_sectors < max_cur_sectors ? num_sectors : max_cur_sectors;
+		size_t cur_size = cur_sectors*self->base.sector_sz;
+
+		uint8_t* data = _dvmDiscRamGetChunk(self, chunk);
+		if (is_write) {
+			// Writing zeros to an unallocated chunk keeps it unallocated
+			if (!data && !_dvmIsZero(buffer, cur_size)) {
+				data = _dvmDiscRamAllocChunk(self, chunk);
+				if (!data) {
+					return false;
+				}
+			}
+
+			if (data) {
+				memcpy(data + chunk_offset*self->base.sector_sz, buffer, cur_size);
+			}
+		} else if (data) {
+			memcpy(buffer, data + chunk_offset*self->base.sector_sz, cur_size);
+		} else {
+			memset(buffer, 0, cur_size);
+		}
+
+		buffer += cur_size;
+		first_sector += cur_sectors;
+		num_sectors -= cur_sectors;
+	}
+
+	return true;
+}
+
+static bool _dvmDiscRamReadSectors(DvmDisc* self_, void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	DvmDiscRam* self = (DvmDiscRam*)self_;
+	__lock_acquire(self->lock);
+	bool ret = _dvmDiscRamReadWrite(self, (uint8_t*)buffer, first_sector, num_sectors, false);
+	__lock_release(self->lock);
+	return ret;
+}
+
+static bool _dvmDiscRamWriteSectors(DvmDisc* self_, const void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	DvmDiscRam* self = (DvmDiscRam*)self_;
+	__lock_acquire(self->lock);
+	bool ret = _dvmDiscRamReadWrite(self, (uint8_t*)buffer, first_sector, num_sectors, true);
+	__lock_release(self->lock);
+	return ret;
+}
+
+static bool _dvmDiscRamFlush(DvmDisc* self_)
+{
+	return true;
+}
+
+static bool _dvmDiscRamTrim(DvmDisc* self_, sec_t first_sector, sec_t num_sectors)
+{
+	DvmDiscRam* self = (DvmDiscRam*)self_;
+
+	// Early fail on out of bounds access
+	if (first_sector >= self->base.num_sectors || num_sectors > self->base.num_sectors - first_sector) {
+		return false;
+	}
+
+	__lock_acquire(self->lock);
+	dvmDebug("ramTrim(0x%lx,%lu)\n", first_sector, num_sectors);
+
+	const unsigned chunk_sectors = 1U << self->chunk_shift;
+
+	while (num_sectors) {
+		sec_t chunk = first_sector >> self->chunk_shift;
+		unsigned chunk_offset = first_sector & (chunk_sectors-1);
+
+		sec_t max_cur_sectors = chunk_sectors - chunk_offset;
+		sec_t cur_sectors = num_sectors < max_cur_sectors ? num_sectors : max_cur_sectors;
+
+		uint8_t** slot = _dvmDiscRamGetSlot(self, chunk, false);
+		if (slot && *slot) {
+			if (chunk_offset == 0 && (cur_sectors == chunk_sectors || first_sector + cur_sectors == self->base.num_sectors)) {
+				// Whole chunk discarded: give the memory back
+				free(*slot);
+				*slot = NULL;
+				self->used_bytes -= self->chunk_bytes;
+			} else {
+				// Discarded sectors read back as zeros
+				memset(*slot + chunk_offset*self->base.sector_sz, 0, cur_sectors*self->base.sector_sz);
+			}
+		}
+
+		first_sector += cur_sectors;
+		num_sectors -= cur_sectors;
+	}
+
+	__lock_release(self->lock);
+	return true;
+}
+
+static const DvmDiscIface s_dvmDiscRamIface = {
+	.destroy       = _dvmDiscRamDestroy,
+	.read_sectors  = _dvmDiscRamReadSectors,
+	.write_sectors = _dvmDiscRamWriteSectors,
+	.flush         = _dvmDiscRamFlush,
+	.trim          = _dvmDiscRamTrim,
+};
+
+DvmDisc* dvmDiscRamCreate(sec_t num_sectors, unsigned sector_sz, size_t max_bytes)
+{
+	if (!sector_sz) {
+		sector_sz = 512U;
+	}
+
+	// Parameter validation
+	if (!num_sectors || ~num_sectors == 0 || sector_sz < 512U || (sector_sz & (sector_sz-1)) || sector_sz > UINT16_MAX) {
+		return NULL;
+	}
+
+	// Chunks are at least one sector
+	size_t chunk_bytes = sector_sz > CHUNK_SZ ? sector_sz : CHUNK_SZ;
+	uint8_t chunk_shift = 0;
+	while ((sector_sz << chunk_shift) != chunk_bytes) {
+		chunk_shift ++;
+	}
+
+	// Size the leaf table directory
+	sec_t num_chunks = ((num_sectors - 1) >> chunk_shift) + 1;
+	sec_t num_leaves = ((num_chunks - 1) >> LEAF_SHIFT) + 1;
+	if (num_leaves > (SIZE_MAX - sizeof(DvmDiscRam)) / sizeof(uint8_t**)) {
+		return NULL;
+	}
+
+	DvmDiscRam* disc = (DvmDiscRam*)calloc(1, sizeof(DvmDiscRam) + num_leaves*sizeof(uint8_t**));
+	if (!disc) {
+		return NULL;
+	}
+
+	disc->base.vt = &s_dvmDiscRamIface;
+	disc->base.io_type = ('R'<<24) | ('A'<<16) | ('M'<<8) | 'D';
+	disc->base.features = FEATURE_MEDIUM_CANREAD | FEATURE_MEDIUM_CANWRITE;
+#ifdef FEATURE_MEDIUM_CANFORMAT
+	disc->base.features |= FEATURE_MEDIUM_CANFORMAT;
+#endif
+	disc->base.num_sectors = num_sectors;
+	disc->base.sector_sz = sector_sz;
+	disc->base.block_sz = 0;
+	disc->base.caps.opt_sectors = 1U << chunk_shift;
+	disc->base.caps.align = 1;
+	disc->base.caps.queue_depth = 1;
+	__lock_init(disc->lock);
+	disc->max_bytes = max_bytes;
+	disc->chunk_bytes = chunk_bytes;
+	disc->chunk_shift = chunk_shift;
+	disc->num_leaves = num_leaves;
+
+	return &disc->base;
+}
+
+size_t dvmDiscRamGetUsage(DvmDisc* disc)
+{
+	if (!disc || disc->vt != &s_dvmDiscRamIface) {
+		return 0;
+	}
+
+	DvmDiscRam* self = (DvmDiscRam*)disc;
+	__lock_acquire(self->lock);
+	size_t ret = self->used_bytes;
+	__lock_release(self->lock);
+	return ret;
+}
@@ -0,0 +1,507 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/lock.h>
+#include <dvm.h>
+#include "dvm_debug.h"
+
+typedef struct DvmDiscSchedReq DvmDiscSchedReq;
+typedef struct DvmDiscSched DvmDiscSched;
+
+struct DvmDiscSchedReq {
+	sec_t first_sector;
+	uint32_t num_sectors;
+	uint32_t data_offset;
+};
+
+struct DvmDiscSched {
+	DvmDisc base;
+
+	_LOCK_T lock;
+	DvmDisc* inner;
+	uint8_t* pool;
+	uint8_t* merge_buf;
+	unsigned pool_sectors;
+	unsigned pool_used;
+	unsigned merge_sectors;
+	unsigned erase_sectors;
+	unsigned deadline;
+	unsigned age;
+	unsigned num_reqs;
+	sec_t head;
+	DvmSchedStats stats;
+
+	DvmDiscSchedReq reqs[];
+};
+
+static inline bool _dvmDiscSchedOverlaps(const DvmDiscSchedReq* req, sec_t first_sector, sec_t num_sectors)
+{
+	return first_sector < req->first_sector + req->num_sectors && req->first_sector < first_sector + num_sectors;
+}
+
+static uint8_t* _dvmDiscSchedReqGetData(DvmDiscSched* self, const DvmDiscSchedReq* req)
+{
+	return self->pool + req->data_offset*self->base.sector_sz;
+}
+
+static void _dvmDiscSchedSort(DvmDiscSched* self)
+{
+	// Insertion sort by sector - the queue is short and mostly sorted already
+	for (unsigned i = 1; i < self->num_reqs; i ++) {
+		DvmDiscSchedReq req = self->reqs[i];
+		unsigned j = i;
+		while (j && self->reqs[j-1].first_sector > req.first_sector) {
+			self->reqs[j] = self->reqs[j-1];
+			j --;
+		}
+		self->reqs[j] = req;
+	}
+}
+
+static bool _dvmDiscSchedWriteInner(DvmDiscSched* self, const void* data, sec_t sector, sec_t num_sectors)
+{
+	self->head = sector + num_sectors;
+	self->stats.sectors_written += num_sectors;
+
+	if (self->erase_sectors) {
+		sec_t first_block = sector / self->erase_sectors;
+		sec_t last_block = (sector + num_sectors - 1) / self->erase_sectors;
+		bool is_whole = (sector % self->erase_sectors) == 0 && (num_sectors % self->erase_sectors) == 0;
+		if (is_whole) {
+			self->stats.blocks_full += last_block - first_block + 1;
+		} else {
+			self->stats.blocks_partial += last_block - first_block + 1;
+		}
+	}
+
+	// Honor the transfer limit of the inner disc
+	const sec_t max_sectors = self->inner->caps.max_sectors;
+	const uint8_t* buf = (const uint8_t*)data;
+
+	bool ret = true;
+	while (ret && num_sectors) {
+		sec_t cur_sectors = max_sectors && num_sectors > max_sectors ? max_sectors : num_sectors;
+		self->stats.write_cmds ++;
+		ret = dvmDiscWriteSectors(self->inner, buf, sector, cur_sectors);
+
+		buf += cur_sectors*self->base.sector_sz;
+		sector += cur_sectors;
+		num_sectors -= cur_sectors;
+	}
+
+	return ret;
+}
+
+static bool _dvmDiscSchedDispatch(DvmDiscSched* self, unsigned first, unsigned count)
+{
+	const DvmDiscSchedReq* req = &self->reqs[first];
+	sec_t sector = req->first_sector;
+	unsigned sz = 0;
+	bool in_pool = true;
+
+	// Check whether the merged requests are also contiguous in the pool
+	for (unsigned i = 0; i < count; i ++) {
+		if (req[i].data_offset != req[0].data_offset + sz) {
+			in_pool = false;
+		}
+		sz += req[i].num_sectors;
+	}
+
+	const void* data;
+	if (in_pool) {
+		data = _dvmDiscSchedReqGetData(self, req);
+	} else {
+		// Gather into the merge buffer
+		uint8_t* buf = self->merge_buf;
+		for (unsigned i = 0; i < count; i ++) {
+			size_t req_sz = req[i].num_sectors*self->base.sector_sz;
+			memcpy(buf, _dvmDiscSchedReqGetData(self, &req[i]), req_sz);
+			buf += req_sz;
+		}
+		data = self->merge_buf;
+	}
+
+	dvmDebug(" dispatch %lx (%u) x%u\n", sector, sz, count);
+	return _dvmDiscSchedWriteInner(self, data, sector, sz);
+}
+
+static bool _dvmDiscSchedDrain(DvmDiscSched* self)
+{
+	if (!self->num_reqs) {
+		return true;
+	}
+
+	dvmDebug("schedDrain(%u)\n", self->num_reqs);
+	_dvmDiscSchedSort(self);
+
+	// Elevator order: start at the first request past the current head position,
+	// sweep upwards, then wrap around to the lowest sector (C-SCAN)
+	unsigned start = 0;
+	while (start < self->num_reqs && self->reqs[start].first_sector < self->head) {
+		start ++;
+	}
+
+	bool ret = true;
+	for (unsigned n = 0; n < self->num_reqs;) {
+		unsigned i = (start + n) % self->num_reqs;
+		unsigned count = 1;
+		sec_t end = self->reqs[i].first_sector + self->reqs[i].num_sectors;
+		unsigned merged_sz = self->reqs[i].num_sectors;
+
+		// Merge subsequent adjacent requests (never across the wrap point)
+		while ((i + count) < self->num_reqs && (n + count) < self->num_reqs) {
+			const DvmDiscSchedReq* next = &self->reqs[i + count];
+			if (next->first_sector != end || merged_sz + next->num_sectors > self->merge_sectors) {
+				break;
+			}
+
+			end += next->num_sectors;
+			merged_sz += next->num_sectors;
+			count ++;
+		}
+
+		ret &= _dvmDiscSchedDispatch(self, i, count);
+		n += count;
+	}
+
+	self->num_reqs = 0;
+	self->pool_used = 0;
+	self->age = 0;
+	return ret;
+}
+
+static bool _dvmDiscSchedFlush(DvmDisc* self_)
+{
+	DvmDiscSched* self = (DvmDiscSched*)self_;
+	__lock_acquire(self->lock);
+	dvmDebug("schedFlush()\n");
+
+	bool ret = _dvmDiscSchedDrain(self);
+	ret &= dvmDiscFlush(self->inner);
+
+	__lock_release(self->lock);
+	return ret;
+}
+
+static void _dvmDiscSchedDestroy(DvmDisc* self_)
+{
+	DvmDiscSched* self = (DvmDiscSched*)self_;
+
+	_dvmDiscSchedFlush(self_);
+	dvmDiscRemoveUser(self->inner);
+	__lock_close(self->lock);
+	free(self->merge_buf);
+	free(self->pool);
+	free(self);
+}
+
+static bool _dvmDiscSchedReadSectors(DvmDisc* self_, void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	DvmDiscSched* self = (DvmDiscSched*)self_;
+	__lock_acquire(self->lock);
+	dvmDebug("schedRead(%p,0x%lx,%lu)\n", buffer, first_sector, num_sectors);
+
+	bool ret = true;
+
+	// Reads of sectors with queued writes must observe them
+	for (unsigned i = 0; i < self->num_reqs; i ++) {
+		if (_dvmDiscSchedOverlaps(&self->reqs[i], first_sector, num_sectors)) {
+			ret = _dvmDiscSchedDrain(self);
+			break;
+		}
+	}
+
+	// Otherwise reads bypass queued write-back
+	if (ret) {
+		ret = self->inner->vt->read_sectors(self->inner, buffer, first_sector, num_sectors, is_partial);
+	}
+
+	// Enforce the deadline for queued writes
+	if (self->num_reqs && ++self->age >= self->deadline) {
+		ret &= _dvmDiscSchedDrain(self);
+	}
+
+	__lock_release(self->lock);
+	return ret;
+}
+
+static void _dvmDiscSchedRemove(DvmDiscSched* self, sec_t first_sector, sec_t num_sectors)
+{
+	// Drop queued requests entirely contained in the given range
+	unsigned j = 0;
+	for (unsigned i = 0; i < self->num_reqs; i ++) {
+		const DvmDiscSchedReq* req = &self->reqs[i];
+		if (req->first_sector < first_sector || (req->first_sector + req->num_sectors) > (first_sector + num_sectors)) {
+			self->reqs[j++] = *req;
+		}
+	}
+
+	self->num_reqs = j;
+	if (!j) {
+		self->pool_used = 0;
+	}
+}
+
+static bool _dvmDiscSchedQueue(DvmDiscSched* self, const uint8_t* buffer, sec_t first_sector, sec_t num_sectors)
+{
+	bool ret = true;
+	DvmDiscSchedReq* req = NULL;
+
+	for (unsigned i = 0; i < self->num_reqs; i ++) {
+		DvmDiscSchedReq* p = &self->reqs[i];
+		if (!_dvmDiscSchedOverlaps(p, first_sector, num_sectors)) {
+			continue;
+		}
+
+		if (p->first_sector == first_sector && p->num_sectors == num_sectors) {
+			// Rewrite of a queued request: replace its data in place
+			req = p;
+		} else {
+			// Partial overlap: preserve write ordering
+			ret = _dvmDiscSchedDrain(self);
+		}
+
+		break;
+	}
+
+	if (!ret) {
+		dvmDebug(" drain error!\n");
+	} else if (req) {
+		memcpy(_dvmDiscSchedReqGetData(self, req), buffer, num_sectors*self->base.sector_sz);
+	} else if (num_sectors > self->pool_sectors) {
+		// Too large to queue: write synchronously
+		ret = _dvmDiscSchedDrain(self);
+		if (ret) {
+			ret = _dvmDiscSchedWriteInner(self, buffer, first_sector, num_sectors);
+		}
+	} else {
+		if ((self->pool_used + num_sectors) > self->pool_sectors) {
+			ret = _dvmDiscSchedDrain(self);
+		}
+
+		memcpy(self->pool + self->pool_used*self->base.sector_sz, buffer, num_sectors*self->base.sector_sz);
+
+		// Extend the previous request if it is adjacent both on disc and in the pool
+		// (but never across an erase block boundary)
+		req = self->num_reqs ? &self->reqs[self->num_reqs-1] : NULL;
+		if (req && (req->first_sector + req->num_sectors) == first_sector && (req->data_offset + req->num_sectors) == self->pool_used &&
+			(!self->erase_sectors || (first_sector % self->erase_sectors) != 0)) {
+			req->num_sectors += num_sectors;
+		} else {
+			req = &self->reqs[self->num_reqs++];
+			req->first_sector = first_sector;
+			req->num_sectors = num_sectors;
+			req->data_offset = self->pool_used;
+		}
+
+		self->pool_used += num_sectors;
+	}
+
+	return ret;
+}
+
+static bool _dvmDiscSchedCheckBlock(DvmDiscSched* self, sec_t block_sector)
+{
+	const unsigned erase_sz = self->erase_sectors;
+
+	// Calculate how much of the erase block is queued
+	unsigned queued = 0;
+	for (unsigned i = 0; i < self->num_reqs; i ++) {
+		const DvmDiscSchedReq* req = &self->reqs[i];
+		if (req->first_sector >= block_sector && req->first_sector < block_sector + erase_sz) {
+			queued += req->num_sectors;
+		}
+	}
+
+	// Keep partially filled erase blocks queued
+	if (queued < erase_sz) {
+		return true;
+	}
+
+	// Assemble the whole erase block and write it in one aligned command
+	for (unsigned i = 0; i < self->num_reqs; i ++) {
+		const DvmDiscSchedReq* req = &self->reqs[i];
+		if (req->first_sector >= block_sector && req->first_sector < block_sector + erase_sz) {
+			memcpy(self->merge_buf + (req->first_sector - block_sector)*self->base.sector_sz,
+				_dvmDiscSchedReqGetData(self, req), req->num_sectors*self->base.sector_sz);
+		}
+	}
+
+	dvmDebug(" erase block %lx\n", block_sector);
+	_dvmDiscSchedRemove(self, block_sector, erase_sz);
+	return _dvmDiscSchedWriteInner(self, self->merge_buf, block_sector, erase_sz);
+}
+
+static bool _dvmDiscSchedQueueErase(DvmDiscSched* self, const uint8_t* buffer, sec_t first_sector, sec_t num_sectors)
+{
+	const unsigned erase_sz = self->erase_sectors;
+
+	bool ret = true;
+	while (ret && num_sectors) {
+		sec_t block_sector = first_sector - first_sector % erase_sz;
+		sec_t block_offset = first_sector - block_sector;
+		sec_t cur_sectors;
+
+		if (block_offset == 0 && num_sectors >= erase_sz) {
+			// Whole erase blocks supersede whatever is queued for them
+			cur_sectors = num_sectors - num_sectors % erase_sz;
+			_dvmDiscSchedRemove(self, first_sector, cur_sectors);
+			ret = _dvmDiscSchedWriteInner(self, buffer, first_sector, cur_sectors);
+		} else {
+			// Gather partial erase block writes until the block fills up
+			sec_t max_cur_sectors = erase_sz - block_offset;
+			cur_sectors = num_sectors < max_cur_sectors ? num_sectors : max_cur_sectors;
+			ret = _dvmDiscSchedQueue(self, buffer, first_sector, cur_sectors);
+			if (ret) {
+				ret = _dvmDiscSchedCheckBlock(self, block_sector);
+			}
+		}
+
+		buffer += cur_sectors*self->base.sector_sz;
+		first_sector += cur_sectors;
+		num_sectors -= cur_sectors;
+	}
+
+	return ret;
+}
+
+static bool _dvmDiscSchedWriteSectors(DvmDisc* self_, const void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	DvmDiscSched* self = (DvmDiscSched*)self_;
+	__lock_acquire(self->lock);
+	dvmDebug("schedWrite(%p,0x%lx,%lu)\n", buffer, first_sector, num_sectors);
+
+	bool ret;
+	self->stats.sectors_submitted += num_sectors;
+	if (self->erase_sectors) {
+		ret = _dvmDiscSchedQueueErase(self, (const uint8_t*)buffer, first_sector, num_sectors);
+	} else {
+		ret = _dvmDiscSchedQueue(self, (const uint8_t*)buffer, first_sector, num_sectors);
+	}
+
+	__lock_release(self->lock);
+	return ret;
+}
+
+static bool _dvmDiscSchedTrim(DvmDisc* self_, sec_t first_sector, sec_t num_sectors)
+{
+	DvmDiscSched* self = (DvmDiscSched*)self_;
+	__lock_acquire(self->lock);
+	dvmDebug("schedTrim(0x%lx,%lu)\n", first_sector, num_sectors);
+
+	bool ret = true;
+
+	// Queued writes to discarded sectors need not be issued at all
+	_dvmDiscSchedRemove(self, first_sector, num_sectors);
+
+	// Writes straddling the range must land before the discard
+	for (unsigned i = 0; i < self->num_reqs; i ++) {
+		if (_dvmDiscSchedOverlaps(&self->reqs[i], first_sector, num_sectors)) {
+			ret = _dvmDiscSchedDrain(self);
+			break;
+		}
+	}
+
+	if (ret) {
+		ret = dvmDiscTrim(self->inner, first_sector, num_sectors);
+	}
+
+	__lock_release(self->lock);
+	return ret;
+}
+
+static const DvmDiscIface s_dvmDiscSchedIface = {
+	.destroy       = _dvmDiscSchedDestroy,
+	.read_sectors  = _dvmDiscSchedReadSectors,
+	.write_sectors = _dvmDiscSchedWriteSectors,
+	.flush         = _dvmDiscSchedFlush,
+	.trim          = _dvmDiscSchedTrim,
+};
+
+DvmDisc* dvmDiscSchedCreate(DvmDisc* inner_disc, unsigned queue_sectors, unsigned merge_sectors, unsigned deadline, unsigned erase_sectors)
+{
+	queue_sectors = queue_sectors*512U / inner_disc->sector_sz;
+	merge_sectors = merge_sectors*512U / inner_disc->sector_sz;
+	erase_sectors = erase_sectors*512U / inner_disc->sector_sz;
+
+	// Erase block combining needs room to assemble at least two erase blocks
+	if (erase_sectors) {
+		if (queue_sectors < 2*erase_sectors) {
+			queue_sectors = 2*erase_sectors;
+		}
+		if (merge_sectors < erase_sectors) {
+			merge_sectors = erase_sectors;
+		}
+	}
+
+	// Merging past the transfer limit of the inner disc would only be split up again
+	const unsigned max_sectors = inner_disc->caps.max_sectors;
+	if (max_sectors && merge_sectors > max_sectors) {
+		merge_sectors = max_sectors > erase_sectors ? max_sectors : erase_sectors;
+	}
+
+	// Parameter validation
+	if (!queue_sectors || !deadline || !(inner_disc->features & FEATURE_MEDIUM_CANWRITE)) {
+		return inner_disc;
+	}
+
+	DvmDiscSched* disc = (DvmDiscSched*)malloc(sizeof(DvmDiscSched) + queue_sectors*sizeof(DvmDiscSchedReq));
+	if (!disc) {
+		return inner_disc;
+	}
+
+	memset(disc, 0, sizeof(DvmDiscSched));
+
+	size_t align = inner_disc->caps.align > LIBDVM_BUFFER_ALIGN ? inner_disc->caps.align : LIBDVM_BUFFER_ALIGN;
+	disc->pool = (uint8_t*)aligned_alloc(align, (queue_sectors*inner_disc->sector_sz + align - 1) &~ (align - 1));
+	if (merge_sectors) {
+		disc->merge_buf = (uint8_t*)aligned_alloc(align, (merge_sectors*inner_disc->sector_sz + align - 1) &~ (align - 1));
+	}
+
+	if (!disc->pool || (merge_sectors && !disc->merge_buf)) {
+		free(disc->merge_buf);
+		free(disc->pool);
+		free(disc);
+		return inner_disc;
+	}
+
+	disc->base.vt = &s_dvmDiscSchedIface;
+	disc->base.io_type = inner_disc->io_type;
+	disc->base.features = inner_disc->features;
+	disc->base.num_sectors = inner_disc->num_sectors;
+	disc->base.sector_sz = inner_disc->sector_sz;
+	disc->base.block_sz = inner_disc->block_sz;
+	disc->base.caps = inner_disc->caps;
+	__lock_init(disc->lock);
+	dvmDiscAddUser(inner_disc);
+	disc->inner = inner_disc;
+	disc->pool_sectors = queue_sectors;
+	disc->merge_sectors = merge_sectors;
+	disc->erase_sectors = erase_sectors;
+	disc->deadline = deadline;
+
+	return &disc->base;
+}
+
+bool dvmDiscSchedGetStats(DvmDisc* disc, DvmSchedStats* out, bool reset)
+{
+	if (!disc || disc->vt != &s_dvmDiscSchedIface) {
+		return false;
+	}
+
+	DvmDiscSched* self = (DvmDiscSched*)disc;
+	__lock_acquire(self->lock);
+
+	if (out) {
+		*out = self->stats;
+	}
+
+	if (reset) {
+		memset(&self->stats, 0, sizeof(self->stats));
+	}
+
+	__lock_release(self->lock);
+	return true;
+}
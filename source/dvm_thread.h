@@ -0,0 +1,12 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#pragma once
+#include <stdbool.h>
+
+// Worker threads provided by backends that support them (callers declare
+// these weak, as backends without threads do not provide them). Started
+// threads run entry(arg), and are finished exactly once: joined after entry
+// returned, or released (without waiting) if abandoned.
+void* _dvmThreadStart(void (*entry)(void* arg), void* arg);
+void _dvmThreadFinish(void* thread, bool join);
+void _dvmThreadSleep(void);
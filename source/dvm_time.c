@@ -0,0 +1,27 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#include <time.h>
+#include <dvm.h>
+
+static uint64_t _dvmClockTimeNs(void)
+{
+	// Platforms without a monotonic clock report 0, which only degrades timing data
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+		return 0;
+	}
+
+	return (uint64_t)ts.tv_sec*1000000000U + ts.tv_nsec;
+}
+
+static DvmTimeSourceFn s_dvmTimeSource = _dvmClockTimeNs;
+
+void dvmSetTimeSource(DvmTimeSourceFn fn)
+{
+	s_dvmTimeSource = fn ? fn : _dvmClockTimeNs;
+}
+
+uint64_t _dvmGetTimeNs(void)
+{
+	return s_dvmTimeSource();
+}
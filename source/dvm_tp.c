@@ -0,0 +1,174 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#include <stdlib.h>
+#include <string.h>
+#include <sys/lock.h>
+#include <dvm.h>
+#include "dvm_debug.h"
+
+uint64_t _dvmGetTimeNs(void);
+
+// Cores without an atomic compare-and-swap (ARMv4/v5) serialize writers
+// through a lock instead. These are all single core, so it is held briefly,
+// and they need no barriers (which would otherwise become library calls).
+#ifdef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_4
+#define DVM_TP_LOCKFREE 1
+#define DVM_TP_ACQUIRE  __ATOMIC_ACQUIRE
+#define DVM_TP_RELEASE  __ATOMIC_RELEASE
+#else
+#define DVM_TP_LOCKFREE 0
+#define DVM_TP_ACQUIRE  __ATOMIC_RELAXED
+#define DVM_TP_RELEASE  __ATOMIC_RELAXED
+#endif
+
+unsigned _dvmTpMask;
+
+static DvmTpRecord* s_dvmTpRing;
+static uint32_t s_dvmTpRingMask;
+static uint32_t s_dvmTpHead;
+static uint32_t s_dvmTpTail;
+static uint32_t s_dvmTpDropped;
+__LOCK_INIT(static, s_dvmTpLock);
+
+uint64_t _dvmTpPackName(const char* name)
+{
+	uint64_t ret = 0;
+	memcpy(&ret, name, strnlen(name, sizeof(ret)));
+	return ret;
+}
+
+void _dvmTpEmit(unsigned id, uint64_t a, uint64_t b, uint64_t c)
+{
+	DvmTpRecord* ring = s_dvmTpRing;
+	if (!ring) {
+		return;
+	}
+
+	uint64_t timestamp = _dvmGetTimeNs();
+
+#if DVM_TP_LOCKFREE
+	uint32_t pos = __atomic_fetch_add(&s_dvmTpHead, 1, __ATOMIC_RELAXED);
+#else
+	__lock_acquire(s_dvmTpLock);
+	uint32_t pos = s_dvmTpHead++;
+#endif
+
+	// The sequence number is cleared while the record is being written, so
+	// that readers can tell torn records apart
+	DvmTpRecord* rec = &ring[pos & s_dvmTpRingMask];
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+#if DVM_TP_LOCKFREE
+	__atomic_thread_fence(DVM_TP_RELEASE);
+#endif
+
+	rec->timestamp_ns = timestamp;
+	rec->arg[0] = a;
+	rec->arg[1] = b;
+	rec->arg[2] = c;
+	rec->id = id;
+	rec->reserved = 0;
+
+#if DVM_TP_LOCKFREE
+	__atomic_store_n(&rec->seq, pos + 1, DVM_TP_RELEASE);
+#else
+	rec->seq = pos + 1;
+	__lock_release(s_dvmTpLock);
+#endif
+}
+
+bool dvmTpStart(size_t max_records, unsigned mask)
+{
+	__lock_acquire(s_dvmTpLock);
+
+	// The ring is allocated once and lives until the process exits, as
+	// writers never synchronize with its owner
+	if (!s_dvmTpRing) {
+		if (!max_records || max_records > (1U << 24)) {
+			__lock_release(s_dvmTpLock);
+			return false;
+		}
+
+		uint32_t num_records = 1;
+		while (num_records < max_records) {
+			num_records <<= 1;
+		}
+
+		DvmTpRecord* ring = (DvmTpRecord*)calloc(num_records, sizeof(DvmTpRecord));
+		if (!ring) {
+			__lock_release(s_dvmTpLock);
+			return false;
+		}
+
+		s_dvmTpRingMask = num_records - 1;
+		__atomic_store_n(&s_dvmTpRing, ring, DVM_TP_RELEASE);
+	}
+
+	_dvmTpMask = mask;
+	__lock_release(s_dvmTpLock);
+	return true;
+}
+
+unsigned dvmTpSetMask(unsigned mask)
+{
+	unsigned prev = _dvmTpMask;
+	_dvmTpMask = mask;
+	return prev;
+}
+
+bool dvmTpGetHeader(DvmTpHeader* out)
+{
+	if (!out) {
+		return false;
+	}
+
+	memset(out, 0, sizeof(*out));
+	out->magic = DVM_TP_MAGIC;
+	out->version = DVM_TP_VERSION;
+	out->record_sz = sizeof(DvmTpRecord);
+
+	__lock_acquire(s_dvmTpLock);
+	out->num_dropped = s_dvmTpDropped;
+	__lock_release(s_dvmTpLock);
+
+	return s_dvmTpRing != NULL;
+}
+
+size_t dvmTpRead(DvmTpRecord* out, size_t max_records)
+{
+	DvmTpRecord* ring = s_dvmTpRing;
+	if (!ring || !out) {
+		return 0;
+	}
+
+	__lock_acquire(s_dvmTpLock);
+
+	// Skip records that were overwritten since the last read
+	uint32_t head = __atomic_load_n(&s_dvmTpHead, DVM_TP_ACQUIRE);
+	uint32_t num_records = s_dvmTpRingMask + 1;
+	if (head - s_dvmTpTail > num_records) {
+		s_dvmTpDropped += head - s_dvmTpTail - num_records;
+		s_dvmTpTail = head - num_records;
+	}
+
+	size_t count = 0;
+	while (count < max_records && s_dvmTpTail != head) {
+		const DvmTpRecord* rec = &ring[s_dvmTpTail & s_dvmTpRingMask];
+		uint32_t seq = __atomic_load_n(&rec->seq, DVM_TP_ACQUIRE);
+		out[count] = *rec;
+#if DVM_TP_LOCKFREE
+		__atomic_thread_fence(DVM_TP_ACQUIRE);
+#endif
+
+		// Records still being written (or already reused) are dropped
+		if (seq == s_dvmTpTail + 1 && __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == seq) {
+			out[count++].seq = seq;
+		} else {
+			s_dvmTpDropped ++;
+		}
+
+		s_dvmTpTail ++;
+	}
+
+	__lock_release(s_dvmTpLock);
+	return count;
+}
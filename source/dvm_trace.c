@@ -0,0 +1,261 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#include <stdlib.h>
+#include <string.h>
+#include <sys/lock.h>
+#include <dvm.h>
+#include "dvm_debug.h"
+
+uint64_t _dvmGetTimeNs(void);
+
+typedef struct DvmDiscTrace {
+	DvmDisc base;
+
+	_LOCK_T lock;
+	DvmDisc* inner;
+	uint64_t epoch;
+	size_t max_records;
+	size_t next_record;
+	size_t num_records;
+	uint32_t num_dropped;
+
+	DvmTraceRecord records[];
+} DvmDiscTrace;
+
+// Hint only: set by the filesystem glue around its disc accesses, not per thread
+static unsigned s_dvmIoClass;
+
+unsigned dvmSetIoClass(unsigned io_class)
+{
+	unsigned prev = s_dvmIoClass;
+	s_dvmIoClass = io_class;
+	return prev;
+}
+
+static void _dvmDiscTraceLog(DvmDiscTrace* self, unsigned op, unsigned flags, sec_t sector, sec_t num_sectors, uint64_t start, uint64_t end)
+{
+	uint64_t duration = end - start;
+
+	__lock_acquire(self->lock);
+
+	// Overwrite the oldest record once the ring is full
+	DvmTraceRecord* rec = &self->records[self->next_record];
+	if (++self->next_record == self->max_records) {
+		self->next_record = 0;
+	}
+	if (self->num_records < self->max_records) {
+		self->num_records ++;
+	} else {
+		self->num_dropped ++;
+	}
+
+	memset(rec, 0, sizeof(*rec));
+	rec->timestamp_ns = start - self->epoch;
+	rec->sector = sector;
+	rec->num_sectors = num_sectors;
+	rec->duration_ns = duration < UINT32_MAX ? duration : UINT32_MAX;
+	rec->op = op;
+	rec->flags = flags;
+	rec->io_class = s_dvmIoClass;
+
+	__lock_release(self->lock);
+}
+
+static void _dvmDiscTraceDestroy(DvmDisc* self_)
+{
+	DvmDiscTrace* self = (DvmDiscTrace*)self_;
+
+	dvmDiscRemoveUser(self->inner);
+	__lock_close(self->lock);
+	free(self);
+}
+
+static bool _dvmDiscTraceReadSectors(DvmDisc* self_, void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	DvmDiscTrace* self = (DvmDiscTrace*)self_;
+
+	uint64_t start = _dvmGetTimeNs();
+	bool ret = self->inner->vt->read_sectors(self->inner, buffer, first_sector, num_sectors, is_partial);
+	_dvmDiscTraceLog(self, DVM_TRACE_OP_READ, (is_partial ? DVM_TRACE_PARTIAL : 0) | (ret ? 0 : DVM_TRACE_FAILED),
+		first_sector, num_sectors, start, _dvmGetTimeNs());
+
+	return ret;
+}
+
+static bool _dvmDiscTraceWriteSectors(DvmDisc* self_, const void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	DvmDiscTrace* self = (DvmDiscTrace*)self_;
+
+	uint64_t start = _dvmGetTimeNs();
+	bool ret = self->inner->vt->write_sectors(self->inner, buffer, first_sector, num_sectors, is_partial);
+	_dvmDiscTraceLog(self, DVM_TRACE_OP_WRITE, (is_partial ? DVM_TRACE_PARTIAL : 0) | (ret ? 0 : DVM_TRACE_FAILED),
+		first_sector, num_sectors, start, _dvmGetTimeNs());
+
+	return ret;
+}
+
+static bool _dvmDiscTraceFlush(DvmDisc* self_)
+{
+	DvmDiscTrace* self = (DvmDiscTrace*)self_;
+
+	uint64_t start = _dvmGetTimeNs();
+	bool ret = dvmDiscFlush(self->inner);
+	_dvmDiscTraceLog(self, DVM_TRACE_OP_FLUSH, ret ? 0 : DVM_TRACE_FAILED, 0, 0, start, _dvmGetTimeNs());
+
+	return ret;
+}
+
+static bool _dvmDiscTraceTrim(DvmDisc* self_, sec_t first_sector, sec_t num_sectors)
+{
+	DvmDiscTrace* self = (DvmDiscTrace*)self_;
+
+	uint64_t start = _dvmGetTimeNs();
+	bool ret = dvmDiscTrim(self->inner, first_sector, num_sectors);
+	_dvmDiscTraceLog(self, DVM_TRACE_OP_TRIM, ret ? 0 : DVM_TRACE_FAILED, first_sector, num_sectors, start, _dvmGetTimeNs());
+
+	return ret;
+}
+
+static const DvmDiscIface s_dvmDiscTraceIface = {
+	.destroy       = _dvmDiscTraceDestroy,
+	.read_sectors  = _dvmDiscTraceReadSectors,
+	.write_sectors = _dvmDiscTraceWriteSectors,
+	.flush         = _dvmDiscTraceFlush,
+	.trim          = _dvmDiscTraceTrim,
+};
+
+DvmDisc* dvmDiscTraceCreate(DvmDisc* inner_disc, size_t max_records)
+{
+	// Parameter validation
+	if (!inner_disc || !max_records || max_records > (SIZE_MAX - sizeof(DvmDiscTrace)) / sizeof(DvmTraceRecord)) {
+		return NULL;
+	}
+
+	DvmDiscTrace* disc = (DvmDiscTrace*)malloc(sizeof(DvmDiscTrace) + max_records*sizeof(DvmTraceRecord));
+	if (!disc) {
+		return NULL;
+	}
+
+	memset(disc, 0, sizeof(DvmDiscTrace));
+	disc->base.vt = &s_dvmDiscTraceIface;
+	disc->base.io_type = inner_disc->io_type;
+	disc->base.features = inner_disc->features;
+	disc->base.num_sectors = inner_disc->num_sectors;
+	disc->base.sector_sz = inner_disc->sector_sz;
+	disc->base.block_sz = inner_disc->block_sz;
+	disc->base.caps = inner_disc->caps;
+	__lock_init(disc->lock);
+	dvmDiscAddUser(inner_disc);
+	disc->inner = inner_disc;
+	disc->epoch = _dvmGetTimeNs();
+	disc->max_records = max_records;
+
+	return &disc->base;
+}
+
+bool dvmDiscTraceGetHeader(DvmDisc* disc, DvmTraceHeader* out)
+{
+	if (!disc || disc->vt != &s_dvmDiscTraceIface || !out) {
+		return false;
+	}
+
+	DvmDiscTrace* self = (DvmDiscTrace*)disc;
+	memset(out, 0, sizeof(*out));
+	out->magic = DVM_TRACE_MAGIC;
+	out->version = DVM_TRACE_VERSION;
+	out->record_sz = sizeof(DvmTraceRecord);
+	out->sector_sz = disc->sector_sz;
+	out->num_sectors = disc->num_sectors;
+
+	__lock_acquire(self->lock);
+	out->num_dropped = self->num_dropped;
+	__lock_release(self->lock);
+
+	return true;
+}
+
+size_t dvmDiscTraceRead(DvmDisc* disc, DvmTraceRecord* out, size_t max_records)
+{
+	if (!disc || disc->vt != &s_dvmDiscTraceIface) {
+		return 0;
+	}
+
+	DvmDiscTrace* self = (DvmDiscTrace*)disc;
+	__lock_acquire(self->lock);
+
+	// Hand out the oldest records first, removing them from the ring
+	size_t count = self->num_records < max_records ? self->num_records : max_records;
+	size_t pos = (self->next_record + self->max_records - self->num_records) % self->max_records;
+	for (size_t i = 0; i < count; i ++) {
+		out[i] = self->records[pos];
+		if (++pos == self->max_records) {
+			pos = 0;
+		}
+	}
+
+	self->num_records -= count;
+	__lock_release(self->lock);
+
+	return count;
+}
+
+size_t dvmDiscTraceReplay(DvmDisc* disc, const DvmTraceRecord* records, size_t num_records)
+{
+	if (!disc) {
+		return 0;
+	}
+
+	// Writes carry whatever the previous reads left in the buffer: only replay
+	// traces containing writes against scratch discs
+	size_t align = disc->caps.align > LIBDVM_BUFFER_ALIGN ? disc->caps.align : LIBDVM_BUFFER_ALIGN;
+	uint8_t* buf = NULL;
+	size_t buf_sz = 0;
+	size_t num_ok = 0;
+
+	for (size_t i = 0; i < num_records; i ++) {
+		const DvmTraceRecord* rec = &records[i];
+		bool is_io = rec->op == DVM_TRACE_OP_READ || rec->op == DVM_TRACE_OP_WRITE;
+		bool is_partial = (rec->flags & DVM_TRACE_PARTIAL) != 0;
+
+		if ((is_io || rec->op == DVM_TRACE_OP_TRIM) &&
+			(rec->sector >= disc->num_sectors || rec->num_sectors > disc->num_sectors - rec->sector)) {
+			dvmDebug("replay: record %zu out of bounds\n", i);
+			continue;
+		}
+
+		size_t needed = ((size_t)rec->num_sectors*disc->sector_sz + align - 1) &~ (align - 1);
+		if (is_io && needed > buf_sz) {
+			free(buf);
+			buf = (uint8_t*)aligned_alloc(align, needed);
+			if (!buf) {
+				break;
+			}
+
+			memset(buf, 0, needed);
+			buf_sz = needed;
+		}
+
+		bool ret = false;
+		switch (rec->op) {
+			case DVM_TRACE_OP_READ:
+				ret = disc->vt->read_sectors(disc, buf, rec->sector, rec->num_sectors, is_partial);
+				break;
+			case DVM_TRACE_OP_WRITE:
+				ret = disc->vt->write_sectors(disc, buf, rec->sector, rec->num_sectors, is_partial);
+				break;
+			case DVM_TRACE_OP_FLUSH:
+				ret = dvmDiscFlush(disc);
+				break;
+			case DVM_TRACE_OP_TRIM:
+				ret = dvmDiscTrim(disc, rec->sector, rec->num_sectors);
+				break;
+		}
+
+		if (ret) {
+			num_ok ++;
+		}
+	}
+
+	free(buf);
+	return num_ok;
+}
@@ -3,23 +3,803 @@
 #include <stdalign.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <limits.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/lock.h>
 #include <dvm.h>
 #include "dvm_debug.h"
+#include "dvm_dentry.h"
+#include "dvm_thread.h"
+
+#ifdef LIBDVM_HOSTED
+// Hosted builds dispatch the working directory through the device table
+#define chdir dvmHostChdir
+#endif
 
 #define MAX_DRIVERS 8
 
+// Mount states (volumes start out pending when mounted lazily)
+#define VOLUME_MOUNTED 0
+#define VOLUME_PENDING 1
+#define VOLUME_FAILED  2
+
+// Cores without atomics (ARMv4/v5) are single core and need no barriers
+#ifdef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_4
+#define VOLUME_ACQUIRE __ATOMIC_ACQUIRE
+#define VOLUME_RELEASE __ATOMIC_RELEASE
+#else
+#define VOLUME_ACQUIRE __ATOMIC_RELAXED
+#define VOLUME_RELEASE __ATOMIC_RELAXED
+#endif
+
 static const DvmFsDriver* s_dvmFsDrvTable[MAX_DRIVERS];
 
+extern unsigned g_dvmLazyMount;
+extern unsigned g_dvmDentryCacheSize;
+extern unsigned g_dvmVolumeStats;
+
+uint64_t _dvmGetTimeNs(void);
+bool _dvmDiscCacheWriteThrough(DvmDisc* disc, bool enable);
+
+// Backends without threads do not provide these
+void* _dvmThreadStart(void (*entry)(void* arg), void* arg) __attribute__((weak));
+void _dvmThreadFinish(void* thread, bool join) __attribute__((weak));
+
+// Open files are prefixed with a handle linking them into their volume,
+// so that dvmSyncAll can find the ones with unwritten changes
+typedef struct DvmVolumeHandle DvmVolumeHandle;
+
+struct DvmVolumeHandle {
+	DvmVolumeHandle* prev;
+	DvmVolumeHandle* next;
+	bool dirty;
+
+	alignas(2*sizeof(void*)) uint8_t file_struct[];
+};
+
 typedef struct DvmVolume {
 	devoptab_t dotab;
 	const DvmFsDriver* fsdrv;
 	char namebuf[32];
 
+	_LOCK_T stats_lock;
+	DvmVolumeStats stats;
+	bool stats_enabled;
+
+	// Lazy mounting: the volume holds a reference to the disc until mounted
+	// (the driver holds its own afterwards)
+	_LOCK_T mount_lock;
+	unsigned mount_state;
+	DvmDisc* disc;
+
+	// Open files, and whether anything changed since the last dvmSyncAll.
+	// The list is guarded by handle_lock, the dirty flags by stats_lock.
+	_LOCK_T handle_lock;
+	DvmVolumeHandle* handles;
+	bool dirty;
+	DvmPartInfo part;
+
+	DvmDentryCache* dcache;
+
+	DvmMountOptions options;
+	DvmDisc* wt_disc;      // Disc cache written through for this volume
+	uint64_t dirty_since;  // Time of the first write since the last commit (0 = none)
+
 	alignas(2*sizeof(void*)) uint8_t device_data[];
 } DvmVolume;
 
+//-----------------------------------------------------------------------------
+// Statistics: the callbacks of the driver are interposed with wrappers that
+// time them, if enabled when mounting. libsysbase passes the deviceData of
+// the volume in every call.
+//-----------------------------------------------------------------------------
+
+static inline DvmVolume* _dvmVolumeFromReent(struct _reent* r)
+{
+	return (DvmVolume*)((uint8_t*)r->deviceData - offsetof(DvmVolume, device_data));
+}
+
+static inline const devoptab_t* _dvmVolumeOps(DvmVolume* vol)
+{
+	return vol->fsdrv->dotab_template;
+}
+
+static inline DvmVolumeHandle* _dvmVolumeHandle(void* fd)
+{
+	return (DvmVolumeHandle*)fd;
+}
+
+// The driver's file structure follows the handle
+static inline void* _dvmVolumeFile(void* fd)
+{
+	return _dvmVolumeHandle(fd)->file_struct;
+}
+
+// Called with stats_lock held
+static inline void _dvmVolumeSetDirty(DvmVolume* vol, DvmVolumeHandle* h)
+{
+	vol->dirty = true;
+	if (h) {
+		h->dirty = true;
+	}
+}
+
+static bool _dvmVolumeMountPending(DvmVolume* vol)
+{
+	__lock_acquire(vol->mount_lock);
+
+	// Only the first caller mounts, the rest wait for its result
+	if (vol->mount_state == VOLUME_PENDING) {
+		bool ok = vol->fsdrv->mount(&vol->dotab, vol->disc, &vol->part);
+		dvmTp(DVM_TP_VOLUME_LAZY_MOUNT, _dvmTpPackName(vol->dotab.name), ok);
+		if (ok) {
+			// The driver holds its own reference now
+			dvmDiscRemoveUser(vol->disc);
+		}
+
+		__atomic_store_n(&vol->mount_state, ok ? VOLUME_MOUNTED : VOLUME_FAILED, VOLUME_RELEASE);
+	}
+
+	bool ret = vol->mount_state == VOLUME_MOUNTED;
+	__lock_release(vol->mount_lock);
+	return ret;
+}
+
+static inline bool _dvmVolumeReady(DvmVolume* vol, struct _reent* r)
+{
+	if (__atomic_load_n(&vol->mount_state, VOLUME_ACQUIRE) == VOLUME_MOUNTED) {
+		return true;
+	}
+
+	if (!_dvmVolumeMountPending(vol)) {
+		r->_errno = EIO;
+		return false;
+	}
+
+	return true;
+}
+
+static inline bool _dvmVolumeReadyToWrite(DvmVolume* vol, struct _reent* r)
+{
+	if (vol->options.flags & DVM_MOUNT_READONLY) {
+		r->_errno = EROFS;
+		return false;
+	} else if (!_dvmVolumeReady(vol, r)) {
+		return false;
+	}
+
+	// The change is about to happen, successful or not
+	__lock_acquire(vol->stats_lock);
+	_dvmVolumeSetDirty(vol, NULL);
+	__lock_release(vol->stats_lock);
+	return true;
+}
+
+static bool _dvmIsRootPath(const char* path)
+{
+	const char* colon = strchr(path, ':');
+	if (colon) {
+		path = colon + 1;
+	}
+
+	return path[0] == 0 || (path[0] == '/' && path[1] == 0);
+}
+
+static inline uint64_t _dvmVolumeStart(DvmVolume* vol)
+{
+	return vol->stats_enabled ? _dvmGetTimeNs() : 0;
+}
+
+static void _dvmVolumeCount(DvmVolume* vol, unsigned op, uint64_t start, bool ok)
+{
+	if (!vol->stats_enabled) {
+		return;
+	}
+
+	uint64_t ns = _dvmGetTimeNs() - start;
+
+	__lock_acquire(vol->stats_lock);
+
+	DvmVolumeOpStats* st = &vol->stats.ops[op];
+	st->count ++;
+	st->total_ns += ns;
+	if (ns > st->max_ns) {
+		st->max_ns = ns;
+	}
+	if (!ok) {
+		st->errors ++;
+	}
+
+	__lock_release(vol->stats_lock);
+}
+
+//-----------------------------------------------------------------------------
+// Path lookup cache: answers for missing paths come from it directly, and
+// paths with a known inode are handed to the driver by inode if it can. The
+// rest are looked up by the driver as usual, and the results are recorded.
+//-----------------------------------------------------------------------------
+
+static void _dvmVolumeCountDentry(DvmVolume* vol, bool hit)
+{
+	if (!vol->stats_enabled) {
+		return;
+	}
+
+	__lock_acquire(vol->stats_lock);
+	if (hit) {
+		vol->stats.dentry_hits ++;
+	} else {
+		vol->stats.dentry_misses ++;
+	}
+	__lock_release(vol->stats_lock);
+}
+
+static void _dvmVolumeCacheMissing(DvmVolume* vol, struct _reent* r, uint32_t ticket, const char* path)
+{
+	// Negative entries go into cached directories. Otherwise, the parent is
+	// looked up (once) so that lookups of its other missing names are
+	// answered as well, and its parent if it is missing too.
+	char* buf = NULL;
+	size_t len = strlen(path);
+	int saved_errno = r->_errno;
+
+	size_t parent_len;
+	while ((parent_len = _dvmDentryInsert(vol->dcache, ticket, buf ? buf : path, len, DENTRY_NEGATIVE, 0))) {
+		if (!buf && !(buf = strndup(path, len))) {
+			break;
+		}
+
+		struct stat st;
+		char saved = buf[parent_len];
+		buf[parent_len] = 0;
+		int ret = _dvmVolumeOps(vol)->stat_r(r, buf, &st);
+		buf[parent_len] = saved;
+
+		if (ret == 0 && S_ISDIR(st.st_mode)) {
+			_dvmDentryInsert(vol->dcache, ticket, buf, parent_len, DENTRY_DIR, st.st_ino);
+		} else if (ret != 0 && r->_errno == ENOENT) {
+			len = parent_len;
+		} else {
+			break;
+		}
+	}
+
+	free(buf);
+	r->_errno = saved_errno;
+}
+
+static int _dvmVolumeOpenCached(DvmVolume* vol, struct _reent* r, void* fd, const char* path, int flags, int mode)
+{
+	DvmDentryCache* dc = vol->dcache;
+	if (!dc) {
+		return _dvmVolumeOps(vol)->open_r(r, fd, path, flags, mode);
+	}
+
+	uint64_t ino;
+	unsigned kind = _dvmDentryLookup(dc, path, &ino);
+	if (kind == DENTRY_NEGATIVE && !(flags & O_CREAT)) {
+		_dvmVolumeCountDentry(vol, true);
+		r->_errno = ENOENT;
+		return -1;
+	}
+
+	if (kind == DENTRY_FILE && ino && vol->fsdrv->open_ino && (flags & (O_ACCMODE|O_CREAT|O_TRUNC|O_APPEND)) == O_RDONLY &&
+		vol->fsdrv->open_ino(r, vol->device_data, fd, ino, flags) == 0) {
+		_dvmVolumeCountDentry(vol, true);
+		return 0;
+	}
+
+	_dvmVolumeCountDentry(vol, false);
+	uint32_t ticket = _dvmDentryTicket(dc);
+	int ret = _dvmVolumeOps(vol)->open_r(r, fd, path, flags, mode);
+
+	if (flags & O_CREAT) {
+		// Files already known to exist are not created
+		if (kind != DENTRY_FILE) {
+			_dvmDentryInvalidate(dc, path);
+		}
+	} else if (ret >= 0) {
+		_dvmDentryInsert(dc, ticket, path, strlen(path), DENTRY_FILE, 0);
+	} else if (r->_errno == ENOENT) {
+		_dvmVolumeCacheMissing(vol, r, ticket, path);
+	}
+
+	return ret;
+}
+
+static int _dvmVolumeStatCached(DvmVolume* vol, struct _reent* r, const char* path, struct stat* st)
+{
+	DvmDentryCache* dc = vol->dcache;
+	if (!dc) {
+		return _dvmVolumeOps(vol)->stat_r(r, path, st);
+	}
+
+	uint64_t ino;
+	unsigned kind = _dvmDentryLookup(dc, path, &ino);
+	if (kind == DENTRY_NEGATIVE) {
+		_dvmVolumeCountDentry(vol, true);
+		r->_errno = ENOENT;
+		return -1;
+	}
+
+	if (kind >= DENTRY_FILE && ino && vol->fsdrv->stat_ino && vol->fsdrv->stat_ino(r, vol->device_data, ino, st) == 0) {
+		_dvmVolumeCountDentry(vol, true);
+		return 0;
+	}
+
+	_dvmVolumeCountDentry(vol, false);
+	uint32_t ticket = _dvmDentryTicket(dc);
+	int ret = _dvmVolumeOps(vol)->stat_r(r, path, st);
+
+	if (ret == 0) {
+		_dvmDentryInsert(dc, ticket, path, strlen(path), S_ISDIR(st->st_mode) ? DENTRY_DIR : DENTRY_FILE, st->st_ino);
+	} else if (r->_errno == ENOENT) {
+		_dvmVolumeCacheMissing(vol, r, ticket, path);
+	}
+
+	return ret;
+}
+
+// Checks a directory path before the driver opens it: returns false if it is known to be missing
+static bool _dvmVolumeDirLookup(DvmVolume* vol, struct _reent* r, const char* path, uint32_t* out_ticket)
+{
+	*out_ticket = 0;
+	if (!vol->dcache) {
+		return true;
+	}
+
+	uint64_t ino;
+	if (_dvmDentryLookup(vol->dcache, path, &ino) == DENTRY_NEGATIVE) {
+		_dvmVolumeCountDentry(vol, true);
+		r->_errno = ENOENT;
+		return false;
+	}
+
+	_dvmVolumeCountDentry(vol, false);
+	*out_ticket = _dvmDentryTicket(vol->dcache);
+	return true;
+}
+
+static void _dvmVolumeDirResult(DvmVolume* vol, struct _reent* r, uint32_t ticket, const char* path, bool ok)
+{
+	if (!vol->dcache) {
+		return;
+	} else if (ok) {
+		_dvmDentryInsert(vol->dcache, ticket, path, strlen(path), DENTRY_DIR, 0);
+	} else if (r->_errno == ENOENT) {
+		_dvmVolumeCacheMissing(vol, r, ticket, path);
+	}
+}
+
+static void _dvmVolumeChanged(DvmVolume* vol, const char* path)
+{
+	if (vol->dcache) {
+		_dvmDentryInvalidate(vol->dcache, path);
+	}
+}
+
+static int _dvmVolumeOpen_r(struct _reent* r, void* fd, const char* path, int flags, int mode)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	uint64_t start = _dvmVolumeStart(vol);
+	bool is_write = (flags & (O_ACCMODE|O_CREAT|O_TRUNC)) != O_RDONLY;
+	bool ready = is_write ? _dvmVolumeReadyToWrite(vol, r) : _dvmVolumeReady(vol, r);
+	DvmVolumeHandle* h = _dvmVolumeHandle(fd);
+	int ret = ready ? _dvmVolumeOpenCached(vol, r, h->file_struct, path, flags, mode) : -1;
+	_dvmVolumeCount(vol, DVM_VOLOP_OPEN, start, ret >= 0);
+
+	if (ret >= 0) {
+		// Created and truncated files have changes to write back already
+		h->prev = NULL;
+		h->dirty = (flags & (O_CREAT|O_TRUNC)) != 0;
+		__lock_acquire(vol->handle_lock);
+		h->next = vol->handles;
+		if (h->next) {
+			h->next->prev = h;
+		}
+		vol->handles = h;
+		__lock_release(vol->handle_lock);
+	}
+
+	return ret;
+}
+
+static int _dvmVolumeClose_r(struct _reent* r, void* fd)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	DvmVolumeHandle* h = _dvmVolumeHandle(fd);
+	__lock_acquire(vol->handle_lock);
+	if (h->prev) {
+		h->prev->next = h->next;
+	} else {
+		vol->handles = h->next;
+	}
+	if (h->next) {
+		h->next->prev = h->prev;
+	}
+	__lock_release(vol->handle_lock);
+
+	uint64_t start = _dvmVolumeStart(vol);
+	int ret = _dvmVolumeOps(vol)->close_r(r, h->file_struct);
+	_dvmVolumeCount(vol, DVM_VOLOP_CLOSE, start, ret >= 0);
+	return ret;
+}
+
+// Called with stats_lock held after data was written to a file. There is
+// no background thread: commits happen on the first write past the interval.
+static bool _dvmVolumeCommitDue(DvmVolume* vol)
+{
+	if (vol->options.flags & DVM_MOUNT_SYNC) {
+		return true;
+	} else if (!vol->options.commit_ms) {
+		return false;
+	}
+
+	uint64_t now = _dvmGetTimeNs();
+	if (!vol->dirty_since) {
+		vol->dirty_since = now;
+		return false;
+	} else if (now - vol->dirty_since < (uint64_t)vol->options.commit_ms*1000000U) {
+		return false;
+	}
+
+	vol->dirty_since = 0;
+	return true;
+}
+
+// Writes back an open file (the caller counts the operation)
+static int _dvmVolumeSyncHandle(DvmVolume* vol, struct _reent* r, DvmVolumeHandle* h)
+{
+	__lock_acquire(vol->stats_lock);
+	bool dirty = h->dirty;
+	h->dirty = false;
+	__lock_release(vol->stats_lock);
+
+	int ret = _dvmVolumeOps(vol)->fsync_r(r, h->file_struct);
+
+	__lock_acquire(vol->stats_lock);
+	if (ret < 0 && dirty) {
+		_dvmVolumeSetDirty(vol, h);
+	} else if (ret >= 0) {
+		vol->dirty_since = 0;
+	}
+	__lock_release(vol->stats_lock);
+
+	return ret;
+}
+
+static ssize_t _dvmVolumeWrite_r(struct _reent* r, void* fd, const char* ptr, size_t len)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	uint64_t start = _dvmVolumeStart(vol);
+	DvmVolumeHandle* h = _dvmVolumeHandle(fd);
+	ssize_t ret = _dvmVolumeOps(vol)->write_r(r, h->file_struct, ptr, len);
+	_dvmVolumeCount(vol, DVM_VOLOP_WRITE, start, ret >= 0);
+
+	if (ret > 0) {
+		__lock_acquire(vol->stats_lock);
+		if (vol->stats_enabled) {
+			vol->stats.bytes_written += ret;
+		}
+		_dvmVolumeSetDirty(vol, h);
+		bool commit = _dvmVolumeCommitDue(vol);
+		__lock_release(vol->stats_lock);
+
+		if (commit && _dvmVolumeOps(vol)->fsync_r && _dvmVolumeSyncHandle(vol, r, h) < 0) {
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+static ssize_t _dvmVolumeRead_r(struct _reent* r, void* fd, char* ptr, size_t len)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	uint64_t start = _dvmVolumeStart(vol);
+	ssize_t ret = _dvmVolumeOps(vol)->read_r(r, _dvmVolumeFile(fd), ptr, len);
+	_dvmVolumeCount(vol, DVM_VOLOP_READ, start, ret >= 0);
+
+	if (ret > 0 && vol->stats_enabled) {
+		__lock_acquire(vol->stats_lock);
+		vol->stats.bytes_read += ret;
+		__lock_release(vol->stats_lock);
+	}
+
+	return ret;
+}
+
+static off_t _dvmVolumeSeek_r(struct _reent* r, void* fd, off_t pos, int dir)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	uint64_t start = _dvmVolumeStart(vol);
+	off_t ret = _dvmVolumeOps(vol)->seek_r(r, _dvmVolumeFile(fd), pos, dir);
+	_dvmVolumeCount(vol, DVM_VOLOP_SEEK, start, ret >= 0);
+	return ret;
+}
+
+static int _dvmVolumeFstat_r(struct _reent* r, void* fd, struct stat* st)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	uint64_t start = _dvmVolumeStart(vol);
+	int ret = _dvmVolumeOps(vol)->fstat_r(r, _dvmVolumeFile(fd), st);
+	_dvmVolumeCount(vol, DVM_VOLOP_FSTAT, start, ret >= 0);
+	return ret;
+}
+
+static int _dvmVolumeStat_r(struct _reent* r, const char* file, struct stat* st)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	uint64_t start = _dvmVolumeStart(vol);
+	int ret = _dvmVolumeReady(vol, r) ? _dvmVolumeStatCached(vol, r, file, st) : -1;
+	_dvmVolumeCount(vol, DVM_VOLOP_STAT, start, ret >= 0);
+	return ret;
+}
+
+static int _dvmVolumeUnlink_r(struct _reent* r, const char* name)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	uint64_t start = _dvmVolumeStart(vol);
+	int ret = -1;
+	if (_dvmVolumeReadyToWrite(vol, r)) {
+		ret = _dvmVolumeOps(vol)->unlink_r(r, name);
+		_dvmVolumeChanged(vol, name);
+	}
+	_dvmVolumeCount(vol, DVM_VOLOP_UNLINK, start, ret >= 0);
+	return ret;
+}
+
+static int _dvmVolumeChdir_r(struct _reent* r, const char* name)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	uint64_t start = _dvmVolumeStart(vol);
+	int ret;
+	if (__atomic_load_n(&vol->mount_state, VOLUME_ACQUIRE) == VOLUME_PENDING && _dvmIsRootPath(name)) {
+		// Volumes start out at their root: setting the default device does not need a mount
+		ret = 0;
+	} else {
+		uint32_t ticket;
+		ret = -1;
+		if (_dvmVolumeReady(vol, r) && _dvmVolumeDirLookup(vol, r, name, &ticket)) {
+			ret = _dvmVolumeOps(vol)->chdir_r(r, name);
+			_dvmVolumeDirResult(vol, r, ticket, name, ret >= 0);
+		}
+	}
+	_dvmVolumeCount(vol, DVM_VOLOP_CHDIR, start, ret >= 0);
+	return ret;
+}
+
+static int _dvmVolumeRename_r(struct _reent* r, const char* oldName, const char* newName)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	uint64_t start = _dvmVolumeStart(vol);
+	int ret = -1;
+	if (_dvmVolumeReadyToWrite(vol, r)) {
+		ret = _dvmVolumeOps(vol)->rename_r(r, oldName, newName);
+		_dvmVolumeChanged(vol, oldName);
+		_dvmVolumeChanged(vol, newName);
+	}
+	_dvmVolumeCount(vol, DVM_VOLOP_RENAME, start, ret >= 0);
+	return ret;
+}
+
+static int _dvmVolumeMkdir_r(struct _reent* r, const char* path, int mode)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	uint64_t start = _dvmVolumeStart(vol);
+	int ret = -1;
+	if (_dvmVolumeReadyToWrite(vol, r)) {
+		ret = _dvmVolumeOps(vol)->mkdir_r(r, path, mode);
+		_dvmVolumeChanged(vol, path);
+	}
+	_dvmVolumeCount(vol, DVM_VOLOP_MKDIR, start, ret >= 0);
+	return ret;
+}
+
+static int _dvmVolumeRmdir_r(struct _reent* r, const char* name)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	uint64_t start = _dvmVolumeStart(vol);
+	int ret = -1;
+	if (_dvmVolumeReadyToWrite(vol, r)) {
+		ret = _dvmVolumeOps(vol)->rmdir_r(r, name);
+		_dvmVolumeChanged(vol, name);
+	}
+	_dvmVolumeCount(vol, DVM_VOLOP_RMDIR, start, ret >= 0);
+	return ret;
+}
+
+static DIR_ITER* _dvmVolumeDiropen_r(struct _reent* r, DIR_ITER* dirState, const char* path)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	uint64_t start = _dvmVolumeStart(vol);
+	DIR_ITER* ret = NULL;
+	uint32_t ticket;
+	if (_dvmVolumeReady(vol, r) && _dvmVolumeDirLookup(vol, r, path, &ticket)) {
+		ret = _dvmVolumeOps(vol)->diropen_r(r, dirState, path);
+		_dvmVolumeDirResult(vol, r, ticket, path, ret != NULL);
+	}
+	_dvmVolumeCount(vol, DVM_VOLOP_DIROPEN, start, ret != NULL);
+	return ret;
+}
+
+static int _dvmVolumeDirnext_r(struct _reent* r, DIR_ITER* dirState, char* filename, struct stat* filestat)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	uint64_t start = _dvmVolumeStart(vol);
+	int ret = _dvmVolumeOps(vol)->dirnext_r(r, dirState, filename, filestat);
+	_dvmVolumeCount(vol, DVM_VOLOP_DIRNEXT, start, ret >= 0 || r->_errno == ENOENT);
+	return ret;
+}
+
+static int _dvmVolumeDirclose_r(struct _reent* r, DIR_ITER* dirState)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	uint64_t start = _dvmVolumeStart(vol);
+	int ret = _dvmVolumeOps(vol)->dirclose_r(r, dirState);
+	_dvmVolumeCount(vol, DVM_VOLOP_DIRCLOSE, start, ret >= 0);
+	return ret;
+}
+
+static int _dvmVolumeStatvfs_r(struct _reent* r, const char* path, struct statvfs* buf)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	uint64_t start = _dvmVolumeStart(vol);
+	int ret = _dvmVolumeReady(vol, r) ? _dvmVolumeOps(vol)->statvfs_r(r, path, buf) : -1;
+	if (ret >= 0 && (vol->options.flags & DVM_MOUNT_READONLY)) {
+		buf->f_flag |= ST_RDONLY;
+	}
+	_dvmVolumeCount(vol, DVM_VOLOP_STATVFS, start, ret >= 0);
+	return ret;
+}
+
+static int _dvmVolumeFtruncate_r(struct _reent* r, void* fd, off_t len)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	uint64_t start = _dvmVolumeStart(vol);
+	DvmVolumeHandle* h = _dvmVolumeHandle(fd);
+	int ret = _dvmVolumeOps(vol)->ftruncate_r(r, h->file_struct, len);
+	if (ret >= 0) {
+		__lock_acquire(vol->stats_lock);
+		_dvmVolumeSetDirty(vol, h);
+		__lock_release(vol->stats_lock);
+	}
+	if (ret >= 0 && (vol->options.flags & DVM_MOUNT_SYNC) && _dvmVolumeOps(vol)->fsync_r) {
+		ret = _dvmVolumeSyncHandle(vol, r, h);
+	}
+	_dvmVolumeCount(vol, DVM_VOLOP_FTRUNCATE, start, ret >= 0);
+	return ret;
+}
+
+static int _dvmVolumeFsync_r(struct _reent* r, void* fd)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	uint64_t start = _dvmVolumeStart(vol);
+	int ret = _dvmVolumeSyncHandle(vol, r, _dvmVolumeHandle(fd));
+	_dvmVolumeCount(vol, DVM_VOLOP_FSYNC, start, ret >= 0);
+	return ret;
+}
+
+// Path operations that are not counted still have to mount the volume first
+
+static int _dvmVolumeLink_r(struct _reent* r, const char* existing, const char* newLink)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	if (!_dvmVolumeReadyToWrite(vol, r)) {
+		return -1;
+	}
+
+	int ret = _dvmVolumeOps(vol)->link_r(r, existing, newLink);
+	_dvmVolumeChanged(vol, newLink);
+	return ret;
+}
+
+static int _dvmVolumeChmod_r(struct _reent* r, const char* path, mode_t mode)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	return _dvmVolumeReadyToWrite(vol, r) ? _dvmVolumeOps(vol)->chmod_r(r, path, mode) : -1;
+}
+
+static int _dvmVolumeLstat_r(struct _reent* r, const char* file, struct stat* st)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	return _dvmVolumeReady(vol, r) ? _dvmVolumeOps(vol)->lstat_r(r, file, st) : -1;
+}
+
+static int _dvmVolumeUtimes_r(struct _reent* r, const char* filename, const struct timeval times[2])
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	return _dvmVolumeReadyToWrite(vol, r) ? _dvmVolumeOps(vol)->utimes_r(r, filename, times) : -1;
+}
+
+// Calls on open files that are not counted pass on the driver's file structure too
+
+static int _dvmVolumeFchmod_r(struct _reent* r, void* fd, mode_t mode)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	if (vol->options.flags & DVM_MOUNT_READONLY) {
+		r->_errno = EROFS;
+		return -1;
+	}
+
+	DvmVolumeHandle* h = _dvmVolumeHandle(fd);
+	int ret = _dvmVolumeOps(vol)->fchmod_r(r, h->file_struct, mode);
+	if (ret >= 0) {
+		__lock_acquire(vol->stats_lock);
+		_dvmVolumeSetDirty(vol, h);
+		__lock_release(vol->stats_lock);
+	}
+
+	return ret;
+}
+
+static long _dvmVolumeFpathconf_r(struct _reent* r, void* fd, int name)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	return _dvmVolumeOps(vol)->fpathconf_r(r, _dvmVolumeFile(fd), name);
+}
+
+static long _dvmVolumePathconf_r(struct _reent* r, const char* path, int name)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	return _dvmVolumeReady(vol, r) ? _dvmVolumeOps(vol)->pathconf_r(r, path, name) : -1;
+}
+
+static int _dvmVolumeSymlink_r(struct _reent* r, const char* target, const char* linkpath)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	if (!_dvmVolumeReadyToWrite(vol, r)) {
+		return -1;
+	}
+
+	int ret = _dvmVolumeOps(vol)->symlink_r(r, target, linkpath);
+	_dvmVolumeChanged(vol, linkpath);
+	return ret;
+}
+
+static ssize_t _dvmVolumeReadlink_r(struct _reent* r, const char* path, char* buf, size_t bufsiz)
+{
+	DvmVolume* vol = _dvmVolumeFromReent(r);
+	return _dvmVolumeReady(vol, r) ? _dvmVolumeOps(vol)->readlink_r(r, path, buf, bufsiz) : -1;
+}
+
+static void _dvmVolumeInterpose(devoptab_t* dotab)
+{
+	// Callbacks the driver does not implement stay NULL. Calls on open files
+	// and directories need no mount check, as opening them mounted the volume.
+#define INTERPOSE(_name, _fn) if (dotab->_name) dotab->_name = _fn
+	INTERPOSE(open_r,      _dvmVolumeOpen_r);
+	INTERPOSE(close_r,     _dvmVolumeClose_r);
+	INTERPOSE(write_r,     _dvmVolumeWrite_r);
+	INTERPOSE(read_r,      _dvmVolumeRead_r);
+	INTERPOSE(seek_r,      _dvmVolumeSeek_r);
+	INTERPOSE(fstat_r,     _dvmVolumeFstat_r);
+	INTERPOSE(stat_r,      _dvmVolumeStat_r);
+	INTERPOSE(unlink_r,    _dvmVolumeUnlink_r);
+	INTERPOSE(chdir_r,     _dvmVolumeChdir_r);
+	INTERPOSE(rename_r,    _dvmVolumeRename_r);
+	INTERPOSE(mkdir_r,     _dvmVolumeMkdir_r);
+	INTERPOSE(rmdir_r,     _dvmVolumeRmdir_r);
+	INTERPOSE(diropen_r,   _dvmVolumeDiropen_r);
+	INTERPOSE(dirnext_r,   _dvmVolumeDirnext_r);
+	INTERPOSE(dirclose_r,  _dvmVolumeDirclose_r);
+	INTERPOSE(statvfs_r,   _dvmVolumeStatvfs_r);
+	INTERPOSE(ftruncate_r, _dvmVolumeFtruncate_r);
+	INTERPOSE(fsync_r,     _dvmVolumeFsync_r);
+	INTERPOSE(link_r,      _dvmVolumeLink_r);
+	INTERPOSE(chmod_r,     _dvmVolumeChmod_r);
+	INTERPOSE(fchmod_r,    _dvmVolumeFchmod_r);
+	INTERPOSE(lstat_r,     _dvmVolumeLstat_r);
+	INTERPOSE(utimes_r,    _dvmVolumeUtimes_r);
+	INTERPOSE(fpathconf_r, _dvmVolumeFpathconf_r);
+	INTERPOSE(pathconf_r,  _dvmVolumePathconf_r);
+	INTERPOSE(symlink_r,   _dvmVolumeSymlink_r);
+	INTERPOSE(readlink_r,  _dvmVolumeReadlink_r);
+#undef INTERPOSE
+}
+
 bool dvmRegisterFsDriver(const DvmFsDriver* fsdrv)
 {
 	if (!fsdrv) {
@@ -40,7 +820,27 @@ bool dvmRegisterFsDriver(const DvmFsDriver* fsdrv)
 	return false;
 }
 
-bool dvmMountPartition(const char* name, DvmDisc* disc, DvmPartInfo* part)
+static void _dvmVolumeRelease(DvmVolume* vol)
+{
+	if (vol->mount_state == VOLUME_MOUNTED) {
+		vol->fsdrv->umount(vol->device_data);
+	} else {
+		dvmDiscRemoveUser(vol->disc);
+	}
+
+	if (vol->wt_disc) {
+		_dvmDiscCacheWriteThrough(vol->wt_disc, false);
+		dvmDiscRemoveUser(vol->wt_disc);
+	}
+
+	_dvmDentryDestroy(vol->dcache);
+	__lock_close(vol->handle_lock);
+	__lock_close(vol->mount_lock);
+	__lock_close(vol->stats_lock);
+	free(vol);
+}
+
+static bool _dvmMountPartition(const char* name, DvmDisc* disc, DvmPartInfo* part, const DvmMountOptions* options, bool lazy)
 {
 	const DvmFsDriver* fsdrv = NULL;
 	for (unsigned i = 0; i < MAX_DRIVERS && s_dvmFsDrvTable[i]; i ++) {
@@ -64,24 +864,58 @@ bool dvmMountPartition(const char* name, DvmDisc* disc, DvmPartInfo* part)
 	memcpy(&vol->dotab, fsdrv->dotab_template, sizeof(vol->dotab));
 	vol->dotab.name = vol->namebuf;
 	vol->dotab.deviceData = vol->device_data;
+	vol->dotab.structSize = sizeof(DvmVolumeHandle) + fsdrv->dotab_template->structSize;
 	vol->fsdrv = fsdrv;
+	vol->disc = disc;
 	memcpy(vol->namebuf, name, strnlen(name, sizeof(vol->namebuf)));
+	if (options) {
+		vol->options = *options;
+	}
 
-	if (!fsdrv->mount(&vol->dotab, disc, part)) {
+	if (lazy) {
+		// Defer the driver mount to the first path operation
+		dvmDiscAddUser(disc);
+		vol->mount_state = VOLUME_PENDING;
+		vol->part = *part;
+		vol->part.fstype = fsdrv->fstype;
+	} else if (!fsdrv->mount(&vol->dotab, disc, part)) {
 		free(vol);
 		return false;
 	}
 
+	__lock_init(vol->stats_lock);
+	vol->stats_enabled = g_dvmVolumeStats != 0;
+	__lock_init(vol->mount_lock);
+	__lock_init(vol->handle_lock);
+	_dvmVolumeInterpose(&vol->dotab);
+
+	// Volumes that support symlinks can reach directories through several
+	// paths: changes there drop the whole cache. The cache is optional.
+	unsigned dentry_flags = 0;
+	if (fsdrv->flags & DVM_FSDRV_CASE_INSENSITIVE) {
+		dentry_flags |= DENTRY_FOLD_CASE;
+	}
+	if (fsdrv->dotab_template->symlink_r) {
+		dentry_flags |= DENTRY_ALIASED;
+	}
+	vol->dcache = _dvmDentryCreate(g_dvmDentryCacheSize, dentry_flags);
+
+	// Only caches created by libdvm can be switched (this affects every volume on the disc)
+	if ((vol->options.flags & DVM_MOUNT_WRITE_THROUGH) && _dvmDiscCacheWriteThrough(disc, true)) {
+		dvmDiscAddUser(disc);
+		vol->wt_disc = disc;
+		dvmDiscFlush(disc); // Pages dirtied by earlier mounts
+	}
+
 	int devid = AddDevice(&vol->dotab);
 	if (devid < 0) {
-		fsdrv->umount(vol->device_data);
-		free(vol);
+		_dvmVolumeRelease(vol);
 		return false;
 	}
 
 	const devoptab_t* default_dev = GetDeviceOpTab("");
 	if (!default_dev || strcmp(default_dev->name, "stdnull") == 0) {
-		dvmDebug("Default dev %s (%d)\n", vol->dotab.name, devid);
+		dvmTp(DVM_TP_VOLUME_MOUNT, _dvmTpPackName(vol->dotab.name), devid, true);
 
 		char cwd[32+3];
 		unsigned pos = strnlen(vol->dotab.name, 32);
@@ -91,13 +925,23 @@ bool dvmMountPartition(const char* name, DvmDisc* disc, DvmPartInfo* part)
 		cwd[pos+2] = 0;
 		chdir(cwd);
 	} else {
-		dvmDebug("Added dev %s (%d)\n", vol->dotab.name, devid);
+		dvmTp(DVM_TP_VOLUME_MOUNT, _dvmTpPackName(vol->dotab.name), devid, false);
 	}
 
 	return true;
 }
 
+bool dvmMountPartition(const char* name, DvmDisc* disc, DvmPartInfo* part)
+{
+	return _dvmMountPartition(name, disc, part, NULL, g_dvmLazyMount != 0);
+}
+
 bool dvmMountVolume(const char* name, DvmDisc* disc, sec_t start_sector, const char* fstype)
+{
+	return dvmMountVolumeEx(name, disc, start_sector, fstype, NULL);
+}
+
+static bool _dvmMountVolume(const char* name, DvmDisc* disc, sec_t start_sector, const char* fstype, const DvmMountOptions* options, bool lazy)
 {
 	DvmPartInfo part;
 	part.index = 0;
@@ -106,7 +950,19 @@ bool dvmMountVolume(const char* name, DvmDisc* disc, sec_t start_sector, const c
 	part.start_sector = start_sector;
 	part.num_sectors = start_sector ? ~(sec_t)0 : disc->num_sectors;
 
-	return dvmMountPartition(name, disc, &part);
+	return _dvmMountPartition(name, disc, &part, options, lazy);
+}
+
+bool dvmMountVolumeEx(const char* name, DvmDisc* disc, sec_t start_sector, const char* fstype, const DvmMountOptions* options)
+{
+	return _dvmMountVolume(name, disc, start_sector, fstype, options, g_dvmLazyMount != 0);
+}
+
+bool _dvmMountVolumeNow(const char* name, DvmDisc* disc, sec_t start_sector, const char* fstype)
+{
+	// For filesystems that were guessed rather than identified: mounting
+	// right away lets a wrong guess fail instead of leaving a dead volume
+	return _dvmMountVolume(name, disc, start_sector, fstype, NULL, false);
 }
 
 static bool _dvmIsVolume(const devoptab_t* dotab)
@@ -117,30 +973,257 @@ static bool _dvmIsVolume(const devoptab_t* dotab)
 	return dotab->name == expected_name && dotab->deviceData == expected_devdata;
 }
 
-bool dvmUnmountVolume(const char* name)
+static const char* _dvmVolumeName(const char* name, char namebuf[32])
 {
-	if (!name) {
-		return false;
-	}
-
-	char namebuf[32];
 	if (*name && !strchr(name, ':')) {
-		size_t namelen = strnlen(name, sizeof(namebuf)-2);
+		size_t namelen = strnlen(name, 32-2);
 		memcpy(namebuf, name, namelen);
 		namebuf[namelen] = ':';
 		namebuf[namelen+1] = 0;
 		name = namebuf;
 	}
 
+	return name;
+}
+
+const DvmFsDriver* _dvmGetVolumeDriver(const devoptab_t* dotab)
+{
+	if (!dotab || !_dvmIsVolume(dotab)) {
+		return NULL;
+	}
+
+	// Callers go on to use the device data, so the volume has to be mounted
+	DvmVolume* vol = (DvmVolume*)dotab;
+	if (__atomic_load_n(&vol->mount_state, VOLUME_ACQUIRE) != VOLUME_MOUNTED && !_dvmVolumeMountPending(vol)) {
+		return NULL;
+	}
+
+	return vol->fsdrv;
+}
+
+const DvmMountOptions* _dvmGetMountOptions(const devoptab_t* dotab)
+{
+	// Drivers read the options of the volume they are mounting
+	static const DvmMountOptions s_defaults;
+	if (!dotab || !_dvmIsVolume(dotab)) {
+		return &s_defaults;
+	}
+
+	return &((DvmVolume*)dotab)->options;
+}
+
+unsigned _dvmGetFileExtents(const devoptab_t* dotab, void* fd, DvmFileExtent* out, unsigned max_extents, DvmDisc** out_disc)
+{
+	if (!dotab || !_dvmIsVolume(dotab)) {
+		return 0;
+	}
+
+	DvmVolume* vol = (DvmVolume*)dotab;
+	if (!vol->fsdrv->get_extents) {
+		return 0;
+	}
+
+	return vol->fsdrv->get_extents(vol->device_data, _dvmVolumeFile(fd), out, max_extents, out_disc);
+}
+
+bool dvmUnmountVolume(const char* name)
+{
+	if (!name) {
+		return false;
+	}
+
+	char namebuf[32];
+	name = _dvmVolumeName(name, namebuf);
+
 	const devoptab_t* dotab = GetDeviceOpTab(name);
 	if (!dotab || !_dvmIsVolume(dotab)) {
 		return false;
 	}
 
 	DvmVolume* vol = (DvmVolume*)dotab;
+	dvmTp(DVM_TP_VOLUME_UNMOUNT, _dvmTpPackName(vol->dotab.name));
 	RemoveDevice(name);
-	vol->fsdrv->umount(vol->device_data);
-	free(vol);
+	_dvmVolumeRelease(vol);
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Global sync: volumes that changed are written back one disc at a time,
+// with a worker thread per disc if the backend provides them.
+//-----------------------------------------------------------------------------
+
+typedef struct DvmSyncJob {
+	DvmDisc* disc;
+	DvmVolume** vols;
+	unsigned num_vols;
+	bool ok;
+	void* thread;
+} DvmSyncJob;
+
+static bool _dvmVolumeSync(DvmVolume* vol)
+{
+	__lock_acquire(vol->stats_lock);
+	bool dirty = vol->dirty;
+	vol->dirty = false;
+	__lock_release(vol->stats_lock);
+
+	if (!dirty) {
+		return true;
+	}
+
+#ifdef LIBDVM_HOSTED
+	struct _reent reent, *r = &reent;
+#else
+	struct _reent* r = _REENT;
+#endif
+	r->deviceData = vol->device_data;
+
+	// Closing files waits for this, so they stay valid
+	bool ok = true;
+	__lock_acquire(vol->handle_lock);
+	for (DvmVolumeHandle* h = vol->handles; h; h = h->next) {
+		if (h->dirty && _dvmVolumeOps(vol)->fsync_r && _dvmVolumeSyncHandle(vol, r, h) < 0) {
+			ok = false;
+		}
+	}
+	__lock_release(vol->handle_lock);
+
+	if (vol->fsdrv->sync && vol->fsdrv->sync(r, vol->device_data) < 0) {
+		ok = false;
+	}
+
+	if (!ok) {
+		__lock_acquire(vol->stats_lock);
+		_dvmVolumeSetDirty(vol, NULL);
+		__lock_release(vol->stats_lock);
+	}
+
+	return ok;
+}
+
+static void _dvmSyncWorker(void* arg)
+{
+	DvmSyncJob* job = (DvmSyncJob*)arg;
+
+	job->ok = true;
+	for (unsigned i = 0; i < job->num_vols; i ++) {
+		job->ok = _dvmVolumeSync(job->vols[i]) && job->ok;
+	}
+
+	job->ok = dvmDiscFlush(job->disc) && job->ok;
+}
+
+bool dvmSyncAll(void)
+{
+	DvmVolume* vols[STD_MAX];
+	DvmSyncJob jobs[STD_MAX];
+	unsigned num_vols = 0, num_jobs = 0;
+
+	// Volumes are grouped by disc, skipping those without changes
+	for (unsigned i = 3; i < STD_MAX; i ++) {
+		const devoptab_t* dotab = devoptab_list[i];
+		if (!dotab || !_dvmIsVolume(dotab)) {
+			continue;
+		}
+
+		DvmVolume* vol = (DvmVolume*)dotab;
+		__lock_acquire(vol->stats_lock);
+		bool dirty = vol->dirty;
+		__lock_release(vol->stats_lock);
+
+		if (dirty) {
+			vols[num_vols++] = vol;
+		}
+	}
+
+	for (unsigned i = 0; i < num_vols; i ++) {
+		unsigned j = 0;
+		while (j < num_jobs && jobs[j].disc != vols[i]->disc) {
+			j ++;
+		}
+
+		if (j == num_jobs) {
+			jobs[num_jobs++].disc = vols[i]->disc;
+		}
+	}
+
+	// Each job's volumes are laid out next to each other
+	DvmVolume* sorted[STD_MAX];
+	unsigned pos = 0;
+	for (unsigned j = 0; j < num_jobs; j ++) {
+		jobs[j].vols = &sorted[pos];
+		jobs[j].num_vols = 0;
+		for (unsigned i = 0; i < num_vols; i ++) {
+			if (vols[i]->disc == jobs[j].disc) {
+				jobs[j].vols[jobs[j].num_vols++] = vols[i];
+			}
+		}
+		pos += jobs[j].num_vols;
+	}
+
+	// The first job runs on the calling thread, as do those without a worker
+	bool parallel = num_jobs > 1 && _dvmThreadStart && _dvmThreadFinish;
+	for (unsigned j = 1; j < num_jobs; j ++) {
+		jobs[j].thread = parallel ? _dvmThreadStart(_dvmSyncWorker, &jobs[j]) : NULL;
+	}
+
+	bool ok = true;
+	for (unsigned j = 0; j < num_jobs; j ++) {
+		if (j == 0 || !jobs[j].thread) {
+			_dvmSyncWorker(&jobs[j]);
+		}
+	}
+
+	for (unsigned j = 0; j < num_jobs; j ++) {
+		if (j != 0 && jobs[j].thread) {
+			_dvmThreadFinish(jobs[j].thread, true);
+		}
+		ok = jobs[j].ok && ok;
+	}
+
+	return ok;
+}
+
+bool dvmGetVolumeStats(const char* name, DvmVolumeStats* out, bool reset)
+{
+	if (!name) {
+		return false;
+	}
+
+	char namebuf[32];
+	const devoptab_t* dotab = GetDeviceOpTab(_dvmVolumeName(name, namebuf));
+	if (!dotab || !_dvmIsVolume(dotab)) {
+		return false;
+	}
+
+	DvmVolume* vol = (DvmVolume*)dotab;
+	__lock_acquire(vol->stats_lock);
+
+	if (out) {
+		*out = vol->stats;
+	}
+
+	if (reset) {
+		memset(&vol->stats, 0, sizeof(vol->stats));
+	}
+
+	__lock_release(vol->stats_lock);
+	return true;
+}
+
+bool dvmGetMountOptions(const char* name, DvmMountOptions* out)
+{
+	if (!name || !out) {
+		return false;
+	}
+
+	char namebuf[32];
+	const devoptab_t* dotab = GetDeviceOpTab(_dvmVolumeName(name, namebuf));
+	if (!dotab || !_dvmIsVolume(dotab)) {
+		return false;
+	}
+
+	*out = ((DvmVolume*)dotab)->options;
 	return true;
 }
 
@@ -10,8 +10,14 @@
 #include "ext4_driver.h"
 #include "dvm_debug.h"
 
+const DvmMountOptions* _dvmGetMountOptions(const devoptab_t* dotab);
+
 static bool _ext4_mount(devoptab_t* dotab, DvmDisc* disc, DvmPartInfo* part);
 static void _ext4_umount(void* device_data);
+static int _ext4_stat_ino(struct _reent* r, void* device_data, uint64_t ino, struct stat* st);
+static int _ext4_open_ino(struct _reent* r, void* device_data, void* fd, uint64_t ino, int flags);
+static int _ext4_sync(struct _reent* r, void* device_data);
+static unsigned _ext4_get_extents(void* device_data, void* fd, DvmFileExtent* out, unsigned max_extents, DvmDisc** out_disc);
 
 static void _ext4_lock(struct ext4_lock*);
 static void _ext4_unlock(struct ext4_lock*);
@@ -87,6 +93,10 @@ const DvmFsDriver g_ext2FsDriver = {
 	.dotab_template = &_ext4_devoptab,
 	.mount          = _ext4_mount,
 	.umount         = _ext4_umount,
+	.stat_ino       = _ext4_stat_ino,
+	.open_ino       = _ext4_open_ino,
+	.sync           = _ext4_sync,
+	.get_extents    = _ext4_get_extents,
 };
 
 static const struct ext4_lock _ext4_locks = {
@@ -106,35 +116,46 @@ bool _ext4_mount(devoptab_t* dotab, DvmDisc* disc, DvmPartInfo* part)
 {
 	Ext4Volume* vol = (Ext4Volume*)dotab->deviceData;
 	vol->disc       = disc;
+	vol->direct     = false;
 
 	memcpy(&vol->locks, &_ext4_locks, sizeof(vol->locks));
 	memcpy(&vol->bdif, &_ext4_blockdev_iface, sizeof(vol->bdif));
 	vol->locks.p_user     = vol;
 	vol->bdif.ph_bsize    = disc->sector_sz;
 	vol->bdif.ph_bcnt     = disc->num_sectors;
-	vol->bdif.p_user      = disc;
+	vol->bdif.p_user      = vol;
 	vol->bdev.bdif        = &vol->bdif;
 	vol->bdev.part_offset = (uint64_t)part->start_sector * disc->sector_sz;
 	vol->bdev.part_size   = (uint64_t)part->num_sectors * disc->sector_sz;
 
-	int rc = ext4_mount(&vol->bdev, &vol->mp, !(disc->features & FEATURE_MEDIUM_CANWRITE));
+	const DvmMountOptions* options = _dvmGetMountOptions(dotab);
+	bool read_only = (options->flags & DVM_MOUNT_READONLY) || !(disc->features & FEATURE_MEDIUM_CANWRITE);
+
+	int rc = ext4_mount(&vol->bdev, &vol->mp, read_only);
 	if (rc != EOK) {
 		return false;
 	}
 
-	rc = ext4_recover(&vol->mp);
-	if (rc != EOK && rc != ENOTSUP) {
-		ext4_umount(&vol->mp);
-		return false;
+	// Forced read-only mounts leave the journal alone (replaying it writes to the disc)
+	if (!(options->flags & DVM_MOUNT_READONLY)) {
+		rc = ext4_recover(&vol->mp);
+		if (rc != EOK && rc != ENOTSUP) {
+			ext4_umount(&vol->mp);
+			return false;
+		}
 	}
 
-	rc = ext4_journal_start(&vol->mp);
-	if (rc != EOK) {
-		ext4_umount(&vol->mp);
-		return false;
+	// lwext4 only journals metadata: full data journaling falls back to ordered mode
+	vol->journal = !(options->flags & DVM_MOUNT_READONLY) && options->journal != DVM_JOURNAL_OFF;
+	if (vol->journal) {
+		rc = ext4_journal_start(&vol->mp);
+		if (rc != EOK) {
+			ext4_umount(&vol->mp);
+			return false;
+		}
 	}
 
-	__lock_init(vol->lock);
+	__lock_init_recursive(vol->lock);
 	ext4_mount_setup_locks(&vol->mp, &vol->locks);
 	dvmDiscAddUser(disc);
 	return true;
@@ -144,10 +165,84 @@ void _ext4_umount(void* device_data)
 {
 	Ext4Volume* vol = (Ext4Volume*)device_data;
 
-	ext4_journal_stop(&vol->mp);
+	if (vol->journal) {
+		ext4_journal_stop(&vol->mp);
+	}
 	ext4_umount(&vol->mp);
 	dvmDiscRemoveUser(vol->disc);
-	__lock_close(vol->lock);
+	__lock_close_recursive(vol->lock);
+}
+
+int _ext4_sync(struct _reent* r, void* device_data)
+{
+	Ext4Volume* vol = (Ext4Volume*)device_data;
+
+	// Metadata stays in the block cache while files are open
+	r->_errno = ext4_cache_flush(&vol->mp);
+	return r->_errno == EOK ? 0 : -1;
+}
+
+unsigned _ext4_get_extents(void* device_data, void* fd, DvmFileExtent* out, unsigned max_extents, DvmDisc** out_disc)
+{
+	Ext4Volume* vol = (Ext4Volume*)device_data;
+	ext4_file* fil = (ext4_file*)fd;
+	DvmDisc* disc = vol->disc;
+	const uint32_t block_sz = ext4_sb_get_block_size(&vol->mp.fs.sb);
+	const sec_t block_sectors = block_sz / disc->sector_sz;
+	const sec_t base_sector = vol->bdev.part_offset / disc->sector_sz;
+
+	// Blocks smaller than a sector cannot be addressed directly
+	if (!block_sectors) {
+		return 0;
+	}
+
+	// Write back cached file data so that the disc holds the current contents
+	if (ext4_cache_flush(fil->mp) != EOK) {
+		return 0;
+	}
+
+	struct ext4_inode_ref ref;
+	_ext4_lock(&vol->locks);
+	int rc = ext4_fs_get_inode_ref(&vol->mp.fs, fil->inode, &ref);
+	if (rc != EOK) {
+		_ext4_unlock(&vol->locks);
+		return 0;
+	}
+
+	unsigned count = 0;
+	sec_t run_end = 0;
+	uint64_t num_blocks = (fil->fsize + block_sz - 1) / block_sz;
+	for (uint64_t i = 0; i < num_blocks; i ++) {
+		ext4_fsblk_t fblock;
+		rc = ext4_fs_get_inode_dblk_idx(&ref, i, &fblock, false);
+
+		// Holes have no backing blocks: leave sparse files to file I/O
+		if (rc != EOK || !fblock) {
+			count = 0;
+			break;
+		}
+
+		sec_t sector = base_sector + (sec_t)fblock*block_sectors;
+		if (count && sector == run_end) {
+			if (count <= max_extents) {
+				out[count-1].num_sectors += block_sectors;
+			}
+		} else {
+			if (count < max_extents) {
+				out[count].sector = sector;
+				out[count].num_sectors = block_sectors;
+			}
+			count ++;
+		}
+
+		run_end = sector + block_sectors;
+	}
+
+	ext4_fs_put_inode_ref(&ref);
+	_ext4_unlock(&vol->locks);
+
+	*out_disc = disc;
+	return count;
 }
 
 static inline const char* _ext4_strip_device(const char* path)
@@ -161,7 +256,7 @@ static void _ext4_set_stat(struct stat* st, struct ext4_mountpoint* mp, ino_t in
 	struct ext4_sblock* sb = &mp->fs.sb;
 	struct ext4_blockdev* bdev = mp->fs.bdev;
 	struct ext4_blockdev_iface* bdif = bdev->bdif;
-	DvmDisc* disc = (DvmDisc*)bdif->p_user;
+	DvmDisc* disc = ((Ext4Volume*)bdif->p_user)->disc;
 
 	// Fill device fields
 	st->st_dev = disc->io_type;
@@ -207,11 +302,48 @@ int _ext4_close_r(struct _reent* r, void* fd)
 	return r->_errno == EOK ? 0 : -1;
 }
 
+static bool _ext4_direct_begin(struct _reent* r, ext4_file* fil, size_t len)
+{
+	if (!(fil->flags & O_DIRECT)) {
+		return true;
+	}
+
+	// lwext4 only transfers whole blocks without going through its cache
+	Ext4Volume* vol = (Ext4Volume*)r->deviceData;
+	const uint32_t block_sz = ext4_sb_get_block_size(&vol->mp.fs.sb);
+	if ((fil->fpos | len) & (block_sz - 1)) {
+		r->_errno = EINVAL;
+		return false;
+	}
+
+	// The flag applies to the whole volume: keep other threads out meanwhile
+	_ext4_lock(&vol->locks);
+	vol->direct = true;
+	return true;
+}
+
+static void _ext4_direct_end(struct _reent* r, ext4_file* fil)
+{
+	if (fil->flags & O_DIRECT) {
+		Ext4Volume* vol = (Ext4Volume*)r->deviceData;
+		vol->direct = false;
+		_ext4_unlock(&vol->locks);
+	}
+}
+
 ssize_t _ext4_write_r(struct _reent* r, void* fd, const char* buf, size_t len)
 {
 	size_t wcnt;
 	ext4_file* fil = (ext4_file*)fd;
+	if (!_ext4_direct_begin(r, fil, len)) {
+		return -1;
+	}
+
+	// Block map updates made on behalf of file I/O are attributed to data too
+	unsigned prev_class = dvmSetIoClass(DVM_IO_CLASS_DATA);
 	r->_errno = ext4_fwrite(fil, buf, len, &wcnt);
+	dvmSetIoClass(prev_class);
+	_ext4_direct_end(r, fil);
 
 	return r->_errno == EOK ? wcnt : -1;
 }
@@ -220,7 +352,14 @@ ssize_t _ext4_read_r(struct _reent* r, void* fd, char* buf, size_t len)
 {
 	size_t rcnt;
 	ext4_file* fil = (ext4_file*)fd;
+	if (!_ext4_direct_begin(r, fil, len)) {
+		return -1;
+	}
+
+	unsigned prev_class = dvmSetIoClass(DVM_IO_CLASS_DATA);
 	r->_errno = ext4_fread(fil, buf, len, &rcnt);
+	dvmSetIoClass(prev_class);
+	_ext4_direct_end(r, fil);
 
 	return r->_errno == EOK ? rcnt : -1;
 }
@@ -260,6 +399,45 @@ int _ext4_stat_r(struct _reent* r, const char* path, struct stat* st)
 	return r->_errno == EOK ? 0 : -1;
 }
 
+int _ext4_stat_ino(struct _reent* r, void* device_data, uint64_t ino, struct stat* st)
+{
+	struct ext4_inode inode;
+	Ext4Volume* vol = (Ext4Volume*)device_data;
+	r->_errno = ext4_raw_inode_fill2(&vol->mp, ino, &inode);
+
+	if (r->_errno == EOK) {
+		_ext4_set_stat(st, &vol->mp, ino, &inode);
+	}
+
+	return r->_errno == EOK ? 0 : -1;
+}
+
+int _ext4_open_ino(struct _reent* r, void* device_data, void* fd, uint64_t ino, int flags)
+{
+	struct ext4_inode inode;
+	Ext4Volume* vol = (Ext4Volume*)device_data;
+	ext4_file* fil = (ext4_file*)fd;
+	r->_errno = ext4_raw_inode_fill2(&vol->mp, ino, &inode);
+
+	// Set up the file like ext4_fopen2 does for read-only opens
+	if (r->_errno == EOK && !S_ISREG(ext4_inode_get_mode(&vol->mp.fs.sb, &inode))) {
+		r->_errno = EINVAL;
+	}
+
+	if (r->_errno == EOK) {
+		fil->mp    = &vol->mp;
+		fil->inode = ino;
+		fil->flags = flags;
+		fil->fsize = ext4_inode_get_size(&vol->mp.fs.sb, &inode);
+		fil->fpos  = 0;
+
+		// Balanced by _ext4_close_r
+		r->_errno = ext4_cache_write_back(fil->mp, true);
+	}
+
+	return r->_errno == EOK ? 0 : -1;
+}
+
 int _ext4_link_r(struct _reent* r, const char* path, const char* new_path)
 {
 	Ext4Volume* vol = (Ext4Volume*)r->deviceData;
@@ -473,16 +651,21 @@ long _ext4_fpathconf_r(struct _reent* r, void* fd, int name)
 			return ext4_sb_get_block_size(&vol->mp.fs.sb);
 
 		case _PC_REC_INCR_XFER_SIZE:
-			return disc->sector_sz;
+			if (disc->caps.opt_sectors) {
+				return (long)disc->caps.opt_sectors * disc->sector_sz;
+			}
+			return disc->block_sz ? disc->block_sz * disc->sector_sz : disc->sector_sz;
 
-		case _PC_REC_MAX_XFER_SIZE:
-			return disc->sector_sz * UINT16_MAX;
+		case _PC_REC_MAX_XFER_SIZE: {
+			uint64_t max_xfer = (uint64_t)disc->sector_sz * (disc->caps.max_sectors ? disc->caps.max_sectors : UINT16_MAX);
+			return max_xfer < LONG_MAX ? (long)max_xfer : LONG_MAX;
+		}
 
 		case _PC_REC_MIN_XFER_SIZE:
-			return disc->block_sz ? disc->block_sz * disc->sector_sz : disc->sector_sz;
+			return disc->sector_sz;
 
 		case _PC_REC_XFER_ALIGN:
-			return LIBDVM_BUFFER_ALIGN;
+			return disc->caps.align > LIBDVM_BUFFER_ALIGN ? disc->caps.align : LIBDVM_BUFFER_ALIGN;
 
 		case _PC_TIMESTAMP_RESOLUTION:
 			return 1000000000L;
@@ -516,13 +699,13 @@ ssize_t _ext4_readlink_r(struct _reent* r, const char* path, char* buf, size_t b
 void _ext4_lock(struct ext4_lock* locks)
 {
 	Ext4Volume* vol = (Ext4Volume*)locks->p_user;
-	__lock_acquire(vol->lock);
+	__lock_acquire_recursive(vol->lock);
 }
 
 void _ext4_unlock(struct ext4_lock* locks)
 {
 	Ext4Volume* vol = (Ext4Volume*)locks->p_user;
-	__lock_release(vol->lock);
+	__lock_release_recursive(vol->lock);
 }
 
 int _ext4_dev_open(struct ext4_blockdev* bdev)
@@ -541,7 +724,14 @@ int _ext4_dev_open(struct ext4_blockdev* bdev)
 int _ext4_dev_bread(struct ext4_blockdev* bdev, void* buf, uint64_t blk_id, uint32_t blk_cnt)
 {
 	struct ext4_blockdev_iface* bdif = bdev->bdif;
-	DvmDisc* disc = (DvmDisc*)bdif->p_user;
+	Ext4Volume* vol = (Ext4Volume*)bdif->p_user;
+	DvmDisc* disc = vol->disc;
+
+	// Everything read on behalf of an O_DIRECT transfer skips the disc cache
+	// (including the odd block that lwext4 goes through its own cache for)
+	if (vol->direct && bdif->ph_bbuf != buf) {
+		return dvmDiscDirectIo(disc, buf, blk_id, blk_cnt, false) ? EOK : EIO;
+	}
 
 	return disc->vt->read_sectors(disc, buf, blk_id, blk_cnt, bdif->ph_bbuf == buf) ? EOK : EIO;
 }
@@ -549,7 +739,12 @@ int _ext4_dev_bread(struct ext4_blockdev* bdev, void* buf, uint64_t blk_id, uint
 int _ext4_dev_bwrite(struct ext4_blockdev* bdev, const void* buf, uint64_t blk_id, uint32_t blk_cnt)
 {
 	struct ext4_blockdev_iface* bdif = bdev->bdif;
-	DvmDisc* disc = (DvmDisc*)bdif->p_user;
+	Ext4Volume* vol = (Ext4Volume*)bdif->p_user;
+	DvmDisc* disc = vol->disc;
+
+	if (vol->direct && bdif->ph_bbuf != buf) {
+		return dvmDiscDirectIo(disc, (void*)buf, blk_id, blk_cnt, true) ? EOK : EIO;
+	}
 
 	return disc->vt->write_sectors(disc, buf, blk_id, blk_cnt, bdif->ph_bbuf == buf) ? EOK : EIO;
 }
@@ -557,7 +752,7 @@ int _ext4_dev_bwrite(struct ext4_blockdev* bdev, const void* buf, uint64_t blk_i
 int _ext4_dev_flush(struct ext4_blockdev* bdev)
 {
 	struct ext4_blockdev_iface* bdif = bdev->bdif;
-	DvmDisc* disc = (DvmDisc*)bdif->p_user;
+	DvmDisc* disc = ((Ext4Volume*)bdif->p_user)->disc;
 
 	return disc->vt->flush(disc) ? EOK : EIO;
 }
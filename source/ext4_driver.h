@@ -5,13 +5,16 @@
 #include <sys/lock.h>
 #include <sys/iosupport.h>
 #include <ext4.h>
+#include <ext4_fs.h>
 #include <ext4_inode.h>
 #include <ext4_super.h>
 #include "ext2.h"
 
 typedef struct FatVolume {
-	_LOCK_T lock;
+	_LOCK_RECURSIVE_T lock;
 	DvmDisc* disc;
+	bool journal;
+	bool direct; // An O_DIRECT transfer is in progress (guarded by lock)
 
 	struct ext4_lock locks;
 	struct ext4_blockdev_iface bdif;
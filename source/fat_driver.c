@@ -10,9 +10,12 @@
 #include "fat_driver.h"
 #include "dvm_debug.h"
 
+const DvmFsDriver* _dvmGetVolumeDriver(const devoptab_t* dotab);
+
 static bool _FAT_mount_vfat(devoptab_t* dotab, DvmDisc* disc, DvmPartInfo* part);
 static bool _FAT_mount_exfat(devoptab_t* dotab, DvmDisc* disc, DvmPartInfo* part);
 static void _FAT_umount(void* device_data);
+static unsigned _FAT_get_extents(void* device_data, void* fd, DvmFileExtent* out, unsigned max_extents, DvmDisc** out_disc);
 
 static int _FAT_open_r(struct _reent*, void*, const char*, int, int);
 static int _FAT_close_r(struct _reent*, void*);
@@ -38,7 +41,7 @@ static long _FAT_fpathconf_r(struct _reent*, void*, int);
 static long _FAT_pathconf_r(struct _reent*, const char*, int);
 
 static const devoptab_t _FAT_devoptab = {
-	.structSize   = sizeof(FFFIL),
+	.structSize   = sizeof(FatFile),
 	.open_r       = _FAT_open_r,
 	.close_r      = _FAT_close_r,
 	.write_r      = _FAT_write_r,
@@ -71,6 +74,8 @@ const DvmFsDriver g_vfatFsDriver = {
 	.dotab_template = &_FAT_devoptab,
 	.mount          = _FAT_mount_vfat,
 	.umount         = _FAT_umount,
+	.get_extents    = _FAT_get_extents,
+	.flags          = DVM_FSDRV_CASE_INSENSITIVE,
 };
 
 const DvmFsDriver g_exfatFsDriver = {
@@ -79,24 +84,56 @@ const DvmFsDriver g_exfatFsDriver = {
 	.dotab_template = &_FAT_devoptab,
 	.mount          = _FAT_mount_exfat,
 	.umount         = _FAT_umount,
+	.get_extents    = _FAT_get_extents,
+	.flags          = DVM_FSDRV_CASE_INSENSITIVE,
 };
 
 static FatVolume* _fatVolumeFromPath(const char* path)
 {
+	// The callbacks of mounted volumes are interposed: identify them by driver
 	const devoptab_t* dotab = GetDeviceOpTab(path);
-	if (!dotab || dotab->open_r != _FAT_open_r) {
+	const DvmFsDriver* fsdrv = _dvmGetVolumeDriver(dotab);
+	if (!fsdrv || fsdrv->dotab_template != &_FAT_devoptab) {
 		return NULL;
 	}
 
 	return (FatVolume*)dotab->deviceData;
 }
 
+static void _FAT_file_begin(FatVolume* vol, FatFile* file)
+{
+	// Hold the volume lock for the whole operation, so that the sectors
+	// FatFs writes in the meantime can be attributed to the file
+	__lock_acquire_recursive(vol->lock);
+	vol->cur_file = file;
+}
+
+static void _FAT_file_end(FatVolume* vol)
+{
+	vol->cur_file = NULL;
+	__lock_release_recursive(vol->lock);
+}
+
+static bool _FAT_file_direct_ok(FatVolume* vol, FatFile* file, size_t len, int* _errno)
+{
+	// O_DIRECT transfers must start and end on sector boundaries, so that
+	// FatFs never needs its sector buffer for them
+	if (file->direct && ((f_tell(&file->fil) | len) & (vol->fs.ssize - 1))) {
+		*_errno = EINVAL;
+		return false;
+	}
+
+	return true;
+}
+
 bool _FAT_mount_vfat(devoptab_t* dotab, DvmDisc* disc, DvmPartInfo* part)
 {
 	FatVolume* vol    = (FatVolume*)dotab->deviceData;
 	vol->disc         = disc;
 	vol->start_sector = part->start_sector;
 	vol->num_sectors  = part->num_sectors;
+	vol->cur_file     = NULL;
+	_dvmDirtyClear(&vol->meta);
 
 	UINT ipart = vol->start_sector ? 0 : part->index;
 	FRESULT fr = f_mount(&vol->fs, vol, ipart);
@@ -138,6 +175,8 @@ bool _FAT_mount_exfat(devoptab_t* dotab, DvmDisc* disc, DvmPartInfo* part)
 	vol->disc         = disc;
 	vol->start_sector = part->start_sector;
 	vol->num_sectors  = part->num_sectors;
+	vol->cur_file     = NULL;
+	_dvmDirtyClear(&vol->meta);
 
 	UINT ipart = vol->start_sector ? 0 : part->index;
 	FRESULT fr = f_mount(&vol->fs, vol, ipart);
@@ -181,6 +220,49 @@ void _FAT_umount(void* device_data)
 	dvmDiscRemoveUser(vol->disc);
 }
 
+unsigned _FAT_get_extents(void* device_data, void* fd, DvmFileExtent* out, unsigned max_extents, DvmDisc** out_disc)
+{
+	FatVolume* vol = (FatVolume*)device_data;
+	FFFIL* fp = (FFFIL*)fd;
+	const FSIZE_t clst_sz = (FSIZE_t)vol->fs.csize * vol->fs.ssize;
+	_FAT_file_begin(vol, (FatFile*)fd);
+	const FSIZE_t size = f_size(fp);
+	const FSIZE_t saved_pos = f_tell(fp);
+
+	// Follow the cluster chain by seeking to the end of each cluster of the file:
+	// FatFs then leaves fp->clust pointing to it. Only the FAT is read, except when
+	// the file ends mid-sector: seeking there loads that last sector into fp->buf.
+	unsigned count = 0;
+	sec_t run_end = 0;
+	for (FSIZE_t pos = 0; pos < size; pos += clst_sz) {
+		FSIZE_t end = (size - pos) < clst_sz ? size : pos + clst_sz;
+		if (f_lseek(fp, end) != FR_OK || fp->clust < 2) {
+			count = 0;
+			break;
+		}
+
+		sec_t sector = vol->start_sector + (sec_t)vol->fs.database + (sec_t)(fp->clust - 2)*vol->fs.csize;
+		if (count && sector == run_end) {
+			if (count <= max_extents) {
+				out[count-1].num_sectors += vol->fs.csize;
+			}
+		} else {
+			if (count < max_extents) {
+				out[count].sector = sector;
+				out[count].num_sectors = vol->fs.csize;
+			}
+			count ++;
+		}
+
+		run_end = sector + vol->fs.csize;
+	}
+
+	f_lseek(fp, saved_pos);
+	_FAT_file_end(vol);
+	*out_disc = vol->disc;
+	return count;
+}
+
 static inline bool _FAT_set_errno(FRESULT fr, int* _errno)
 {
 	static const uint8_t fr_to_errno[] = {
@@ -211,7 +293,7 @@ static inline bool _FAT_set_errno(FRESULT fr, int* _errno)
 	}
 
 	if (fr != FR_OK) {
-		dvmDebug("FatFs fr = %u\n", fr);
+		dvmTp(DVM_TP_DRIVER_FAT_ERROR, fr);
 	}
 
 	if (!_errno) {
@@ -339,6 +421,8 @@ int _FAT_open_r(struct _reent* r, void* fd, const char* path, int flags, int mod
 		ffmode &= ~FA_OPEN_ALWAYS;
 	}
 
+	_dvmDirtyClear(&((FatFile*)fd)->dirty);
+	((FatFile*)fd)->direct = (flags & O_DIRECT) != 0;
 	FRESULT fr = f_open(fp, &vol->fs, _FAT_strip_device(path), ffmode);
 
 	return _FAT_set_errno(fr, &r->_errno) ? 0 : -1;
@@ -346,8 +430,11 @@ int _FAT_open_r(struct _reent* r, void* fd, const char* path, int flags, int mod
 
 int _FAT_close_r(struct _reent* r, void* fd)
 {
+	FatVolume* vol = (FatVolume*)r->deviceData;
 	FFFIL* fp = (FFFIL*)fd;
+	_FAT_file_begin(vol, (FatFile*)fd);
 	FRESULT fr = f_close(fp);
+	_FAT_file_end(vol);
 
 	return _FAT_set_errno(fr, &r->_errno) ? 0 : -1;
 }
@@ -355,8 +442,15 @@ int _FAT_close_r(struct _reent* r, void* fd)
 ssize_t _FAT_write_r(struct _reent* r, void* fd, const char* buf, size_t len)
 {
 	UINT bw;
+	FatVolume* vol = (FatVolume*)r->deviceData;
 	FFFIL* fp = (FFFIL*)fd;
+	if (!_FAT_file_direct_ok(vol, (FatFile*)fd, len, &r->_errno)) {
+		return -1;
+	}
+
+	_FAT_file_begin(vol, (FatFile*)fd);
 	FRESULT fr = f_write(fp, buf, len, &bw);
+	_FAT_file_end(vol);
 
 	return _FAT_set_errno(fr, &r->_errno) ? bw : -1;
 }
@@ -364,8 +458,15 @@ ssize_t _FAT_write_r(struct _reent* r, void* fd, const char* buf, size_t len)
 ssize_t _FAT_read_r(struct _reent* r, void* fd, char* buf, size_t len)
 {
 	UINT br;
+	FatVolume* vol = (FatVolume*)r->deviceData;
 	FFFIL* fp = (FFFIL*)fd;
+	if (!_FAT_file_direct_ok(vol, (FatFile*)fd, len, &r->_errno)) {
+		return -1;
+	}
+
+	_FAT_file_begin(vol, (FatFile*)fd);
 	FRESULT fr = f_read(fp, buf, len, &br);
+	_FAT_file_end(vol);
 
 	return _FAT_set_errno(fr, &r->_errno) ? br : -1;
 }
@@ -398,7 +499,14 @@ off_t _FAT_seek_r(struct _reent* r, void* fd, off_t offset, int whence)
 	if (offset >= 0 || pos >= (-offset)) {
 		// Apply new position
 		pos += (FSIZE_t)offset;
-		fr = pos != f_tell(fp) ? f_lseek(fp, pos) : FR_OK;
+		if (pos != f_tell(fp)) {
+			FatVolume* vol = (FatVolume*)r->deviceData;
+			_FAT_file_begin(vol, (FatFile*)fd);
+			fr = f_lseek(fp, pos);
+			_FAT_file_end(vol);
+		} else {
+			fr = FR_OK;
+		}
 	} else {
 		// Attempted to seek before the beginning of the file
 		fr = FR_INVALID_PARAMETER;
@@ -581,8 +689,10 @@ int _FAT_statvfs_r(struct _reent* r, const char* path, struct statvfs* buf)
 int _FAT_ftruncate_r(struct _reent* r, void* fd, off_t size)
 {
 	FSIZE_t pos_backup;
+	FatVolume* vol = (FatVolume*)r->deviceData;
 	FFFIL* fp = (FFFIL*)fd;
 	FRESULT fr = size >= 0 ? FR_OK : FR_INVALID_PARAMETER;
+	_FAT_file_begin(vol, (FatFile*)fd);
 
 	if (fr == FR_OK) {
 		f_expand(fp, (FSIZE_t)size, 1);
@@ -605,13 +715,18 @@ int _FAT_ftruncate_r(struct _reent* r, void* fd, off_t size)
 		fr = f_lseek(fp, pos_backup);
 	}
 
+	_FAT_file_end(vol);
+
 	return _FAT_set_errno(fr, &r->_errno) ? 0 : -1;
 }
 
 int _FAT_fsync_r(struct _reent* r, void* fd)
 {
+	FatVolume* vol = (FatVolume*)r->deviceData;
 	FFFIL* fp = (FFFIL*)fd;
+	_FAT_file_begin(vol, (FatFile*)fd);
 	FRESULT fr = f_sync(fp);
+	_FAT_file_end(vol);
 
 	return _FAT_set_errno(fr, &r->_errno) ? 0 : -1;
 }
@@ -673,16 +788,21 @@ long _FAT_fpathconf_r(struct _reent* r, void* fd, int name)
 			return vol->fs.csize * vol->fs.ssize;
 
 		case _PC_REC_INCR_XFER_SIZE:
-			return disc->sector_sz;
+			if (disc->caps.opt_sectors) {
+				return (long)disc->caps.opt_sectors * disc->sector_sz;
+			}
+			return disc->block_sz ? disc->block_sz * disc->sector_sz : disc->sector_sz;
 
-		case _PC_REC_MAX_XFER_SIZE:
-			return disc->sector_sz * UINT16_MAX;
+		case _PC_REC_MAX_XFER_SIZE: {
+			uint64_t max_xfer = (uint64_t)disc->sector_sz * (disc->caps.max_sectors ? disc->caps.max_sectors : UINT16_MAX);
+			return max_xfer < LONG_MAX ? (long)max_xfer : LONG_MAX;
+		}
 
 		case _PC_REC_MIN_XFER_SIZE:
-			return disc->block_sz ? disc->block_sz * disc->sector_sz : disc->sector_sz;
+			return disc->sector_sz;
 
 		case _PC_REC_XFER_ALIGN:
-			return LIBDVM_BUFFER_ALIGN;
+			return disc->caps.align > LIBDVM_BUFFER_ALIGN ? disc->caps.align : LIBDVM_BUFFER_ALIGN;
 
 		case _PC_TIMESTAMP_RESOLUTION:
 			return 2000000000L;
@@ -765,7 +885,7 @@ static _LOCK_T s_fatSystemLock;
 int ff_mutex_create(FATFS* fs)
 {
 	if (fs) {
-		__lock_init(_fatVolumeFromFatFs(fs)->lock);
+		__lock_init_recursive(_fatVolumeFromFatFs(fs)->lock);
 	} else {
 		__lock_init(s_fatSystemLock);
 	}
@@ -776,7 +896,7 @@ int ff_mutex_create(FATFS* fs)
 void ff_mutex_delete(FATFS* fs)
 {
 	if (fs) {
-		__lock_close(_fatVolumeFromFatFs(fs)->lock);
+		__lock_close_recursive(_fatVolumeFromFatFs(fs)->lock);
 	} else {
 		__lock_close(s_fatSystemLock);
 	}
@@ -785,7 +905,7 @@ void ff_mutex_delete(FATFS* fs)
 int ff_mutex_take(FATFS* fs)
 {
 	if (fs) {
-		__lock_acquire(_fatVolumeFromFatFs(fs)->lock);
+		__lock_acquire_recursive(_fatVolumeFromFatFs(fs)->lock);
 	} else {
 		__lock_acquire(s_fatSystemLock);
 	}
@@ -796,7 +916,7 @@ int ff_mutex_take(FATFS* fs)
 void ff_mutex_give(FATFS* fs)
 {
 	if (fs) {
-		__lock_release(_fatVolumeFromFatFs(fs)->lock);
+		__lock_release_recursive(_fatVolumeFromFatFs(fs)->lock);
 	} else {
 		__lock_release(s_fatSystemLock);
 	}
@@ -828,7 +948,18 @@ DRESULT disk_read(void* pdrv, BYTE* buff, LBA_t sector_, UINT count, BYTE opt)
 	DvmDisc* disc = vol->disc;
 	sec_t sector = vol->start_sector + (sec_t)sector_;
 
-	return disc->vt->read_sectors(disc, buff, sector, count, opt) ? RES_OK : RES_ERROR;
+	// FatFs accesses FAT and directory sectors exclusively through its window
+	unsigned prev_class = dvmSetIoClass(buff == vol->fs.win ? DVM_IO_CLASS_META : DVM_IO_CLASS_DATA);
+	// Data of files opened with O_DIRECT skips the disc cache
+	bool ret;
+	if (vol->cur_file && vol->cur_file->direct && buff != vol->fs.win) {
+		ret = dvmDiscDirectIo(disc, buff, sector, count, false);
+	} else {
+		ret = disc->vt->read_sectors(disc, buff, sector, count, opt);
+	}
+	dvmSetIoClass(prev_class);
+
+	return ret ? RES_OK : RES_ERROR;
 }
 
 DRESULT disk_write(void* pdrv, const BYTE* buff, LBA_t sector_, UINT count, BYTE opt)
@@ -837,7 +968,22 @@ DRESULT disk_write(void* pdrv, const BYTE* buff, LBA_t sector_, UINT count, BYTE
 	DvmDisc* disc = vol->disc;
 	sec_t sector = vol->start_sector + (sec_t)sector_;
 
-	return disc->vt->write_sectors(disc, buff, sector, count, opt) ? RES_OK : RES_ERROR;
+	unsigned prev_class = dvmSetIoClass(buff == vol->fs.win ? DVM_IO_CLASS_META : DVM_IO_CLASS_DATA);
+	bool ret;
+	if (vol->cur_file && vol->cur_file->direct && buff != vol->fs.win) {
+		ret = dvmDiscDirectIo(disc, (void*)buff, sector, count, true);
+	} else {
+		ret = disc->vt->write_sectors(disc, buff, sector, count, opt);
+	}
+	dvmSetIoClass(prev_class);
+
+	if (vol->cur_file && buff != vol->fs.win) {
+		_dvmDirtyAdd(&vol->cur_file->dirty, sector, count);
+	} else {
+		_dvmDirtyAdd(&vol->meta, sector, count);
+	}
+
+	return ret ? RES_OK : RES_ERROR;
 }
 
 DRESULT disk_ioctl(void* pdrv, BYTE cmd, void* buff)
@@ -851,7 +997,14 @@ DRESULT disk_ioctl(void* pdrv, BYTE cmd, void* buff)
 		}
 
 		case CTRL_SYNC: {
-			return disc->vt->flush(disc) ? RES_OK : RES_ERROR;
+			// Syncing a file only writes back its own sectors and the metadata
+			bool ret;
+			if (vol->cur_file) {
+				ret = _dvmDirtyFlush(disc, &vol->cur_file->dirty, &vol->meta);
+			} else if ((ret = disc->vt->flush(disc))) {
+				_dvmDirtyClear(&vol->meta);
+			}
+			return ret ? RES_OK : RES_ERROR;
 		}
 
 		case GET_SECTOR_COUNT: {
@@ -868,5 +1021,11 @@ DRESULT disk_ioctl(void* pdrv, BYTE cmd, void* buff)
 			*(DWORD*)buff = (DWORD)disc->block_sz;
 			return RES_OK;
 		}
+
+		case CTRL_TRIM: {
+			const LBA_t* range = (const LBA_t*)buff;
+			sec_t sector = vol->start_sector + (sec_t)range[0];
+			return dvmDiscTrim(disc, sector, range[1] - range[0] + 1) ? RES_OK : RES_ERROR;
+		}
 	}
 }
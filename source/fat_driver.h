@@ -7,13 +7,25 @@
 #include <ff.h>
 #include <diskio.h>
 #include "fat.h"
+#include "dvm_dirty.h"
+
+typedef struct FatFile {
+	FFFIL fil;          // First, so that FatFs gets the file structure as is
+	DvmDirtyRuns dirty; // Data sectors written since the file was last synced
+	bool direct;        // Opened with O_DIRECT: data bypasses the disc cache
+} FatFile;
 
 typedef struct FatVolume {
-	_LOCK_T lock;
+	_LOCK_RECURSIVE_T lock;
 	DvmDisc* disc;
 	sec_t start_sector;
 	sec_t num_sectors;
 
+	// Sectors written during an operation on an open file belong to it, the
+	// rest (directories, FAT, file system info) to every file
+	FatFile* cur_file;
+	DvmDirtyRuns meta;
+
 	FATFS fs;
 } FatVolume;
 
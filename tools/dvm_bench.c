@@ -0,0 +1,673 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fat.h>
+#include <ext2.h>
+
+#define IO_ALIGN   4096U
+#define SMALL_SZ   4096U
+#define RANDOM_SZ  4096U
+#define LIST_PASSES 3U
+
+extern unsigned g_dvmDefaultCachePages, g_dvmDefaultSectorsPerPage;
+
+typedef struct BenchCfg {
+	unsigned cache_pages;
+	unsigned sectors_per_page;
+	unsigned image_flags;
+	const DvmEmuTiming* emu;
+	unsigned seq_mib;
+	unsigned seq_block_kib;
+	unsigned random_ops;
+	unsigned small_files;
+	unsigned tree_depth;
+	unsigned tree_files;
+	unsigned mount_iters;
+	unsigned stat_passes;
+	bool csv;
+} BenchCfg;
+
+typedef struct BenchStats {
+	double* lat;
+	size_t count;
+	size_t cap;
+	uint64_t bytes;
+	double elapsed;
+} BenchStats;
+
+static double _now(void)
+{
+	// Emulated device time adds to the real time spent in software
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec*1e-9 + dvmEmuClockNs()*1e-9;
+}
+
+static void _statsReset(BenchStats* st)
+{
+	st->count = 0;
+	st->bytes = 0;
+	st->elapsed = 0.0;
+}
+
+static bool _statsAdd(BenchStats* st, double lat)
+{
+	if (st->count == st->cap) {
+		size_t cap = st->cap ? 2*st->cap : 1024;
+		double* lat_buf = (double*)realloc(st->lat, cap*sizeof(double));
+		if (!lat_buf) {
+			return false;
+		}
+		st->lat = lat_buf;
+		st->cap = cap;
+	}
+
+	st->lat[st->count++] = lat;
+	return true;
+}
+
+static int _cmpDouble(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+static double _percentile(const BenchStats* st, double p)
+{
+	if (!st->count) {
+		return 0.0;
+	}
+
+	size_t idx = (size_t)(p*(st->count - 1) + 0.5);
+	return st->lat[idx];
+}
+
+static void _report(const BenchCfg* cfg, const char* label, const char* test, BenchStats* st)
+{
+	qsort(st->lat, st->count, sizeof(double), _cmpDouble);
+
+	double secs = st->elapsed > 0.0 ? st->elapsed : 1e-9;
+	double mib_s = st->bytes / secs / (1024.0*1024.0);
+	double iops = st->count / secs;
+	double p50 = _percentile(st, 0.50)*1e6;
+	double p90 = _percentile(st, 0.90)*1e6;
+	double p99 = _percentile(st, 0.99)*1e6;
+	double max = _percentile(st, 1.00)*1e6;
+
+	if (cfg->csv) {
+		printf("%s,%s,%u,%u,%zu,%llu,%.6f,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+			label, test, cfg->cache_pages, cfg->sectors_per_page, st->count, (unsigned long long)st->bytes,
+			secs, mib_s, iops, p50, p90, p99, max);
+	} else {
+		printf("{\"fs\":\"%s\",\"test\":\"%s\",\"cache_pages\":%u,\"sectors_per_page\":%u,"
+			"\"ops\":%zu,\"bytes\":%llu,\"secs\":%.6f,\"mib_s\":%.3f,\"iops\":%.1f,"
+			"\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+			label, test, cfg->cache_pages, cfg->sectors_per_page, st->count, (unsigned long long)st->bytes,
+			secs, mib_s, iops, p50, p90, p99, max);
+	}
+
+	fflush(stdout);
+}
+
+static bool _fail(const char* what, const char* path)
+{
+	fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+	return false;
+}
+
+static bool _pathTooLong(const char* dir)
+{
+	errno = ENAMETOOLONG;
+	return _fail("path", dir);
+}
+
+static unsigned _benchProbeMount(const BenchCfg* cfg, const char* label, const char* image)
+{
+	if (!cfg->emu) {
+		return dvmProbeMountImage(label, image, cfg->image_flags, cfg->cache_pages, cfg->sectors_per_page);
+	}
+
+	DvmDisc* disc = dvmDiscImageCreate(image, cfg->image_flags, 0);
+	DvmDisc* emu = disc ? dvmDiscEmuCreate(disc, cfg->emu, 0) : NULL;
+	if (!emu) {
+		if (disc) {
+			disc->vt->destroy(disc);
+		}
+		return 0;
+	}
+
+	if (cfg->cache_pages) {
+		emu = dvmDiscCacheCreate(emu, cfg->cache_pages, cfg->sectors_per_page);
+	}
+
+	unsigned num_mounted = dvmProbeMountDisc(label, emu);
+	if (!num_mounted) {
+		emu->vt->destroy(emu);
+	}
+
+	return num_mounted;
+}
+
+static bool _benchMount(const BenchCfg* cfg, const char* label, const char* image, BenchStats* st)
+{
+	// Every iteration but the last unmounts again, leaving the volume mounted for the other tests
+	for (unsigned i = 0; i < cfg->mount_iters; i ++) {
+		double t = _now();
+		unsigned num_mounted = _benchProbeMount(cfg, label, image);
+		t = _now() - t;
+
+		if (!num_mounted) {
+			fprintf(stderr, "%s: cannot mount %s\n", label, image);
+			return false;
+		}
+
+		_statsAdd(st, t);
+		st->elapsed += t;
+
+		if ((i + 1) < cfg->mount_iters) {
+			dvmUnmountVolume(label);
+		}
+	}
+
+	return true;
+}
+
+static bool _benchSeq(const BenchCfg* cfg, const char* path, uint8_t* buf, bool is_write, BenchStats* st)
+{
+	const size_t block_sz = cfg->seq_block_kib*1024U;
+	const uint64_t total_sz = (uint64_t)cfg->seq_mib*1024U*1024U;
+
+	int flags = is_write ? (O_WRONLY | O_CREAT | O_TRUNC) : O_RDONLY;
+	int fd = dvmHostOpen(path, flags, 0666);
+	if (fd < 0) {
+		return _fail("open", path);
+	}
+
+	bool ret = true;
+	double start = _now();
+	for (uint64_t pos = 0; ret && pos < total_sz; pos += block_sz) {
+		size_t cur_sz = (total_sz - pos) < block_sz ? (size_t)(total_sz - pos) : block_sz;
+
+		double t = _now();
+		ssize_t cur = is_write ? dvmHostWrite(fd, buf, cur_sz) : dvmHostRead(fd, buf, cur_sz);
+		t = _now() - t;
+
+		if (cur != (ssize_t)cur_sz) {
+			ret = _fail(is_write ? "write" : "read", path);
+		}
+
+		_statsAdd(st, t);
+		st->bytes += cur_sz;
+	}
+
+	// Written data only counts once it reached the image
+	if (ret && is_write && dvmHostFsync(fd) != 0) {
+		ret = _fail("fsync", path);
+	}
+
+	st->elapsed = _now() - start;
+	dvmHostClose(fd);
+	return ret;
+}
+
+static bool _benchRandom(const BenchCfg* cfg, const char* path, uint8_t* buf, bool is_write, BenchStats* st)
+{
+	const uint64_t num_blocks = (uint64_t)cfg->seq_mib*1024U*1024U / RANDOM_SZ;
+
+	int fd = dvmHostOpen(path, is_write ? O_RDWR : O_RDONLY, 0666);
+	if (fd < 0) {
+		return _fail("open", path);
+	}
+
+	bool ret = true;
+	double start = _now();
+	for (unsigned i = 0; ret && i < cfg->random_ops; i ++) {
+		off_t pos = (off_t)(((uint64_t)rand() << 16 ^ rand()) % num_blocks)*RANDOM_SZ;
+
+		double t = _now();
+		ssize_t cur = -1;
+		if (dvmHostLseek(fd, pos, SEEK_SET) == pos) {
+			cur = is_write ? dvmHostWrite(fd, buf, RANDOM_SZ) : dvmHostRead(fd, buf, RANDOM_SZ);
+		}
+		t = _now() - t;
+
+		if (cur != RANDOM_SZ) {
+			ret = _fail(is_write ? "write" : "read", path);
+		}
+
+		_statsAdd(st, t);
+		st->bytes += RANDOM_SZ;
+	}
+
+	if (ret && is_write && dvmHostFsync(fd) != 0) {
+		ret = _fail("fsync", path);
+	}
+
+	st->elapsed = _now() - start;
+	dvmHostClose(fd);
+	return ret;
+}
+
+static bool _benchSmallFiles(const BenchCfg* cfg, const char* label, const char* dir, uint8_t* buf, BenchStats* st)
+{
+	char path[PATH_MAX];
+	if (dvmHostMkdir(dir, 0777) != 0) {
+		return _fail("mkdir", dir);
+	}
+
+	bool ret = true;
+	double start = _now();
+	for (unsigned i = 0; ret && i < cfg->small_files; i ++) {
+		if ((size_t)snprintf(path, sizeof(path), "%s/f%05u.bin", dir, i) >= sizeof(path)) {
+			ret = _pathTooLong(dir);
+			break;
+		}
+
+		double t = _now();
+		int fd = dvmHostOpen(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		ret = fd >= 0 && dvmHostWrite(fd, buf, SMALL_SZ) == SMALL_SZ;
+		ret = (fd < 0 || dvmHostClose(fd) == 0) && ret;
+		t = _now() - t;
+
+		if (!ret) {
+			_fail("create", path);
+		}
+
+		_statsAdd(st, t);
+		st->bytes += SMALL_SZ;
+	}
+
+	st->elapsed = _now() - start;
+	_report(cfg, label, "small_create", st);
+
+	_statsReset(st);
+	start = _now();
+	for (unsigned i = 0; i < cfg->small_files; i ++) {
+		if ((size_t)snprintf(path, sizeof(path), "%s/f%05u.bin", dir, i) >= sizeof(path)) {
+			break;
+		}
+
+		double t = _now();
+		int rc = dvmHostUnlink(path);
+		t = _now() - t;
+
+		if (rc != 0 && ret) {
+			ret = _fail("unlink", path);
+		}
+
+		_statsAdd(st, t);
+	}
+
+	st->elapsed = _now() - start;
+	_report(cfg, label, "small_delete", st);
+
+	dvmHostRmdir(dir);
+	return ret;
+}
+
+static void _treePath(char* out, size_t out_sz, const char* root, unsigned depth)
+{
+	size_t len = snprintf(out, out_sz, "%s/tree", root);
+	for (unsigned i = 0; i < depth && len < out_sz; i ++) {
+		len += snprintf(out + len, out_sz - len, "/d%u", i);
+	}
+}
+
+static bool _benchTreeCreate(const BenchCfg* cfg, const char* root)
+{
+	char dir[PATH_MAX], path[PATH_MAX];
+	for (unsigned d = 0; d <= cfg->tree_depth; d ++) {
+		_treePath(dir, sizeof(dir), root, d);
+		if (dvmHostMkdir(dir, 0777) != 0) {
+			return _fail("mkdir", dir);
+		}
+
+		for (unsigned i = 0; i < cfg->tree_files; i ++) {
+			if ((size_t)snprintf(path, sizeof(path), "%s/entry%04u", dir, i) >= sizeof(path)) {
+				return _pathTooLong(dir);
+			}
+
+			int fd = dvmHostOpen(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+			if (fd < 0) {
+				return _fail("create", path);
+			}
+			dvmHostClose(fd);
+		}
+	}
+
+	return true;
+}
+
+static void _benchTreeRemove(const BenchCfg* cfg, const char* root)
+{
+	char dir[PATH_MAX], path[PATH_MAX];
+	for (unsigned d = cfg->tree_depth + 1; d --;) {
+		_treePath(dir, sizeof(dir), root, d);
+		for (unsigned i = 0; i < cfg->tree_files; i ++) {
+			if ((size_t)snprintf(path, sizeof(path), "%s/entry%04u", dir, i) < sizeof(path)) {
+				dvmHostUnlink(path);
+			}
+		}
+		dvmHostRmdir(dir);
+	}
+}
+
+static bool _benchTreeList(const BenchCfg* cfg, const char* root, BenchStats* st)
+{
+	char dir[PATH_MAX], name[NAME_MAX+1];
+	struct stat sb;
+
+	double start = _now();
+	for (unsigned pass = 0; pass < LIST_PASSES; pass ++) {
+		for (unsigned d = 0; d <= cfg->tree_depth; d ++) {
+			_treePath(dir, sizeof(dir), root, d);
+
+			double t = _now();
+			DIR_ITER* it = dvmHostDirOpen(dir);
+			if (!it) {
+				return _fail("diropen", dir);
+			}
+
+			// Each entry returned counts as one operation
+			for (;;) {
+				int rc = dvmHostDirNext(it, name, &sb);
+				double now = _now();
+				if (rc != 0) {
+					break;
+				}
+
+				_statsAdd(st, now - t);
+				t = now;
+			}
+
+			dvmHostDirClose(it);
+		}
+	}
+
+	st->elapsed = _now() - start;
+	return true;
+}
+
+static bool _benchStat(const BenchCfg* cfg, const char* root, BenchStats* st)
+{
+	char dir[PATH_MAX], path[PATH_MAX];
+	struct stat sb;
+
+	double start = _now();
+	for (unsigned pass = 0; pass < cfg->stat_passes; pass ++) {
+		for (unsigned d = 0; d <= cfg->tree_depth; d ++) {
+			_treePath(dir, sizeof(dir), root, d);
+			for (unsigned i = 0; i < cfg->tree_files; i ++) {
+				if ((size_t)snprintf(path, sizeof(path), "%s/entry%04u", dir, i) >= sizeof(path)) {
+					return _pathTooLong(dir);
+				}
+
+				double t = _now();
+				int rc = dvmHostStat(path, &sb);
+				t = _now() - t;
+
+				if (rc != 0) {
+					return _fail("stat", path);
+				}
+
+				_statsAdd(st, t);
+			}
+		}
+	}
+
+	st->elapsed = _now() - start;
+	return true;
+}
+
+static bool _benchImage(const BenchCfg* cfg, const char* label, const char* image, uint8_t* buf)
+{
+	char root[64], path[PATH_MAX];
+	BenchStats st = {0};
+
+	bool ret = _benchMount(cfg, label, image, &st);
+	if (ret) {
+		_report(cfg, label, "mount", &st);
+	} else {
+		free(st.lat);
+		return false;
+	}
+
+	snprintf(root, sizeof(root), "%s:/dvm_bench", label);
+	if (dvmHostMkdir(root, 0777) != 0 && errno != EEXIST) {
+		ret = _fail("mkdir", root);
+	}
+
+	snprintf(path, sizeof(path), "%s/seq.bin", root);
+
+	static const struct {
+		const char* name;
+		bool is_write;
+		bool is_random;
+	} s_ioTests[] = {
+		{ "seq_write",   true,  false },
+		{ "seq_read",    false, false },
+		{ "rand_read",   false, true  },
+		{ "rand_write",  true,  true  },
+	};
+
+	for (unsigned i = 0; ret && i < sizeof(s_ioTests)/sizeof(s_ioTests[0]); i ++) {
+		_statsReset(&st);
+		if (s_ioTests[i].is_random) {
+			ret = _benchRandom(cfg, path, buf, s_ioTests[i].is_write, &st);
+		} else {
+			ret = _benchSeq(cfg, path, buf, s_ioTests[i].is_write, &st);
+		}
+		if (ret) {
+			_report(cfg, label, s_ioTests[i].name, &st);
+		}
+	}
+	dvmHostUnlink(path);
+
+	if (ret) {
+		_statsReset(&st);
+		snprintf(path, sizeof(path), "%s/small", root);
+		ret = _benchSmallFiles(cfg, label, path, buf, &st);
+	}
+
+	if (ret) {
+		ret = _benchTreeCreate(cfg, root);
+		if (ret) {
+			_statsReset(&st);
+			ret = _benchTreeList(cfg, root, &st);
+			if (ret) {
+				_report(cfg, label, "dir_list", &st);
+			}
+		}
+		if (ret) {
+			_statsReset(&st);
+			ret = _benchStat(cfg, root, &st);
+			if (ret) {
+				_report(cfg, label, "stat", &st);
+			}
+		}
+		_benchTreeRemove(cfg, root);
+	}
+
+	dvmHostRmdir(root);
+	dvmUnmountVolume(label);
+	free(st.lat);
+	return ret;
+}
+
+static void _usage(const char* argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [options] label=image ...\n"
+		"Runs the workload matrix against each image (FAT32, exFAT or ext2, for example\n"
+		"made with mkfs.vfat -F 32, mkfs.exfat and mke2fs -t ext2). Images are modified.\n"
+		"  -c pages  Disc cache pages (default %u)\n"
+		"  -p secs   Sectors per cache page (default %u)\n"
+		"  -D        Open images with O_DIRECT\n"
+		"  -E name   Emulate the timing of a device on virtual time (see below)\n"
+		"  -s MiB    Sequential/random test file size (default 64)\n"
+		"  -b KiB    Sequential transfer size (default 128)\n"
+		"  -n ops    Random 4 KiB operations (default 2000)\n"
+		"  -f files  Small files to create and delete (default 500)\n"
+		"  -d depth  Directory tree depth (default 8)\n"
+		"  -e files  Entries per tree directory (default 32)\n"
+		"  -m iters  Mount iterations (default 5)\n"
+		"  -t passes Stat passes over the tree (default 10)\n"
+		"  -r seed   Random seed (default 1)\n"
+		"  -C        CSV output instead of JSON lines\n"
+		"  -T file   Record tracepoints into file (decode with dvmtp)\n",
+		argv0, g_dvmDefaultCachePages, g_dvmDefaultSectorsPerPage);
+
+	fprintf(stderr, "Device presets:");
+	for (unsigned i = 0; dvmEmuGetPreset(i); i ++) {
+		fprintf(stderr, " %s", dvmEmuGetPreset(i)->name);
+	}
+	fprintf(stderr, "\n");
+}
+
+static bool _dumpTracepoints(const char* path)
+{
+	FILE* f = fopen(path, "wb");
+	if (!f) {
+		perror(path);
+		return false;
+	}
+
+	// The header goes last so that it includes the records dropped while reading
+	DvmTpRecord records[256];
+	size_t count;
+	bool ok = fseek(f, sizeof(DvmTpHeader), SEEK_SET) == 0;
+	while ((count = dvmTpRead(records, 256))) {
+		ok = ok && fwrite(records, sizeof(DvmTpRecord), count, f) == count;
+	}
+
+	DvmTpHeader hdr;
+	dvmTpGetHeader(&hdr);
+	ok = ok && fseek(f, 0, SEEK_SET) == 0;
+	ok = ok && fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+	ok = fclose(f) == 0 && ok;
+
+	if (!ok) {
+		fprintf(stderr, "%s: write error\n", path);
+	}
+
+	return ok;
+}
+
+static const DvmEmuTiming* _findPreset(const char* name)
+{
+	const DvmEmuTiming* t;
+	for (unsigned i = 0; (t = dvmEmuGetPreset(i)); i ++) {
+		if (strcmp(t->name, name) == 0) {
+			return t;
+		}
+	}
+
+	return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+	BenchCfg cfg = {
+		.cache_pages      = g_dvmDefaultCachePages,
+		.sectors_per_page = g_dvmDefaultSectorsPerPage,
+		.seq_mib          = 64,
+		.seq_block_kib    = 128,
+		.random_ops       = 2000,
+		.small_files      = 500,
+		.tree_depth       = 8,
+		.tree_files       = 32,
+		.mount_iters      = 5,
+		.stat_passes      = 10,
+	};
+	unsigned seed = 1;
+	const char* tp_path = NULL;
+
+	int opt;
+	bool bad_preset = false;
+	while ((opt = getopt(argc, argv, "c:p:DE:s:b:n:f:d:e:m:t:r:CT:")) != -1) {
+		switch (opt) {
+			case 'c': cfg.cache_pages = strtoul(optarg, NULL, 0); break;
+			case 'p': cfg.sectors_per_page = strtoul(optarg, NULL, 0); break;
+			case 'D': cfg.image_flags |= DVM_IMAGE_DIRECT; break;
+			case 'E': bad_preset = !(cfg.emu = _findPreset(optarg)); break;
+			case 's': cfg.seq_mib = strtoul(optarg, NULL, 0); break;
+			case 'b': cfg.seq_block_kib = strtoul(optarg, NULL, 0); break;
+			case 'n': cfg.random_ops = strtoul(optarg, NULL, 0); break;
+			case 'f': cfg.small_files = strtoul(optarg, NULL, 0); break;
+			case 'd': cfg.tree_depth = strtoul(optarg, NULL, 0); break;
+			case 'e': cfg.tree_files = strtoul(optarg, NULL, 0); break;
+			case 'm': cfg.mount_iters = strtoul(optarg, NULL, 0); break;
+			case 't': cfg.stat_passes = strtoul(optarg, NULL, 0); break;
+			case 'r': seed = strtoul(optarg, NULL, 0); break;
+			case 'C': cfg.csv = true; break;
+			case 'T': tp_path = optarg; break;
+			default: _usage(argv[0]); return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc || bad_preset || !cfg.seq_mib || !cfg.seq_block_kib || !cfg.mount_iters) {
+		_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	dvmRegisterFsDriver(&g_vfatFsDriver);
+	dvmRegisterFsDriver(&g_exfatFsDriver);
+	dvmRegisterFsDriver(&g_ext2FsDriver);
+
+	size_t buf_sz = cfg.seq_block_kib*1024U > SMALL_SZ ? cfg.seq_block_kib*1024U : SMALL_SZ;
+	uint8_t* buf = (uint8_t*)aligned_alloc(IO_ALIGN, (buf_sz + IO_ALIGN - 1) &~ (IO_ALIGN - 1));
+	if (!buf) {
+		fprintf(stderr, "Out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	srand(seed);
+	for (size_t i = 0; i < buf_sz; i ++) {
+		buf[i] = rand();
+	}
+
+	if (tp_path && !dvmTpStart(1U << 18, DVM_TP_MASK_ALL)) {
+		fprintf(stderr, "Cannot enable tracepoints\n");
+		free(buf);
+		return EXIT_FAILURE;
+	}
+
+	if (cfg.csv) {
+		printf("fs,test,cache_pages,sectors_per_page,ops,bytes,secs,mib_s,iops,p50_us,p90_us,p99_us,max_us\n");
+	}
+
+	int ret = EXIT_SUCCESS;
+	for (int i = optind; i < argc; i ++) {
+		char label[16];
+		const char* eq = strchr(argv[i], '=');
+		size_t label_len = eq ? (size_t)(eq - argv[i]) : 0;
+		if (!label_len || label_len >= sizeof(label)) {
+			fprintf(stderr, "%s: expected label=image\n", argv[i]);
+			ret = EXIT_FAILURE;
+			continue;
+		}
+
+		memcpy(label, argv[i], label_len);
+		label[label_len] = 0;
+
+		srand(seed);
+		if (!_benchImage(&cfg, label, eq + 1, buf)) {
+			ret = EXIT_FAILURE;
+		}
+	}
+
+	if (tp_path && !_dumpTracepoints(tp_path)) {
+		ret = EXIT_FAILURE;
+	}
+
+	free(buf);
+	return ret;
+}
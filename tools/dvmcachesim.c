@@ -0,0 +1,224 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "dvmtrace.h"
+
+#define MAX_POINTS 32
+
+typedef struct SimDisc {
+	DvmDisc base;
+
+	uint64_t read_cmds;
+	uint64_t write_cmds;
+	uint64_t read_sectors;
+	uint64_t write_sectors;
+	uint64_t flushes;
+} SimDisc;
+
+typedef struct SimPolicy {
+	const char* name;
+	unsigned flags;
+} SimPolicy;
+
+static const SimPolicy s_policies[] = {
+	{ "lru",     0 },
+	{ "ra",      DVM_CACHE_READ_AHEAD },
+	{ "mid",     DVM_CACHE_MIDPOINT_INSERT },
+	{ "ra+mid",  DVM_CACHE_READ_AHEAD | DVM_CACHE_MIDPOINT_INSERT },
+};
+
+#define NUM_POLICIES (sizeof(s_policies)/sizeof(s_policies[0]))
+
+// The simulated device only counts commands: buffer contents are irrelevant
+static void _simDestroy(DvmDisc* self_)
+{
+}
+
+static bool _simReadSectors(DvmDisc* self_, void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	SimDisc* self = (SimDisc*)self_;
+	self->read_cmds ++;
+	self->read_sectors += num_sectors;
+	return true;
+}
+
+static bool _simWriteSectors(DvmDisc* self_, const void* buffer, sec_t first_sector, sec_t num_sectors, bool is_partial)
+{
+	SimDisc* self = (SimDisc*)self_;
+	self->write_cmds ++;
+	self->write_sectors += num_sectors;
+	return true;
+}
+
+static bool _simFlush(DvmDisc* self_)
+{
+	SimDisc* self = (SimDisc*)self_;
+	self->flushes ++;
+	return true;
+}
+
+static const DvmDiscIface s_simIface = {
+	.destroy       = _simDestroy,
+	.read_sectors  = _simReadSectors,
+	.write_sectors = _simWriteSectors,
+	.flush         = _simFlush,
+};
+
+static unsigned _parseList(const char* str, unsigned* out)
+{
+	unsigned count = 0;
+	while (*str && count < MAX_POINTS) {
+		char* end;
+		unsigned long value = strtoul(str, &end, 0);
+		if (end == str || !value) {
+			return 0;
+		}
+
+		out[count++] = value;
+		str = *end == ',' ? end + 1 : end;
+	}
+
+	return count;
+}
+
+static unsigned _parsePolicies(const char* str)
+{
+	unsigned mask = 0;
+	while (*str) {
+		size_t len = strcspn(str, ",");
+		unsigned i;
+		for (i = 0; i < NUM_POLICIES; i ++) {
+			if (strlen(s_policies[i].name) == len && strncmp(s_policies[i].name, str, len) == 0) {
+				mask |= 1U << i;
+				break;
+			}
+		}
+
+		if (i == NUM_POLICIES) {
+			return 0;
+		}
+
+		str += len;
+		str += *str == ',';
+	}
+
+	return mask;
+}
+
+static void _usage(const char* argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-c pages,...] [-p secs,...] [-P policy,...] [-M max_sectors] [-C] trace.bin\n"
+		"  -c  Cache page counts to sweep (default 4,8,16,32,64)\n"
+		"  -p  Sectors per page to sweep, in 512 byte units (default 1,2,4,8,16,32)\n"
+		"  -P  Policies to sweep: lru, ra (read-ahead), mid (midpoint insertion), ra+mid (default all)\n"
+		"  -M  Transfer limit of the simulated device in sectors (default none)\n"
+		"  -C  Output CSV instead of a table\n"
+		"The trace must have been recorded above the cache (or without one).\n",
+		argv0);
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned pages[MAX_POINTS] = { 4, 8, 16, 32, 64 };
+	unsigned num_pages = 5;
+	unsigned spps[MAX_POINTS] = { 1, 2, 4, 8, 16, 32 };
+	unsigned num_spps = 6;
+	unsigned policy_mask = (1U << NUM_POLICIES) - 1;
+	unsigned max_sectors = 0;
+	bool csv = false;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "c:p:P:M:C")) != -1) {
+		switch (opt) {
+			case 'c': num_pages = _parseList(optarg, pages); break;
+			case 'p': num_spps = _parseList(optarg, spps); break;
+			case 'P': policy_mask = _parsePolicies(optarg); break;
+			case 'M': max_sectors = strtoul(optarg, NULL, 0); break;
+			case 'C': csv = true; break;
+			default: _usage(argv[0]); return EXIT_FAILURE;
+		}
+	}
+
+	if ((argc - optind) != 1 || !num_pages || !num_spps || !policy_mask) {
+		_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	TraceFile tf;
+	if (!_traceLoad(&tf, argv[optind])) {
+		return EXIT_FAILURE;
+	}
+
+	uint64_t req_sectors = 0;
+	for (size_t i = 0; i < tf.num_records; i ++) {
+		if (tf.records[i].op == DVM_TRACE_OP_READ || tf.records[i].op == DVM_TRACE_OP_WRITE) {
+			req_sectors += tf.records[i].num_sectors;
+		}
+	}
+
+	bool warned = false;
+	printf(csv ? "%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s\n" : "%-7s %6s %6s %8s %7s %10s %10s %12s %12s %10s %8s\n",
+		"policy", "pages", "spp", "mem_kib", "hit%", "read_cmds", "write_cmds", "read_kib", "write_kib", "direct_kib", "ra_pages");
+
+	for (unsigned pol = 0; pol < NUM_POLICIES; pol ++) {
+		if (!(policy_mask & (1U << pol))) {
+			continue;
+		}
+
+		for (unsigned i = 0; i < num_pages; i ++) {
+			for (unsigned j = 0; j < num_spps; j ++) {
+				SimDisc sim;
+				memset(&sim, 0, sizeof(sim));
+				sim.base.vt = &s_simIface;
+				sim.base.io_type = ('S'<<24) | ('I'<<16) | ('M'<<8) | ' ';
+				sim.base.features = FEATURE_MEDIUM_CANREAD | FEATURE_MEDIUM_CANWRITE;
+				sim.base.num_sectors = tf.hdr.num_sectors;
+				sim.base.sector_sz = tf.hdr.sector_sz;
+				sim.base.caps.max_sectors = max_sectors;
+				sim.base.caps.align = 1;
+				sim.base.caps.queue_depth = 1;
+
+				DvmDisc* disc = dvmDiscCacheCreateEx(&sim.base, pages[i], spps[j], s_policies[pol].flags);
+				if (disc == &sim.base) {
+					fprintf(stderr, "Skipping %u pages x %u sectors: cannot create cache\n", pages[i], spps[j]);
+					continue;
+				}
+
+				size_t num_ok = dvmDiscTraceReplay(disc, tf.records, tf.num_records);
+				dvmDiscFlush(disc);
+
+				DvmCacheStats st;
+				dvmDiscCacheGetStats(disc, &st, false);
+				disc->vt->destroy(disc);
+
+				if (num_ok != tf.num_records && !warned) {
+					fprintf(stderr, "warning: %zu records failed to replay\n", tf.num_records - num_ok);
+					warned = true;
+				}
+
+				uint64_t accesses = st.hits + st.misses;
+				double hit_pct = accesses ? 100.0*st.hits/accesses : 0.0;
+				unsigned mem_kib = pages[i]*spps[j]/2;
+
+				printf(csv ? "%s,%u,%u,%u,%.2f,%llu,%llu,%llu,%llu,%llu,%u\n" : "%-7s %6u %6u %8u %6.2f%% %10llu %10llu %12llu %12llu %10llu %8u\n",
+					s_policies[pol].name, pages[i], spps[j], mem_kib, hit_pct,
+					(unsigned long long)sim.read_cmds, (unsigned long long)sim.write_cmds,
+					(unsigned long long)(sim.read_sectors*tf.hdr.sector_sz / 1024),
+					(unsigned long long)(sim.write_sectors*tf.hdr.sector_sz / 1024),
+					(unsigned long long)(st.direct_sectors*tf.hdr.sector_sz / 1024), st.readahead_pages);
+			}
+		}
+	}
+
+	if (!csv) {
+		printf("%zu records, %llu KiB requested\n", tf.num_records, (unsigned long long)(req_sectors*tf.hdr.sector_sz / 1024));
+	}
+
+	free(tf.records);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,203 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <dvm.h>
+
+#define NUM_CATEGORIES 4
+#define MAX_EVENTS     16
+
+// Argument kinds: x = hex, u = decimal, s = packed name, - = unused
+typedef struct TpEvent {
+	const char* name;
+	const char* kinds;
+	const char* args[3];
+} TpEvent;
+
+static const char* const s_catNames[NUM_CATEGORIES] = { "cache", "probe", "volume", "driver" };
+
+static const TpEvent s_events[NUM_CATEGORIES][MAX_EVENTS] = {
+	[DVM_TP_CAT_CACHE] = {
+		[DVM_TP_CACHE_READ & 0xff]         = { "read",         "xu-", { "sector", "count" } },
+		[DVM_TP_CACHE_WRITE & 0xff]        = { "write",        "xu-", { "sector", "count" } },
+		[DVM_TP_CACHE_TRIM & 0xff]         = { "trim",         "xu-", { "sector", "count" } },
+		[DVM_TP_CACHE_FLUSH & 0xff]        = { "flush",        "---" },
+		[DVM_TP_CACHE_SEARCH & 0xff]       = { "search",       "xx-", { "sector", "found" } },
+		[DVM_TP_CACHE_MISS & 0xff]         = { "miss",         "x--", { "sector" } },
+		[DVM_TP_CACHE_MAPPED & 0xff]       = { "mapped",       "xu-", { "sector", "count" } },
+		[DVM_TP_CACHE_LOAD & 0xff]         = { "load",         "xu-", { "sector", "count" } },
+		[DVM_TP_CACHE_LOAD_ERROR & 0xff]   = { "load_error",   "xu-", { "sector", "count" } },
+		[DVM_TP_CACHE_WRITEBACK & 0xff]    = { "writeback",    "xu-", { "sector", "count" } },
+		[DVM_TP_CACHE_WB_ERROR & 0xff]     = { "wb_error",     "xu-", { "sector", "count" } },
+		[DVM_TP_CACHE_DIRECT_READ & 0xff]  = { "direct_read",  "xu-", { "sector", "count" } },
+		[DVM_TP_CACHE_DIRECT_WRITE & 0xff] = { "direct_write", "xu-", { "sector", "count" } },
+		[DVM_TP_CACHE_DIRECT_ERROR & 0xff] = { "direct_error", "xu-", { "sector", "count" } },
+	},
+	[DVM_TP_CAT_PROBE] = {
+		[DVM_TP_PROBE_READ_ERROR & 0xff]   = { "read_error",   "x--", { "sector" } },
+		[DVM_TP_PROBE_VBR & 0xff]          = { "vbr",          "---" },
+		[DVM_TP_PROBE_MBR & 0xff]          = { "mbr",          "---" },
+		[DVM_TP_PROBE_NO_TABLE & 0xff]     = { "no_table",     "---" },
+		[DVM_TP_PROBE_MALFORMED & 0xff]    = { "malformed",    "---" },
+		[DVM_TP_PROBE_SIZE & 0xff]         = { "size",         "xx-", { "disc", "used" } },
+		[DVM_TP_PROBE_OUT_OF_BOUND & 0xff] = { "out_of_bound", "---" },
+		[DVM_TP_PROBE_PART & 0xff]         = { "part",         "xxx", { "index_type", "start", "count" } },
+		[DVM_TP_PROBE_FSTYPE & 0xff]       = { "fstype",       "us-", { "index", "fstype" } },
+		[DVM_TP_PROBE_LOADED & 0xff]       = { "loaded",       "u--", { "parts" } },
+		[DVM_TP_PROBE_TIMEOUT & 0xff]      = { "timeout",      "s--", { "name" } },
+		[DVM_TP_PROBE_GPT & 0xff]          = { "gpt",          "xu-", { "sector", "entries" } },
+		[DVM_TP_PROBE_GPT_INVALID & 0xff]  = { "gpt_invalid",  "x--", { "sector" } },
+		[DVM_TP_PROBE_EBR & 0xff]          = { "ebr",          "x--", { "sector" } },
+	},
+	[DVM_TP_CAT_VOLUME] = {
+		[DVM_TP_VOLUME_MOUNT & 0xff]       = { "mount",        "suu", { "name", "devid", "default" } },
+		[DVM_TP_VOLUME_UNMOUNT & 0xff]     = { "unmount",      "s--", { "name" } },
+		[DVM_TP_VOLUME_LAZY_MOUNT & 0xff]  = { "lazy_mount",   "su-", { "name", "ok" } },
+	},
+	[DVM_TP_CAT_DRIVER] = {
+		[DVM_TP_DRIVER_FAT_ERROR & 0xff]   = { "fat_error",    "u--", { "fr" } },
+	},
+};
+
+static void _usage(const char* argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-C] tp.bin\n"
+		"Decodes a tracepoint dump (a DvmTpHeader followed by the records from dvmTpRead).\n"
+		"  -C  Output CSV instead of text\n",
+		argv0);
+}
+
+static void _printArg(char kind, uint64_t value, bool swap)
+{
+	switch (kind) {
+		case 'x': printf("0x%llx", (unsigned long long)value); break;
+		case 'u': printf("%llu", (unsigned long long)value); break;
+		case 's': {
+			// Names were packed in the memory order of the capturing machine
+			char name[9] = { 0 };
+			if (swap) {
+				value = __builtin_bswap64(value);
+			}
+			memcpy(name, &value, 8);
+			printf("%s", name);
+			break;
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	bool csv = false;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "C")) != -1) {
+		switch (opt) {
+			case 'C': csv = true; break;
+			default: _usage(argv[0]); return EXIT_FAILURE;
+		}
+	}
+
+	if ((argc - optind) != 1) {
+		_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	const char* path = argv[optind];
+	FILE* f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	DvmTpHeader hdr;
+	bool ok = fread(&hdr, sizeof(hdr), 1, f) == 1;
+
+	// Dumps from big endian consoles are converted while decoding
+	bool swap = ok && hdr.magic == __builtin_bswap32(DVM_TP_MAGIC);
+	if (swap) {
+		hdr.version = __builtin_bswap16(hdr.version);
+		hdr.record_sz = __builtin_bswap16(hdr.record_sz);
+		hdr.num_dropped = __builtin_bswap32(hdr.num_dropped);
+	}
+
+	if (!ok || (!swap && hdr.magic != DVM_TP_MAGIC) || hdr.version != DVM_TP_VERSION || hdr.record_sz != sizeof(DvmTpRecord)) {
+		fprintf(stderr, "%s: not a version %u tracepoint dump\n", path, DVM_TP_VERSION);
+		fclose(f);
+		return EXIT_FAILURE;
+	}
+
+	if (csv) {
+		printf("seq,time_us,category,event,arg0,arg1,arg2\n");
+	} else {
+		printf("# %u records dropped\n", hdr.num_dropped);
+	}
+
+	DvmTpRecord rec;
+	uint64_t epoch = 0;
+	uint32_t next_seq = 0;
+	size_t num_records = 0, num_gaps = 0;
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		if (swap) {
+			rec.timestamp_ns = __builtin_bswap64(rec.timestamp_ns);
+			for (unsigned i = 0; i < 3; i ++) {
+				rec.arg[i] = __builtin_bswap64(rec.arg[i]);
+			}
+			rec.seq = __builtin_bswap32(rec.seq);
+			rec.id = __builtin_bswap16(rec.id);
+		}
+
+		if (!num_records++) {
+			epoch = rec.timestamp_ns;
+		} else if (rec.seq != next_seq) {
+			num_gaps ++;
+			if (!csv) {
+				printf("# gap: %u records missing\n", rec.seq - next_seq);
+			}
+		}
+		next_seq = rec.seq + 1;
+
+		unsigned cat = rec.id >> 8, idx = rec.id & 0xff;
+		const TpEvent* ev = cat < NUM_CATEGORIES && idx < MAX_EVENTS ? &s_events[cat][idx] : NULL;
+		const char* kinds = ev && ev->name ? ev->kinds : "xxx";
+		double time_us = (int64_t)(rec.timestamp_ns - epoch)*1e-3;
+
+		if (csv) {
+			printf("%u,%.3f,%s,", rec.seq, time_us, cat < NUM_CATEGORIES ? s_catNames[cat] : "?");
+			if (ev && ev->name) {
+				printf("%s", ev->name);
+			} else {
+				printf("0x%04x", rec.id);
+			}
+			for (unsigned i = 0; i < 3; i ++) {
+				putchar(',');
+				_printArg(kinds[i], rec.arg[i], swap);
+			}
+		} else {
+			printf("%12.3f %6s.", time_us, cat < NUM_CATEGORIES ? s_catNames[cat] : "?");
+			if (ev && ev->name) {
+				printf(kinds[0] != '-' ? "%-12s" : "%s", ev->name);
+			} else {
+				printf("0x%04x      ", rec.id);
+			}
+			for (unsigned i = 0; i < 3; i ++) {
+				if (kinds[i] == '-') {
+					continue;
+				}
+				printf(" %s=", ev && ev->name ? ev->args[i] : "arg");
+				_printArg(kinds[i], rec.arg[i], swap);
+			}
+		}
+		putchar('\n');
+	}
+
+	if (!csv) {
+		printf("# %zu records, %zu gaps\n", num_records, num_gaps);
+	}
+
+	fclose(f);
+	return EXIT_SUCCESS;
+}
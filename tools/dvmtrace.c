@@ -0,0 +1,182 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include "dvmtrace.h"
+
+#define NUM_OPS     4
+#define NUM_CLASSES 3
+
+typedef struct TraceSummary {
+	uint64_t count;
+	uint64_t sectors;
+	uint64_t partial;
+	uint64_t failed;
+	uint64_t sequential;
+	uint64_t total_ns;
+	uint32_t max_ns;
+} TraceSummary;
+
+static const char* const s_opNames[NUM_OPS] = { "read", "write", "flush", "trim" };
+static const char* const s_classNames[NUM_CLASSES] = { "other", "meta", "data" };
+
+static void _usage(const char* argv0)
+{
+	fprintf(stderr,
+		"Usage: %s dump trace.bin\n"
+		"       %s stats trace.bin\n"
+		"       %s replay [-c pages] [-p secs] [-D] trace.bin scratch.img\n"
+		"  -c  Cache pages between the replayer and the image (0 = no cache)\n"
+		"  -p  Sectors per cache page\n"
+		"  -D  Open the image with O_DIRECT\n"
+		"Replaying writes destroys the contents of the image.\n",
+		argv0, argv0, argv0);
+}
+
+static int _cmdDump(const TraceFile* tf)
+{
+	printf("# sector_sz=%u num_sectors=%llu dropped=%u\n", tf->hdr.sector_sz,
+		(unsigned long long)tf->hdr.num_sectors, tf->hdr.num_dropped);
+	printf("timestamp_us,op,class,sector,num_sectors,partial,failed,duration_us\n");
+
+	for (size_t i = 0; i < tf->num_records; i ++) {
+		const DvmTraceRecord* rec = &tf->records[i];
+		printf("%.3f,%s,%s,%llu,%u,%u,%u,%.3f\n", rec->timestamp_ns*1e-3,
+			rec->op < NUM_OPS ? s_opNames[rec->op] : "?", rec->io_class < NUM_CLASSES ? s_classNames[rec->io_class] : "?",
+			(unsigned long long)rec->sector, rec->num_sectors,
+			(rec->flags & DVM_TRACE_PARTIAL) != 0, (rec->flags & DVM_TRACE_FAILED) != 0, rec->duration_ns*1e-3);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int _cmdStats(const TraceFile* tf)
+{
+	TraceSummary sum[NUM_OPS][NUM_CLASSES];
+	memset(sum, 0, sizeof(sum));
+
+	// A request is sequential if it starts where the previous one of the same kind ended
+	uint64_t next_sector[NUM_OPS] = { UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX };
+	for (size_t i = 0; i < tf->num_records; i ++) {
+		const DvmTraceRecord* rec = &tf->records[i];
+		if (rec->op >= NUM_OPS) {
+			continue;
+		}
+
+		TraceSummary* s = &sum[rec->op][rec->io_class < NUM_CLASSES ? rec->io_class : 0];
+		s->count ++;
+		s->sectors += rec->num_sectors;
+		s->partial += (rec->flags & DVM_TRACE_PARTIAL) != 0;
+		s->failed += (rec->flags & DVM_TRACE_FAILED) != 0;
+		s->sequential += rec->num_sectors && rec->sector == next_sector[rec->op];
+		s->total_ns += rec->duration_ns;
+		if (rec->duration_ns > s->max_ns) {
+			s->max_ns = rec->duration_ns;
+		}
+
+		next_sector[rec->op] = rec->sector + rec->num_sectors;
+	}
+
+	uint64_t span_ns = tf->num_records ? tf->records[tf->num_records-1].timestamp_ns - tf->records[0].timestamp_ns : 0;
+	printf("%zu records over %.3f s, sector_sz=%u, %u dropped\n", tf->num_records, span_ns*1e-9,
+		tf->hdr.sector_sz, tf->hdr.num_dropped);
+	printf("%-6s %-6s %10s %12s %8s %8s %6s %10s %10s\n",
+		"op", "class", "count", "KiB", "partial", "seq", "fail", "avg_us", "max_us");
+
+	for (unsigned op = 0; op < NUM_OPS; op ++) {
+		for (unsigned cls = 0; cls < NUM_CLASSES; cls ++) {
+			const TraceSummary* s = &sum[op][cls];
+			if (!s->count) {
+				continue;
+			}
+
+			printf("%-6s %-6s %10llu %12llu %7.1f%% %7.1f%% %6llu %10.1f %10.1f\n", s_opNames[op], s_classNames[cls],
+				(unsigned long long)s->count, (unsigned long long)(s->sectors*tf->hdr.sector_sz / 1024),
+				100.0*s->partial/s->count, 100.0*s->sequential/s->count, (unsigned long long)s->failed,
+				s->total_ns*1e-3/s->count, s->max_ns*1e-3);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int _cmdReplay(const TraceFile* tf, const char* image, unsigned cache_pages, unsigned sectors_per_page, unsigned flags)
+{
+	DvmDisc* disc = dvmDiscImageCreate(image, flags, tf->hdr.sector_sz);
+	if (!disc) {
+		fprintf(stderr, "%s: cannot open as a disc with %u byte sectors\n", image, tf->hdr.sector_sz);
+		return EXIT_FAILURE;
+	}
+
+	if (disc->num_sectors < tf->hdr.num_sectors) {
+		fprintf(stderr, "%s: warning: smaller than the traced disc, some records will fail\n", image);
+	}
+
+	if (cache_pages) {
+		disc = dvmDiscCacheCreate(disc, cache_pages, sectors_per_page);
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	size_t num_ok = dvmDiscTraceReplay(disc, tf->records, tf->num_records);
+	bool flushed = dvmDiscFlush(disc);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)*1e-9;
+	uint64_t traced_ns = tf->num_records ? tf->records[tf->num_records-1].timestamp_ns - tf->records[0].timestamp_ns : 0;
+	printf("%zu/%zu records replayed in %.3f s (traced: %.3f s)\n", num_ok, tf->num_records, secs, traced_ns*1e-9);
+
+	disc->vt->destroy(disc);
+	return num_ok == tf->num_records && flushed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2) {
+		_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	const char* cmd = argv[1];
+	unsigned cache_pages = 0;
+	unsigned sectors_per_page = 8;
+	unsigned flags = 0;
+
+	optind = 2;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:p:D")) != -1) {
+		switch (opt) {
+			case 'c': cache_pages = strtoul(optarg, NULL, 0); break;
+			case 'p': sectors_per_page = strtoul(optarg, NULL, 0); break;
+			case 'D': flags |= DVM_IMAGE_DIRECT; break;
+			default: _usage(argv[0]); return EXIT_FAILURE;
+		}
+	}
+
+	bool is_replay = strcmp(cmd, "replay") == 0;
+	if ((argc - optind) != (is_replay ? 2 : 1) || (!is_replay && strcmp(cmd, "dump") != 0 && strcmp(cmd, "stats") != 0)) {
+		_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	TraceFile tf;
+	if (!_traceLoad(&tf, argv[optind])) {
+		return EXIT_FAILURE;
+	}
+
+	int ret;
+	if (is_replay) {
+		ret = _cmdReplay(&tf, argv[optind+1], cache_pages, sectors_per_page, flags);
+	} else if (strcmp(cmd, "dump") == 0) {
+		ret = _cmdDump(&tf);
+	} else {
+		ret = _cmdStats(&tf);
+	}
+
+	free(tf.records);
+	return ret;
+}
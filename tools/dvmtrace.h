@@ -0,0 +1,74 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <dvm.h>
+
+typedef struct TraceFile {
+	DvmTraceHeader hdr;
+	DvmTraceRecord* records;
+	size_t num_records;
+} TraceFile;
+
+static void _swapRecord(DvmTraceRecord* rec)
+{
+	rec->timestamp_ns = __builtin_bswap64(rec->timestamp_ns);
+	rec->sector = __builtin_bswap64(rec->sector);
+	rec->num_sectors = __builtin_bswap32(rec->num_sectors);
+	rec->duration_ns = __builtin_bswap32(rec->duration_ns);
+}
+
+static bool _traceLoad(TraceFile* tf, const char* path)
+{
+	FILE* f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return false;
+	}
+
+	memset(tf, 0, sizeof(*tf));
+	bool ok = fread(&tf->hdr, sizeof(tf->hdr), 1, f) == 1;
+
+	// Traces captured on big endian consoles are converted on load
+	bool swap = ok && tf->hdr.magic == __builtin_bswap32(DVM_TRACE_MAGIC);
+	if (swap) {
+		tf->hdr.version = __builtin_bswap16(tf->hdr.version);
+		tf->hdr.record_sz = __builtin_bswap16(tf->hdr.record_sz);
+		tf->hdr.sector_sz = __builtin_bswap16(tf->hdr.sector_sz);
+		tf->hdr.num_dropped = __builtin_bswap32(tf->hdr.num_dropped);
+		tf->hdr.num_sectors = __builtin_bswap64(tf->hdr.num_sectors);
+	}
+
+	if (!ok || (!swap && tf->hdr.magic != DVM_TRACE_MAGIC) || tf->hdr.version != DVM_TRACE_VERSION ||
+		tf->hdr.record_sz != sizeof(DvmTraceRecord)) {
+		fprintf(stderr, "%s: not a version %u trace file\n", path, DVM_TRACE_VERSION);
+		fclose(f);
+		return false;
+	}
+
+	size_t cap = 0;
+	DvmTraceRecord rec;
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		if (tf->num_records == cap) {
+			cap = cap ? 2*cap : 4096;
+			DvmTraceRecord* records = (DvmTraceRecord*)realloc(tf->records, cap*sizeof(DvmTraceRecord));
+			if (!records) {
+				fprintf(stderr, "Out of memory\n");
+				fclose(f);
+				return false;
+			}
+			tf->records = records;
+		}
+
+		if (swap) {
+			_swapRecord(&rec);
+		}
+		tf->records[tf->num_records++] = rec;
+	}
+
+	fclose(f);
+	return true;
+}
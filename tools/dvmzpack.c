@@ -0,0 +1,270 @@
+// SPDX-License-Identifier: ZPL-2.1
+// SPDX-FileCopyrightText: Copyright fincs, devkitPro
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "dvm_comp.h"
+
+#define HASH_LOG      14
+#define MIN_MATCH     4
+#define LAST_LITERALS 5
+#define MF_LIMIT      12
+#define MAX_OFFSET    65535
+
+#define PAD_SZ        4096U
+
+static void _writeLe(uint8_t* buf, uint64_t value, unsigned size)
+{
+	for (unsigned i = 0; i < size; i ++) {
+		buf[i] = value >> (8*i);
+	}
+}
+
+static uint32_t _read32(const uint8_t* p)
+{
+	uint32_t ret;
+	memcpy(&ret, p, sizeof(ret));
+	return ret;
+}
+
+static uint8_t* _emitLength(uint8_t* out, uint8_t* out_end, size_t len)
+{
+	// Continuation bytes for lengths of 15 and above
+	for (len -= 15; out && len >= 255; len -= 255) {
+		if (out >= out_end) {
+			return NULL;
+		}
+		*out++ = 255;
+	}
+
+	if (!out || out >= out_end) {
+		return NULL;
+	}
+
+	*out++ = len;
+	return out;
+}
+
+static uint8_t* _emitSequence(uint8_t* out, uint8_t* out_end, const uint8_t* lit, size_t lit_len, size_t offset, size_t match_len)
+{
+	if (out >= out_end) {
+		return NULL;
+	}
+
+	uint8_t* token = out++;
+	*token = (lit_len < 15 ? lit_len : 15) << 4;
+	if (lit_len >= 15) {
+		out = _emitLength(out, out_end, lit_len);
+	}
+
+	if (!out || (size_t)(out_end - out) < lit_len) {
+		return NULL;
+	}
+
+	memcpy(out, lit, lit_len);
+	out += lit_len;
+
+	// The last sequence has no match
+	if (!match_len) {
+		return out;
+	}
+
+	if ((out_end - out) < 2) {
+		return NULL;
+	}
+
+	*out++ = offset;
+	*out++ = offset >> 8;
+
+	match_len -= MIN_MATCH;
+	*token |= match_len < 15 ? match_len : 15;
+	if (match_len >= 15) {
+		out = _emitLength(out, out_end, match_len);
+	}
+
+	return out;
+}
+
+// Greedy LZ4 block compressor. Returns 0 if the output does not fit.
+static size_t _lz4Compress(const uint8_t* src, size_t src_sz, uint8_t* dst, size_t dst_sz)
+{
+	static uint32_t table[1U << HASH_LOG];
+	memset(table, 0, sizeof(table));
+
+	uint8_t* out = dst;
+	uint8_t* out_end = dst + dst_sz;
+	size_t anchor = 0;
+
+	if (src_sz > MF_LIMIT) {
+		size_t limit = src_sz - MF_LIMIT;
+		for (size_t pos = 0; pos < limit;) {
+			uint32_t seq = _read32(src + pos);
+			uint32_t hash = (seq * 2654435761U) >> (32 - HASH_LOG);
+
+			// Table entries hold position+1, so that 0 means empty
+			size_t ref = table[hash];
+			table[hash] = pos + 1;
+
+			if (!ref-- || pos - ref > MAX_OFFSET || _read32(src + ref) != seq) {
+				pos ++;
+				continue;
+			}
+
+			size_t match_len = MIN_MATCH;
+			size_t max_len = src_sz - LAST_LITERALS - pos;
+			while (match_len < max_len && src[ref + match_len] == src[pos + match_len]) {
+				match_len ++;
+			}
+
+			out = _emitSequence(out, out_end, src + anchor, pos - anchor, pos - ref, match_len);
+			if (!out) {
+				return 0;
+			}
+
+			pos += match_len;
+			anchor = pos;
+		}
+	}
+
+	out = _emitSequence(out, out_end, src + anchor, src_sz - anchor, 0, 0);
+	return out ? (size_t)(out - dst) : 0;
+}
+
+static void _usage(const char* argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-b block_kib] [-s sector_sz] input.img output.dvmz\n"
+		"  -b  Uncompressed block size in KiB (power of two, 4..1024, default 64)\n"
+		"  -s  Logical sector size in bytes (power of two, default 512)\n",
+		argv0);
+}
+
+static unsigned _log2(unsigned x)
+{
+	unsigned ret = 0;
+	while ((1U << ret) < x) {
+		ret ++;
+	}
+	return (1U << ret) == x ? ret : 0;
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned block_sz = 64*1024;
+	unsigned sector_sz = 512;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "b:s:")) != -1) {
+		switch (opt) {
+			case 'b': block_sz = strtoul(optarg, NULL, 0)*1024; break;
+			case 's': sector_sz = strtoul(optarg, NULL, 0); break;
+			default: _usage(argv[0]); return EXIT_FAILURE;
+		}
+	}
+
+	unsigned block_shift = _log2(block_sz);
+	unsigned sector_shift = _log2(sector_sz);
+	if ((argc - optind) != 2 || block_sz < DVMZ_MIN_BLOCK_SZ || block_sz > DVMZ_MAX_BLOCK_SZ || !block_shift ||
+		sector_shift < 9 || sector_shift > 15 || sector_sz > block_sz) {
+		_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	FILE* fin = fopen(argv[optind], "rb");
+	if (!fin) {
+		perror(argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	fseeko(fin, 0, SEEK_END);
+	uint64_t in_sz = ftello(fin);
+	fseeko(fin, 0, SEEK_SET);
+	if (!in_sz || (in_sz % sector_sz)) {
+		fprintf(stderr, "%s: size is not a non-zero multiple of %u\n", argv[optind], sector_sz);
+		fclose(fin);
+		return EXIT_FAILURE;
+	}
+
+	FILE* fout = fopen(argv[optind+1], "wb");
+	if (!fout) {
+		perror(argv[optind+1]);
+		fclose(fin);
+		return EXIT_FAILURE;
+	}
+
+	uint64_t num_sectors = in_sz / sector_sz;
+	uint32_t num_blocks = (in_sz + block_sz - 1) / block_sz;
+	size_t index_bytes = (num_blocks + 1)*sizeof(uint64_t);
+
+	uint8_t* index = (uint8_t*)calloc(1, index_bytes);
+	uint8_t* in_buf = (uint8_t*)malloc(block_sz);
+	uint8_t* out_buf = (uint8_t*)malloc(block_sz);
+	if (!index || !in_buf || !out_buf) {
+		fprintf(stderr, "Out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	DvmCompHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	_writeLe(hdr.magic_le, DVMZ_MAGIC, 4);
+	_writeLe(hdr.version_le, DVMZ_VERSION, 2);
+	hdr.block_shift = block_shift;
+	hdr.sector_shift = sector_shift;
+	_writeLe(hdr.num_sectors_le, num_sectors, 8);
+	_writeLe(hdr.num_blocks_le, num_blocks, 4);
+
+	// The index is rewritten once all block offsets are known
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, fout) == 1 && fwrite(index, index_bytes, 1, fout) == 1;
+	uint64_t offset = sizeof(hdr) + index_bytes;
+	uint64_t raw_blocks = 0;
+
+	for (uint32_t i = 0; ok && i < num_blocks; i ++) {
+		size_t cur_sz = (in_sz - (uint64_t)i*block_sz) < block_sz ? (size_t)(in_sz - (uint64_t)i*block_sz) : block_sz;
+		if (fread(in_buf, 1, cur_sz, fin) != cur_sz) {
+			perror(argv[optind]);
+			ok = false;
+			break;
+		}
+
+		// Store incompressible blocks raw
+		size_t comp_sz = _lz4Compress(in_buf, cur_sz, out_buf, cur_sz - 1);
+		uint64_t entry = offset;
+		if (comp_sz) {
+			ok = fwrite(out_buf, 1, comp_sz, fout) == comp_sz;
+		} else {
+			comp_sz = cur_sz;
+			entry |= DVMZ_INDEX_RAW;
+			raw_blocks ++;
+			ok = fwrite(in_buf, 1, cur_sz, fout) == cur_sz;
+		}
+
+		_writeLe(index + i*sizeof(uint64_t), entry, sizeof(uint64_t));
+		offset += comp_sz;
+	}
+
+	_writeLe(index + num_blocks*sizeof(uint64_t), offset, sizeof(uint64_t));
+	ok = ok && fseeko(fout, sizeof(hdr), SEEK_SET) == 0 && fwrite(index, index_bytes, 1, fout) == 1;
+
+	// Pad to a whole number of sectors so the image can back a DvmDisc directly
+	if (ok && (offset % PAD_SZ)) {
+		ok = fflush(fout) == 0 && ftruncate(fileno(fout), offset + PAD_SZ - offset % PAD_SZ) == 0;
+	}
+
+	ok = fclose(fout) == 0 && ok;
+	fclose(fin);
+
+	if (!ok) {
+		fprintf(stderr, "%s: write error\n", argv[optind+1]);
+		return EXIT_FAILURE;
+	}
+
+	printf("%u blocks (%llu raw), %llu -> %llu bytes (%.1f%%)\n", num_blocks, (unsigned long long)raw_blocks,
+		(unsigned long long)in_sz, (unsigned long long)offset, 100.0*offset/in_sz);
+
+	free(out_buf);
+	free(in_buf);
+	free(index);
+	return EXIT_SUCCESS;
+}